@@ -0,0 +1,81 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#include <stdio.h>
+#include <M451Series.h>
+#include <Display.h>
+#include <Font.h>
+#include <Thread.h>
+#include <AtomicOps.h>
+
+// Iterations per measurement
+#define ITERS 1000
+
+// Runs op ITERS times with IRQs masked, storing the
+// elapsed cycles (from the DWT cycle counter) in result
+#define MEASURE(result, op) do { \
+	uint32_t i, start, primask; \
+	primask = Thread_IrqDisable(); \
+	start = DWT->CYCCNT; \
+	for(i = 0; i < ITERS; i++) { \
+		op; \
+		asm volatile("" : : : "memory"); \
+	} \
+	result = DWT->CYCCNT - start; \
+	Thread_IrqRestore(primask); \
+} while(0)
+
+volatile uint32_t counter;
+
+int main() {
+	uint32_t base, cycles[7];
+	char buf[160];
+	uint8_t i;
+
+	// Enable the cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	// Empty loop, subtracted from all measurements
+	MEASURE(base, (void) 0);
+
+	MEASURE(cycles[0], AtomicOps_Add(&counter, 1));
+	MEASURE(cycles[1], AtomicOps_AddAcquire(&counter, 1));
+	MEASURE(cycles[2], AtomicOps_AddRelease(&counter, 1));
+	MEASURE(cycles[3], AtomicOps_AddRelaxed(&counter, 1));
+	MEASURE(cycles[4], AtomicOps_CmpSwap(&counter, counter, 0));
+	MEASURE(cycles[5], AtomicOps_CmpSwapAcquire(&counter, counter, 0));
+	MEASURE(cycles[6], AtomicOps_CmpSwapRelaxed(&counter, counter, 0));
+
+	// Cycles per operation, in tenths
+	for(i = 0; i < 7; i++) {
+		cycles[i] = (cycles[i] - base) * 10 / ITERS;
+	}
+
+	siprintf(buf, "Cycles/op\n"
+		"add  %2lu.%lu\nadd.a %lu.%lu\nadd.r %lu.%lu\nadd.x %lu.%lu\n"
+		"cas  %2lu.%lu\ncas.a %lu.%lu\ncas.x %lu.%lu",
+		cycles[0] / 10, cycles[0] % 10, cycles[1] / 10, cycles[1] % 10,
+		cycles[2] / 10, cycles[2] % 10, cycles[3] / 10, cycles[3] % 10,
+		cycles[4] / 10, cycles[4] % 10, cycles[5] / 10, cycles[5] % 10,
+		cycles[6] / 10, cycles[6] % 10);
+	Display_PutText(0, 0, buf, FONT_DEJAVU_8PT);
+	Display_Update();
+}
@@ -0,0 +1,584 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/*
+ * Step response benchmarks for the atomizer feedback loop, run
+ * against the simulated converter in HostAtomizer.c. Each scenario
+ * measures the base resistance, fires from cold and reports how long
+ * the output takes to first reach and to settle within the tolerance
+ * band, the overshoot and the ripple once settled. Power scenarios
+ * also heat up the coil while firing and report how closely the output
+ * power follows the rising resistance. Temperature control scenarios
+ * use a coil that heats up with the output power, fire at a target
+ * temperature and report the coil temperature as simulated. The
+ * median filter benchmark checks the atomizer filter against a plain
+ * selection sort median and compares their speed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <Thread.h>
+#include <Atomizer.h>
+#include <HostPort.h>
+#include <HostAtomizer.h>
+
+/* Device stack size for the benchmark thread. */
+#define BENCH_STACKSIZE 1024
+
+/* Simulated firing time, in feedback iterations (300ms). */
+#define BENCH_STEPS 3000
+/* Ripple is measured over the last iterations (20ms). */
+#define BENCH_RIPPLE_STEPS 200
+/* Settling band, in percent of the target. */
+#define BENCH_BAND_PERCENT 2
+/* ADC noise, in LSBs. */
+#define BENCH_NOISE 2
+/* Power scenarios ramp the resistance over these iterations (100ms). */
+#define BENCH_HEAT_START 1000
+#define BENCH_HEAT_END   2000
+/* Temperature control firing time, in iterations (1s). */
+#define BENCH_TC_STEPS 10000
+/* Temperature control settling band, in °C. */
+#define BENCH_TC_BAND 5
+/* Simulated coil heat capacity (J/K) and thermal resistance (K/W). */
+#define BENCH_COIL_HEATCAP 0.08
+#define BENCH_COIL_THERMRES 12.0
+
+/* Median filter benchmark: samples per window size, sample pool size. */
+#define BENCH_FILTER_SAMPLES 2000000
+#define BENCH_FILTER_POOL    4096
+
+/* Period of the application-side power loop used for comparison,
+ * in iterations (50ms). */
+#define BENCH_APP_PERIOD 500
+
+/**
+ * Step response scenario.
+ */
+typedef struct {
+	/**< Scenario name. */
+	const char *name;
+	/**< Target voltage, in mV. */
+	uint16_t voltage;
+	/**< Coil resistance, in mOhm. */
+	uint16_t resistance;
+} Bench_Scenario_t;
+
+static const Bench_Scenario_t Bench_scenarios[] = {
+	{"buck 3.0V 1.0ohm",  3000, 1000},
+	{"buck 1.0V 0.2ohm",  1000,  200},
+	{"buck 3.0V 0.15ohm", 3000,  150},
+	{"boost 6.0V 1.5ohm", 6000, 1500},
+	{"boost 8.0V 2.0ohm", 8000, 2000}
+};
+
+/**
+ * Power tracking scenario.
+ */
+typedef struct {
+	/**< Scenario name. */
+	const char *name;
+	/**< Target power, in mW. */
+	uint32_t power;
+	/**< Cold coil resistance, in mOhm. */
+	uint16_t resistance;
+	/**< Hot coil resistance, in mOhm. */
+	uint16_t hotResistance;
+} Bench_PowerScenario_t;
+
+static const Bench_PowerScenario_t Bench_powerScenarios[] = {
+	{"30W 0.5-0.6ohm",   30000,  500,  600},
+	{"50W 0.15-0.3ohm",  50000,  150,  300},
+	{"20W 1.5-1.8ohm",   20000, 1500, 1800}
+};
+
+/**
+ * Temperature control scenario.
+ */
+typedef struct {
+	/**< Scenario name. */
+	const char *name;
+	/**< Coil material. */
+	Atomizer_Material_t material;
+	/**< Simulated resistance curve (see HostAtomizer_SetCoil()). */
+	double coeffs[4];
+	/**< Coil resistance at ambient temperature, in mOhm. */
+	uint16_t resistance;
+	/**< Target temperature, in °C. */
+	uint16_t temp;
+	/**< Power ceiling, in mW. */
+	uint32_t maxPower;
+} Bench_TempScenario_t;
+
+static const Bench_TempScenario_t Bench_tempScenarios[] = {
+	{"Ni200 0.15ohm 220C", ATOMIZER_MATERIAL_NI200,
+		{5.485e-3, 6.65e-6, 2.805e-11, -2e-17}, 150, 220, 40000},
+	{"Ti 0.5ohm 230C", ATOMIZER_MATERIAL_TITANIUM,
+		{0.0035, 0, 0, 0}, 500, 230, 40000},
+	{"SS316 0.5ohm 200C", ATOMIZER_MATERIAL_SS316,
+		{0.00088, 0, 0, 0}, 500, 200, 40000},
+	{"NiFe30 0.3ohm 200C", ATOMIZER_MATERIAL_CUSTOM,
+		{0.0032, 0, 0, 0}, 300, 200, 25000}
+};
+
+static uint8_t Bench_failed;
+
+/* Set by the base update callback. */
+static volatile uint8_t Bench_baseUpdated;
+/* True to run the feedback loop from the stepper thread. */
+static volatile uint8_t Bench_autoStep;
+
+/* Feedback gains from the command line, if given. */
+static uint8_t Bench_hasGains;
+static uint16_t Bench_gains[3];
+
+/**
+ * Prints a failure message and marks the run as failed.
+ *
+ * @param msg Message.
+ */
+static void Bench_Fail(const char *msg) {
+	uint32_t primask = Thread_IrqDisable();
+
+	fprintf(stderr, "FAIL: %s\n", msg);
+	Bench_failed = 1;
+	Thread_IrqRestore(primask);
+}
+
+static uint8_t Bench_BaseUpdateCallback(uint16_t oldRes, uint8_t oldTemp, uint16_t *newRes, uint8_t *newTemp) {
+	Bench_baseUpdated = 1;
+	return 1;
+}
+
+/**
+ * Runs the feedback loop while the benchmark thread is blocked
+ * in Atomizer_ReadInfo(). Runs at the lowest priority, so it
+ * never preempts the benchmark thread.
+ */
+static void *Bench_StepperProc(void *args) {
+	while(1) {
+		if(Bench_autoStep) {
+			HostAtomizer_Step();
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Measures the base resistance of the simulated coil, as the
+ * application would through Atomizer_ReadInfo().
+ *
+ * @return True on success, false if the measure didn't complete.
+ */
+static uint8_t Bench_MeasureBase() {
+	Atomizer_Info_t info;
+	uint32_t i;
+
+	Bench_baseUpdated = 0;
+	Atomizer_ForceMeasure();
+
+	Bench_autoStep = 1;
+	// The update can come from a lower reading while still measuring
+	for(i = 0; i < BENCH_STEPS * 10 && (!Bench_baseUpdated || Atomizer_GetError() == OPEN); i++) {
+		// Let the refresh timer run between reads
+		HostAtomizer_Step();
+		Atomizer_ReadInfo(&info);
+	}
+	Bench_autoStep = 0;
+
+	return Bench_baseUpdated;
+}
+
+/**
+ * Measures the base resistance, fires the atomizer from cold
+ * and prints the step response figures.
+ *
+ * @param scenario Scenario to run.
+ */
+static void Bench_StepResponse(const Bench_Scenario_t *scenario) {
+	uint32_t i, volts, band, rise, settled, peak, rippleMin, rippleMax;
+	uint32_t primask;
+	uint8_t isMeasured;
+
+	HostAtomizer_Setup(scenario->resistance, BENCH_NOISE);
+	isMeasured = Bench_MeasureBase();
+	Atomizer_SetOutputVoltage(scenario->voltage);
+	Atomizer_Control(1);
+
+	band = scenario->voltage * BENCH_BAND_PERCENT / 100;
+	rise = BENCH_STEPS;
+	settled = BENCH_STEPS;
+	peak = 0;
+	rippleMin = UINT32_MAX;
+	rippleMax = 0;
+
+	for(i = 0; i < BENCH_STEPS; i++) {
+		HostAtomizer_Step();
+		volts = HostAtomizer_GetVoltage();
+
+		if(volts > peak) {
+			peak = volts;
+		}
+		if(volts + band < scenario->voltage || volts > scenario->voltage + band) {
+			settled = BENCH_STEPS;
+		}
+		else if(settled == BENCH_STEPS) {
+			settled = i;
+			rise = rise < i ? rise : i;
+		}
+		if(i >= BENCH_STEPS - BENCH_RIPPLE_STEPS) {
+			rippleMin = volts < rippleMin ? volts : rippleMin;
+			rippleMax = volts > rippleMax ? volts : rippleMax;
+		}
+	}
+
+	Atomizer_Control(0);
+
+	primask = Thread_IrqDisable();
+	if(!isMeasured || Atomizer_GetError() != OK || settled == BENCH_STEPS) {
+		printf("%-20s %10s %10s %10s %10lu %10s  FAIL (error %d, base %s)\n", scenario->name, "-",
+			"-", "-", (unsigned long) volts, "-", Atomizer_GetError(), isMeasured ? "ok" : "missing");
+		Bench_failed = 1;
+	}
+	else {
+		printf("%-20s %10.1f %10.1f %10ld %10lu %10lu\n", scenario->name,
+			rise * HOSTATOMIZER_STEP_US / 1000.0,
+			settled * HOSTATOMIZER_STEP_US / 1000.0,
+			(long) (peak > scenario->voltage ? peak - scenario->voltage : 0),
+			(unsigned long) volts, (unsigned long) (rippleMax - rippleMin));
+	}
+	fflush(stdout);
+	Thread_IrqRestore(primask);
+}
+
+/**
+ * Fires the atomizer in constant power mode, heats up the coil and
+ * prints how closely the output power follows.
+ *
+ * @param scenario Scenario to run.
+ * @param inLoop   True to regulate power in the feedback loop, false
+ *                 to recompute the output voltage from the resistance
+ *                 every BENCH_APP_PERIOD iterations, like an application
+ *                 would do from Atomizer_ReadInfo().
+ */
+static void Bench_PowerTracking(const Bench_PowerScenario_t *scenario, uint8_t inLoop) {
+	uint32_t i, power, band, settled, error, maxError, res;
+	uint32_t primask;
+	uint8_t isMeasured;
+	char name[32];
+
+	res = scenario->resistance;
+	HostAtomizer_Setup(res, BENCH_NOISE);
+	isMeasured = Bench_MeasureBase();
+	if(inLoop) {
+		Atomizer_SetOutputPower(scenario->power);
+	}
+	else {
+		Atomizer_SetOutputVoltage(sqrt((double) scenario->power * res));
+	}
+	Atomizer_Control(1);
+
+	band = scenario->power * BENCH_BAND_PERCENT / 100;
+	settled = BENCH_STEPS;
+	maxError = 0;
+
+	for(i = 0; i < BENCH_STEPS; i++) {
+		if(i >= BENCH_HEAT_START && i < BENCH_HEAT_END) {
+			res = scenario->resistance + (scenario->hotResistance - scenario->resistance) *
+				(i - BENCH_HEAT_START) / (BENCH_HEAT_END - BENCH_HEAT_START);
+			HostAtomizer_SetResistance(res);
+		}
+		if(!inLoop && i % BENCH_APP_PERIOD == BENCH_APP_PERIOD - 1) {
+			// Best case for the application: exact resistance, no latency
+			Atomizer_SetOutputVoltage(sqrt((double) scenario->power * res));
+		}
+
+		HostAtomizer_Step();
+		power = HostAtomizer_GetPower();
+		error = power > scenario->power ? power - scenario->power : scenario->power - power;
+
+		if(i < BENCH_HEAT_START) {
+			if(error > band) {
+				settled = BENCH_STEPS;
+			}
+			else if(settled == BENCH_STEPS) {
+				settled = i;
+			}
+		}
+		else if(error > maxError) {
+			maxError = error;
+		}
+	}
+
+	Atomizer_Control(0);
+
+	snprintf(name, sizeof(name), "%s%s", scenario->name, inLoop ? "" : " app");
+	primask = Thread_IrqDisable();
+	if(!isMeasured || Atomizer_GetError() != OK || settled == BENCH_STEPS) {
+		printf("%-20s %10s %10s %10lu  FAIL (error %d, base %s)\n", name, "-", "-",
+			(unsigned long) power, Atomizer_GetError(), isMeasured ? "ok" : "missing");
+		Bench_failed = 1;
+	}
+	else {
+		printf("%-20s %10.1f %10lu %10lu\n", name,
+			settled * HOSTATOMIZER_STEP_US / 1000.0,
+			(unsigned long) maxError, (unsigned long) power);
+	}
+	fflush(stdout);
+	Thread_IrqRestore(primask);
+}
+
+/**
+ * Reference median filter: selection sort of a copy of the window,
+ * as the atomizer library used to do.
+ *
+ * @param value  New sample.
+ * @param buf    Sample buffer.
+ * @param idx    Pointer to the index of the oldest sample.
+ * @param window Window size (odd).
+ *
+ * @return New filtered sample.
+ */
+static uint16_t Bench_ReferenceMedian(uint16_t value, uint16_t *buf, uint8_t *idx, uint8_t window) {
+	uint8_t i, j, minIdx;
+	uint16_t sortBuf[ATOMIZER_FILTER_WINDOW_MAX], min;
+
+	buf[*idx] = value;
+	*idx = (*idx + 1) % window;
+
+	memcpy(sortBuf, buf, window * sizeof(uint16_t));
+	for(i = 0; i < (window + 1) / 2; i++) {
+		minIdx = i;
+		for(j = i + 1; j < window; j++) {
+			if(sortBuf[j] < sortBuf[minIdx]) {
+				minIdx = j;
+			}
+		}
+		if(i != minIdx) {
+			min = sortBuf[minIdx];
+			sortBuf[minIdx] = sortBuf[i];
+			sortBuf[i] = min;
+		}
+	}
+
+	return sortBuf[window / 2];
+}
+
+/**
+ * Checks the voltage median filter against the reference for every
+ * window size and prints the time per sample of both.
+ */
+static void Bench_MedianFilter() {
+	static uint16_t pool[BENCH_FILTER_POOL];
+	uint16_t buf[ATOMIZER_FILTER_WINDOW_MAX], out;
+	uint32_t i, filterData, seed, primask, sum;
+	uint64_t start, newNs, refNs;
+	ADC_Filter_t filter;
+	uint8_t window, idx;
+
+	// ADC-like samples: a slow ramp with noise and outliers
+	seed = 1;
+	for(i = 0; i < BENCH_FILTER_POOL; i++) {
+		seed = seed * 1103515245 + 12345;
+		pool[i] = (i % 1024) + ((seed >> 16) % 9) + ((seed >> 28) == 0 ? 2000 : 0);
+	}
+
+	filter = HostAtomizer_GetFilter(ADC_MODULE_VATM, &filterData);
+
+	for(window = 1; window <= ATOMIZER_FILTER_WINDOW_MAX; window += 2) {
+		Atomizer_SetFilterWindow(ATOMIZER_FILTER_VOLTAGE, window);
+		memset(buf, 0, sizeof(buf));
+		idx = 0;
+
+		// Outputs match once both windows are full of the same samples
+		for(i = 0; i < BENCH_FILTER_POOL; i++) {
+			out = filter(pool[i], filterData);
+			if(Bench_ReferenceMedian(pool[i], buf, &idx, window) != out && i >= window) {
+				Bench_Fail("median filter mismatch");
+				break;
+			}
+		}
+
+		sum = 0;
+		start = Host_GetTimeNs();
+		for(i = 0; i < BENCH_FILTER_SAMPLES; i++) {
+			sum += filter(pool[i % BENCH_FILTER_POOL], filterData);
+		}
+		newNs = Host_GetTimeNs() - start;
+
+		start = Host_GetTimeNs();
+		for(i = 0; i < BENCH_FILTER_SAMPLES; i++) {
+			sum -= Bench_ReferenceMedian(pool[i % BENCH_FILTER_POOL], buf, &idx, window);
+		}
+		refNs = Host_GetTimeNs() - start;
+
+		primask = Thread_IrqDisable();
+		printf("median window %-6u %10.1f %10.1f %9.1fx\n", window,
+			(double) newNs / BENCH_FILTER_SAMPLES, (double) refNs / BENCH_FILTER_SAMPLES,
+			(double) refNs / newNs);
+		fflush(stdout);
+		Thread_IrqRestore(primask);
+
+		// Both ran on the same samples from the same window
+		if(sum != 0) {
+			Bench_Fail("median filter mismatch");
+		}
+	}
+
+	Atomizer_SetFilterWindow(ATOMIZER_FILTER_VOLTAGE, ATOMIZER_FILTER_WINDOW_DEFAULT);
+}
+
+/**
+ * Measures the base resistance, fires the atomizer in temperature
+ * control mode and prints the simulated coil temperature response.
+ *
+ * @param scenario Scenario to run.
+ */
+static void Bench_TempControl(const Bench_TempScenario_t *scenario) {
+	uint32_t i, settled, primask;
+	double temp, peak, rippleMin, rippleMax;
+	uint8_t isMeasured;
+
+	HostAtomizer_Setup(scenario->resistance, BENCH_NOISE);
+	HostAtomizer_SetCoil(scenario->coeffs, BENCH_COIL_HEATCAP, BENCH_COIL_THERMRES);
+	isMeasured = Bench_MeasureBase();
+
+	Atomizer_SetOutputTemperature(scenario->temp, scenario->material, scenario->maxPower);
+	Atomizer_Control(1);
+
+	settled = BENCH_TC_STEPS;
+	peak = 0;
+	rippleMin = 1000;
+	rippleMax = 0;
+
+	for(i = 0; i < BENCH_TC_STEPS; i++) {
+		HostAtomizer_Step();
+		temp = HostAtomizer_GetTemperature();
+
+		if(temp > peak) {
+			peak = temp;
+		}
+		if(temp < scenario->temp - BENCH_TC_BAND || temp > scenario->temp + BENCH_TC_BAND) {
+			settled = BENCH_TC_STEPS;
+		}
+		else if(settled == BENCH_TC_STEPS) {
+			settled = i;
+		}
+		if(i >= BENCH_TC_STEPS - BENCH_RIPPLE_STEPS) {
+			rippleMin = temp < rippleMin ? temp : rippleMin;
+			rippleMax = temp > rippleMax ? temp : rippleMax;
+		}
+	}
+
+	Atomizer_Control(0);
+
+	primask = Thread_IrqDisable();
+	if(!isMeasured || Atomizer_GetError() != OK || settled == BENCH_TC_STEPS) {
+		printf("%-20s %10s %10s %10.1f %10s  FAIL (error %d, base %s)\n", scenario->name,
+			"-", "-", temp, "-", Atomizer_GetError(), isMeasured ? "ok" : "missing");
+		Bench_failed = 1;
+	}
+	else {
+		printf("%-20s %10.1f %10.1f %10.1f %10.1f %10lu\n", scenario->name,
+			settled * HOSTATOMIZER_STEP_US / 1000.0, peak > scenario->temp ? peak - scenario->temp : 0,
+			temp, rippleMax - rippleMin, (unsigned long) HostAtomizer_GetPower());
+	}
+	fflush(stdout);
+	Thread_IrqRestore(primask);
+}
+
+static void *Bench_MainProc(void *args) {
+	Thread_t stepper;
+	uint32_t primask;
+	uint8_t i;
+
+	Atomizer_Init();
+	Atomizer_SetBaseUpdateCallback(Bench_BaseUpdateCallback);
+	Thread_CreateEx(&stepper, Bench_StepperProc, NULL, BENCH_STACKSIZE, THREAD_PRIORITY_MIN);
+	if(Bench_hasGains) {
+		Atomizer_SetFeedbackGains(Bench_gains[0], Bench_gains[1], Bench_gains[2]);
+	}
+
+	primask = Thread_IrqDisable();
+	printf("%-20s %10s %10s %10s %10s %10s\n", "step response", "rise ms",
+		"settle ms", "overshoot", "final mV", "ripple mV");
+	Thread_IrqRestore(primask);
+
+	for(i = 0; i < sizeof(Bench_scenarios) / sizeof(Bench_scenarios[0]); i++) {
+		Bench_StepResponse(&Bench_scenarios[i]);
+	}
+
+	primask = Thread_IrqDisable();
+	printf("\n%-20s %10s %10s %10s\n", "power tracking", "settle ms",
+		"heat err", "final mW");
+	Thread_IrqRestore(primask);
+
+	for(i = 0; i < sizeof(Bench_powerScenarios) / sizeof(Bench_powerScenarios[0]); i++) {
+		Bench_PowerTracking(&Bench_powerScenarios[i], 0);
+		Bench_PowerTracking(&Bench_powerScenarios[i], 1);
+	}
+
+	primask = Thread_IrqDisable();
+	printf("\n%-20s %10s %10s %10s %10s %10s\n", "temperature control", "settle ms",
+		"overshoot", "final C", "ripple C", "final mW");
+	Thread_IrqRestore(primask);
+
+	for(i = 0; i < sizeof(Bench_tempScenarios) / sizeof(Bench_tempScenarios[0]); i++) {
+		Bench_TempControl(&Bench_tempScenarios[i]);
+	}
+
+	primask = Thread_IrqDisable();
+	printf("\n%-20s %10s %10s %10s\n", "median filter", "ns/sample",
+		"ref ns", "speedup");
+	Thread_IrqRestore(primask);
+
+	Bench_MedianFilter();
+
+	// Leave with IRQs masked: the C library runs atexit handlers
+	Thread_IrqDisable();
+	exit(Bench_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	return NULL;
+}
+
+/**
+ * Usage: AtomizerBench [kp ki kd]
+ * Gains are in Q8, as for Atomizer_SetFeedbackGains().
+ */
+int main(int argc, char **argv) {
+	Thread_t mainThread;
+
+	if(argc == 4) {
+		Bench_hasGains = 1;
+		Bench_gains[0] = atoi(argv[1]);
+		Bench_gains[1] = atoi(argv[2]);
+		Bench_gains[2] = atoi(argv[3]);
+	}
+
+	Host_Init();
+	Thread_Init();
+	Thread_Create(&mainThread, Bench_MainProc, NULL, BENCH_STACKSIZE);
+
+	// The scheduler takes over from here
+	while(1);
+}
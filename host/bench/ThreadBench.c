@@ -0,0 +1,579 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/*
+ * Scheduler benchmarks for the host port of the thread library.
+ * Absolute figures include the cost of the host context switch and of
+ * the emulated exception model: use them to compare scheduler changes
+ * on the same machine, not as a prediction of on-device timings.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <Thread.h>
+#include <WorkQueue.h>
+#include <Task.h>
+#include <HostPort.h>
+
+/* Device stack size for benchmark threads. */
+#define BENCH_STACKSIZE 1024
+
+/* Iteration counts. */
+#define BENCH_YIELD_ITERS   200000
+#define BENCH_WAKEUP_ITERS  100000
+#define BENCH_SEMA_ITERS    100000
+#define BENCH_MUTEX_ITERS   50000
+#define BENCH_MUTEX_THREADS 4
+#define BENCH_DELAY_REPS    20
+#define BENCH_WORK_ITERS    100000
+#define BENCH_PERIODIC_REPS 100
+#define BENCH_DEFER_ITERS   100000
+#define BENCH_TASK_ITERS    100000
+#define BENCH_TASK_COUNT    8
+
+/* Benchmark thread arguments must be addressable with 32 bits. */
+static Thread_Semaphore_t Bench_sema[2];
+static Thread_Mutex_t Bench_mutex;
+static volatile uint32_t Bench_counter;
+static volatile uint64_t Bench_wakeStart;
+static uint64_t Bench_wakeMin, Bench_wakeMax, Bench_wakeTotal;
+static uint8_t Bench_failed;
+
+/**
+ * Prints a line of the results table. Output runs with
+ * IRQs masked, since the C library isn't thread-aware.
+ *
+ * @param name       Benchmark name.
+ * @param iterations Number of operations.
+ * @param totalNs    Total time, in nanoseconds.
+ * @param notes      Extra information, or NULL.
+ */
+static void Bench_Report(const char *name, uint32_t iterations, uint64_t totalNs, const char *notes) {
+	uint32_t primask = Thread_IrqDisable();
+
+	printf("%-24s %10lu %12.1f  %s\n", name, (unsigned long) iterations,
+		(double) totalNs / iterations, notes != NULL ? notes : "");
+	fflush(stdout);
+	Thread_IrqRestore(primask);
+}
+
+/**
+ * Prints a failure message and marks the run as failed.
+ *
+ * @param msg Message.
+ */
+static void Bench_Fail(const char *msg) {
+	uint32_t primask = Thread_IrqDisable();
+
+	fprintf(stderr, "FAIL: %s\n", msg);
+	Bench_failed = 1;
+	Thread_IrqRestore(primask);
+}
+
+/**
+ * Runs a set of threads with the same entry point and waits for them.
+ *
+ * @param count    Number of threads.
+ * @param entry    Thread entry point.
+ * @param args     Array of thread arguments, one per thread.
+ * @param priority Thread priority.
+ *
+ * @return Elapsed time, in nanoseconds.
+ */
+static uint64_t Bench_RunThreads(uint8_t count, Thread_EntryPtr_t entry, void **args, uint8_t priority) {
+	Thread_t threads[BENCH_MUTEX_THREADS];
+	uint64_t start;
+	void *ret;
+	uint8_t i;
+
+	start = Host_GetTimeNs();
+	for(i = 0; i < count; i++) {
+		if(Thread_CreateEx(&threads[i], entry, args[i], BENCH_STACKSIZE, priority) != TD_SUCCESS) {
+			Bench_Fail("thread creation");
+			return 0;
+		}
+	}
+	for(i = 0; i < count; i++) {
+		Thread_Join(threads[i], &ret);
+	}
+
+	return Host_GetTimeNs() - start;
+}
+
+static void *Bench_YieldProc(void *args) {
+	uint32_t i;
+
+	for(i = 0; i < BENCH_YIELD_ITERS; i++) {
+		Thread_Yield();
+	}
+
+	return NULL;
+}
+
+/**
+ * Context switch cost: two threads of the same priority yield
+ * to each other, so every yield is a switch.
+ */
+static void Bench_Yield() {
+	void *args[2] = {NULL, NULL};
+	uint64_t total;
+
+	total = Bench_RunThreads(2, Bench_YieldProc, args, THREAD_PRIORITY_DEFAULT);
+	Bench_Report("yield switch", 2 * BENCH_YIELD_ITERS, total, NULL);
+}
+
+static void *Bench_WakeupProc(void *args) {
+	uint64_t latency;
+	uint32_t i;
+
+	for(i = 0; i < BENCH_WAKEUP_ITERS; i++) {
+		Thread_SemaphoreDown(Bench_sema[0]);
+		latency = Host_GetTimeNs() - Bench_wakeStart;
+		Bench_wakeTotal += latency;
+		if(latency < Bench_wakeMin) {
+			Bench_wakeMin = latency;
+		}
+		if(latency > Bench_wakeMax) {
+			Bench_wakeMax = latency;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Wakeup latency: a high priority thread blocked on a semaphore
+ * preempts the benchmark thread as soon as it's released.
+ */
+static void Bench_Wakeup() {
+	Thread_t thread;
+	char notes[64];
+	uint32_t i;
+	void *ret;
+
+	Bench_wakeMin = UINT64_MAX;
+	Bench_wakeMax = 0;
+	Bench_wakeTotal = 0;
+	Thread_CreateEx(&thread, Bench_WakeupProc, NULL, BENCH_STACKSIZE, THREAD_PRIORITY_DEFAULT + 2);
+	for(i = 0; i < BENCH_WAKEUP_ITERS; i++) {
+		Bench_wakeStart = Host_GetTimeNs();
+		Thread_SemaphoreUp(Bench_sema[0]);
+	}
+	Thread_Join(thread, &ret);
+
+	snprintf(notes, sizeof(notes), "min %lu ns, max %lu ns",
+		(unsigned long) Bench_wakeMin, (unsigned long) Bench_wakeMax);
+	Bench_Report("wakeup latency", BENCH_WAKEUP_ITERS, Bench_wakeTotal, notes);
+}
+
+static void *Bench_PingProc(void *args) {
+	uint32_t i;
+
+	for(i = 0; i < BENCH_SEMA_ITERS; i++) {
+		Thread_SemaphoreUp(Bench_sema[0]);
+		Thread_SemaphoreDown(Bench_sema[1]);
+	}
+
+	return NULL;
+}
+
+static void *Bench_PongProc(void *args) {
+	uint32_t i;
+
+	for(i = 0; i < BENCH_SEMA_ITERS; i++) {
+		Thread_SemaphoreDown(Bench_sema[0]);
+		Thread_SemaphoreUp(Bench_sema[1]);
+	}
+
+	return NULL;
+}
+
+/**
+ * Semaphore ping-pong: two threads hand a token back and forth.
+ * Reported time is per round trip (two switches).
+ */
+static void Bench_SemaPingPong() {
+	Thread_t ping, pong;
+	uint64_t start;
+	void *ret;
+
+	start = Host_GetTimeNs();
+	Thread_CreateEx(&pong, Bench_PongProc, NULL, BENCH_STACKSIZE, THREAD_PRIORITY_DEFAULT + 1);
+	Thread_CreateEx(&ping, Bench_PingProc, NULL, BENCH_STACKSIZE, THREAD_PRIORITY_DEFAULT + 1);
+	Thread_Join(ping, &ret);
+	Thread_Join(pong, &ret);
+
+	Bench_Report("semaphore round trip", BENCH_SEMA_ITERS, Host_GetTimeNs() - start, NULL);
+}
+
+static void *Bench_MutexProc(void *args) {
+	uint32_t i;
+
+	for(i = 0; i < BENCH_MUTEX_ITERS; i++) {
+		Thread_MutexLock(Bench_mutex);
+		Bench_counter++;
+		// Give up the CPU while holding the lock, so
+		// that every other thread blocks on it.
+		Thread_Yield();
+		Thread_MutexUnlock(Bench_mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * Mutex contention: several threads of the same priority
+ * increment a counter under a contended mutex.
+ */
+static void Bench_Mutex() {
+	void *args[BENCH_MUTEX_THREADS] = {NULL};
+	uint32_t maxBlock;
+	uint64_t total;
+	char notes[64];
+
+	Bench_counter = 0;
+	total = Bench_RunThreads(BENCH_MUTEX_THREADS, Bench_MutexProc, args, THREAD_PRIORITY_DEFAULT + 1);
+	if(Bench_counter != BENCH_MUTEX_THREADS * BENCH_MUTEX_ITERS) {
+		Bench_Fail("mutex counter mismatch");
+	}
+
+	Thread_MutexGetMaxBlockTime(Bench_mutex, &maxBlock);
+	snprintf(notes, sizeof(notes), "%d threads, max block %lu ms",
+		BENCH_MUTEX_THREADS, (unsigned long) maxBlock);
+	Bench_Report("mutex lock/unlock", BENCH_MUTEX_THREADS * BENCH_MUTEX_ITERS, total, notes);
+}
+
+static void Bench_WorkProc(void *context, uint32_t arg) {
+	uint64_t latency = Host_GetTimeNs() - Bench_wakeStart;
+
+	Bench_wakeTotal += latency;
+	if(latency > Bench_wakeMax) {
+		Bench_wakeMax = latency;
+	}
+	Thread_SemaphoreUp(Bench_sema[1]);
+}
+
+/**
+ * Deferred work latency: from WorkQueue_Post() to the
+ * item running on the worker thread.
+ */
+static void Bench_Work() {
+	char notes[64];
+	uint32_t i;
+
+	if(!WorkQueue_Start()) {
+		Bench_Fail("work queue start");
+		return;
+	}
+
+	Bench_wakeMax = 0;
+	Bench_wakeTotal = 0;
+	for(i = 0; i < BENCH_WORK_ITERS; i++) {
+		Bench_wakeStart = Host_GetTimeNs();
+		if(!WorkQueue_Post(Bench_WorkProc, NULL, i)) {
+			Bench_Fail("work item dropped");
+			return;
+		}
+		Thread_SemaphoreDown(Bench_sema[1]);
+	}
+
+	snprintf(notes, sizeof(notes), "max %lu ns", (unsigned long) Bench_wakeMax);
+	Bench_Report("work item latency", BENCH_WORK_ITERS, Bench_wakeTotal, notes);
+}
+
+/**
+ * Thread_DelayMs() accuracy. Reports mean and worst
+ * oversleep for a few delays; undersleeping fails.
+ */
+static void Bench_Delay() {
+	static const uint32_t delays[] = {1, 2, 5, 10, 20, 50};
+	uint64_t start, elapsed, total;
+	int64_t error, maxError;
+	char name[32], notes[64];
+	uint32_t i, j;
+
+	for(i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+		total = 0;
+		maxError = 0;
+		for(j = 0; j < BENCH_DELAY_REPS; j++) {
+			start = Host_GetTimeNs();
+			Thread_DelayMs(delays[i]);
+			elapsed = Host_GetTimeNs() - start;
+			total += elapsed;
+			error = (int64_t) elapsed - (int64_t) delays[i] * 1000000;
+			if(error > maxError) {
+				maxError = error;
+			}
+			if(error < -1000000) {
+				Bench_Fail("delay ended more than a tick early");
+			}
+		}
+
+		snprintf(name, sizeof(name), "delay %lu ms", (unsigned long) delays[i]);
+		snprintf(notes, sizeof(notes), "mean error %+.1f us, max %+.1f us",
+			((double) total / BENCH_DELAY_REPS - delays[i] * 1000000.0) / 1000,
+			maxError / 1000.0);
+		Bench_Report(name, BENCH_DELAY_REPS, total, notes);
+	}
+}
+
+static Thread_Deferred_t Bench_deferred;
+
+static void Bench_DeferredProc(uint32_t bits) {
+	uint64_t latency = Host_GetTimeNs() - Bench_wakeStart;
+
+	Bench_wakeTotal += latency;
+	if(latency > Bench_wakeMax) {
+		Bench_wakeMax = latency;
+	}
+	Thread_SemaphoreUp(Bench_sema[1]);
+}
+
+/**
+ * Deferred call latency: from Thread_DeferredPost() to the
+ * deferred function running in the PendSV handler.
+ */
+static void Bench_Deferred() {
+	char notes[64];
+	uint32_t i;
+
+	Thread_DeferredInit(&Bench_deferred, Bench_DeferredProc);
+	Bench_wakeMax = 0;
+	Bench_wakeTotal = 0;
+	for(i = 0; i < BENCH_DEFER_ITERS; i++) {
+		Bench_wakeStart = Host_GetTimeNs();
+		Thread_DeferredPost(&Bench_deferred, 1);
+		Thread_SemaphoreDown(Bench_sema[1]);
+	}
+
+	snprintf(notes, sizeof(notes), "max %lu ns", (unsigned long) Bench_wakeMax);
+	Bench_Report("deferred call latency", BENCH_DEFER_ITERS, Bench_wakeTotal, notes);
+}
+
+static Task_t Bench_tasks[BENCH_TASK_COUNT];
+static volatile uint32_t Bench_taskRuns[BENCH_TASK_COUNT];
+
+static void Bench_TaskLatencyProc(Task_t *task, void *context, uint8_t event) {
+	uint64_t latency = Host_GetTimeNs() - Bench_wakeStart;
+
+	if(event != (uint8_t) (uintptr_t) context) {
+		Bench_Fail("wrong task event");
+	}
+	Bench_wakeTotal += latency;
+	if(latency > Bench_wakeMax) {
+		Bench_wakeMax = latency;
+	}
+	if(event == TASK_EVENT_SEMA) {
+		// Wait for the next up
+		Task_WaitSemaphore(task, Bench_sema[0], 0);
+	}
+	Thread_SemaphoreUp(Bench_sema[1]);
+}
+
+static void Bench_TaskPeriodicProc(Task_t *task, void *context, uint8_t event) {
+	uint32_t *runs = context;
+
+	if(++*runs < BENCH_PERIODIC_REPS) {
+		Task_DelayUntil(task, 5);
+	}
+	else {
+		Thread_SemaphoreUp(Bench_sema[1]);
+	}
+}
+
+/**
+ * Cooperative task latency, from Task_Post() and Task_SemaphoreUp()
+ * to the task running. Then several 5 ms periodic tasks sharing the
+ * runner stack, reporting the drift of the whole run.
+ */
+static void Bench_Task() {
+	static const struct {
+		const char *name;
+		uint8_t event;
+	} modes[] = {
+		{"task post latency", TASK_EVENT_POST},
+		{"task semaphore latency", TASK_EVENT_SEMA}
+	};
+	uint64_t start, end;
+	uint32_t i, j;
+	char notes[64];
+
+	if(!Task_Start()) {
+		Bench_Fail("task runner start");
+		return;
+	}
+
+	for(i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		Task_Init(&Bench_tasks[0], Bench_TaskLatencyProc, (void *) (uintptr_t) modes[i].event);
+		if(modes[i].event == TASK_EVENT_SEMA) {
+			Task_WaitSemaphore(&Bench_tasks[0], Bench_sema[0], 0);
+		}
+		Bench_wakeMax = 0;
+		Bench_wakeTotal = 0;
+		for(j = 0; j < BENCH_TASK_ITERS; j++) {
+			Bench_wakeStart = Host_GetTimeNs();
+			if(modes[i].event == TASK_EVENT_POST) {
+				Task_Post(&Bench_tasks[0]);
+			}
+			else {
+				Task_SemaphoreUp(Bench_sema[0]);
+			}
+			Thread_SemaphoreDown(Bench_sema[1]);
+		}
+		Task_Cancel(&Bench_tasks[0]);
+
+		snprintf(notes, sizeof(notes), "max %lu ns", (unsigned long) Bench_wakeMax);
+		Bench_Report(modes[i].name, BENCH_TASK_ITERS, Bench_wakeTotal, notes);
+	}
+
+	start = Host_GetTimeNs();
+	for(i = 0; i < BENCH_TASK_COUNT; i++) {
+		Bench_taskRuns[i] = 0;
+		Task_Init(&Bench_tasks[i], Bench_TaskPeriodicProc, (void *) &Bench_taskRuns[i]);
+		Task_DelayUntil(&Bench_tasks[i], 5);
+	}
+	for(i = 0; i < BENCH_TASK_COUNT; i++) {
+		Thread_SemaphoreDown(Bench_sema[1]);
+	}
+	end = Host_GetTimeNs();
+
+	snprintf(notes, sizeof(notes), "%d tasks, drift %+.1f us", BENCH_TASK_COUNT,
+		((double) (end - start) - BENCH_PERIODIC_REPS * 5000000.0) / 1000);
+	Bench_Report("task periodic", BENCH_PERIODIC_REPS, end - start, notes);
+}
+
+/**
+ * Reports the longest kernel lock over all the benchmarks.
+ */
+static void Bench_LockStats() {
+	Thread_LockStats_t stats;
+	char notes[64];
+
+	Thread_GetLockStats(&stats);
+	snprintf(notes, sizeof(notes), "max %lu cycles (%.1f us)",
+		(unsigned long) stats.maxCycles, stats.maxCycles / (SystemCoreClock / 1e6));
+	Bench_Report("kernel lock", stats.count, 0, notes);
+}
+
+/**
+ * Busy loops for the specified time, in nanoseconds.
+ */
+static void Bench_Spin(uint64_t ns) {
+	uint64_t start = Host_GetTimeNs();
+
+	while(Host_GetTimeNs() - start < ns);
+}
+
+/**
+ * Periodic loop drift: 5 ms period with up to 3 ms of work per
+ * iteration, using relative and absolute delays. Then a loop
+ * that overruns every other deadline, to check missed deadline
+ * reporting.
+ */
+static void Bench_Periodic() {
+	static const struct {
+		const char *name;
+		uint8_t mode;
+	} loops[] = {
+		{"periodic DelayMs", 0},
+		{"periodic DelayUntil", 1},
+		{"periodic nobusywait", 2}
+	};
+	Thread_Periodic_t periodic;
+	uint64_t start, end;
+	uint32_t i, j, lastWake, missed;
+	char notes[64];
+
+	for(i = 0; i < sizeof(loops) / sizeof(loops[0]); i++) {
+		lastWake = Thread_GetSysTicks();
+		start = Host_GetTimeNs();
+		for(j = 0; j < BENCH_PERIODIC_REPS; j++) {
+			Bench_Spin((j % 4) * 1000000);
+			switch(loops[i].mode) {
+				case 0:
+					Thread_DelayMs(5);
+					break;
+				case 1:
+					Thread_DelayUntil(&lastWake, 5);
+					break;
+				case 2:
+					Thread_DelayUntilEx(&lastWake, 5, THREAD_DELAY_NOBUSYWAIT);
+					break;
+			}
+		}
+		end = Host_GetTimeNs();
+
+		snprintf(notes, sizeof(notes), "drift %+.1f us",
+			((double) (end - start) - BENCH_PERIODIC_REPS * 5000000.0) / 1000);
+		Bench_Report(loops[i].name, BENCH_PERIODIC_REPS, end - start, notes);
+	}
+
+	Thread_PeriodicInit(&periodic, 5, 0);
+	missed = 0;
+	for(j = 0; j < BENCH_PERIODIC_REPS; j++) {
+		Bench_Spin(j % 2 ? 7000000 : 0);
+		missed += Thread_PeriodicWait(&periodic);
+	}
+	if(missed != periodic.missed || missed < BENCH_PERIODIC_REPS / 2) {
+		Bench_Fail("missed deadlines not reported");
+	}
+	snprintf(notes, sizeof(notes), "%lu deadlines missed", (unsigned long) missed);
+	Bench_Report("periodic overrun", BENCH_PERIODIC_REPS, 0, notes);
+}
+
+static void *Bench_MainProc(void *args) {
+	uint32_t primask;
+
+	Thread_SemaphoreCreate(&Bench_sema[0], 0);
+	Thread_SemaphoreCreate(&Bench_sema[1], 0);
+	Thread_MutexCreate(&Bench_mutex);
+
+	primask = Thread_IrqDisable();
+	printf("%-24s %10s %12s  %s\n", "benchmark", "iterations", "ns/op", "notes");
+	Thread_IrqRestore(primask);
+
+	Bench_Yield();
+	Bench_Wakeup();
+	Bench_SemaPingPong();
+	Bench_Mutex();
+	Bench_Work();
+	Bench_Deferred();
+	Bench_Delay();
+	Bench_Periodic();
+	Bench_Task();
+	Bench_LockStats();
+
+	// Leave with IRQs masked: the C library runs atexit handlers
+	Thread_IrqDisable();
+	exit(Bench_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+
+	return NULL;
+}
+
+int main() {
+	Thread_t mainThread;
+
+	Host_Init();
+	Thread_Init();
+	Thread_Create(&mainThread, Bench_MainProc, NULL, BENCH_STACKSIZE);
+
+	// The scheduler takes over from here
+	while(1);
+}
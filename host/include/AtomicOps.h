@@ -0,0 +1,82 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/*
+ * Host version of AtomicOps.h, built on the compiler atomic builtins.
+ * It provides the same operations, widths and orderings as the
+ * LDREX/STREX implementation.
+ */
+
+#ifndef EVICSDK_ATOMICOPS_H
+#define EVICSDK_ATOMICOPS_H
+
+#include <stdint.h>
+
+#define ATOMICOPS_INLINE __attribute__((always_inline)) static inline
+
+#define ATOMICOPS_ORDERS(def, name, type, ...) \
+	def(name,          type, __ATOMIC_SEQ_CST, __VA_ARGS__) \
+	def(name##Acquire, type, __ATOMIC_ACQUIRE, __VA_ARGS__) \
+	def(name##Release, type, __ATOMIC_RELEASE, __VA_ARGS__) \
+	def(name##Relaxed, type, __ATOMIC_RELAXED, __VA_ARGS__)
+
+#define ATOMICOPS_WIDTHS(def, name, ...) \
+	ATOMICOPS_ORDERS(def, name,     uint32_t, __VA_ARGS__) \
+	ATOMICOPS_ORDERS(def, name##16, uint16_t, __VA_ARGS__) \
+	ATOMICOPS_ORDERS(def, name##8,  uint8_t,  __VA_ARGS__)
+
+#define ATOMICOPS_DEF_SWAP(name, type, order, unused) \
+	ATOMICOPS_INLINE type AtomicOps_##name(volatile type *ptr, type newVal) { \
+		return __atomic_exchange_n(ptr, newVal, order); \
+	}
+
+#define ATOMICOPS_DEF_CMPSWAP(name, type, order, unused) \
+	ATOMICOPS_INLINE type AtomicOps_##name(volatile type *ptr, type expVal, type newVal) { \
+		__atomic_compare_exchange_n(ptr, &expVal, newVal, 0, order, __ATOMIC_RELAXED); \
+		return expVal; \
+	}
+
+#define ATOMICOPS_DEF_RMW(name, type, order, builtin) \
+	ATOMICOPS_INLINE type AtomicOps_##name(volatile type *ptr, type n) { \
+		return builtin(ptr, n, order); \
+	}
+
+ATOMICOPS_INLINE void AtomicOps_Barrier() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_SWAP, Swap, 0)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_CMPSWAP, CmpSwap, 0)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, Add, __atomic_add_fetch)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, Sub, __atomic_sub_fetch)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, And, __atomic_and_fetch)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, Or,  __atomic_or_fetch)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchAdd, __atomic_fetch_add)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchSub, __atomic_fetch_sub)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchAnd, __atomic_fetch_and)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchOr,  __atomic_fetch_or)
+
+#undef ATOMICOPS_DEF_RMW
+#undef ATOMICOPS_DEF_CMPSWAP
+#undef ATOMICOPS_DEF_SWAP
+#undef ATOMICOPS_WIDTHS
+#undef ATOMICOPS_ORDERS
+#undef ATOMICOPS_INLINE
+
+#endif
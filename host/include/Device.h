@@ -0,0 +1,39 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/*
+ * Host replacement for the device header: an eVic VTC Mini,
+ * as far as the atomizer library is concerned.
+ */
+
+#ifndef EVICSDK_HOST_DEVICE_H
+#define EVICSDK_HOST_DEVICE_H
+
+#include <stdint.h>
+
+#define DEVICE_ADC_MODULE_VBAT 0x12
+
+/**
+ * Gets the atomizer shunt resistance.
+ *
+ * @return Shunt resistance, in 100ths of a mOhm.
+ */
+uint8_t Device_GetAtomizerShunt();
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_HOSTATOMIZER_H
+#define EVICSDK_HOSTATOMIZER_H
+
+#include <stdint.h>
+#include <ADC.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Simulation step, in microseconds. One feedback iteration
+ * runs per step, like the 10kHz loop timer on the device.
+ */
+#define HOSTATOMIZER_STEP_US 100
+
+/**
+ * Ambient temperature, in °C. Also the board temperature
+ * reported by the thermistor.
+ */
+#define HOSTATOMIZER_AMBIENT 25
+
+/**
+ * Sets up the simulated load. Resets the output voltage
+ * to zero, the battery to full charge and the coil to ambient
+ * temperature, with a constant resistance.
+ *
+ * @param resistance Coil resistance, in mOhm.
+ * @param noise      ADC noise amplitude, in LSBs (0 for none).
+ */
+void HostAtomizer_Setup(uint16_t resistance, uint8_t noise);
+
+/**
+ * Makes the coil resistance follow its temperature. The coil heats
+ * up with the output power and loses heat to the ambient through a
+ * thermal resistance. The resistance set by HostAtomizer_Setup() is
+ * the resistance at HOSTATOMIZER_AMBIENT. Call after HostAtomizer_Setup().
+ *
+ * @param coeffs       Resistance curve coefficients {a, b, c, d}:
+ *                     R(T) / R(0 °C) = 1 + aT + bT^2 + cT^4 + dT^6.
+ * @param heatCapacity Coil heat capacity, in J/K.
+ * @param thermalRes   Thermal resistance to ambient, in K/W.
+ */
+void HostAtomizer_SetCoil(const double coeffs[4], double heatCapacity, double thermalRes);
+
+/**
+ * Gets the simulated coil temperature.
+ *
+ * @return Coil temperature, in °C.
+ */
+double HostAtomizer_GetTemperature(void);
+
+/**
+ * Changes the coil resistance without resetting the plant.
+ *
+ * @param resistance Coil resistance, in mOhm.
+ */
+void HostAtomizer_SetResistance(uint16_t resistance);
+
+/**
+ * Advances the converter model by HOSTATOMIZER_STEP_US and runs
+ * one iteration of the atomizer feedback loop, with IRQs masked
+ * since the loop runs above the kernel on the device.
+ */
+void HostAtomizer_Step(void);
+
+/**
+ * Gets the simulated output voltage at the coil.
+ *
+ * @return Output voltage, in mV.
+ */
+uint32_t HostAtomizer_GetVoltage(void);
+
+/**
+ * Gets the simulated output power.
+ *
+ * @return Output power, in mW.
+ */
+uint32_t HostAtomizer_GetPower(void);
+
+/**
+ * Gets the simulated battery voltage under load.
+ *
+ * @return Battery voltage, in mV.
+ */
+uint32_t HostAtomizer_GetBatteryVoltage(void);
+
+/**
+ * Gets the filter installed on an ADC module with ADC_SetFilter().
+ *
+ * @param moduleNum  One of ADC_MODULE_*.
+ * @param filterData Pointer to receive the filter data.
+ *
+ * @return ADC filter function, or NULL if none.
+ */
+ADC_Filter_t HostAtomizer_GetFilter(uint8_t moduleNum, uint32_t *filterData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
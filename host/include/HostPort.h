@@ -0,0 +1,56 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_HOSTPORT_H
+#define EVICSDK_HOSTPORT_H
+
+#include <stdint.h>
+#include <M451Series.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Initializes the host port: checks that the image and heap are
+ * addressable with 32-bit pointers and starts the interrupt tick.
+ * Must be called before Thread_Init().
+ */
+void Host_Init(void);
+
+/**
+ * Gets the time elapsed since Host_Init().
+ *
+ * @return Elapsed time, in nanoseconds.
+ */
+uint64_t Host_GetTimeNs(void);
+
+/**
+ * Gets the time elapsed since Host_Init(), expressed in
+ * cycles of the emulated core clock (SystemCoreClock).
+ *
+ * @return Elapsed time, in emulated core cycles.
+ */
+uint64_t Host_GetCycles(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
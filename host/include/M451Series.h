@@ -0,0 +1,217 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/*
+ * Host replacement for the M451 device header. It provides just enough
+ * of the CMSIS core interface for the thread library: SysTick and SCB
+ * are emulated by HostPort.c, exceptions run from a SIGALRM tick and
+ * PRIMASK/BASEPRI/IPSR are software state. The GPIO and PWM subset
+ * used by the atomizer library is emulated by HostAtomizer.c.
+ */
+
+#ifndef EVICSDK_HOST_M451SERIES_H
+#define EVICSDK_HOST_M451SERIES_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	PendSV_IRQn  = -2,
+	SysTick_IRQn = -1
+} IRQn_Type;
+
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t LOAD;
+	volatile uint32_t VAL;
+	volatile uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct {
+	volatile uint32_t CPUID;
+	volatile uint32_t ICSR;
+	volatile uint32_t VTOR;
+	volatile uint32_t AIRCR;
+	volatile uint32_t SCR;
+	volatile uint32_t CCR;
+	volatile uint8_t  SHP[12];
+	volatile uint32_t SHCSR;
+	volatile uint32_t CPACR;
+} SCB_Type;
+
+typedef struct {
+	volatile uint8_t IP[240];
+} NVIC_Type;
+
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef struct {
+	volatile uint32_t TYPE;
+	volatile uint32_t CTRL;
+	volatile uint32_t RNR;
+	volatile uint32_t RBAR;
+	volatile uint32_t RASR;
+} MPU_Type;
+
+#define SysTick_CTRL_ENABLE_Msk    (1UL << 0)
+#define SysTick_CTRL_TICKINT_Msk   (1UL << 1)
+#define SysTick_CTRL_CLKSOURCE_Msk (1UL << 2)
+#define SysTick_CTRL_COUNTFLAG_Msk (1UL << 16)
+#define SysTick_LOAD_RELOAD_Msk    0xFFFFFFUL
+#define SysTick_VAL_CURRENT_Msk    0xFFFFFFUL
+
+#define SCB_ICSR_PENDSTCLR_Msk     (1UL << 25)
+#define SCB_ICSR_PENDSTSET_Msk     (1UL << 26)
+#define SCB_ICSR_PENDSVCLR_Msk     (1UL << 27)
+#define SCB_ICSR_PENDSVSET_Msk     (1UL << 28)
+#define SCB_SHCSR_USGFAULTENA_Msk  (1UL << 18)
+
+#define DWT_CTRL_CYCCNTENA_Msk     (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+#define __NVIC_PRIO_BITS 4
+
+#define MPU_CTRL_ENABLE_Pos     0
+#define MPU_CTRL_HFNMIENA_Pos   1
+#define MPU_CTRL_PRIVDEFENA_Pos 2
+#define MPU_RNR_REGION_Pos      0
+#define MPU_RASR_ENABLE_Pos     0
+#define MPU_RASR_SIZE_Pos       1
+#define MPU_RASR_SRD_Pos        8
+#define MPU_RASR_B_Pos          16
+#define MPU_RASR_C_Pos          17
+#define MPU_RASR_S_Pos          18
+#define MPU_RASR_TEX_Pos        19
+#define MPU_RASR_AP_Pos         24
+#define MPU_RASR_XN_Pos         28
+
+/* Register accesses sync the emulated peripherals first. */
+#define SysTick (Host_GetSysTick())
+#define SCB     (Host_GetScb())
+#define MPU     (&Host_mpu)
+#define NVIC    (&Host_nvic)
+#define DWT     (&Host_dwt)
+#define CoreDebug (&Host_coreDebug)
+
+/* Heap and data live in the low 4GB (see HostPort.c). */
+#define THREAD_RAM_START 0x00001000UL
+#define THREAD_RAM_END   0xFFFFFFFFUL
+
+/* The cycle counter is derived from the monotonic clock. */
+#define THREAD_GET_CYCLES() ((uint32_t) Host_GetCycles())
+
+/* PendSV takes effect right away when it isn't masked. */
+#define THREAD_PEND_SCHED() Host_SetPendSV()
+
+/* Atomizer peripherals: GPIO port C, PC.0-PC.3 multi-function pins, PWM0. */
+typedef struct {
+	volatile uint32_t GPC_MFPL;
+} SYS_T;
+
+typedef struct {
+	volatile uint32_t MODE;
+} GPIO_T;
+
+typedef struct {
+	volatile uint32_t CMPDAT[6];
+} PWM_T;
+
+#define BIT0 (1UL << 0)
+#define BIT1 (1UL << 1)
+#define BIT2 (1UL << 2)
+#define BIT3 (1UL << 3)
+
+#define GPIO_MODE_OUTPUT 0x1UL
+
+#define SYS_GPC_MFPL_PC0MFP_Msk      (0xFUL << 0)
+#define SYS_GPC_MFPL_PC0MFP_PWM0_CH0 (0x6UL << 0)
+#define SYS_GPC_MFPL_PC2MFP_Msk      (0xFUL << 8)
+#define SYS_GPC_MFPL_PC2MFP_PWM0_CH2 (0x6UL << 8)
+
+#define PWM_CH_0_MASK 0x1UL
+#define PWM_CH_2_MASK 0x4UL
+
+#define SYS  (&Host_sys)
+#define PC   (&Host_gpioC)
+#define PWM0 (&Host_pwm0)
+#define PC0  (Host_gpioCPin[0])
+#define PC1  (Host_gpioCPin[1])
+#define PC2  (Host_gpioCPin[2])
+#define PC3  (Host_gpioCPin[3])
+
+#define PWM_SET_CMR(pwm, ch, cmr) ((pwm)->CMPDAT[ch] = (cmr))
+
+extern SYS_T Host_sys;
+extern GPIO_T Host_gpioC;
+extern PWM_T Host_pwm0;
+extern volatile uint32_t Host_gpioCPin[16];
+
+void GPIO_SetMode(GPIO_T *port, uint32_t pinMask, uint32_t mode);
+uint32_t PWM_ConfigOutputChannel(PWM_T *pwm, uint32_t ch, uint32_t freq, uint32_t duty);
+void PWM_EnableOutput(PWM_T *pwm, uint32_t mask);
+void PWM_Start(PWM_T *pwm, uint32_t mask);
+
+extern uint32_t SystemCoreClock;
+extern MPU_Type Host_mpu;
+extern NVIC_Type Host_nvic;
+extern DWT_Type Host_dwt;
+extern CoreDebug_Type Host_coreDebug;
+
+SysTick_Type *Host_GetSysTick(void);
+SCB_Type *Host_GetScb(void);
+void Host_SetPendSV(void);
+uint64_t Host_GetCycles(void);
+
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+uint32_t __get_BASEPRI(void);
+void __set_BASEPRI(uint32_t basepri);
+void __set_BASEPRI_MAX(uint32_t basepri);
+uint32_t __get_IPSR(void);
+void __WFI(void);
+
+static inline void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority) {
+	(void) irqn;
+	(void) priority;
+}
+
+static inline uint32_t __CLZ(uint32_t value) {
+	return value == 0 ? 32 : (uint32_t) __builtin_clz(value);
+}
+
+static inline void __DSB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline void __DMB(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline void __ISB(void) { __atomic_signal_fence(__ATOMIC_SEQ_CST); }
+static inline void __NOP(void) { __asm__ volatile("nop"); }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/*
+ * Simulated DC/DC converter, battery and coil for the host build of
+ * the atomizer library. Replaces the ADC, battery, PWM, GPIO and timer
+ * drivers that Atomizer.c depends on. The model is deliberately simple:
+ * an ideal buck or boost gain on the battery voltage, a first-order
+ * output response, a source resistance in series with the coil, a
+ * battery with internal resistance and optionally a coil that heats up
+ * and changes resistance accordingly. It is meant to compare control
+ * loops against each other, not to reproduce a specific board.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <M451Series.h>
+#include <ADC.h>
+#include <Battery.h>
+#include <Device.h>
+#include <TimerUtils.h>
+#include <Thread.h>
+#include <HostAtomizer.h>
+
+/* PWM period, in CMR counts. */
+#define HOSTATOMIZER_PWM_PERIOD 960.0
+/* Converter output time constant, in seconds. */
+#define HOSTATOMIZER_TAU        200e-6
+/* Converter and wiring resistance in series with the coil, in Ohm. */
+#define HOSTATOMIZER_RSRC       0.030
+/* Converter efficiency. */
+#define HOSTATOMIZER_EFFICIENCY 0.90
+/* Battery open circuit voltage, in V. */
+#define HOSTATOMIZER_BATT_VOC   4.00
+/* Battery internal resistance, in Ohm. */
+#define HOSTATOMIZER_BATT_RINT  0.015
+/* Integration substeps per simulation step. */
+#define HOSTATOMIZER_SUBSTEPS   10
+/* Shunt resistance, in 100ths of a mOhm (eVic VTC Mini). */
+#define HOSTATOMIZER_SHUNT      115
+/* ADC reading for the board thermistor at HOSTATOMIZER_AMBIENT. */
+#define HOSTATOMIZER_ADC_TEMP   1760
+
+/* Number of emulated ADC modules. */
+#define HOSTATOMIZER_ADC_MODULES 32
+
+SYS_T Host_sys;
+GPIO_T Host_gpioC;
+PWM_T Host_pwm0;
+volatile uint32_t Host_gpioCPin[16];
+
+/* Plant state: output and loaded battery voltage (V), coil resistance (Ohm). */
+static double HostAtomizer_vout, HostAtomizer_vbatt, HostAtomizer_rload;
+static uint8_t HostAtomizer_noise;
+
+/* Thermal model: enabled flag, resistance curve, coil temperature (°C),
+ * resistance at 0°C (Ohm), heat capacity (J/K) and thermal resistance (K/W). */
+static uint8_t HostAtomizer_isThermal;
+static double HostAtomizer_coeffs[4];
+static double HostAtomizer_temp, HostAtomizer_r0, HostAtomizer_heatCap, HostAtomizer_thermalRes;
+static uint32_t HostAtomizer_seed;
+
+/* ADC cache, conversions waiting to be committed and filters. */
+static uint16_t HostAtomizer_adcCache[HOSTATOMIZER_ADC_MODULES];
+static uint16_t HostAtomizer_adcPending[HOSTATOMIZER_ADC_MODULES];
+static uint8_t HostAtomizer_adcIsPending[HOSTATOMIZER_ADC_MODULES];
+static ADC_Filter_t HostAtomizer_adcFilter[HOSTATOMIZER_ADC_MODULES];
+static uint32_t HostAtomizer_adcFilterData[HOSTATOMIZER_ADC_MODULES];
+
+/* Feedback loop timer callback. */
+static Timer_Callback_t HostAtomizer_callback;
+static uint32_t HostAtomizer_callbackData;
+
+/**
+ * Gets the converter voltage gain from the PWM and GPIO setup.
+ * This is an internal function.
+ *
+ * @return Output to battery voltage ratio.
+ */
+static double HostAtomizer_GetGain() {
+	uint32_t mfpl = Host_sys.GPC_MFPL;
+	double cmr;
+
+	if(!Host_gpioCPin[1] || !Host_gpioCPin[3]) {
+		return 0;
+	}
+
+	if((mfpl & SYS_GPC_MFPL_PC2MFP_Msk) == SYS_GPC_MFPL_PC2MFP_PWM0_CH2) {
+		cmr = Host_pwm0.CMPDAT[2];
+		return HOSTATOMIZER_PWM_PERIOD / (cmr < 1 ? 1 : cmr);
+	}
+	if((mfpl & SYS_GPC_MFPL_PC0MFP_Msk) == SYS_GPC_MFPL_PC0MFP_PWM0_CH0) {
+		return Host_pwm0.CMPDAT[0] / HOSTATOMIZER_PWM_PERIOD;
+	}
+
+	// Buck switch held on as a GPIO
+	return Host_gpioCPin[0] ? 1 : 0;
+}
+
+/**
+ * Evaluates the coil resistance curve.
+ * This is an internal function.
+ *
+ * @param temp Temperature, in °C.
+ *
+ * @return R(temp) / R(0 °C).
+ */
+static double HostAtomizer_Curve(double temp) {
+	double t2 = temp * temp;
+
+	return 1 + HostAtomizer_coeffs[0] * temp + HostAtomizer_coeffs[1] * t2 +
+		HostAtomizer_coeffs[2] * t2 * t2 + HostAtomizer_coeffs[3] * t2 * t2 * t2;
+}
+
+/**
+ * Draws ADC noise.
+ * This is an internal function.
+ *
+ * @return Noise, in LSBs.
+ */
+static int32_t HostAtomizer_Noise() {
+	if(HostAtomizer_noise == 0) {
+		return 0;
+	}
+
+	HostAtomizer_seed = HostAtomizer_seed * 1103515245 + 12345;
+	return (int32_t) ((HostAtomizer_seed >> 16) % (2 * HostAtomizer_noise + 1)) - HostAtomizer_noise;
+}
+
+/**
+ * Converts a plant quantity for an ADC module, with noise and filtering.
+ * This is an internal function.
+ *
+ * @param moduleNum ADC module.
+ *
+ * @return ADC conversion result.
+ */
+static uint16_t HostAtomizer_Convert(uint8_t moduleNum) {
+	double value;
+	int32_t x;
+
+	switch(moduleNum) {
+		case ADC_MODULE_VATM:
+			// Inverse of ATOMIZER_ADC_VOLTAGE
+			value = HostAtomizer_vout * 100 * 30 * ADC_DENOMINATOR / (13 * ADC_VREF);
+			break;
+		case ADC_MODULE_CURS:
+			// Inverse of ATOMIZER_ADC_CURRENT
+			value = HostAtomizer_vout / HostAtomizer_rload * 1000 * HOSTATOMIZER_SHUNT / 625;
+			break;
+		case ADC_MODULE_VBAT:
+			// Inverse of ATOMIZER_ADC_WEAKBATT
+			value = HostAtomizer_vbatt * 800;
+			break;
+		case ADC_MODULE_TEMP:
+			value = HOSTATOMIZER_ADC_TEMP;
+			break;
+		default:
+			value = 0;
+			break;
+	}
+
+	x = lround(value) + HostAtomizer_Noise();
+	if(x < 0) {
+		x = 0;
+	}
+	else if(x > ADC_DENOMINATOR - 1) {
+		x = ADC_DENOMINATOR - 1;
+	}
+
+	if(HostAtomizer_adcFilter[moduleNum] != NULL) {
+		x = HostAtomizer_adcFilter[moduleNum](x, HostAtomizer_adcFilterData[moduleNum]);
+	}
+
+	return x;
+}
+
+/**
+ * Commits pending ADC conversions to the cache.
+ * This is an internal function.
+ */
+static void HostAtomizer_CommitCache() {
+	uint8_t i;
+
+	for(i = 0; i < HOSTATOMIZER_ADC_MODULES; i++) {
+		if(HostAtomizer_adcIsPending[i]) {
+			HostAtomizer_adcCache[i] = HostAtomizer_adcPending[i];
+			HostAtomizer_adcIsPending[i] = 0;
+		}
+	}
+}
+
+void HostAtomizer_Setup(uint16_t resistance, uint8_t noise) {
+	HostAtomizer_vout = 0;
+	HostAtomizer_vbatt = HOSTATOMIZER_BATT_VOC;
+	HostAtomizer_rload = resistance / 1000.0;
+	HostAtomizer_noise = noise;
+	HostAtomizer_seed = 1;
+	HostAtomizer_isThermal = 0;
+	HostAtomizer_temp = HOSTATOMIZER_AMBIENT;
+}
+
+void HostAtomizer_SetCoil(const double coeffs[4], double heatCapacity, double thermalRes) {
+	uint8_t i;
+
+	for(i = 0; i < 4; i++) {
+		HostAtomizer_coeffs[i] = coeffs[i];
+	}
+	HostAtomizer_r0 = HostAtomizer_rload / HostAtomizer_Curve(HOSTATOMIZER_AMBIENT);
+	HostAtomizer_heatCap = heatCapacity;
+	HostAtomizer_thermalRes = thermalRes;
+	HostAtomizer_temp = HOSTATOMIZER_AMBIENT;
+	HostAtomizer_isThermal = 1;
+}
+
+double HostAtomizer_GetTemperature() {
+	return HostAtomizer_temp;
+}
+
+void HostAtomizer_SetResistance(uint16_t resistance) {
+	HostAtomizer_rload = resistance / 1000.0;
+}
+
+void HostAtomizer_Step() {
+	double gain, target, pout, alpha;
+	uint32_t primask;
+	uint8_t i;
+
+	primask = Thread_IrqDisable();
+
+	alpha = 1 - exp(-HOSTATOMIZER_STEP_US * 1e-6 / HOSTATOMIZER_SUBSTEPS / HOSTATOMIZER_TAU);
+	for(i = 0; i < HOSTATOMIZER_SUBSTEPS; i++) {
+		gain = HostAtomizer_GetGain();
+		target = gain * HostAtomizer_vbatt * HostAtomizer_rload /
+			(HostAtomizer_rload + HOSTATOMIZER_RSRC);
+		HostAtomizer_vout += (target - HostAtomizer_vout) * alpha;
+
+		pout = HostAtomizer_vout * HostAtomizer_vout / HostAtomizer_rload;
+		if(HostAtomizer_isThermal) {
+			HostAtomizer_temp += (pout - (HostAtomizer_temp - HOSTATOMIZER_AMBIENT) /
+				HostAtomizer_thermalRes) * HOSTATOMIZER_STEP_US * 1e-6 /
+				HOSTATOMIZER_SUBSTEPS / HostAtomizer_heatCap;
+			HostAtomizer_rload = HostAtomizer_r0 * HostAtomizer_Curve(HostAtomizer_temp);
+		}
+		HostAtomizer_vbatt = HOSTATOMIZER_BATT_VOC - pout /
+			(HOSTATOMIZER_EFFICIENCY * HostAtomizer_vbatt) * HOSTATOMIZER_BATT_RINT;
+	}
+
+	// Conversions started by the last iteration are done by now
+	HostAtomizer_CommitCache();
+	if(HostAtomizer_callback != NULL) {
+		HostAtomizer_callback(HostAtomizer_callbackData);
+	}
+
+	Thread_IrqRestore(primask);
+}
+
+uint32_t HostAtomizer_GetVoltage() {
+	return lround(HostAtomizer_vout * 1000);
+}
+
+uint32_t HostAtomizer_GetPower() {
+	return lround(HostAtomizer_vout * HostAtomizer_vout / HostAtomizer_rload * 1000);
+}
+
+uint32_t HostAtomizer_GetBatteryVoltage() {
+	return lround(HostAtomizer_vbatt * 1000);
+}
+
+ADC_Filter_t HostAtomizer_GetFilter(uint8_t moduleNum, uint32_t *filterData) {
+	*filterData = HostAtomizer_adcFilterData[moduleNum];
+	return HostAtomizer_adcFilter[moduleNum];
+}
+
+void ADC_UpdateCache(const uint8_t moduleNum[], uint8_t len, uint8_t isBlocking) {
+	uint8_t i;
+
+	for(i = 0; i < len; i++) {
+		HostAtomizer_adcPending[moduleNum[i]] = HostAtomizer_Convert(moduleNum[i]);
+		HostAtomizer_adcIsPending[moduleNum[i]] = 1;
+	}
+
+	if(isBlocking) {
+		HostAtomizer_CommitCache();
+	}
+}
+
+uint16_t ADC_GetCachedResult(uint8_t moduleNum) {
+	return HostAtomizer_adcCache[moduleNum];
+}
+
+uint16_t ADC_Read(uint8_t moduleNum) {
+	return HostAtomizer_Convert(moduleNum);
+}
+
+void ADC_SetFilter(uint8_t moduleNum, ADC_Filter_t filter, uint32_t filterData) {
+	HostAtomizer_adcFilter[moduleNum] = filter;
+	HostAtomizer_adcFilterData[moduleNum] = filterData;
+}
+
+uint16_t Battery_GetVoltage() {
+	return HostAtomizer_GetBatteryVoltage();
+}
+
+uint8_t Device_GetAtomizerShunt() {
+	return HOSTATOMIZER_SHUNT;
+}
+
+int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData) {
+	// Only the feedback loop timer is emulated
+	HostAtomizer_callback = callback;
+	HostAtomizer_callbackData = callbackData;
+	return 0;
+}
+
+void Timer_SetPriority(int8_t index, uint8_t priority) {
+}
+
+void GPIO_SetMode(GPIO_T *port, uint32_t pinMask, uint32_t mode) {
+}
+
+uint32_t PWM_ConfigOutputChannel(PWM_T *pwm, uint32_t ch, uint32_t freq, uint32_t duty) {
+	return freq;
+}
+
+void PWM_EnableOutput(PWM_T *pwm, uint32_t mask) {
+}
+
+void PWM_Start(PWM_T *pwm, uint32_t mask) {
+}
@@ -0,0 +1,592 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+/*
+ * Host port of the thread library. The Cortex-M exception model is
+ * emulated in software:
+ *  - PRIMASK, BASEPRI and IPSR are plain variables. SysTick and
+ *    PendSV are the only exceptions and both run at or below the
+ *    kernel priority, so any nonzero BASEPRI masks them;
+ *  - SysTick counts down in emulated core cycles derived from the
+ *    monotonic clock, and SCB->ICSR reports pending SysTick/PendSV;
+ *  - a periodic SIGALRM plays the role of the interrupt line: when
+ *    nothing is masked it runs pending exceptions right away,
+ *    otherwise they run as soon as they are unmasked;
+ *  - PendSV calls Thread_Schedule() and switches between ucontexts,
+ *    one per thread, each with its own host stack.
+ *
+ * Register writes are picked up lazily: every access through the
+ * SysTick/SCB macros syncs the emulated state first, and writes are
+ * detected by comparing with the values filled in by the last sync.
+ *
+ * Thread.c stores pointers in 32-bit handles and contexts, so the
+ * image must be linked without PIE and the heap must stay in the
+ * low 4GB. Host_Init() checks both.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <ucontext.h>
+#include <sys/time.h>
+#include <M451Series.h>
+#include <HostPort.h>
+
+/* Period of the emulated interrupt tick, in microseconds. */
+#ifndef HOST_TICK_US
+#define HOST_TICK_US 50
+#endif
+
+/* Host stack size for each thread, in bytes. */
+#ifndef HOST_STACK_SIZE
+#define HOST_STACK_SIZE (64 * 1024)
+#endif
+
+/* EXC_RETURN of a thread that has never run. */
+#define HOST_ER_NEW     0xFFFFFFFD
+/* Marks a software context with a host context attached: 'HOST'. */
+#define HOST_ER_STARTED 0x54534F48
+
+/* Exception numbers, as reported by IPSR. */
+#define HOST_IPSR_PENDSV  14
+#define HOST_IPSR_SYSTICK 15
+
+/* Compiler barrier, to keep memory accesses inside masked sections. */
+#define HOST_BARRIER() __asm__ volatile("" ::: "memory")
+
+/**
+ * Mirror of Thread_SoftwareContext_t (no FPU support).
+ * The host port keeps its context pointer in r[0] and r[1].
+ */
+typedef struct {
+	/**< Saved stack pointer. */
+	uint32_t sp;
+	/**< Software-saved registers. */
+	uint32_t r[8];
+	/**< EXC_RETURN, or HOST_ER_STARTED. */
+	uint32_t er;
+} Host_SoftwareContext_t;
+
+/**
+ * Mirror of Thread_StackedContext_t (no FPU support).
+ */
+typedef struct {
+	uint32_t r0;
+	uint32_t r1;
+	uint32_t r2;
+	uint32_t r3;
+	uint32_t r12;
+	uint32_t lr;
+	uint32_t pc;
+	uint32_t psr;
+} Host_StackedContext_t;
+
+/**
+ * Host execution context for a thread.
+ */
+typedef struct {
+	/**< Saved host context. */
+	ucontext_t uc;
+	/**< Host stack. */
+	void *stack;
+	/**< Thread entry point. */
+	void *(*entry)(void *);
+	/**< Thread entry argument. */
+	void *args;
+	/**< Procedure the entry point returns to. */
+	void (*exitProc)(void *);
+} Host_Context_t;
+
+uint64_t Thread_Schedule(uint32_t er);
+void SysTick_Handler(void);
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_memalign(size_t alignment, size_t size);
+void __real_free(void *ptr);
+
+uint32_t SystemCoreClock = 72000000;
+MPU_Type Host_mpu;
+NVIC_Type Host_nvic;
+DWT_Type Host_dwt;
+CoreDebug_Type Host_coreDebug;
+
+/* Emulated registers, as seen by the SDK. */
+static SysTick_Type Host_sysTick;
+static SCB_Type Host_scb;
+/* Register values filled in by the last sync. */
+static uint32_t Host_sysTickCtrl, Host_sysTickVal, Host_scbIcsr;
+/* Emulated cycle at which SysTick next reaches zero. */
+static uint64_t Host_sysTickEnd;
+
+/* Emulated core state. */
+static volatile uint32_t Host_primask, Host_basepri, Host_ipsr;
+static volatile uint8_t Host_pendST, Host_pendSV, Host_sigPending;
+
+/* Host context of the running thread (NULL for main). */
+static Host_Context_t *Host_curCtx;
+/* Host context of a dead thread, freed once off its stack. */
+static Host_Context_t *Host_zombieCtx;
+
+static struct timespec Host_startTime;
+
+/**
+ * Prints an error and aborts.
+ * This is an internal function.
+ *
+ * @param msg Error message.
+ */
+static void Host_Panic(const char *msg) {
+	Host_primask = 1;
+	fprintf(stderr, "HostPort: %s\n", msg);
+	abort();
+}
+
+uint64_t Host_GetTimeNs() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - Host_startTime.tv_sec) * 1000000000ULL +
+		now.tv_nsec - Host_startTime.tv_nsec;
+}
+
+uint64_t Host_GetCycles() {
+	return Host_GetTimeNs() * (SystemCoreClock / 1000000) / 1000;
+}
+
+/**
+ * Checks if the SDK wrote to an emulated register since the last sync.
+ * This is an internal function.
+ *
+ * @return True if a register was written.
+ */
+static int Host_RegsDirty() {
+	return Host_scb.ICSR != Host_scbIcsr ||
+		Host_sysTick.VAL != Host_sysTickVal ||
+		Host_sysTick.CTRL != Host_sysTickCtrl;
+}
+
+/**
+ * Applies register writes, advances SysTick to the current time
+ * and refills the registers. Must be called with PRIMASK set or
+ * from an exception.
+ * This is an internal function.
+ */
+static void Host_SyncRegs() {
+	uint64_t now, period;
+	uint32_t icsr, val;
+
+	icsr = Host_scb.ICSR;
+	if(icsr != Host_scbIcsr) {
+		if(icsr & SCB_ICSR_PENDSVSET_Msk) {
+			Host_pendSV = 1;
+		}
+		if(icsr & SCB_ICSR_PENDSVCLR_Msk) {
+			Host_pendSV = 0;
+		}
+		if(icsr & SCB_ICSR_PENDSTSET_Msk) {
+			Host_pendST = 1;
+		}
+		if(icsr & SCB_ICSR_PENDSTCLR_Msk) {
+			Host_pendST = 0;
+		}
+	}
+
+	now = Host_GetCycles();
+	period = (Host_sysTick.LOAD & SysTick_LOAD_RELOAD_Msk) + 1;
+	if(Host_sysTick.VAL != Host_sysTickVal ||
+	   (Host_sysTick.CTRL & ~Host_sysTickCtrl & SysTick_CTRL_ENABLE_Msk)) {
+		// Writing VAL clears the counter, which reloads on the
+		// next cycle. Enabling the counter starts it the same way.
+		Host_sysTickEnd = now + period;
+	}
+	Host_sysTickCtrl = Host_sysTick.CTRL;
+
+	if(Host_sysTickCtrl & SysTick_CTRL_ENABLE_Msk) {
+		if(now > Host_sysTickEnd) {
+			// Counter wrapped one or more times
+			Host_sysTickEnd += ((now - Host_sysTickEnd - 1) / period + 1) * period;
+			Host_pendST = 1;
+		}
+		// VAL never reads as zero, so that a write of zero
+		// is always detected. This costs one cycle of error.
+		val = Host_sysTickEnd - now;
+		if(val > period - 1) {
+			val = period - 1;
+		}
+		Host_sysTick.VAL = (val == 0 ? 1 : val);
+	}
+	Host_sysTickVal = Host_sysTick.VAL;
+
+	Host_scbIcsr =
+		(Host_pendST ? SCB_ICSR_PENDSTSET_Msk : 0) |
+		(Host_pendSV ? SCB_ICSR_PENDSVSET_Msk : 0);
+	Host_scb.ICSR = Host_scbIcsr;
+}
+
+/**
+ * Checks if an exception may need to run.
+ * This is an internal function.
+ *
+ * @return True if the exception loop must run.
+ */
+static int Host_HasPending() {
+	return Host_sigPending || Host_pendST || Host_pendSV || Host_RegsDirty();
+}
+
+/**
+ * Frees the host context of a dead thread, if any.
+ * Must be called from a different host context.
+ * This is an internal function.
+ */
+static void Host_FreeZombie() {
+	if(Host_zombieCtx != NULL && Host_zombieCtx != Host_curCtx) {
+		__real_free(Host_zombieCtx->stack);
+		__real_free(Host_zombieCtx);
+		Host_zombieCtx = NULL;
+	}
+}
+
+/**
+ * Runs pending exceptions, in priority order, until none is left.
+ * Must be called from thread mode with PRIMASK cleared.
+ * This is an internal function.
+ */
+static void Host_RunExceptions();
+
+/**
+ * Entry point for the host context of a new thread.
+ * This is an internal function.
+ */
+static void Host_ThreadStart() {
+	Host_Context_t *hc = Host_curCtx;
+
+	// We got here from PendSV: return to thread mode
+	Host_FreeZombie();
+	Host_ipsr = 0;
+	__set_PRIMASK(0);
+
+	hc->exitProc(hc->entry(hc->args));
+	Host_Panic("thread exit procedure returned");
+}
+
+/**
+ * Gets the host context for a thread, creating it on the first
+ * switch from the initial stacked context.
+ * This is an internal function.
+ *
+ * @param ctx Software context of the thread.
+ *
+ * @return Host context.
+ */
+static Host_Context_t *Host_GetContext(Host_SoftwareContext_t *ctx) {
+	Host_StackedContext_t *hwCtx;
+	Host_Context_t *hc;
+
+	if(ctx->er == HOST_ER_STARTED) {
+		return (Host_Context_t *) (uintptr_t)
+			(((uint64_t) ctx->r[1] << 32) | ctx->r[0]);
+	}
+	if(ctx->er != HOST_ER_NEW) {
+		Host_Panic("corrupted thread context");
+	}
+
+	hc = __real_malloc(sizeof(Host_Context_t));
+	if(hc == NULL || (hc->stack = __real_malloc(HOST_STACK_SIZE)) == NULL) {
+		Host_Panic("out of memory for host context");
+	}
+	hwCtx = (Host_StackedContext_t *) (uintptr_t) ctx->sp;
+	hc->entry = (void *(*)(void *)) (uintptr_t) hwCtx->pc;
+	hc->args = (void *) (uintptr_t) hwCtx->r0;
+	hc->exitProc = (void (*)(void *)) (uintptr_t) hwCtx->lr;
+
+	getcontext(&hc->uc);
+	hc->uc.uc_stack.ss_sp = hc->stack;
+	hc->uc.uc_stack.ss_size = HOST_STACK_SIZE;
+	hc->uc.uc_link = NULL;
+	sigemptyset(&hc->uc.uc_sigmask);
+	makecontext(&hc->uc, Host_ThreadStart, 0);
+
+	ctx->r[0] = (uint32_t) (uintptr_t) hc;
+	ctx->r[1] = (uint32_t) ((uint64_t) (uintptr_t) hc >> 32);
+	ctx->er = HOST_ER_STARTED;
+
+	return hc;
+}
+
+/**
+ * PendSV handler: runs the scheduler and switches host contexts.
+ * This is an internal function.
+ */
+static void Host_PendSV() {
+	Host_SoftwareContext_t *newCtx, *oldCtx;
+	Host_Context_t *prevHc, *nextHc;
+	uint64_t ret;
+
+	ret = Thread_Schedule(HOST_ER_NEW);
+	newCtx = (Host_SoftwareContext_t *) (uintptr_t) (uint32_t) ret;
+	oldCtx = (Host_SoftwareContext_t *) (uintptr_t) (uint32_t) (ret >> 32);
+	if(newCtx == NULL) {
+		return;
+	}
+
+	nextHc = Host_GetContext(newCtx);
+	prevHc = Host_curCtx;
+	Host_curCtx = nextHc;
+	if(oldCtx != NULL) {
+		swapcontext(&prevHc->uc, &nextHc->uc);
+	}
+	else {
+		// First switch from main, or the old thread is dead:
+		// its host context is freed once we're off its stack.
+		Host_zombieCtx = prevHc;
+		setcontext(&nextHc->uc);
+	}
+
+	// Resumed from another thread
+	Host_FreeZombie();
+}
+
+static void Host_RunExceptions() {
+	while(1) {
+		Host_primask = 1;
+		HOST_BARRIER();
+		if(Host_sigPending || Host_RegsDirty()) {
+			Host_sigPending = 0;
+			Host_SyncRegs();
+		}
+		HOST_BARRIER();
+		Host_primask = 0;
+
+		if(Host_pendST && (Host_sysTickCtrl &
+		   (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk)) ==
+		   (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk)) {
+			Host_pendST = 0;
+			Host_ipsr = HOST_IPSR_SYSTICK;
+			SysTick_Handler();
+			Host_ipsr = 0;
+		}
+		else if(Host_pendSV) {
+			Host_pendSV = 0;
+			Host_ipsr = HOST_IPSR_PENDSV;
+			Host_PendSV();
+			Host_ipsr = 0;
+		}
+		else {
+			break;
+		}
+	}
+}
+
+/**
+ * SIGALRM handler: the emulated interrupt line.
+ * This is an internal function.
+ *
+ * @param sig Signal number.
+ */
+static void Host_SignalHandler(int sig) {
+	int savedErrno = errno;
+
+	(void) sig;
+	Host_sigPending = 1;
+	if(!Host_primask && !Host_basepri && !Host_ipsr) {
+		Host_RunExceptions();
+	}
+	errno = savedErrno;
+}
+
+uint32_t __get_PRIMASK() {
+	return Host_primask;
+}
+
+void __set_PRIMASK(uint32_t primask) {
+	HOST_BARRIER();
+	Host_primask = primask & 1;
+	if(!Host_primask && !Host_basepri && !Host_ipsr && Host_HasPending()) {
+		Host_RunExceptions();
+	}
+	HOST_BARRIER();
+}
+
+uint32_t __get_BASEPRI() {
+	return Host_basepri;
+}
+
+void __set_BASEPRI(uint32_t basepri) {
+	HOST_BARRIER();
+	Host_basepri = basepri & 0xFF;
+	if(!Host_primask && !Host_basepri && !Host_ipsr && Host_HasPending()) {
+		Host_RunExceptions();
+	}
+	HOST_BARRIER();
+}
+
+void __set_BASEPRI_MAX(uint32_t basepri) {
+	basepri &= 0xFF;
+	if(basepri != 0 && (Host_basepri == 0 || basepri < Host_basepri)) {
+		HOST_BARRIER();
+		Host_basepri = basepri;
+		HOST_BARRIER();
+	}
+}
+
+uint32_t __get_IPSR() {
+	return Host_ipsr;
+}
+
+void __WFI() {
+	sigset_t alarmSet, oldSet;
+
+	sigemptyset(&alarmSet);
+	sigaddset(&alarmSet, SIGALRM);
+	sigprocmask(SIG_BLOCK, &alarmSet, &oldSet);
+	if(!Host_HasPending()) {
+		sigsuspend(&oldSet);
+	}
+	sigprocmask(SIG_SETMASK, &oldSet, NULL);
+}
+
+SysTick_Type *Host_GetSysTick() {
+	uint32_t primask = __get_PRIMASK();
+
+	Host_primask = 1;
+	Host_SyncRegs();
+	__set_PRIMASK(primask);
+
+	return &Host_sysTick;
+}
+
+SCB_Type *Host_GetScb() {
+	uint32_t primask = __get_PRIMASK();
+
+	Host_primask = 1;
+	Host_SyncRegs();
+	__set_PRIMASK(primask);
+
+	return &Host_scb;
+}
+
+void Host_SetPendSV() {
+	Host_pendSV = 1;
+	if(!Host_primask && !Host_basepri && !Host_ipsr) {
+		Host_RunExceptions();
+	}
+}
+
+/**
+ * Checks that a heap block is addressable with 32 bits.
+ * This is an internal function.
+ *
+ * @param ptr Heap block.
+ *
+ * @return ptr.
+ */
+static void *Host_CheckHeap(void *ptr) {
+	if((uintptr_t) ptr > UINT32_MAX) {
+		Host_Panic("heap block above 4GB");
+	}
+	return ptr;
+}
+
+/*
+ * The C library isn't aware of our threads: allocations run with
+ * interrupts masked. These are hooked up with --wrap at link time.
+ */
+
+void *__wrap_malloc(size_t size) {
+	uint32_t primask = __get_PRIMASK();
+	void *ptr;
+
+	Host_primask = 1;
+	ptr = Host_CheckHeap(__real_malloc(size));
+	__set_PRIMASK(primask);
+
+	return ptr;
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+	uint32_t primask = __get_PRIMASK();
+	void *ptr;
+
+	Host_primask = 1;
+	ptr = Host_CheckHeap(__real_calloc(num, size));
+	__set_PRIMASK(primask);
+
+	return ptr;
+}
+
+void *__wrap_realloc(void *old, size_t size) {
+	uint32_t primask = __get_PRIMASK();
+	void *ptr;
+
+	Host_primask = 1;
+	ptr = Host_CheckHeap(__real_realloc(old, size));
+	__set_PRIMASK(primask);
+
+	return ptr;
+}
+
+void *__wrap_memalign(size_t alignment, size_t size) {
+	uint32_t primask = __get_PRIMASK();
+	void *ptr;
+
+	Host_primask = 1;
+	ptr = Host_CheckHeap(__real_memalign(alignment, size));
+	__set_PRIMASK(primask);
+
+	return ptr;
+}
+
+void __wrap_free(void *ptr) {
+	uint32_t primask = __get_PRIMASK();
+
+	Host_primask = 1;
+	__real_free(ptr);
+	__set_PRIMASK(primask);
+}
+
+void Host_Init() {
+	struct sigaction action;
+	struct itimerval timer;
+
+	if((uintptr_t) &Host_sysTick > UINT32_MAX || (uintptr_t) Host_Init > UINT32_MAX) {
+		Host_Panic("image must be linked below 4GB (build with -no-pie)");
+	}
+
+	// Keep large allocations on the brk heap
+	mallopt(M_MMAP_MAX, 0);
+	clock_gettime(CLOCK_MONOTONIC, &Host_startTime);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = Host_SignalHandler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &action, NULL);
+
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = HOST_TICK_US;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
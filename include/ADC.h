@@ -70,6 +70,8 @@ extern "C" {
 /**
  * Function pointer type for ADC filters.
  * Invoked from an interrupt handler, keep it as fast as possible.
+ * The handler runs above the kernel priority (see THREAD_KERNEL_PRIORITY),
+ * so filters must not call thread functions.
  *
  * @param value      Read ADC value.
  * @param filterData Optional filter data passed to ADC_SetFilter().
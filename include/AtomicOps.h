@@ -25,41 +25,119 @@
 // extern "C" is omitted because none
 // of this is going to be exported.
 
+/*
+ * Every operation comes in 32-bit, 16-bit and 8-bit versions (suffixes
+ * none, 16 and 8) and in four memory orderings (suffixes none, Acquire,
+ * Release and Relaxed), e.g. AtomicOps_Add, AtomicOps_Add16Acquire,
+ * AtomicOps_FetchOr8Relaxed:
+ *  - no suffix: sequentially consistent, DMB before and after;
+ *  - Acquire: later accesses are not moved before the operation,
+ *    DMB after;
+ *  - Release: earlier accesses are not moved after the operation,
+ *    DMB before;
+ *  - Relaxed: atomicity only, no DMB.
+ * All of them are compiler barriers. The Cortex-M4 doesn't reorder
+ * memory accesses, so the barriers only matter for other bus masters
+ * and for portability: prefer the weakest ordering that is correct.
+ */
+
 /* Always inline, no extern version. */
 #define ATOMICOPS_INLINE __attribute__((always_inline)) static inline
 
+/* Instantiates an operation for every ordering: DMBs before and after. */
+#define ATOMICOPS_ORDERS(def, name, type, width, ...) \
+	def(name,          type, width, "dmb\n", "\n\tdmb", __VA_ARGS__) \
+	def(name##Acquire, type, width, "",      "\n\tdmb", __VA_ARGS__) \
+	def(name##Release, type, width, "dmb\n", "",        __VA_ARGS__) \
+	def(name##Relaxed, type, width, "",      "",        __VA_ARGS__)
+
+/* Instantiates an operation for every width and ordering. */
+#define ATOMICOPS_WIDTHS(def, name, ...) \
+	ATOMICOPS_ORDERS(def, name,     uint32_t, "",  __VA_ARGS__) \
+	ATOMICOPS_ORDERS(def, name##16, uint16_t, "h", __VA_ARGS__) \
+	ATOMICOPS_ORDERS(def, name##8,  uint8_t,  "b", __VA_ARGS__)
+
+/* Swap: ptr, newVal -> old value. */
+#define ATOMICOPS_DEF_SWAP(name, type, width, pre, post, unused) \
+	ATOMICOPS_INLINE type AtomicOps_##name(volatile type *ptr, type newVal) { \
+		uint32_t oldVal, strexRet; \
+		asm volatile("@ AtomicOps_" #name "\n\t" \
+			pre \
+		"1:\n\t" \
+			"ldrex" width " %0, [%2]\n\t" \
+			"strex" width " %1, %3, [%2]\n\t" \
+			"teq    %1, #0\n\t" \
+			"bne    1b" \
+			post \
+		: "=&r" (oldVal), "=&r" (strexRet) \
+		: "r" (ptr), "r" ((uint32_t) newVal) \
+		: "memory", "cc"); \
+		return oldVal; \
+	}
+
+/* Compare and swap: ptr, expVal, newVal -> old value. */
+#define ATOMICOPS_DEF_CMPSWAP(name, type, width, pre, post, unused) \
+	ATOMICOPS_INLINE type AtomicOps_##name(volatile type *ptr, type expVal, type newVal) { \
+		uint32_t loadVal, strexRet; \
+		asm volatile("@ AtomicOps_" #name "\n\t" \
+			pre \
+		"1:\n\t" \
+			"ldrex" width "   %0, [%2]\n\t" \
+			"teq      %0, %3\n\t" \
+			"itt      eq\n\t" \
+			"strex" width "eq %1, %4, [%2]\n\t" \
+			"teqeq    %1, #1\n\t" \
+			"beq      1b" \
+			post \
+		: "=&r" (loadVal), "=&r" (strexRet) \
+		: "r" (ptr), "r" ((uint32_t) expVal), "r" ((uint32_t) newVal) \
+		: "memory", "cc"); \
+		return loadVal; \
+	}
+
+/* Read-modify-write: ptr, n -> new value (fetch = 0) or old value (fetch = 1). */
+#define ATOMICOPS_DEF_RMW(name, type, width, pre, post, insn, fetch) \
+	ATOMICOPS_INLINE type AtomicOps_##name(volatile type *ptr, type n) { \
+		uint32_t oldVal, newVal, strexRet; \
+		asm volatile("@ AtomicOps_" #name "\n\t" \
+			pre \
+		"1:\n\t" \
+			"ldrex" width " %0, [%3]\n\t" \
+			insn "    %1, %0, %4\n\t" \
+			"strex" width " %2, %1, [%3]\n\t" \
+			"teq    %2, #0\n\t" \
+			"bne    1b" \
+			post \
+		: "=&r" (oldVal), "=&r" (newVal), "=&r" (strexRet) \
+		: "r" (ptr), "r" ((uint32_t) n) \
+		: "memory", "cc"); \
+		return (fetch) ? oldVal : newVal; \
+	}
+
 /**
- * Atomically stores a 32-bit value to memory, giving
- * back the old value.
+ * Full memory barrier: all memory accesses before the barrier
+ * complete before any memory access after it.
+ */
+ATOMICOPS_INLINE void AtomicOps_Barrier() {
+	asm volatile("dmb" : : : "memory");
+}
+
+/**
+ * AtomicOps_Swap[16|8][Acquire|Release|Relaxed]:
+ * atomically stores a value to memory, giving back the old value.
  *
  * @param ptr    Memory to store the value to.
  * @param newVal Value to store.
  *
  * @return Old value.
  */
-ATOMICOPS_INLINE uint32_t AtomicOps_Swap(volatile uint32_t *ptr, uint32_t newVal) {
-	uint32_t oldVal, strexRet;
-
-	// TODO: too many memory barriers?
-	asm volatile("@ AtomicOps_Swap\n\t"
-		"dmb\n"
-	"1:\n\t"
-		"ldrex %0, [%2]\n\t"
-		"strex %1, %3, [%2]\n\t"
-		"teq   %1, #0\n\t"
-		"bne   1b\n\t"
-		"dmb"
-	: "=&r" (oldVal), "=&r" (strexRet)
-	: "r" (ptr), "r" (newVal)
-	: "memory", "cc");
-
-	return oldVal;
-}
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_SWAP, Swap, 0)
 
 /**
- * Atomically stores a 32-bit value to memory, only if
- * the value currently in memory is equal to the expected
- * value, giving back the old value.
+ * AtomicOps_CmpSwap[16|8][Acquire|Release|Relaxed]:
+ * atomically stores a value to memory, only if the value currently
+ * in memory is equal to the expected value, giving back the old value.
+ * The ordering only applies if the store happens.
  *
  * @param ptr    Memory to store the value to.
  * @param expVal Expected value.
@@ -67,56 +145,43 @@ ATOMICOPS_INLINE uint32_t AtomicOps_Swap(volatile uint32_t *ptr, uint32_t newVal
  *
  * @return Old value.
  */
-ATOMICOPS_INLINE uint32_t AtomicOps_CmpSwap(volatile uint32_t *ptr, uint32_t expVal, uint32_t newVal) {
-	uint32_t loadVal, strexRet;
-
-	// TODO: too many memory barriers?
-	asm volatile("@ AtomicOps_CmpSwap\n\t"
-		"dmb\n"
-	"1:\n\t"
-		"ldrex   %0, [%2]\n\t"
-		"teq     %0, %3\n\t"
-		"itt     eq\n\t"
-		"strexeq %1, %4, [%2]\n\t"
-		"teqeq   %1, #1\n\t"
-		"beq     1b\n\t"
-		"dmb"
-	: "=&r" (loadVal), "=&r" (strexRet)
-	: "r" (ptr), "r" (expVal), "r" (newVal)
-	: "memory", "cc");
-
-	return loadVal;
-}
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_CMPSWAP, CmpSwap, 0)
 
 /**
- * Atomically adds to a 32-bit value in memory.
+ * AtomicOps_{Add|Sub|And|Or}[16|8][Acquire|Release|Relaxed]:
+ * atomically adds, subtracts, ANDs or ORs a value in memory.
  *
- * @param ptr Memory where the first addend is and
+ * @param ptr Memory where the first operand is and
  *            where the result will be stored.
- * @param n   Second addend.
+ * @param n   Second operand.
  *
- * @return New value after addition.
+ * @return New value after the operation.
  */
-ATOMICOPS_INLINE uint32_t AtomicOps_Add(volatile uint32_t *ptr, uint32_t n) {
-	uint32_t result, strexRet;
-
-	// TODO: too many memory barriers?
-	asm volatile("@ AtomicOps_Add:\n\t"
-		"dmb\n"
-	"1:\n\t"
-		"ldrex %0, [%2]\n\t"
-		"add   %0, %0, %3\n\t"
-		"strex %1, %0, [%2]\n\t"
-		"teq   %1, #0\n\t"
-		"bne   1b\n\t"
-		"dmb"
-	: "=&r" (result), "=&r" (strexRet)
-	: "r" (ptr), "r" (n)
-	: "memory", "cc");
-
-	return result;
-}
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, Add, "add", 0)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, Sub, "sub", 0)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, And, "and", 0)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, Or,  "orr", 0)
+
+/**
+ * AtomicOps_Fetch{Add|Sub|And|Or}[16|8][Acquire|Release|Relaxed]:
+ * same as the operations above, but give back the old value.
+ *
+ * @param ptr Memory where the first operand is and
+ *            where the result will be stored.
+ * @param n   Second operand.
+ *
+ * @return Old value before the operation.
+ */
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchAdd, "add", 1)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchSub, "sub", 1)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchAnd, "and", 1)
+ATOMICOPS_WIDTHS(ATOMICOPS_DEF_RMW, FetchOr,  "orr", 1)
 
+#undef ATOMICOPS_DEF_RMW
+#undef ATOMICOPS_DEF_CMPSWAP
+#undef ATOMICOPS_DEF_SWAP
+#undef ATOMICOPS_WIDTHS
+#undef ATOMICOPS_ORDERS
 #undef ATOMICOPS_INLINE
 
 #endif
@@ -56,6 +56,38 @@ extern "C" {
  */
 #define ATOMIZER_RESISTANCE_MAX 3500
 
+/**
+ * Minimum coil temperature for temperature control, in °C.
+ */
+#define ATOMIZER_TEMP_MIN 100
+/**
+ * Maximum coil temperature for temperature control, in °C.
+ */
+#define ATOMIZER_TEMP_MAX 315
+
+/**
+ * Number of entries in a resistance-temperature table.
+ * Entry i is for 20 * i °C, so tables cover 0 - 320 °C.
+ */
+#define ATOMIZER_TCR_TABLE_LEN 17
+
+/**
+ * Default median filter window size, in samples.
+ */
+#define ATOMIZER_FILTER_WINDOW_DEFAULT 5
+/**
+ * Maximum median filter window size, in samples.
+ */
+#define ATOMIZER_FILTER_WINDOW_MAX 9
+
+/**
+ * Default feedback loop gains, in Q8 fixed point (256 = 1.0).
+ * See Atomizer_SetFeedbackGains().
+ */
+#define ATOMIZER_FEEDBACK_KP 24
+#define ATOMIZER_FEEDBACK_KI 16
+#define ATOMIZER_FEEDBACK_KD 0
+
 /**
  * Maximum output voltage, in millivolts.
  * Deprecated: use ATOMIZER_VOLTAGE_MAX.
@@ -120,6 +152,46 @@ typedef enum {
 	OVER_TEMP
 } Atomizer_Error_t;
 
+/**
+ * Coil materials for temperature control.
+ */
+typedef enum {
+	/**
+	 * Nickel (Ni200).
+	 */
+	ATOMIZER_MATERIAL_NI200,
+	/**
+	 * Titanium (grade 1).
+	 */
+	ATOMIZER_MATERIAL_TITANIUM,
+	/**
+	 * Stainless steel (SS316L).
+	 */
+	ATOMIZER_MATERIAL_SS316,
+	/**
+	 * User-defined table (see Atomizer_SetCustomMaterial).
+	 */
+	ATOMIZER_MATERIAL_CUSTOM
+} Atomizer_Material_t;
+
+/**
+ * Median filtered measurements.
+ */
+typedef enum {
+	/**
+	 * Output voltage (ADC samples).
+	 */
+	ATOMIZER_FILTER_VOLTAGE,
+	/**
+	 * Output current (ADC samples).
+	 */
+	ATOMIZER_FILTER_CURRENT,
+	/**
+	 * Resistance, as computed by the feedback loop.
+	 */
+	ATOMIZER_FILTER_RESISTANCE
+} Atomizer_Filter_t;
+
 /**
  * Function pointer type for atomizer base update callbacks.
  * This callback will be invoked when base resistance and/or
@@ -144,10 +216,13 @@ typedef uint8_t (*Atomizer_BaseUpdateCallback_t)(uint16_t oldRes, uint8_t oldTem
 
 /**
  * Function pointer type for atomizer error callbacks.
- * This callback will be invoked both from normal context and
- * interrupt context, so it should be as fast as possible.
+ * This callback will be invoked from interrupt context (the
+ * PendSV handler, since the feedback loop runs above the kernel
+ * priority), so it should be as fast as possible.
  * You'll typically want to just set a flag and return, and
  * then act on that flag from you main application loop.
+ * Slower callbacks can run in thread context instead (see
+ * Atomizer_SetErrorCallbackEx).
  *
  * @param error Latest atomizer error.
  */
@@ -166,11 +241,93 @@ void Atomizer_Init();
  * While the voltage is expressed in mV, the actual precision
  * is 10mV. Millivolt units are used for uniformity between SDK
  * functions. Voltage will be rounded to the nearest 10mV.
+ * If the atomizer was in constant power mode (see
+ * Atomizer_SetOutputPower), it switches to constant voltage mode.
  *
  * @param volts Output voltage, in millivolts.
  */
 void Atomizer_SetOutputVoltage(uint16_t volts);
 
+/**
+ * Sets the atomizer output power, switching to constant power mode.
+ * This can always be called, the atomizer doesn't need to be
+ * powered on. The feedback loop regulates V^2/R using the resistance
+ * it measures on every iteration, so power follows the coil resistance
+ * as it heats up. The output voltage is still limited to the
+ * ATOMIZER_VOLTAGE_MIN - ATOMIZER_VOLTAGE_MAX range, so the actual
+ * power can be lower on high resistance coils.
+ * Calling Atomizer_SetOutputVoltage() switches back to constant
+ * voltage mode.
+ *
+ * @param power Output power, in mW.
+ */
+void Atomizer_SetOutputPower(uint32_t power);
+
+/**
+ * Sets the target coil temperature, switching to temperature control
+ * mode. This can always be called, the atomizer doesn't need to be
+ * powered on. The feedback loop estimates the coil temperature on every
+ * iteration from the measured resistance, the base resistance and
+ * temperature (see Atomizer_Info_t) and the resistance-temperature
+ * table of the material, then adjusts the output power to reach the
+ * target without exceeding maxPower.
+ * The base resistance must be known (i.e. Atomizer_ReadInfo() must
+ * have reported it) and must be measured with a cold coil. Without it
+ * the output is kept at ATOMIZER_POWER_MIN.
+ * Calling Atomizer_SetOutputVoltage() or Atomizer_SetOutputPower()
+ * leaves temperature control mode.
+ *
+ * @param temp     Target temperature, in °C. Limited to
+ *                 ATOMIZER_TEMP_MIN - ATOMIZER_TEMP_MAX.
+ * @param material Coil material. Unknown materials are ignored,
+ *                 leaving the output mode unchanged.
+ * @param maxPower Power ceiling, in mW.
+ */
+void Atomizer_SetOutputTemperature(uint16_t temp, Atomizer_Material_t material, uint32_t maxPower);
+
+/**
+ * Sets the resistance-temperature table for ATOMIZER_MATERIAL_CUSTOM.
+ * Entry i is R(20 * i °C) / R(0 °C) in Q12 fixed point (4096 = 1.0),
+ * and entries must be strictly increasing. For a linear TCR alpha,
+ * entry i is 4096 * (1 + alpha * 20 * i). The table is copied.
+ * The default is a linear TCR of 0.0032 (NiFe30).
+ *
+ * @param table Resistance-temperature table.
+ *
+ * @return True on success, false if the table is not increasing.
+ */
+uint8_t Atomizer_SetCustomMaterial(const uint16_t table[ATOMIZER_TCR_TABLE_LEN]);
+
+/**
+ * Sets the median filter window size for a measurement.
+ * Larger windows reject more noise, but delay the measurement by
+ * half the window: the voltage filter delay slows down the feedback
+ * loop. The default is ATOMIZER_FILTER_WINDOW_DEFAULT for all filters.
+ * Changing the window restarts the filter from the latest sample.
+ * This function is ISR-safe.
+ *
+ * @param filter Filtered measurement. Unknown measurements are
+ *               ignored.
+ * @param window Window size, in samples. Even sizes are rounded up.
+ *               Limited to ATOMIZER_FILTER_WINDOW_MAX.
+ */
+void Atomizer_SetFilterWindow(Atomizer_Filter_t filter, uint8_t window);
+
+/**
+ * Sets the gains of the output voltage feedback loop.
+ * Gains are in Q8 fixed point (256 = 1.0) and are normalized to the
+ * converter operating point: an integral gain of 256 corrects the whole
+ * voltage error in one iteration, in buck and boost mode alike, at any
+ * battery voltage. Defaults are ATOMIZER_FEEDBACK_KP, ATOMIZER_FEEDBACK_KI
+ * and ATOMIZER_FEEDBACK_KD. The integral gain must not be zero.
+ * This function is ISR-safe.
+ *
+ * @param kp Proportional gain.
+ * @param ki Integral gain.
+ * @param kd Derivative gain.
+ */
+void Atomizer_SetFeedbackGains(uint16_t kp, uint16_t ki, uint16_t kd);
+
 /**
  * Powers the atomizer on or off.
  *
@@ -245,6 +402,20 @@ void Atomizer_Unlock();
  */
 void Atomizer_SetErrorCallback(Atomizer_ErrorCallback_t callbackPtr);
 
+/**
+ * Sets the error callback, optionally running in thread context (not
+ * ISR-safe). Same as Atomizer_SetErrorCallback, but if inThread is true
+ * the callback always runs on the work queue thread (see WorkQueue.h),
+ * so it doesn't need to be fast. Errors are dropped if the work queue
+ * is full.
+ *
+ * @param callbackPtr Callback function pointer, or NULL to disable.
+ * @param inThread    True to run the callback in thread context.
+ *
+ * @return True on success, false if the work queue couldn't be started.
+ */
+uint8_t Atomizer_SetErrorCallbackEx(Atomizer_ErrorCallback_t callbackPtr, uint8_t inThread);
+
 /**
  * Reads the DC/DC converter temperature.
  *
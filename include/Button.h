@@ -50,7 +50,8 @@ extern "C" {
  * Callbacks will be invoked from an interrupt handler,
  * so they should be as fast as possible. You'll typically
  * want to just set a flag and return, and then act on that
- * flag from you main application loop.
+ * flag from you main application loop. Slower callbacks can
+ * run in thread context instead (see Button_CreateCallbackEx).
  */
 typedef void (*Button_Callback_t)(uint8_t);
 
@@ -83,6 +84,24 @@ uint8_t Button_GetState();
  */
 int8_t Button_CreateCallback(Button_Callback_t callback, uint8_t buttonMask);
 
+/**
+ * Creates a button callback, optionally running in thread context (not
+ * ISR-safe). Same as Button_CreateCallback, but if inThread is true the
+ * callback runs on the work queue thread (see WorkQueue.h) instead of
+ * in the interrupt handler. The button state is the one at the time of
+ * the interrupt. Callbacks are dropped if the work queue is full.
+ *
+ * @param callback   Callback function.
+ * @param buttonMask Bitwise OR of BUTTON_MASK_* values to specify which
+ *                   buttons the callback should be notified of.
+ * @param inThread   True to run the callback in thread context.
+ *
+ * @return A positive index if the callback was successfully created, or a
+ *         negative value if no callback slots are available, if callback
+ *         is NULL or if the work queue couldn't be started.
+ */
+int8_t Button_CreateCallbackEx(Button_Callback_t callback, uint8_t buttonMask, uint8_t inThread);
+
 /**
  * Deletes a callback.
  *
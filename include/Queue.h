@@ -43,6 +43,8 @@ typedef struct {
 typedef struct {
 	/** Next item in queue. */
 	void *next;
+	/** Previous item in queue. */
+	void *prev;
 } Queue_Header_t;
 
 /**
@@ -68,6 +70,16 @@ void Queue_PushFront(Queue_t *queue, void *item);
  */
 void Queue_PushBack(Queue_t *queue, void *item);
 
+/**
+ * Inserts an item after another one.
+ *
+ * @param queue Queue.
+ * @param prev  Item after which to insert, or
+ *              NULL to insert at the front.
+ * @param item  Item to insert.
+ */
+void Queue_InsertAfter(Queue_t *queue, void *prev, void *item);
+
 /**
  * Pops the first item off the queue.
  *
@@ -79,13 +91,12 @@ void *Queue_PopFront(Queue_t *queue);
 
 /**
  * Removes an item from the queue.
+ * The item must be in the queue.
  *
  * @param queue Queue.
- * @param prev  Item preceding the one to be removed,
- *              or NULL if removing the first item.
  * @param item  Item to remove.
  */
-void Queue_Remove(Queue_t *queue, void *prev, void *item);
+void Queue_Remove(Queue_t *queue, void *item);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,157 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_RINGBUFFER_H
+#define EVICSDK_RINGBUFFER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Lock-free single-producer/single-consumer byte ring buffer.
+ * One context (thread or ISR) writes and one context reads,
+ * without masking interrupts: the producer only moves the head
+ * and the consumer only moves the tail. Any number of readers
+ * or writers needs external locking on its own side.
+ * Indices run freely and wrap with the size, which must be a
+ * power of two. All bytes in the buffer can be used.
+ */
+typedef struct {
+	/**< Data buffer. */
+	uint8_t *buffer;
+	/**< Buffer size mask (size - 1). */
+	uint32_t mask;
+	/**< Write index. Only modified by the producer. */
+	volatile uint32_t head;
+	/**< Read index. Only modified by the consumer. */
+	volatile uint32_t tail;
+} RingBuffer_t;
+
+/**
+ * Initializes an user-allocated ring buffer.
+ * Not safe while a producer or consumer is using it.
+ *
+ * @param ring   Ring buffer.
+ * @param buffer Data buffer.
+ * @param size   Data buffer size, in bytes. Must be a power of two.
+ */
+void RingBuffer_Init(RingBuffer_t *ring, uint8_t *buffer, uint32_t size);
+
+/**
+ * Gets the number of bytes available for reading.
+ * The value is exact for the consumer and a lower bound for
+ * everyone else.
+ *
+ * @param ring Ring buffer.
+ *
+ * @return Number of used bytes.
+ */
+uint32_t RingBuffer_GetUsed(const RingBuffer_t *ring);
+
+/**
+ * Gets the number of bytes available for writing.
+ * The value is exact for the producer and a lower bound for
+ * everyone else.
+ *
+ * @param ring Ring buffer.
+ *
+ * @return Number of free bytes.
+ */
+uint32_t RingBuffer_GetFree(const RingBuffer_t *ring);
+
+/**
+ * Writes data to the ring buffer (producer only).
+ * If the data doesn't fit, excess bytes are discarded.
+ *
+ * @param ring Ring buffer.
+ * @param src  Source buffer.
+ * @param size Data size, in bytes.
+ *
+ * @return Number of bytes actually written.
+ */
+uint32_t RingBuffer_Write(RingBuffer_t *ring, const uint8_t *src, uint32_t size);
+
+/**
+ * Reads data from the ring buffer (consumer only).
+ * If less data is available, the read size is reduced.
+ *
+ * @param ring Ring buffer.
+ * @param dst  Destination buffer.
+ * @param size Data size, in bytes.
+ *
+ * @return Number of bytes actually read.
+ */
+uint32_t RingBuffer_Read(RingBuffer_t *ring, uint8_t *dst, uint32_t size);
+
+/**
+ * Gets the largest contiguous free region for zero-copy
+ * writes (producer only). Fill it (or a part of it), then
+ * publish the data with RingBuffer_WriteCommit(). When the
+ * free space wraps around the buffer end, a second peek
+ * after the commit returns the rest.
+ *
+ * @param ring Ring buffer.
+ * @param ptr  Pointer to receive the region start.
+ *
+ * @return Region size, in bytes. Zero if the buffer is full.
+ */
+uint32_t RingBuffer_WritePeek(RingBuffer_t *ring, uint8_t **ptr);
+
+/**
+ * Publishes data written to a region obtained with
+ * RingBuffer_WritePeek() (producer only).
+ *
+ * @param ring Ring buffer.
+ * @param size Number of bytes written. Must not exceed
+ *             the size returned by the last peek.
+ */
+void RingBuffer_WriteCommit(RingBuffer_t *ring, uint32_t size);
+
+/**
+ * Gets the largest contiguous data region for zero-copy
+ * reads (consumer only). Consume it (or a part of it), then
+ * release the space with RingBuffer_ReadCommit(). When the
+ * data wraps around the buffer end, a second peek after the
+ * commit returns the rest.
+ *
+ * @param ring Ring buffer.
+ * @param ptr  Pointer to receive the region start.
+ *
+ * @return Region size, in bytes. Zero if the buffer is empty.
+ */
+uint32_t RingBuffer_ReadPeek(RingBuffer_t *ring, const uint8_t **ptr);
+
+/**
+ * Releases data read from a region obtained with
+ * RingBuffer_ReadPeek() (consumer only).
+ *
+ * @param ring Ring buffer.
+ * @param size Number of bytes consumed. Must not exceed
+ *             the size returned by the last peek.
+ */
+void RingBuffer_ReadCommit(RingBuffer_t *ring, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
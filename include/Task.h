@@ -0,0 +1,183 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_TASK_H
+#define EVICSDK_TASK_H
+
+#include <stdint.h>
+#include <Thread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Runner thread priority.
+ */
+#define TASK_PRIORITY THREAD_PRIORITY_DEFAULT
+
+/**
+ * Runner thread stack size, in bytes. All tasks share this stack.
+ */
+#define TASK_STACKSIZE THREAD_DEFAULT_STACKSIZE
+
+/**
+ * Task event: the delay expired, or the semaphore wait timed out.
+ */
+#define TASK_EVENT_TIMEOUT 0
+/**
+ * Task event: the semaphore the task was waiting on was downed.
+ */
+#define TASK_EVENT_SEMA    1
+/**
+ * Task event: the task was posted with Task_Post().
+ */
+#define TASK_EVENT_POST    2
+
+struct Task;
+
+/**
+ * Function pointer type for tasks.
+ * Tasks are run to completion on the runner thread, one at a time,
+ * and share its stack. A task must not block: to wait, it schedules
+ * its next run (Task_DelayMs(), Task_DelayUntil(), Task_WaitSemaphore())
+ * and returns. If it returns without scheduling itself, it stays idle
+ * until scheduled or posted again.
+ *
+ * @param task    Task being run.
+ * @param context User-defined pointer.
+ * @param event   Why the task is being run (TASK_EVENT_*).
+ */
+typedef void (*Task_Func_t)(struct Task *task, void *context, uint8_t event);
+
+/**
+ * Cooperative task. Costs a few words instead of a thread stack.
+ * Initialize with Task_Init(). All fields are private.
+ */
+typedef struct Task {
+	/**< Function to run. */
+	Task_Func_t func;
+	/**< User-defined pointer. */
+	void *context;
+	/**< Wakeup time (or last deadline), in system ticks. */
+	uint32_t time;
+	/**< Semaphore being waited on, or 0. */
+	Thread_Semaphore_t sema;
+	/**< Next task in the schedule list. */
+	struct Task *next;
+	/**< Next task in the post list. */
+	struct Task *postNext;
+	/**< True if posted and not yet run. */
+	volatile uint32_t posted;
+	/**< Task state. */
+	uint8_t state;
+} Task_t;
+
+/**
+ * Starts the runner thread, if it isn't running yet (not ISR-safe).
+ * The thread is allocated on the heap. Tasks can be scheduled before
+ * the runner is started: they will run once it starts.
+ *
+ * @return True if the runner is running, false if it couldn't be
+ *         started (out of memory).
+ */
+uint8_t Task_Start();
+
+/**
+ * Initializes a task (not ISR-safe). The task is idle until
+ * scheduled or posted.
+ *
+ * @param task    Task.
+ * @param func    Task function.
+ * @param context User-defined pointer passed to func.
+ */
+void Task_Init(Task_t *task, Task_Func_t func, void *context);
+
+/**
+ * Schedules a task to run after a delay (not ISR-safe).
+ * Replaces any previous delay or wait of the task.
+ *
+ * @param task  Task.
+ * @param delay Delay in milliseconds. Zero runs the task as soon
+ *              as possible.
+ */
+void Task_DelayMs(Task_t *task, uint32_t delay);
+
+/**
+ * Schedules a task to run at a fixed period (not ISR-safe).
+ * The deadline is the previous deadline plus period, so a task
+ * rescheduling itself with this doesn't accumulate drift, like
+ * Thread_DelayUntil(). For a task that has never been delayed, or
+ * that was last run for a post or semaphore, the previous deadline
+ * is the time it was initialized or run. If the deadline
+ * has already passed the task runs as soon as possible.
+ *
+ * @param task   Task.
+ * @param period Period, in milliseconds. Must be less than 2^31 ticks.
+ *
+ * @return True if the deadline had already passed, false otherwise.
+ */
+uint8_t Task_DelayUntil(Task_t *task, uint32_t period);
+
+/**
+ * Schedules a task to run when a semaphore can be downed (not ISR-safe).
+ * The runner downs the semaphore on behalf of the task, then runs it
+ * with TASK_EVENT_SEMA. If the timeout expires first the task runs
+ * with TASK_EVENT_TIMEOUT. Replaces any previous delay or wait.
+ * The runner only checks the semaphore when it wakes up: up it with
+ * Task_SemaphoreUp() to wake the runner right away.
+ *
+ * @param task    Task.
+ * @param sema    Semaphore handle.
+ * @param timeout Timeout, in milliseconds, or zero to wait forever.
+ */
+void Task_WaitSemaphore(Task_t *task, Thread_Semaphore_t sema, uint32_t timeout);
+
+/**
+ * Runs a task as soon as possible with TASK_EVENT_POST, cancelling
+ * its current delay or wait. Posting a task that is already posted
+ * has no effect. This function is ISR-safe.
+ *
+ * @param task Task.
+ */
+void Task_Post(Task_t *task);
+
+/**
+ * Cancels the delay or wait of a task (not ISR-safe).
+ * The task becomes idle. A pending post is not cancelled.
+ *
+ * @param task Task.
+ */
+void Task_Cancel(Task_t *task);
+
+/**
+ * Increments a semaphore count, and wakes up the runner so that a
+ * task waiting on it runs promptly. This function is ISR-safe.
+ *
+ * @param sema Semaphore handle.
+ *
+ * @return TD_SUCCESS or TD_INVALID_SEMA.
+ */
+Thread_Error_t Task_SemaphoreUp(Thread_Semaphore_t sema);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
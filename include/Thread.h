@@ -32,6 +32,21 @@ extern "C" {
  */
 #define THREAD_SYSTICK_MS 1
 
+/**
+ * Kernel interrupt priority (NVIC priority, 0 is the highest).
+ * The thread library masks interrupts at this priority and below
+ * (numerically greater or equal) while working on its internal data
+ * structures, using BASEPRI. Interrupts with a higher priority (1 to
+ * THREAD_KERNEL_PRIORITY - 1) are never delayed by the thread library,
+ * but they must not call any thread function other than
+ * Thread_DeferredPost(). Priority 0 is reserved: Thread_Init() moves
+ * all interrupts still at priority 0 to the kernel priority, so that
+ * interrupts that don't set a priority keep working as before.
+ */
+#ifndef THREAD_KERNEL_PRIORITY
+#define THREAD_KERNEL_PRIORITY 4
+#endif
+
 /**
  * Default stack size for the main thread.
  */
@@ -45,6 +60,190 @@ extern "C" {
  */
 #define THREAD_MAIN_STACKSIZE(size) uint16_t Startup_mainThreadStackSize = (size)
 
+/**
+ * Number of thread priority levels.
+ */
+#define THREAD_PRIORITY_COUNT 8
+
+/**
+ * Lowest thread priority.
+ */
+#define THREAD_PRIORITY_MIN 0
+
+/**
+ * Highest thread priority.
+ */
+#define THREAD_PRIORITY_MAX (THREAD_PRIORITY_COUNT - 1)
+
+/**
+ * Default thread priority. This is used for the main
+ * thread and for threads created with Thread_Create().
+ */
+#define THREAD_PRIORITY_DEFAULT (THREAD_PRIORITY_COUNT / 2)
+
+/**
+ * Required alignment for static thread storage, in bytes.
+ */
+#define THREAD_STATIC_ALIGN 32
+
+/**
+ * Space reserved for the thread control block in static
+ * thread storage, in bytes.
+ */
+#ifdef EVICSDK_FPU_SUPPORT
+#define THREAD_STATIC_TCB_SIZE (96 + 14 * sizeof(void *))
+#else
+#define THREAD_STATIC_TCB_SIZE (96 + 13 * sizeof(void *))
+#endif
+
+/**
+ * Per-thread stack overhead in static thread storage, in bytes:
+ * stack guard and initial hardware-pushed context.
+ */
+#ifdef EVICSDK_FPU_SUPPORT
+#define THREAD_STATIC_STACK_OVERHEAD (32 + 104)
+#else
+#define THREAD_STATIC_STACK_OVERHEAD (32 + 32)
+#endif
+
+/**
+ * Size of the static storage needed for a thread, in bytes.
+ *
+ * @param stackSize Stack size, in bytes.
+ */
+#define THREAD_STATIC_SIZE(stackSize) (THREAD_STATIC_STACK_OVERHEAD + \
+	(((stackSize) + 7) & ~7) + THREAD_STATIC_TCB_SIZE)
+
+/**
+ * Defines properly sized and aligned static storage for a thread,
+ * to be passed to Thread_CreateStatic().
+ *
+ * @param name      Storage variable name.
+ * @param stackSize Stack size, in bytes.
+ */
+#define THREAD_STATIC_STORAGE(name, stackSize) uint8_t name[THREAD_STATIC_SIZE(stackSize)] \
+	__attribute__((aligned(THREAD_STATIC_ALIGN)))
+
+/**
+ * Event flags wait mode: wait for any of the flags.
+ */
+#define THREAD_EVENTFLAGS_ANY   0
+
+/**
+ * Event flags wait mode: wait for all of the flags.
+ */
+#define THREAD_EVENTFLAGS_ALL   (1 << 0)
+
+/**
+ * Event flags wait option: clear the waited flags on wakeup.
+ * Can be combined with THREAD_EVENTFLAGS_ANY or THREAD_EVENTFLAGS_ALL.
+ */
+#define THREAD_EVENTFLAGS_CLEAR (1 << 1)
+
+/**
+ * Delay option: always suspend the thread, never busy wait.
+ * By default short delays that end before the next preemption
+ * are busy waited, which is more accurate but burns CPU time
+ * that lower priority threads could use.
+ */
+#define THREAD_DELAY_NOBUSYWAIT (1 << 0)
+
+/**
+ * Idle hook function pointer.
+ * The hook is called repeatedly from the idle thread, before
+ * the CPU is put to sleep. It must not block, delay or call
+ * any function that could suspend the calling thread. It
+ * runs on a small stack (512 bytes).
+ */
+typedef void (*Thread_IdleHook_t)();
+
+/**
+ * Idle statistics.
+ */
+typedef struct {
+	/**< Total time spent idle since boot, in system ticks. */
+	uint32_t totalIdle;
+	/**< CPU load over the last measurement window (about
+	 *   one second), in tenths of percent (0 to 1000). */
+	uint16_t load;
+} Thread_IdleStats_t;
+
+/**
+ * Periodic task state, for Thread_PeriodicWait().
+ * Initialize with Thread_PeriodicInit().
+ */
+typedef struct {
+	/**< Start of the current period, in system ticks. */
+	uint32_t lastWake;
+	/**< Period, in milliseconds. */
+	uint32_t period;
+	/**< Delay options (THREAD_DELAY_*). */
+	uint8_t flags;
+	/**< Total number of missed deadlines. */
+	uint32_t missed;
+} Thread_Periodic_t;
+
+/**
+ * Kernel lock statistics.
+ * Measure how long interrupts at the kernel priority and
+ * below are kept masked by the thread library. The few short
+ * sections that mask all interrupts (Thread_IrqDisable()), such
+ * as the idle thread wakeup sample, are not accounted.
+ */
+typedef struct {
+	/**< Longest kernel lock, in CPU cycles. */
+	uint32_t maxCycles;
+	/**< Number of kernel locks taken. */
+	uint32_t count;
+} Thread_LockStats_t;
+
+/**
+ * Function pointer type for deferred calls.
+ * Invoked from the PendSV handler, with all the bits that have
+ * been posted since the last invocation. It runs in interrupt
+ * context at the lowest priority: only ISR-safe functions can
+ * be called.
+ *
+ * @param bits Posted bits.
+ */
+typedef void (*Thread_DeferredFunc_t)(uint32_t bits);
+
+/**
+ * Deferred call, for Thread_DeferredPost().
+ * Initialize with Thread_DeferredInit(). All fields are private.
+ */
+typedef struct Thread_Deferred {
+	/**< Function to invoke. */
+	Thread_DeferredFunc_t func;
+	/**< Bits posted and not yet delivered. */
+	volatile uint32_t pending;
+	/**< Next deferred call in the pending list. */
+	struct Thread_Deferred *next;
+} Thread_Deferred_t;
+
+/**
+ * Thread runtime statistics.
+ */
+typedef struct {
+	/**< CPU time used by the thread, in CPU cycles. */
+	uint64_t cpuCycles;
+	/**< Number of times the thread has been switched in. */
+	uint32_t switches;
+	/**< Number of times the thread gave up the CPU, by
+	 *   blocking, delaying or yielding. */
+	uint32_t voluntarySwitches;
+	/**< Number of times the thread was preempted. */
+	uint32_t involuntarySwitches;
+	/**< Stack size, in bytes, excluding the stack guard. */
+	uint16_t stackSize;
+	/**< Maximum stack usage (high-water mark), in bytes. */
+	uint16_t stackUsed;
+	/**< Effective priority, including inheritance. */
+	uint8_t priority;
+	/**< Base priority. */
+	uint8_t basePriority;
+} Thread_Stats_t;
+
 /**
  * Type for thread handles.
  */
@@ -60,6 +259,52 @@ typedef uint32_t Thread_Semaphore_t;
  */
 typedef uint32_t Thread_Mutex_t;
 
+/**
+ * Type for event flags handles.
+ */
+typedef uint32_t Thread_EventFlags_t;
+
+/**
+ * Type for message queue handles.
+ */
+typedef uint32_t Thread_MsgQueue_t;
+
+/**
+ * Storage for a static semaphore.
+ * Contents are private to the thread manager.
+ */
+typedef struct {
+	/**< Opaque semaphore data. */
+	uintptr_t opaque[5];
+} Thread_SemaphoreStatic_t;
+
+/**
+ * Storage for a static mutex.
+ * Contents are private to the thread manager.
+ */
+typedef struct {
+	/**< Opaque mutex data. */
+	uintptr_t opaque[7];
+} Thread_MutexStatic_t;
+
+/**
+ * Storage for static event flags.
+ * Contents are private to the thread manager.
+ */
+typedef struct {
+	/**< Opaque event flags data. */
+	uintptr_t opaque[5];
+} Thread_EventFlagsStatic_t;
+
+/**
+ * Storage for a static message queue control block.
+ * Contents are private to the thread manager.
+ */
+typedef struct {
+	/**< Opaque message queue data. */
+	uintptr_t opaque[12];
+} Thread_MsgQueueStatic_t;
+
 /**
  * Return values for thread API.
  * Zero means success, a negative value means error.
@@ -73,6 +318,8 @@ typedef enum {
 	TD_TRY_FAIL = -2,
 	/**< An invalid value was passed. */
 	TD_INVALID_VALUE = -3,
+	/**< A timed wait timed out. */
+	TD_TIMEOUT = -4,
 	/**< An invalid thread handle was passed. */
 	TD_INVALID_THREAD = -100,
 	/**< Attempted to join an already joined thread. */
@@ -82,7 +329,11 @@ typedef enum {
 	/**< An invalid mutex handle was passed. */
 	TD_INVALID_MUTEX = -300,
 	/**< Bad mutex unlock: already unlocked, or locked by a different thread. */
-	TD_MUTEX_BAD_UNLOCK = -301
+	TD_MUTEX_BAD_UNLOCK = -301,
+	/**< An invalid event flags handle was passed. */
+	TD_INVALID_EVENTFLAGS = -400,
+	/**< An invalid message queue handle was passed. */
+	TD_INVALID_MSGQUEUE = -500
 } Thread_Error_t;
 
 /**
@@ -98,7 +349,7 @@ typedef void *(*Thread_EntryPtr_t)(void *args);
 void Thread_Init();
 
 /**
- * Creates a new thread.
+ * Creates a new thread with default priority.
  *
  * @param thread    Pointer to receive the thread handle.
  * @param entry     Thread entry function.
@@ -110,6 +361,83 @@ void Thread_Init();
  */
 Thread_Error_t Thread_Create(Thread_t *thread, Thread_EntryPtr_t entry, void *args, uint16_t stackSize);
 
+/**
+ * Creates a new thread with the specified priority.
+ * Threads with higher priority always run before threads
+ * with lower priority. Threads with the same priority are
+ * scheduled round-robin. If the new thread has a higher
+ * priority than the calling thread, it will run immediately.
+ *
+ * @param thread    Pointer to receive the thread handle.
+ * @param entry     Thread entry function.
+ * @param args      Arguments parameter to be passed to entry.
+ * @param stackSize Stack size, in bytes.
+ * @param priority  Thread priority, from THREAD_PRIORITY_MIN
+ *                  to THREAD_PRIORITY_MAX.
+ *
+ * @return TD_SUCCESS, TD_INVALID_VALUE (bad priority) or TD_NO_MEMORY.
+ *         In case of error the value of thread is undefined.
+ */
+Thread_Error_t Thread_CreateEx(Thread_t *thread, Thread_EntryPtr_t entry, void *args, uint16_t stackSize, uint8_t priority);
+
+/**
+ * Creates a new thread in caller-provided storage, without
+ * allocating memory. The storage must be at least
+ * THREAD_STATIC_SIZE(stackSize) bytes, aligned to
+ * THREAD_STATIC_ALIGN bytes and located in RAM. Use
+ * THREAD_STATIC_STORAGE() to define it. The storage must
+ * not be touched until the thread has exited, after which
+ * it can be reused.
+ *
+ * @param thread    Pointer to receive the thread handle.
+ * @param entry     Thread entry function.
+ * @param args      Arguments parameter to be passed to entry.
+ * @param storage   Thread storage (stack and control block).
+ * @param stackSize Stack size, in bytes.
+ * @param priority  Thread priority, from THREAD_PRIORITY_MIN
+ *                  to THREAD_PRIORITY_MAX.
+ *
+ * @return TD_SUCCESS or TD_INVALID_VALUE (bad priority or storage).
+ *         In case of error the value of thread is undefined.
+ */
+Thread_Error_t Thread_CreateStatic(Thread_t *thread, Thread_EntryPtr_t entry, void *args, void *storage, uint16_t stackSize, uint8_t priority);
+
+/**
+ * Gets the handle of the current thread.
+ * From ISRs, this is the handle of the interrupted thread.
+ *
+ * @return Current thread handle.
+ */
+Thread_t Thread_GetCurrent();
+
+/**
+ * Sets the priority of a thread (not ISR-safe).
+ * If the change makes a higher priority thread ready to
+ * run, the calling thread will be preempted immediately.
+ * While the thread holds mutexes, it might run at a higher
+ * priority because of priority inheritance or ceilings.
+ *
+ * @param thread   Thread handle.
+ * @param priority New priority, from THREAD_PRIORITY_MIN
+ *                 to THREAD_PRIORITY_MAX.
+ *
+ * @return TD_SUCCESS, TD_INVALID_THREAD or TD_INVALID_VALUE.
+ */
+Thread_Error_t Thread_SetPriority(Thread_t thread, uint8_t priority);
+
+/**
+ * Gets the priority of a thread (not ISR-safe).
+ * This is the priority set by the user, not including
+ * any priority inherited through mutexes.
+ *
+ * @param thread   Thread handle.
+ * @param priority Pointer to receive the priority.
+ *
+ * @return TD_SUCCESS or TD_INVALID_THREAD. In case of
+ *         error the value of priority is undefined.
+ */
+Thread_Error_t Thread_GetPriority(Thread_t thread, uint8_t *priority);
+
 /**
  * Yields this thread back to the scheduler, letting
  * other threads run (not ISR-safe).
@@ -130,6 +458,21 @@ void Thread_Yield();
  */
 Thread_Error_t Thread_Join(Thread_t thread, void **ret);
 
+/**
+ * Waits for another thread to complete, with a timeout (not ISR-safe).
+ * Same as Thread_Join, but gives up after the timeout expires. If it
+ * does, the thread can be joined again.
+ *
+ * @param thread  Handle of the thread to wait for.
+ * @param ret     Pointer to receive the return value of the
+ *                joined thread.
+ * @param timeout Timeout, in milliseconds. If zero, fails
+ *                immediately unless the thread is invalid.
+ *
+ * @return TD_SUCCESS, TD_INVALID_THREAD, TD_ALREADY_JOINED or TD_TIMEOUT.
+ */
+Thread_Error_t Thread_JoinTimeout(Thread_t thread, void **ret, uint32_t timeout);
+
 /**
  * Delays the current thread for the specified amount of time
  * (not ISR-safe).
@@ -140,6 +483,73 @@ Thread_Error_t Thread_Join(Thread_t thread, void **ret);
  */
 void Thread_DelayMs(uint32_t delay);
 
+/**
+ * Gives the current thread its own C library reentrancy state (not
+ * ISR-safe). By default all threads share the global newlib state:
+ * errno, stdio buffers, strtok(), rand() and the like. Threads that
+ * use those concurrently should call this once before using them.
+ * The state is allocated from the heap (about 1KB with the full
+ * newlib, much less with newlib-nano) and freed when the thread
+ * terminates. Does nothing if the state has already been allocated.
+ *
+ * @return TD_SUCCESS or TD_NO_MEMORY.
+ */
+Thread_Error_t Thread_EnableReent();
+
+/**
+ * Delays the current thread until an absolute deadline (not ISR-safe).
+ * The deadline is lastWake + period, and lastWake is advanced to it.
+ * Since the deadline doesn't depend on when this function is called,
+ * a loop calling it runs with a fixed period without accumulating
+ * drift from its own execution time. Initialize lastWake with
+ * Thread_GetSysTicks() before the first call.
+ * If the deadline has already passed the thread is not delayed.
+ *
+ * @param lastWake Pointer to the start of the current period, in
+ *                 system ticks. Receives the deadline.
+ * @param period   Period, in milliseconds. Must be less than 2^31 ticks.
+ *
+ * @return True if the deadline had already passed, false otherwise.
+ */
+uint8_t Thread_DelayUntil(uint32_t *lastWake, uint32_t period);
+
+/**
+ * Same as Thread_DelayUntil(), with delay options (not ISR-safe).
+ *
+ * @param lastWake Pointer to the start of the current period, in
+ *                 system ticks. Receives the deadline.
+ * @param period   Period, in milliseconds. Must be less than 2^31 ticks.
+ * @param flags    Delay options (THREAD_DELAY_*), or 0.
+ *
+ * @return True if the deadline had already passed, false otherwise.
+ */
+uint8_t Thread_DelayUntilEx(uint32_t *lastWake, uint32_t period, uint8_t flags);
+
+/**
+ * Initializes a periodic task (not ISR-safe).
+ * The first period starts now.
+ *
+ * @param periodic Periodic task state.
+ * @param period   Period, in milliseconds. Must be nonzero and
+ *                 less than 2^31 ticks.
+ * @param flags    Delay options (THREAD_DELAY_*), or 0.
+ */
+void Thread_PeriodicInit(Thread_Periodic_t *periodic, uint32_t period, uint8_t flags);
+
+/**
+ * Waits for the next period of a periodic task (not ISR-safe).
+ * Call at the end of each iteration of the task loop. If the
+ * task overran one or more deadlines it is not delayed: the
+ * missed periods are skipped, so that the task realigns to its
+ * original phase instead of running a burst of late iterations.
+ * Missed deadlines are also added to periodic->missed.
+ *
+ * @param periodic Periodic task state.
+ *
+ * @return Number of deadlines missed since the last call.
+ */
+uint32_t Thread_PeriodicWait(Thread_Periodic_t *periodic);
+
 /**
  * Enters a global critical section, disabling scheduling
  * for other threads.
@@ -165,8 +575,29 @@ void Thread_CriticalExit();
  */
 Thread_Error_t Thread_SemaphoreCreate(Thread_Semaphore_t *sema, int32_t count);
 
+/**
+ * Initializes a semaphore in caller-provided storage, without
+ * allocating memory. The storage must be located in RAM and
+ * must not be touched until the semaphore is destroyed.
+ *
+ * @param sema    Pointer to receive semaphore handle.
+ * @param storage Semaphore storage.
+ * @param count   Initial count (must not be negative).
+ *
+ * @return TD_SUCCESS or TD_INVALID_VALUE (negative count or bad storage).
+ *         In case of error the value of sema is undefined.
+ */
+Thread_Error_t Thread_SemaphoreInitStatic(Thread_Semaphore_t *sema, Thread_SemaphoreStatic_t *storage, int32_t count);
+
 /**
  * Destroys a semaphore.
+ * Threads waiting on the semaphore are woken up, and their wait
+ * returns TD_INVALID_SEMA. The same holds for all synchronization
+ * objects: destroying one wakes up its waiters with its invalid
+ * handle error, and the destroyed object is never touched again.
+ * Destroying an object that another thread is still using outside
+ * of a wait (e.g. while it returns from one) is not allowed.
+ * Static semaphores are destroyed without freeing their storage.
  *
  * @param sema Semaphore handle.
  *
@@ -184,6 +615,19 @@ Thread_Error_t Thread_SemaphoreDestroy(Thread_Semaphore_t sema);
  */
 Thread_Error_t Thread_SemaphoreDown(Thread_Semaphore_t sema);
 
+/**
+ * Decrements the semaphore count, with a timeout (not ISR-safe).
+ * If count is zero, waits until another thread increments it or
+ * the timeout expires.
+ *
+ * @param sema    Semaphore handle.
+ * @param timeout Timeout, in milliseconds. If zero, behaves
+ *                like Thread_SemaphoreTryDown.
+ *
+ * @return TD_SUCCESS, TD_INVALID_SEMA or TD_TIMEOUT.
+ */
+Thread_Error_t Thread_SemaphoreDownTimeout(Thread_Semaphore_t sema, uint32_t timeout);
+
 /**
  * Decrements the semaphore count.
  * If count is zero, it fails without waiting.
@@ -225,8 +669,25 @@ Thread_Error_t Thread_SemaphoreGetCount(Thread_Semaphore_t sema, int32_t *count)
  */
 Thread_Error_t Thread_MutexCreate(Thread_Mutex_t *mutex);
 
+/**
+ * Initializes a mutex in caller-provided storage, without
+ * allocating memory. The storage must be located in RAM and
+ * must not be touched until the mutex is destroyed.
+ * The mutex is initially unlocked.
+ *
+ * @param mutex   Pointer to receive mutex handle.
+ * @param storage Mutex storage.
+ *
+ * @return TD_SUCCESS or TD_INVALID_VALUE (bad storage). In
+ *         case of error the value of mutex is undefined.
+ */
+Thread_Error_t Thread_MutexInitStatic(Thread_Mutex_t *mutex, Thread_MutexStatic_t *storage);
+
 /**
  * Destroys a mutex.
+ * Threads waiting on the mutex are woken up, and their wait
+ * returns TD_INVALID_MUTEX.
+ * Static mutexes are destroyed without freeing their storage.
  *
  * @param mutex Mutex handle.
  *
@@ -234,9 +695,25 @@ Thread_Error_t Thread_MutexCreate(Thread_Mutex_t *mutex);
  */
 Thread_Error_t Thread_MutexDestroy(Thread_Mutex_t mutex);
 
+/**
+ * Sets the priority ceiling of a mutex (not ISR-safe).
+ * While a thread holds the mutex, its priority is raised
+ * to at least the ceiling. The default ceiling is
+ * THREAD_PRIORITY_MIN, which disables the protocol.
+ *
+ * @param mutex   Mutex handle.
+ * @param ceiling Priority ceiling.
+ *
+ * @return TD_SUCCESS, TD_INVALID_MUTEX or TD_INVALID_VALUE.
+ */
+Thread_Error_t Thread_MutexSetCeiling(Thread_Mutex_t mutex, uint8_t ceiling);
+
 /**
  * Locks a mutex (not ISR-safe).
- * If the mutex is locked, waits until it's unlocked.
+ * If the mutex is locked, waits until it's unlocked. While
+ * waiting, the owner thread inherits the caller's priority
+ * if higher. Mutexes are recursive: the owner can lock them
+ * again, and must unlock them the same number of times.
  *
  * @param mutex Mutex handle.
  *
@@ -244,6 +721,18 @@ Thread_Error_t Thread_MutexDestroy(Thread_Mutex_t mutex);
  */
 Thread_Error_t Thread_MutexLock(Thread_Mutex_t mutex);
 
+/**
+ * Locks a mutex, with a timeout (not ISR-safe).
+ * Same as Thread_MutexLock, but gives up after the timeout expires.
+ *
+ * @param mutex   Mutex handle.
+ * @param timeout Timeout, in milliseconds. If zero, behaves
+ *                like Thread_MutexTryLock.
+ *
+ * @return TD_SUCCESS, TD_INVALID_MUTEX or TD_TIMEOUT.
+ */
+Thread_Error_t Thread_MutexLockTimeout(Thread_Mutex_t mutex, uint32_t timeout);
+
 /**
  * Locks a mutex (not ISR-safe).
  * If the mutex is locked, fails without waiting.
@@ -257,10 +746,12 @@ Thread_Error_t Thread_MutexTryLock(Thread_Mutex_t mutex);
 /**
  * Unlocks a mutex (not ISR-safe).
  * Only the thread that locked a mutex can unlock it.
+ * When the last recursive lock is undone, the mutex is
+ * handed off to the highest priority waiting thread.
  *
  * @param mutex Mutex handle.
  *
- * @return TD_SUCCESS or TD_MUTEX_BAD_UNLOCK.
+ * @return TD_SUCCESS, TD_INVALID_MUTEX or TD_MUTEX_BAD_UNLOCK.
  */
 Thread_Error_t Thread_MutexUnlock(Thread_Mutex_t mutex);
 
@@ -276,22 +767,385 @@ Thread_Error_t Thread_MutexUnlock(Thread_Mutex_t mutex);
  */
 Thread_Error_t Thread_MutexGetState(Thread_Mutex_t mutex, uint8_t *isLocked);
 
-/* Always inline, no extern version. */
-#define THREAD_INLINE __attribute__((always_inline)) static inline
+/**
+ * Gets the maximum time a thread has been blocked
+ * waiting to lock a mutex.
+ *
+ * @param mutex   Mutex handle.
+ * @param maxTime Pointer to receive the maximum blocking time, in ticks.
+ *
+ * @return TD_SUCCESS or TD_INVALID_MUTEX. In case of error the value
+ *         of maxTime is undefined.
+ */
+Thread_Error_t Thread_MutexGetMaxBlockTime(Thread_Mutex_t mutex, uint32_t *maxTime);
+
+/**
+ * Creates an event flags group.
+ * An event flags group holds 32 flags, initially all cleared.
+ * Threads can wait for any or all of a set of flags to be set.
+ *
+ * @param flags Pointer to receive event flags handle.
+ *
+ * @return TD_SUCCESS or TD_NO_MEMORY. In case of
+ *         error the value of flags is undefined.
+ */
+Thread_Error_t Thread_EventFlagsCreate(Thread_EventFlags_t *flags);
+
+/**
+ * Initializes an event flags group in caller-provided storage,
+ * without allocating memory. The storage must be located in RAM
+ * and must not be touched until the group is destroyed.
+ *
+ * @param flags   Pointer to receive event flags handle.
+ * @param storage Event flags storage.
+ *
+ * @return TD_SUCCESS or TD_INVALID_VALUE (bad storage). In
+ *         case of error the value of flags is undefined.
+ */
+Thread_Error_t Thread_EventFlagsInitStatic(Thread_EventFlags_t *flags, Thread_EventFlagsStatic_t *storage);
+
+/**
+ * Destroys an event flags group.
+ * Threads waiting on the group are woken up, and their wait
+ * returns TD_INVALID_EVENTFLAGS without writing the flags.
+ * Static groups are destroyed without freeing their storage.
+ *
+ * @param flags Event flags handle.
+ *
+ * @return TD_SUCCESS or TD_INVALID_EVENTFLAGS.
+ */
+Thread_Error_t Thread_EventFlagsDestroy(Thread_EventFlags_t flags);
+
+/**
+ * Sets flags in an event flags group, waking up all the
+ * threads whose wait condition is satisfied. Flags requested
+ * with THREAD_EVENTFLAGS_CLEAR by woken threads are cleared
+ * after all waiters have been checked.
+ * This function is ISR-safe.
+ *
+ * @param flags Event flags handle.
+ * @param mask  Flags to set.
+ *
+ * @return TD_SUCCESS or TD_INVALID_EVENTFLAGS.
+ */
+Thread_Error_t Thread_EventFlagsSet(Thread_EventFlags_t flags, uint32_t mask);
+
+/**
+ * Clears flags in an event flags group.
+ * This function is ISR-safe.
+ *
+ * @param flags Event flags handle.
+ * @param mask  Flags to clear.
+ *
+ * @return TD_SUCCESS or TD_INVALID_EVENTFLAGS.
+ */
+Thread_Error_t Thread_EventFlagsClear(Thread_EventFlags_t flags, uint32_t mask);
+
+/**
+ * Gets the current flags of an event flags group.
+ * This function is ISR-safe.
+ *
+ * @param flags Event flags handle.
+ * @param value Pointer to receive the flags.
+ *
+ * @return TD_SUCCESS or TD_INVALID_EVENTFLAGS. In case of
+ *         error the value of value is undefined.
+ */
+Thread_Error_t Thread_EventFlagsGet(Thread_EventFlags_t flags, uint32_t *value);
+
+/**
+ * Waits for flags in an event flags group (not ISR-safe).
+ * If the condition is already satisfied, returns immediately.
+ *
+ * @param flags Event flags handle.
+ * @param mask  Flags to wait for (must not be zero).
+ * @param mode  THREAD_EVENTFLAGS_ANY or THREAD_EVENTFLAGS_ALL,
+ *              optionally ORed with THREAD_EVENTFLAGS_CLEAR.
+ * @param value Pointer to receive the flags that satisfied the
+ *              wait, before clearing (optional, can be NULL).
+ *
+ * @return TD_SUCCESS, TD_INVALID_VALUE (zero mask) or TD_INVALID_EVENTFLAGS.
+ *         In case of error the value of value is undefined.
+ */
+Thread_Error_t Thread_EventFlagsWait(Thread_EventFlags_t flags, uint32_t mask, uint8_t mode, uint32_t *value);
+
+/**
+ * Waits for flags in an event flags group, with a timeout (not ISR-safe).
+ * Same as Thread_EventFlagsWait, but gives up after the timeout expires.
+ *
+ * @param flags   Event flags handle.
+ * @param mask    Flags to wait for (must not be zero).
+ * @param mode    THREAD_EVENTFLAGS_ANY or THREAD_EVENTFLAGS_ALL,
+ *                optionally ORed with THREAD_EVENTFLAGS_CLEAR.
+ * @param value   Pointer to receive the flags that satisfied the
+ *                wait, before clearing (optional, can be NULL).
+ * @param timeout Timeout, in milliseconds. If zero, fails
+ *                immediately when the condition is not satisfied.
+ *
+ * @return TD_SUCCESS, TD_INVALID_VALUE (zero mask), TD_INVALID_EVENTFLAGS
+ *         or TD_TIMEOUT. In case of error the value of value is undefined.
+ */
+Thread_Error_t Thread_EventFlagsWaitTimeout(Thread_EventFlags_t flags, uint32_t mask, uint8_t mode, uint32_t *value, uint32_t timeout);
+
+/**
+ * Creates a message queue.
+ * Messages have a fixed size and are stored in a caller-provided
+ * ring buffer of msgSize * msgCount bytes, located in RAM. The
+ * buffer must not be touched until the queue is destroyed. Slot
+ * N starts at buffer + N * msgSize: to get aligned slots, use an
+ * aligned buffer and a msgSize multiple of the alignment.
+ *
+ * @param queue    Pointer to receive message queue handle.
+ * @param buffer   Message buffer.
+ * @param msgSize  Size of a message, in bytes (must not be zero).
+ * @param msgCount Number of message slots (must not be zero).
+ *
+ * @return TD_SUCCESS, TD_INVALID_VALUE (bad size or buffer) or TD_NO_MEMORY.
+ *         In case of error the value of queue is undefined.
+ */
+Thread_Error_t Thread_MsgQueueCreate(Thread_MsgQueue_t *queue, void *buffer, uint16_t msgSize, uint16_t msgCount);
+
+/**
+ * Initializes a message queue with a control block in caller-provided
+ * storage, without allocating memory. The storage must be located in
+ * RAM and must not be touched until the queue is destroyed.
+ * See Thread_MsgQueueCreate for the buffer requirements.
+ *
+ * @param queue    Pointer to receive message queue handle.
+ * @param storage  Message queue storage.
+ * @param buffer   Message buffer.
+ * @param msgSize  Size of a message, in bytes (must not be zero).
+ * @param msgCount Number of message slots (must not be zero).
+ *
+ * @return TD_SUCCESS or TD_INVALID_VALUE (bad size, buffer or storage).
+ *         In case of error the value of queue is undefined.
+ */
+Thread_Error_t Thread_MsgQueueInitStatic(Thread_MsgQueue_t *queue, Thread_MsgQueueStatic_t *storage,
+	void *buffer, uint16_t msgSize, uint16_t msgCount);
+
+/**
+ * Destroys a message queue. The buffer is not freed.
+ * Threads waiting on the queue are woken up, and their wait
+ * returns TD_INVALID_MSGQUEUE. A receive that got a message copies
+ * it out after its wait: the queue must not be destroyed meanwhile.
+ * Static queues are destroyed without freeing their storage.
+ *
+ * @param queue Message queue handle.
+ *
+ * @return TD_SUCCESS or TD_INVALID_MSGQUEUE.
+ */
+Thread_Error_t Thread_MsgQueueDestroy(Thread_MsgQueue_t queue);
+
+/**
+ * Posts a message to the back of a queue, copying it into
+ * the queue buffer. Never blocks.
+ * This function is ISR-safe.
+ *
+ * @param queue Message queue handle.
+ * @param msg   Message to post (msgSize bytes).
+ *
+ * @return TD_SUCCESS, TD_INVALID_MSGQUEUE or TD_TRY_FAIL (queue full).
+ */
+Thread_Error_t Thread_MsgQueuePost(Thread_MsgQueue_t queue, const void *msg);
+
+/**
+ * Reserves a slot at the back of a queue, to be filled in place
+ * and then committed with Thread_MsgQueueCommit. Never blocks.
+ * Messages are received in reservation order. A message becomes
+ * visible to receivers only once all outstanding reservations
+ * on the queue have been committed, so commit as soon as possible.
+ * This function is ISR-safe.
+ *
+ * @param queue Message queue handle.
+ * @param msg   Pointer to receive the slot address.
+ *
+ * @return TD_SUCCESS, TD_INVALID_MSGQUEUE or TD_TRY_FAIL (queue full).
+ *         In case of error the value of msg is undefined.
+ */
+Thread_Error_t Thread_MsgQueueReserve(Thread_MsgQueue_t queue, void **msg);
+
+/**
+ * Commits a slot reserved with Thread_MsgQueueReserve.
+ * This function is ISR-safe.
+ *
+ * @param queue Message queue handle.
+ *
+ * @return TD_SUCCESS, TD_INVALID_MSGQUEUE or TD_INVALID_VALUE
+ *         (no outstanding reservation).
+ */
+Thread_Error_t Thread_MsgQueueCommit(Thread_MsgQueue_t queue);
+
+/**
+ * Receives a message from the front of a queue (not ISR-safe).
+ * If the queue is empty, waits until a message is posted.
+ *
+ * @param queue Message queue handle.
+ * @param msg   Buffer to receive the message (msgSize bytes).
+ *
+ * @return TD_SUCCESS or TD_INVALID_MSGQUEUE.
+ */
+Thread_Error_t Thread_MsgQueueReceive(Thread_MsgQueue_t queue, void *msg);
+
+/**
+ * Receives a message from the front of a queue, with a timeout (not ISR-safe).
+ * Same as Thread_MsgQueueReceive, but gives up after the timeout expires.
+ *
+ * @param queue   Message queue handle.
+ * @param msg     Buffer to receive the message (msgSize bytes).
+ * @param timeout Timeout, in milliseconds. If zero, behaves
+ *                like Thread_MsgQueueTryReceive.
+ *
+ * @return TD_SUCCESS, TD_INVALID_MSGQUEUE or TD_TIMEOUT.
+ */
+Thread_Error_t Thread_MsgQueueReceiveTimeout(Thread_MsgQueue_t queue, void *msg, uint32_t timeout);
+
+/**
+ * Receives a message from the front of a queue, failing
+ * instead of waiting if the queue is empty.
+ * This function is ISR-safe.
+ *
+ * @param queue Message queue handle.
+ * @param msg   Buffer to receive the message (msgSize bytes).
+ *
+ * @return TD_SUCCESS, TD_INVALID_MSGQUEUE or TD_TRY_FAIL.
+ */
+Thread_Error_t Thread_MsgQueueTryReceive(Thread_MsgQueue_t queue, void *msg);
+
+/**
+ * Gets the number of messages ready to be received.
+ * This function is ISR-safe.
+ *
+ * @param queue Message queue handle.
+ * @param count Pointer to receive the count.
+ *
+ * @return TD_SUCCESS or TD_INVALID_MSGQUEUE. In case of
+ *         error the value of count is undefined.
+ */
+Thread_Error_t Thread_MsgQueueGetCount(Thread_MsgQueue_t queue, uint16_t *count);
+
+/**
+ * Gets the runtime statistics of a thread (not ISR-safe).
+ * The stack high-water mark is found by scanning the stack
+ * for the pattern painted when the thread was created, so
+ * this takes time proportional to the unused stack size.
+ *
+ * @param thread Thread handle.
+ * @param stats  Pointer to receive statistics.
+ *
+ * @return TD_SUCCESS or TD_INVALID_THREAD. In case of
+ *         error the value of stats is undefined.
+ */
+Thread_Error_t Thread_GetStats(Thread_t thread, Thread_Stats_t *stats);
+
+/**
+ * Enumerates all threads, including the idle thread (not ISR-safe).
+ * Threads can exit at any time after this returns, use the
+ * handles with functions that validate them.
+ *
+ * @param threads Array to receive thread handles.
+ * @param size    Size of the array, in elements.
+ *
+ * @return Total number of threads. If greater than size,
+ *         only the first size handles have been stored.
+ */
+uint32_t Thread_Enumerate(Thread_t *threads, uint32_t size);
+
+/**
+ * Sets the idle hook, which is called from the idle thread
+ * when no other thread is ready, before the CPU is put to
+ * sleep until the next interrupt.
+ * This function is ISR-safe.
+ *
+ * @param hook Idle hook, or NULL to disable it.
+ */
+void Thread_SetIdleHook(Thread_IdleHook_t hook);
+
+/**
+ * Gets the idle statistics. The CPU load is measured over
+ * windows of at least one second.
+ * This function is ISR-safe.
+ *
+ * @param stats Pointer to receive idle statistics.
+ */
+void Thread_GetIdleStats(Thread_IdleStats_t *stats);
+
+/**
+ * Gets the kernel lock statistics.
+ * This function is ISR-safe.
+ *
+ * @param stats Pointer to receive kernel lock statistics.
+ */
+void Thread_GetLockStats(Thread_LockStats_t *stats);
+
+/**
+ * Resets the kernel lock statistics.
+ * This function is ISR-safe.
+ */
+void Thread_ResetLockStats();
+
+/**
+ * Masks interrupts at the kernel priority and below, leaving
+ * higher priority interrupts enabled. This is enough to protect
+ * data shared with interrupt handlers that run at the kernel
+ * priority. Kernel locks can be nested, and are accounted in the
+ * kernel lock statistics.
+ * This function is ISR-safe, for interrupts at the kernel
+ * priority and below.
+ *
+ * @return Interrupt mask for Thread_KernelUnlock.
+ */
+uint32_t Thread_KernelLock();
+
+/**
+ * Restores the interrupt mask saved by Thread_KernelLock.
+ * This function is ISR-safe, for interrupts at the kernel
+ * priority and below.
+ *
+ * @param basepri Interrupt mask from Thread_KernelLock.
+ */
+void Thread_KernelUnlock(uint32_t basepri);
+
+/**
+ * Initializes a deferred call.
+ *
+ * @param deferred Deferred call.
+ * @param func     Function to invoke.
+ */
+void Thread_DeferredInit(Thread_Deferred_t *deferred, Thread_DeferredFunc_t func);
+
+/**
+ * Posts bits to a deferred call. The deferred function will be
+ * invoked once from the PendSV handler with all the bits posted
+ * until then. This lets interrupts with a priority higher than the
+ * kernel (which can't call thread functions) signal threads, e.g.
+ * with a deferred function that sets event flags.
+ * Posting never fails and never blocks. This function is ISR-safe,
+ * from interrupts at any priority.
+ *
+ * @param deferred Deferred call.
+ * @param bits     Bits to post. Must not be zero.
+ */
+void Thread_DeferredPost(Thread_Deferred_t *deferred, uint32_t bits);
 
 /**
  * Gets the current system uptime.
+ * The scheduler is tickless, so this is computed from
+ * the SysTick counter instead of being read from memory.
+ * This function is ISR-safe.
  * Wraps around at 49 days, 17:02:47.296.
  *
  * @return Current system uptime, in ticks.
  */
-THREAD_INLINE uint32_t Thread_GetSysTicks() {
-	extern volatile uint32_t Thread_sysTick;
-	return Thread_sysTick;
-}
+uint32_t Thread_GetSysTicks();
+
+/* Always inline, no extern version. */
+#define THREAD_INLINE __attribute__((always_inline)) static inline
 
 /**
- * Saves and disables interrupts.
+ * Saves and disables interrupts, at all priorities.
+ * To keep high priority interrupts enabled see Thread_KernelLock.
+ * Unlike kernel locks, this isn't accounted in the kernel lock
+ * statistics.
  *
  * @return Interrupt mask for Thread_IrqRestore.
  */
@@ -33,10 +33,50 @@ extern "C" {
  * Callbacks will be invoked from an interrupt handler,
  * so they should be as fast as possible. You'll typically
  * want to just set a flag and return, and then act on that
- * flag from you main application loop.
+ * flag from you main application loop. Slower callbacks can
+ * run in thread context instead (see Timer_CreateTimerEx).
  */
 typedef void (*Timer_Callback_t)(uint32_t);
 
+/**
+ * Software timer flag: the timer is periodic.
+ */
+#define TIMER_SOFT_PERIODIC (1 << 0)
+/**
+ * Software timer flag: the callback runs in thread context
+ * (see WorkQueue.h). Expirations are dropped if the work
+ * queue is full.
+ */
+#define TIMER_SOFT_INTHREAD (1 << 1)
+
+/**
+ * Minimum software timer timeout, in microseconds.
+ * Shorter timeouts are rounded up to this.
+ */
+#define TIMER_SOFT_MIN_TIMEOUT 50
+
+/**
+ * Software timer. Any number of software timers share a single
+ * hardware timer slot. Initialize with Timer_SoftInit().
+ * All fields are private.
+ */
+typedef struct Timer_Soft {
+	/**< Timeout callback function. */
+	Timer_Callback_t callback;
+	/**< Argument to pass to the callback function. */
+	uint32_t callbackData;
+	/**< Expiration time, in microseconds. */
+	uint32_t expiry;
+	/**< Period, in microseconds. */
+	uint32_t period;
+	/**< Next timer in the active list. */
+	struct Timer_Soft *next;
+	/**< Timer flags (TIMER_SOFT_*). */
+	uint8_t flags;
+	/**< True if the timer is running. */
+	volatile uint8_t isActive;
+} Timer_Soft_t;
+
 /**
  * Creates and starts a timer with a specified frequency.
  * There are three timer slots available to users.
@@ -56,6 +96,25 @@ typedef void (*Timer_Callback_t)(uint32_t);
  */
 int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData);
 
+/**
+ * Creates and starts a timer with a specified frequency, optionally
+ * running its callback in thread context (not ISR-safe).
+ * Same as Timer_CreateTimer, but if inThread is true the callback runs
+ * on the work queue thread (see WorkQueue.h) instead of in the interrupt
+ * handler. Ticks are dropped if the work queue is full.
+ *
+ * @param freq         Timer frequency, in Hz.
+ * @param isPeriodic   True if the timer is periodic, false if one-shot.
+ * @param callback     Timeout callback function.
+ * @param callbackData Optional argument to pass to the callback function.
+ * @param inThread     True to run the callback in thread context.
+ *
+ * @return A positive index for the newly created timer, or a negative
+ *         value if there are no timer slots available, if callback is NULL
+ *         or if the work queue couldn't be started.
+ */
+int8_t Timer_CreateTimerEx(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData, uint8_t inThread);
+
 /**
  * Creates and starts a timer with a specified period.
  * There are three timer slots available to users.
@@ -72,6 +131,23 @@ int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t cal
  */
 int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData);
 
+/**
+ * Creates and starts a timer with a specified period, optionally
+ * running its callback in thread context (not ISR-safe).
+ * Same as Timer_CreateTimeout, with inThread as in Timer_CreateTimerEx.
+ *
+ * @param timeout      Timer period, in milliseconds.
+ * @param isPeriodic   True if the timer is periodic, false if one-shot.
+ * @param callback     Timeout callback function.
+ * @param callbackData Optional argument to pass to the callback function.
+ * @param inThread     True to run the callback in thread context.
+ *
+ * @return A positive index for the newly created timer, or a negative
+ *         value if there are no timer slots available, if callback is NULL
+ *         or if the work queue couldn't be started.
+ */
+int8_t Timer_CreateTimeoutEx(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData, uint8_t inThread);
+
 /**
  * Stops and deletes a timer.
  *
@@ -79,6 +155,67 @@ int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_
  */
 void Timer_DeleteTimer(int8_t index);
 
+/**
+ * Sets the interrupt priority of a timer (NVIC priority, 0 is the
+ * highest). Timers are created at THREAD_KERNEL_PRIORITY. A timer
+ * with a higher priority is never delayed by the thread library,
+ * but its callback must not call any thread function other than
+ * Thread_DeferredPost(), and it can't run in thread context.
+ *
+ * @param index    Timer index.
+ * @param priority Interrupt priority.
+ */
+void Timer_SetPriority(int8_t index, uint8_t priority);
+
+/**
+ * Initializes a software timer (not ISR-safe). The timer is stopped.
+ * The first call takes a hardware timer slot for the software timer
+ * service, which runs at THREAD_KERNEL_PRIORITY. Unless created with
+ * TIMER_SOFT_INTHREAD, callbacks are invoked from its interrupt
+ * handler, like hardware timer callbacks.
+ *
+ * @param timer        Software timer.
+ * @param callback     Timeout callback function.
+ * @param callbackData Optional argument to pass to the callback function.
+ * @param flags        Timer flags (TIMER_SOFT_*), or 0.
+ *
+ * @return True on success, false if callback is NULL, if there are no
+ *         timer slots available or if the work queue couldn't be started.
+ */
+uint8_t Timer_SoftInit(Timer_Soft_t *timer, Timer_Callback_t callback, uint32_t callbackData, uint8_t flags);
+
+/**
+ * Starts or restarts a software timer. If the timer is running, its
+ * current countdown is discarded. Periodic timers expire every timeout
+ * microseconds from now on, without accumulating drift. Expirations
+ * missed because the system was busy are skipped.
+ * This function is ISR-safe.
+ *
+ * @param timer   Software timer.
+ * @param timeout Timeout (period for periodic timers), in microseconds.
+ *                Must be less than 2^31.
+ */
+void Timer_SoftStart(Timer_Soft_t *timer, uint32_t timeout);
+
+/**
+ * Stops a software timer. A callback already deferred to thread
+ * context may still run. This function is ISR-safe.
+ *
+ * @param timer Software timer.
+ */
+void Timer_SoftStop(Timer_Soft_t *timer);
+
+/**
+ * Checks whether a software timer is running.
+ * One-shot timers stop when they expire.
+ * This function is ISR-safe.
+ *
+ * @param timer Software timer.
+ *
+ * @return True if the timer is running, false otherwise.
+ */
+uint8_t Timer_SoftIsActive(Timer_Soft_t *timer);
+
 /**
  * Delays for the specified time (not ISR-safe).
  * Do not call from interrupt/callback context.
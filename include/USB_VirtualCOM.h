@@ -78,7 +78,9 @@ uint16_t USB_VirtualCOM_GetAvailableSize();
 /**
  * Reads received data from the USB virtual COM port.
  * If the asked read size exceeds the available data size,
- * it will be reduced.
+ * it will be reduced. Reads never mask interrupts. Threads
+ * are serialized, but reading from the RX callback must not
+ * race with reads from threads.
  *
  * @param buf  Destination buffer.
  * @param size Number of bytes to read.
@@ -0,0 +1,93 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#ifndef EVICSDK_WORKQUEUE_H
+#define EVICSDK_WORKQUEUE_H
+
+#include <stdint.h>
+#include <Thread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum number of pending work items.
+ */
+#define WORKQUEUE_SIZE 16
+
+/**
+ * Worker thread priority. Work items preempt all
+ * application threads with a lower priority.
+ */
+#define WORKQUEUE_PRIORITY THREAD_PRIORITY_MAX
+
+/**
+ * Worker thread stack size, in bytes.
+ */
+#define WORKQUEUE_STACKSIZE THREAD_DEFAULT_STACKSIZE
+
+/**
+ * Function pointer type for work items.
+ * Work items run in thread context on the worker thread, one
+ * at a time and in posting order, so they can block and call
+ * non ISR-safe functions. Long items delay the ones after them.
+ *
+ * @param context User-defined pointer.
+ * @param arg     User-defined argument.
+ */
+typedef void (*WorkQueue_Func_t)(void *context, uint32_t arg);
+
+/**
+ * Starts the worker thread, if it isn't running yet (not ISR-safe).
+ * This is done automatically when a callback is set up to run in
+ * thread context. The thread and queue are allocated on the heap.
+ *
+ * @return True if the worker is running, false if it couldn't be
+ *         started (out of memory).
+ */
+uint8_t WorkQueue_Start();
+
+/**
+ * Posts a work item to be run on the worker thread.
+ * This is mostly useful from interrupt handlers, to defer work
+ * that is too slow to do at interrupt level.
+ *
+ * @param func    Work item function.
+ * @param context User-defined pointer passed to func.
+ * @param arg     User-defined argument passed to func.
+ *
+ * @return True if the item was posted, false if the queue is
+ *         full or the worker hasn't been started.
+ */
+uint8_t WorkQueue_Post(WorkQueue_Func_t func, void *context, uint32_t arg);
+
+/**
+ * Gets the number of work items that couldn't be posted
+ * because the queue was full or the worker wasn't running.
+ *
+ * @return Number of dropped work items.
+ */
+uint32_t WorkQueue_GetDropCount();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,13 @@
  * Interrupts 0-3 are assigned in that order.
  */
 
+/**
+ * ADC interrupt priority. ADC handlers don't call into the
+ * thread library, so they run above the kernel priority and
+ * the atomizer feedback loop always sees fresh conversions.
+ */
+#define ADC_IRQ_PRIORITY 1
+
 /**
  * ADC sample module numbers for interrupts 0-3.
  * In Nuvoton SDK those are 32 bit ints, but 8 bits
@@ -161,6 +168,7 @@ void ADC_Init() {
 	for(i = 0; i < 4; i++) {
 		EADC_ENABLE_INT(EADC, 1 << i);
 		EADC_ENABLE_SAMPLE_MODULE_INT(EADC, i, 1 << ADC_moduleNum[i]);
+		NVIC_SetPriority(irqNum[i], ADC_IRQ_PRIORITY);
 		NVIC_EnableIRQ(irqNum[i]);
 	}
 }
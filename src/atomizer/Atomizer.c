@@ -26,6 +26,7 @@
 #include <SysInfo.h>
 #include <Battery.h>
 #include <Thread.h>
+#include <WorkQueue.h>
 #include <Device.h>
 
 /**
@@ -47,13 +48,46 @@
 /* Feedback loop frequency (Hz) */
 #define ATOMIZER_LOOP_FREQ 10000
 
-/* Warmup timer: 10 feedback iterations */
-#define ATOMIZER_TMRCNT_WARMUP  10
+/* Feedback loop interrupt priority, above the kernel (see THREAD_KERNEL_PRIORITY).
+ * The loop signals threads through Atomizer_deferred. */
+#define ATOMIZER_IRQ_PRIORITY 2
+
+/* Warmup ends once the output has stayed within ATOMIZER_WARMUP_BAND of the
+ * target for ATOMIZER_TMRCNT_WARMUP feedback iterations, or after
+ * ATOMIZER_TMRCNT_WARMUP_MAX iterations if it never settles */
+#define ATOMIZER_TMRCNT_WARMUP     3
+#define ATOMIZER_TMRCNT_WARMUP_MAX 100
 /* Refresh timer: 200ms */
 #define ATOMIZER_TMRCNT_REFRESH (200 * ATOMIZER_LOOP_FREQ / 1000)
 
-/* Median filter window size (must be odd) */
-#define ATOMIZER_MEDIANFILTER_WINDOW 5
+/* Feedback controller output range. Buck CMR 0-959 maps to 0-959,
+ * boost CMR 959-160 maps to 960-1759. Output increases with voltage. */
+#define ATOMIZER_CTRL_BOOST     960
+#define ATOMIZER_CTRL_MAX       1759
+/* Controller output fractional bits */
+#define ATOMIZER_CTRL_SHIFT     8
+/* Bound on the controller correction before gain scheduling (Q8, 10mV units).
+ * Keeps the scheduling products within 32 bits. */
+#define ATOMIZER_CTRL_STEP_MAX  (1L << 21)
+
+/* Bound on the feed-forward source resistance, in 1/16 mOhm */
+#define ATOMIZER_FF_RES_MAX  (200 * 16)
+/* Buck duty cycles below this are too coarse to learn the gain from */
+#define ATOMIZER_FF_CMR_MIN  100
+/* Bound on the feedback iterations the feed-forward output is held for */
+#define ATOMIZER_FF_HOLD_MAX 10
+
+/* Temperature controller gains: proportional in mW/°C,
+ * integral in mW/°C per iteration with 8 fractional bits */
+#define ATOMIZER_TC_KP 2000
+#define ATOMIZER_TC_KI 512
+
+/* Compare-and-swap for sorting networks, so that a <= b.
+ * Compiles to compare and conditional moves, without branches. */
+#define ATOMIZER_SORT2(a, b) do { \
+	uint16_t _min = (a) < (b) ? (a) : (b); \
+	(b) = (a) < (b) ? (b) : (a); \
+	(a) = _min; } while(0)
 
 /* Macros to convert ADC readings to absolute values */
 // Read voltage is x * ADC_VREF / ADC_DENOMINATOR.
@@ -104,12 +138,17 @@
 #define ATOMIZER_PREDICT_WEAKBATT(targetVolts, res, battVolts) ((battVolts) < 3100 || \
 	((res) != 0 && (battVolts) - (targetVolts) * 100L / (res) < 2800))
 
+// Tolerance band around the target voltage for warmup, in 10mV units:
+// 2% of the target, but at least 20mV.
+#define ATOMIZER_WARMUP_BAND(targetVolts) ((targetVolts) < 100 ? 2 : (targetVolts) / 50)
+
 // Timer flags
 #define ATOMIZER_TMRFLAG_WARMUP (1 << 0)
 #define ATOMIZER_TMRFLAG_REFRESH (1 << 1)
 #define ATOMIZER_TIMER_WARMUP_RESET() do { \
 	uint32_t primask = Thread_IrqDisable(); \
-	Atomizer_timerCountWarmup = ATOMIZER_TMRCNT_WARMUP + 1; \
+	Atomizer_timerCountWarmup = ATOMIZER_TMRCNT_WARMUP_MAX; \
+	Atomizer_timerCountSettle = 0; \
 	Atomizer_timerFlag &= ~ATOMIZER_TMRFLAG_WARMUP; \
 	Thread_IrqRestore(primask); } while(0)
 #define ATOMIZER_TIMER_REFRESH_RESET() do { \
@@ -118,8 +157,23 @@
 	Atomizer_timerFlag &= ~ATOMIZER_TMRFLAG_REFRESH; \
 	Thread_IrqRestore(primask); } while(0)
 
-// Busy wait for warmup or error
-#define ATOMIZER_WAIT_WARMUP() do {} while(!(Atomizer_timerFlag & ATOMIZER_TMRFLAG_WARMUP) && Atomizer_error == OK)
+// Event flags, set by the feedback loop
+#define ATOMIZER_EVENT_WARMUP (1 << 0)
+#define ATOMIZER_EVENT_SAMPLE (1 << 1)
+
+// Deferred call bit: invoke the error callback (see Atomizer_DeferredNotify)
+#define ATOMIZER_DEFER_ERROR (1UL << 31)
+
+// Waits for an event, re-checking cond on every wakeup
+#define ATOMIZER_WAIT_EVENT(event, cond) do { \
+	while(cond) { \
+		Thread_EventFlagsWait(Atomizer_events, (event), \
+			THREAD_EVENTFLAGS_ANY | THREAD_EVENTFLAGS_CLEAR, NULL); \
+	} } while(0)
+
+// Wait for warmup or error
+#define ATOMIZER_WAIT_WARMUP() ATOMIZER_WAIT_EVENT(ATOMIZER_EVENT_WARMUP, \
+	!(Atomizer_timerFlag & ATOMIZER_TMRFLAG_WARMUP) && Atomizer_error == OK)
 
 // Updates the ADC cache, blocking if block is true
 #define ATOMIZER_ADC_UPDATECACHE(block) do { \
@@ -177,14 +231,22 @@ typedef struct {
  */
 typedef struct {
 	/**
-	 * Sample buffer.
+	 * Sample buffer, in arrival order.
 	 */
-	uint16_t buf[ATOMIZER_MEDIANFILTER_WINDOW];
+	uint16_t buf[ATOMIZER_FILTER_WINDOW_MAX];
+	/**
+	 * Samples in ascending order. Only kept for
+	 * windows larger than 5.
+	 */
+	uint16_t sorted[ATOMIZER_FILTER_WINDOW_MAX];
 	/**
 	 * Index of the oldest sample in the buffer.
 	 */
 	uint8_t idx;
-
+	/**
+	 * Window size (odd).
+	 */
+	uint8_t window;
 } Atomizer_MedianFilterCtx_t;
 
 /**
@@ -197,6 +259,92 @@ static volatile uint16_t Atomizer_targetVolts;
  */
 static volatile uint16_t Atomizer_curCmr;
 
+/**
+ * Target power, in mW. Zero for constant voltage mode.
+ */
+static volatile uint32_t Atomizer_targetPower;
+
+/**
+ * Target coil temperature, in °C. Zero if not in temperature
+ * control mode. In temperature control mode Atomizer_targetPower
+ * is the power ceiling.
+ */
+static volatile uint16_t Atomizer_targetTemp;
+
+/**
+ * Test voltage for measurements, in 10mV units. When not zero
+ * it overrides the target voltage, power and temperature.
+ */
+static volatile uint16_t Atomizer_testVolts;
+
+/**
+ * Latest filtered resistance from the feedback loop, in mOhm.
+ * Used to regulate power and temperature.
+ */
+static volatile uint16_t Atomizer_curRes;
+
+/**
+ * Resistance-temperature table for temperature control.
+ */
+static const uint16_t * volatile Atomizer_tcrTable;
+
+/**
+ * Base resistance (mOhm) and its ratio to the resistance at 0°C (Q12),
+ * taken when temperature control is set up or the atomizer is fired.
+ */
+static volatile uint16_t Atomizer_tcBaseRes;
+static volatile uint16_t Atomizer_tcBaseRatio;
+
+/**
+ * Temperature controller integral term, in mW with 8 fractional bits.
+ */
+static volatile int32_t Atomizer_tcIntegral;
+
+/**
+ * Temperature controller output power, in mW.
+ */
+static volatile uint32_t Atomizer_tcPower;
+
+/**
+ * Feedback controller output, with ATOMIZER_CTRL_SHIFT fractional bits
+ * (see ATOMIZER_CTRL_BOOST).
+ */
+static volatile int32_t Atomizer_ctrlOut;
+
+/**
+ * Feedback controller errors for the last two iterations, in 10mV units.
+ */
+static volatile int16_t Atomizer_ctrlError[2];
+
+/**
+ * Feed-forward source resistance, in 1/16 mOhm. Models the drop from the
+ * ideal converter output (battery sag and converter losses) as a resistor
+ * in series with the atomizer, so that the converter gain it gives follows
+ * the load. It starts from an ideal converter, which can only underestimate
+ * the duty cycle, and is learned while the output is within the warmup band.
+ */
+static volatile uint16_t Atomizer_ffRes;
+
+/**
+ * Battery voltage before power on, in 10mV units. The source resistance
+ * is learned against it, so that it accounts for the battery sag.
+ */
+static volatile uint16_t Atomizer_ffBattVolts;
+
+/**
+ * Feedback iterations left to hold the feed-forward output for after
+ * power on, and the output voltage measured in the last one (10mV units).
+ */
+static volatile uint8_t Atomizer_ffHold;
+static volatile uint16_t Atomizer_ffLastVolts;
+
+/**
+ * Feedback controller gains (Q8).
+ */
+static volatile uint16_t Atomizer_ctrlKp = ATOMIZER_FEEDBACK_KP;
+static volatile uint16_t Atomizer_ctrlKi = ATOMIZER_FEEDBACK_KI;
+static volatile uint16_t Atomizer_ctrlKd = ATOMIZER_FEEDBACK_KD;
+
 /**
  * Current converters state.
  */
@@ -254,6 +402,13 @@ static volatile uint16_t Atomizer_tempTargetVolts;
  */
 static volatile uint8_t Atomizer_timerCountWarmup;
 
+/**
+ * Warmup settle counter: consecutive feedback iterations with the output
+ * within ATOMIZER_WARMUP_BAND. Sets ATOMIZER_TMRFLAG_WARMUP when it
+ * reaches ATOMIZER_TMRCNT_WARMUP.
+ */
+static volatile uint8_t Atomizer_timerCountSettle;
+
 /**
  * Refresh timer counter. One tick per feedback iteration.
  * Counts down to zero and sets ATOMIZER_TMRFLAG_REFRESH.
@@ -287,6 +442,11 @@ static volatile uint8_t Atomizer_isLocked;
  */
 static volatile Atomizer_ErrorCallback_t Atomizer_errorCallbackPtr;
 
+/**
+ * True if the error callback runs in thread context.
+ */
+static volatile uint8_t Atomizer_errorCallbackInThread;
+
 /**
  * Overcurrent threshold (ADC value).
  */
@@ -297,18 +457,61 @@ static uint16_t Atomizer_adcOverCurrent;
  */
 static Thread_Mutex_t Atomizer_mutex;
 
+/**
+ * Atomizer event flags (ATOMIZER_EVENT_*), and their storage.
+ * Set on warmup, accumulation completion and errors.
+ */
+static Thread_EventFlags_t Atomizer_events;
+static Thread_EventFlagsStatic_t Atomizer_eventsStorage;
+
+/**
+ * Deferred call used by the feedback loop to set event flags
+ * (ATOMIZER_EVENT_*) and invoke the error callback
+ * (ATOMIZER_DEFER_ERROR) at the kernel priority.
+ */
+static Thread_Deferred_t Atomizer_deferred;
+
+/**
+ * Latest error to pass to the error callback.
+ */
+static volatile Atomizer_Error_t Atomizer_deferredError;
+
 /**
  * ADC data.
  */
 static volatile Atomizer_ADCAccumulator_t Atomizer_adcAcc;
 
 /**
- * Median filter contexts.
+ * Median filter contexts, indexed by Atomizer_Filter_t.
  */
 static Atomizer_MedianFilterCtx_t Atomizer_medianFilterCtx[3];
-#define ATOMIZER_MEDIANFILTER_VOLTAGE    Atomizer_medianFilterCtx[0]
-#define ATOMIZER_MEDIANFILTER_CURRENT    Atomizer_medianFilterCtx[1]
-#define ATOMIZER_MEDIANFILTER_RESISTANCE Atomizer_medianFilterCtx[2]
+#define ATOMIZER_MEDIANFILTER_VOLTAGE    Atomizer_medianFilterCtx[ATOMIZER_FILTER_VOLTAGE]
+#define ATOMIZER_MEDIANFILTER_CURRENT    Atomizer_medianFilterCtx[ATOMIZER_FILTER_CURRENT]
+#define ATOMIZER_MEDIANFILTER_RESISTANCE Atomizer_medianFilterCtx[ATOMIZER_FILTER_RESISTANCE]
+
+/**
+ * Resistance-temperature tables for the built-in materials, indexed
+ * by Atomizer_Material_t. Entry i is R(20 * i °C) / R(0 °C) in Q12.
+ * Ni200 follows DIN 43760, titanium (grade 1) and SS316L are linear
+ * with a TCR of 0.0035 and 0.00088.
+ */
+static const uint16_t Atomizer_tcrTables[3][ATOMIZER_TCR_TABLE_LEN] = {
+	{4096, 4556, 5039, 5544, 6072, 6626, 7208, 7819, 8462,
+	 9140, 9857, 10617, 11422, 12278, 13189, 14158, 15191},
+	{4096, 4383, 4669, 4956, 5243, 5530, 5816, 6103, 6390,
+	 6676, 6963, 7250, 7537, 7823, 8110, 8397, 8684},
+	{4096, 4168, 4240, 4312, 4384, 4456, 4529, 4601, 4673,
+	 4745, 4817, 4889, 4961, 5033, 5105, 5177, 5249}
+};
+
+/**
+ * Resistance-temperature table for ATOMIZER_MATERIAL_CUSTOM.
+ * Defaults to a linear TCR of 0.0032 (NiFe30).
+ */
+static uint16_t Atomizer_tcrCustomTable[ATOMIZER_TCR_TABLE_LEN] = {
+	4096, 4358, 4620, 4882, 5145, 5407, 5669, 5931, 6193,
+	6455, 6717, 6980, 7242, 7504, 7766, 8028, 8290
+};
 
 /**
  * Thermistor resistance to board temperature lookup table.
@@ -323,6 +526,10 @@ static const uint16_t Atomizer_boardTempTable[21] = {
 
 /**
  * Performs median filtering.
+ * Windows of 3 and 5 samples use a sorting network on the sample
+ * buffer. Larger windows keep the samples sorted and move the new
+ * sample into the slot of the oldest one, which only shifts the
+ * samples in between.
  * Can be casted to ADC_Filter_t.
  *
  * @param value  New sample.
@@ -331,30 +538,80 @@ static const uint16_t Atomizer_boardTempTable[21] = {
  * @return New filtered sample.
  */
 static uint16_t Atomizer_MedianFilter(uint16_t value, Atomizer_MedianFilterCtx_t *ctx) {
-	uint8_t i, j, minIdx;
-	uint16_t sortBuf[ATOMIZER_MEDIANFILTER_WINDOW], min;
+	uint16_t a, b, c, d, e, old, *sorted;
+	uint8_t i, window;
+
+	window = ctx->window;
 
 	// Replace oldest sample with the new one
+	old = ctx->buf[ctx->idx];
 	ctx->buf[ctx->idx] = value;
-	ctx->idx = (ctx->idx + 1) % ATOMIZER_MEDIANFILTER_WINDOW;
-
-	// Selection sort. We only need to sort the first half.
-	memcpy(sortBuf, ctx->buf, sizeof(sortBuf));
-	for(i = 0; i < (ATOMIZER_MEDIANFILTER_WINDOW + 1) / 2; i++) {
-		minIdx = i;
-		for(j = i + 1; j < ATOMIZER_MEDIANFILTER_WINDOW; j++) {
-			if(sortBuf[j] < sortBuf[minIdx]) {
-				minIdx = j;
-			}
+	ctx->idx = ctx->idx + 1 == window ? 0 : ctx->idx + 1;
+
+	switch(window) {
+		case 1:
+			return value;
+		case 3:
+			a = ctx->buf[0];
+			b = ctx->buf[1];
+			c = ctx->buf[2];
+			ATOMIZER_SORT2(a, b);
+			ATOMIZER_SORT2(b, c);
+			ATOMIZER_SORT2(a, b);
+			return b;
+		case 5:
+			// 7 compare-and-swaps, enough to place the median
+			a = ctx->buf[0];
+			b = ctx->buf[1];
+			c = ctx->buf[2];
+			d = ctx->buf[3];
+			e = ctx->buf[4];
+			ATOMIZER_SORT2(a, b);
+			ATOMIZER_SORT2(d, e);
+			ATOMIZER_SORT2(a, d);
+			ATOMIZER_SORT2(b, e);
+			ATOMIZER_SORT2(b, c);
+			ATOMIZER_SORT2(c, d);
+			ATOMIZER_SORT2(b, c);
+			return c;
+	}
+
+	// Find the oldest sample, then shift samples towards
+	// its slot until the new one fits in order. The search
+	// is bounded: if the sorted copy doesn't hold the oldest
+	// sample, the last slot is replaced instead.
+	sorted = ctx->sorted;
+	for(i = 0; i < window - 1 && sorted[i] != old; i++);
+	if(value > old) {
+		for(; i < window - 1 && sorted[i + 1] < value; i++) {
+			sorted[i] = sorted[i + 1];
 		}
-		if(i != minIdx) {
-			min = sortBuf[minIdx];
-			sortBuf[minIdx] = sortBuf[i];
-			sortBuf[i] = min;
+	}
+	else {
+		for(; i > 0 && sorted[i - 1] > value; i--) {
+			sorted[i] = sorted[i - 1];
 		}
 	}
+	sorted[i] = value;
+
+	return sorted[window / 2];
+}
+
+/**
+ * Resets a median filter, filling its window with a value.
+ * This is an internal function.
+ *
+ * @param ctx  Filter context.
+ * @param seed Initial value.
+ */
+static void Atomizer_MedianFilterReset(Atomizer_MedianFilterCtx_t *ctx, uint16_t seed) {
+	uint8_t i;
 
-	return sortBuf[ATOMIZER_MEDIANFILTER_WINDOW / 2];
+	for(i = 0; i < ctx->window; i++) {
+		ctx->buf[i] = seed;
+		ctx->sorted[i] = seed;
+	}
+	ctx->idx = 0;
 }
 
 /**
@@ -427,6 +684,276 @@ static void Atomizer_ConfigureConverters(uint8_t enableBuck, uint8_t enableBoost
 	}
 }
 
+/**
+ * Calculates an integer square root.
+ * This is an internal function.
+ *
+ * @param x Radicand.
+ *
+ * @return Square root of x, rounded down.
+ */
+static uint16_t Atomizer_Sqrt(uint32_t x) {
+	uint32_t root, bit;
+
+	// Bitwise method: one result bit per iteration
+	root = 0;
+	for(bit = 1UL << 30; bit != 0; bit >>= 2) {
+		if(x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else {
+			root >>= 1;
+		}
+	}
+
+	return root;
+}
+
+/**
+ * Gets the voltage the feedback loop should regulate to.
+ * In constant power and temperature control modes this is
+ * sqrt(P * R), limited to the output voltage range.
+ * This is an internal function.
+ *
+ * @param res Atomizer resistance, in mOhm.
+ *
+ * @return Target voltage, in 10mV units.
+ */
+static uint16_t Atomizer_GetTargetVolts(uint16_t res) {
+	uint32_t power;
+	uint16_t volts;
+
+	if(Atomizer_testVolts != 0) {
+		return Atomizer_testVolts;
+	}
+
+	power = Atomizer_targetTemp != 0 ? Atomizer_tcPower : Atomizer_targetPower;
+	if(power == 0) {
+		return Atomizer_targetVolts;
+	}
+
+	// mW * mOhm = mV^2, divide by 100 for (10mV)^2
+	volts = Atomizer_Sqrt(power * res / 100);
+	if(volts < ATOMIZER_VOLTAGE_MIN / 10) {
+		volts = ATOMIZER_VOLTAGE_MIN / 10;
+	}
+	else if(volts > ATOMIZER_VOLTAGE_MAX / 10) {
+		volts = ATOMIZER_VOLTAGE_MAX / 10;
+	}
+
+	return volts;
+}
+
+/**
+ * Looks up the resistance ratio for a temperature, interpolating
+ * linearly between table entries.
+ * This is an internal function.
+ *
+ * @param table Resistance-temperature table.
+ * @param temp  Temperature, in °C.
+ *
+ * @return R(temp) / R(0 °C), in Q12.
+ */
+static uint16_t Atomizer_TcrRatio(const uint16_t *table, uint16_t temp) {
+	uint8_t i;
+
+	i = temp / 20;
+	if(i >= ATOMIZER_TCR_TABLE_LEN - 1) {
+		return table[ATOMIZER_TCR_TABLE_LEN - 1];
+	}
+
+	return table[i] + (table[i + 1] - table[i]) * (temp % 20) / 20;
+}
+
+/**
+ * Looks up the temperature for a resistance ratio, interpolating
+ * linearly between table entries.
+ * This is an internal function.
+ *
+ * @param table Resistance-temperature table.
+ * @param ratio R / R(0 °C), in Q12.
+ *
+ * @return Temperature, in °C, clamped to the table range.
+ */
+static uint16_t Atomizer_TcrTemp(const uint16_t *table, uint16_t ratio) {
+	uint8_t i;
+
+	// Handle corner cases
+	if(ratio <= table[0]) {
+		return 0;
+	}
+	else if(ratio >= table[ATOMIZER_TCR_TABLE_LEN - 1]) {
+		return 20 * (ATOMIZER_TCR_TABLE_LEN - 1);
+	}
+
+	// Look up higher ratio bound
+	for(i = 1; i < ATOMIZER_TCR_TABLE_LEN - 1 && ratio >= table[i]; i++);
+
+	// Interpolate
+	return 20 * (i - 1) + 20 * (ratio - table[i - 1]) / (table[i] - table[i - 1]);
+}
+
+/**
+ * Takes the base resistance and temperature as the reference
+ * for temperature control.
+ * This is an internal function.
+ */
+static void Atomizer_TcSetBase() {
+	const uint16_t *table;
+
+	table = Atomizer_tcrTable;
+	if(table != NULL) {
+		Atomizer_tcBaseRatio = Atomizer_TcrRatio(table, Atomizer_baseTemp);
+		Atomizer_tcBaseRes = Atomizer_baseRes;
+	}
+}
+
+/**
+ * Runs one iteration of the temperature controller, updating
+ * Atomizer_tcPower. This is a PI controller from coil temperature
+ * to output power, limited to ATOMIZER_POWER_MIN and the power ceiling.
+ * The integral term stops integrating while the output is limited.
+ * Without a base resistance the coil temperature is unknown, so the
+ * output is kept at ATOMIZER_POWER_MIN.
+ * This is an internal function.
+ *
+ * @param res Filtered atomizer resistance, in mOhm.
+ */
+static void Atomizer_UpdateTempController(uint16_t res) {
+	int32_t error, power, integral, ceiling;
+	uint32_t ratio;
+
+	if(Atomizer_tcBaseRes == 0) {
+		Atomizer_tcPower = ATOMIZER_POWER_MIN;
+		return;
+	}
+
+	// R / R(0 °C) = (R / Rbase) * (Rbase / R(0 °C))
+	ratio = (uint32_t) res * Atomizer_tcBaseRatio / Atomizer_tcBaseRes;
+	if(ratio > 0xFFFF) {
+		ratio = 0xFFFF;
+	}
+	error = (int32_t) Atomizer_targetTemp - Atomizer_TcrTemp(Atomizer_tcrTable, ratio);
+
+	ceiling = Atomizer_targetPower;
+	integral = Atomizer_tcIntegral + ATOMIZER_TC_KI * error;
+	power = ATOMIZER_TC_KP * error + (integral >> 8);
+	if(power > ceiling) {
+		power = ceiling;
+		if(error > 0) {
+			integral = Atomizer_tcIntegral;
+		}
+	}
+	else if(power < ATOMIZER_POWER_MIN) {
+		power = ATOMIZER_POWER_MIN;
+		if(error < 0) {
+			integral = Atomizer_tcIntegral;
+		}
+	}
+
+	if(integral < 0) {
+		integral = 0;
+	}
+	else if(integral > (ceiling << 8)) {
+		integral = ceiling << 8;
+	}
+
+	Atomizer_tcIntegral = integral;
+	Atomizer_tcPower = power;
+}
+
+/**
+ * Estimates the controller output that reaches a target voltage,
+ * from the battery voltage and the learned source resistance.
+ * The battery voltage is kept for Atomizer_UpdateFeedForward().
+ * This is an internal function.
+ *
+ * @param targetVolts Target voltage, in 10mV units.
+ * @param res         Atomizer resistance in mOhm, or zero if unknown.
+ * @param battVolts   Battery voltage, in mV.
+ *
+ * @return Controller output, with ATOMIZER_CTRL_SHIFT fractional bits
+ *         (see ATOMIZER_CTRL_BOOST).
+ */
+static int32_t Atomizer_FeedForward(uint16_t targetVolts, uint16_t res, uint16_t battVolts) {
+	uint32_t idealVolts, out;
+
+	// Output voltage an ideal converter would need, in 10mV units:
+	// Vout * (R + Rsrc) / R. Without a resistance, assume ideal.
+	idealVolts = targetVolts;
+	if(res != 0) {
+		idealVolts += (uint32_t) targetVolts * Atomizer_ffRes / 16 / res;
+	}
+	battVolts /= 10;
+	Atomizer_ffBattVolts = battVolts;
+	if(idealVolts == 0 || battVolts == 0) {
+		return 0;
+	}
+
+	// Buck: cmr = 960 * Vout / Vbatt
+	out = (960UL << ATOMIZER_CTRL_SHIFT) * idealVolts / battVolts;
+	if(out < (ATOMIZER_CTRL_BOOST << ATOMIZER_CTRL_SHIFT)) {
+		return out;
+	}
+
+	// Boost: cmr = 960 * Vbatt / Vout
+	out = (960UL << ATOMIZER_CTRL_SHIFT) * battVolts / idealVolts;
+	out = ((2 * ATOMIZER_CTRL_BOOST - 1) << ATOMIZER_CTRL_SHIFT) - out;
+	if(out < (ATOMIZER_CTRL_BOOST << ATOMIZER_CTRL_SHIFT)) {
+		out = ATOMIZER_CTRL_BOOST << ATOMIZER_CTRL_SHIFT;
+	}
+	else if(out > (ATOMIZER_CTRL_MAX << ATOMIZER_CTRL_SHIFT)) {
+		out = ATOMIZER_CTRL_MAX << ATOMIZER_CTRL_SHIFT;
+	}
+
+	return out;
+}
+
+/**
+ * Updates the learned source resistance from a measured output voltage.
+ * Only called while the output is within the warmup band, so that the
+ * duty cycle matches the measured voltage.
+ * This is an internal function.
+ *
+ * @param curVolts Measured output voltage, in 10mV units.
+ * @param res      Filtered atomizer resistance, in mOhm.
+ */
+static void Atomizer_UpdateFeedForward(uint16_t curVolts, uint16_t res) {
+	int32_t idealVolts, srcRes;
+	uint32_t battVolts, cmr;
+
+	battVolts = Atomizer_ffBattVolts;
+	if(curVolts == 0 || battVolts == 0) {
+		return;
+	}
+
+	// Ideal output voltage, in 1/16 of 10mV units
+	cmr = Atomizer_curCmr;
+	if(Atomizer_curState == POWERON_BUCK) {
+		if(cmr < ATOMIZER_FF_CMR_MIN) {
+			return;
+		}
+		// Vbatt * cmr / 960
+		idealVolts = battVolts * cmr / 60;
+	}
+	else {
+		// Vbatt * 960 / cmr
+		idealVolts = battVolts * 960 * 16 / cmr;
+	}
+
+	// Rsrc = (Videal - Vout) * R / Vout, averaged over about 16 iterations
+	srcRes = (idealVolts - 16L * curVolts) * res / curVolts;
+	srcRes = Atomizer_ffRes + ((srcRes - Atomizer_ffRes) >> 4);
+	if(srcRes < 0) {
+		srcRes = 0;
+	}
+	else if(srcRes > ATOMIZER_FF_RES_MAX) {
+		srcRes = ATOMIZER_FF_RES_MAX;
+	}
+	Atomizer_ffRes = srcRes;
+}
+
 static void Atomizer_SetError(Atomizer_Error_t);
 
 /**
@@ -436,8 +963,8 @@ static void Atomizer_SetError(Atomizer_Error_t);
  * @param powerOn True to power the atomizer on, false to power it off.
  */
 static void Atomizer_ControlUnlocked(uint8_t powerOn) {
-	uint8_t i;
 	uint16_t battVolts, resSeed;
+	uint32_t primask;
 
 	if(powerOn && (Atomizer_isLocked || Atomizer_error == SHORT)) {
 		// Lock atomizer after short or if locked by error
@@ -450,31 +977,56 @@ static void Atomizer_ControlUnlocked(uint8_t powerOn) {
 	}
 
 	if(powerOn) {
+		// Temperature control starts from the power ceiling
+		Atomizer_TcSetBase();
+		Atomizer_tcIntegral = 0;
+		Atomizer_tcPower = Atomizer_targetPower;
+
 		// Don't even bother firing if the battery is weak
 		battVolts = Battery_GetVoltage();
-		if(ATOMIZER_PREDICT_WEAKBATT(Atomizer_targetVolts, Atomizer_baseRes, battVolts)) {
+		if(ATOMIZER_PREDICT_WEAKBATT(Atomizer_GetTargetVolts(Atomizer_baseRes),
+		   Atomizer_baseRes, battVolts)) {
 			Atomizer_SetError(WEAK_BATT);
 			return;
 		}
 
-		// Reset filters used by the feedback loop
-		memset(Atomizer_medianFilterCtx, 0, sizeof(Atomizer_medianFilterCtx));
-		// Seed resistance filter with ATOMIZER_RESISTANCE_MIN or base resistance
+		// Reset filters used by the feedback loop. The ADC
+		// interrupt keeps filtering samples meanwhile.
 		resSeed = Atomizer_baseRes == 0 ? ATOMIZER_RESISTANCE_MIN : Atomizer_baseRes;
-		for(i = 0; i < ATOMIZER_MEDIANFILTER_WINDOW; i++) {
-			ATOMIZER_MEDIANFILTER_RESISTANCE.buf[i] = resSeed;
-		}
+		primask = Thread_IrqDisable();
+		Atomizer_MedianFilterReset(&ATOMIZER_MEDIANFILTER_VOLTAGE, 0);
+		Atomizer_MedianFilterReset(&ATOMIZER_MEDIANFILTER_CURRENT, 0);
+		// Seed resistance filter with ATOMIZER_RESISTANCE_MIN or base resistance
+		Atomizer_MedianFilterReset(&ATOMIZER_MEDIANFILTER_RESISTANCE, resSeed);
+		Thread_IrqRestore(primask);
+		Atomizer_curRes = resSeed;
 
 		// Update ADC cache for the first feedback iteration, blocking
 		ATOMIZER_ADC_UPDATECACHE(1);
 
-		// Start from buck with duty cycle 20
+		// Start from the estimated duty cycle, buck or boost
 		Atomizer_error = OK;
-		Atomizer_curCmr = 20;
-		PWM_SET_CMR(PWM0, ATOMIZER_PWMCH_BUCK, Atomizer_curCmr);
-		Atomizer_ConfigureConverters(1, 0);
+		Atomizer_ctrlOut = Atomizer_FeedForward(Atomizer_GetTargetVolts(resSeed),
+			Atomizer_baseRes, battVolts);
+		Atomizer_ctrlError[0] = Atomizer_ctrlError[1] = 0;
+		Atomizer_ffHold = ATOMIZER_FF_HOLD_MAX;
+		Atomizer_ffLastVolts = 0;
 		ATOMIZER_TIMER_WARMUP_RESET();
-		Atomizer_curState = POWERON_BUCK;
+		if(Atomizer_ctrlOut < (ATOMIZER_CTRL_BOOST << ATOMIZER_CTRL_SHIFT)) {
+			Atomizer_curCmr = Atomizer_ctrlOut >> ATOMIZER_CTRL_SHIFT;
+			if(Atomizer_curCmr < 20) {
+				Atomizer_curCmr = 0;
+			}
+			PWM_SET_CMR(PWM0, ATOMIZER_PWMCH_BUCK, Atomizer_curCmr);
+			Atomizer_ConfigureConverters(1, 0);
+			Atomizer_curState = POWERON_BUCK;
+		}
+		else {
+			Atomizer_curCmr = 2 * ATOMIZER_CTRL_BOOST - 1 - (Atomizer_ctrlOut >> ATOMIZER_CTRL_SHIFT);
+			PWM_SET_CMR(PWM0, ATOMIZER_PWMCH_BOOST, Atomizer_curCmr);
+			Atomizer_ConfigureConverters(0, 1);
+			Atomizer_curState = POWERON_BOOST;
+		}
 	}
 	else {
 		Atomizer_curState = POWEROFF;
@@ -483,6 +1035,50 @@ static void Atomizer_ControlUnlocked(uint8_t powerOn) {
 	}
 }
 
+/**
+ * Runs the error callback deferred to thread context.
+ * This is an internal function.
+ *
+ * @param context Unused.
+ * @param arg     Atomizer error.
+ */
+static void Atomizer_DeferredErrorCallback(void *context, uint32_t arg) {
+	Atomizer_ErrorCallback_t callback;
+
+	// The callback could have been changed in the meantime
+	callback = Atomizer_errorCallbackPtr;
+	if(callback != NULL) {
+		callback((Atomizer_Error_t) arg);
+	}
+}
+
+/**
+ * Sets event flags and invokes the error callback on behalf of the
+ * feedback loop. Runs as a deferred call from the PendSV handler.
+ * This is an internal function.
+ *
+ * @param bits ATOMIZER_EVENT_* and ATOMIZER_DEFER_ERROR bits.
+ */
+static void Atomizer_DeferredNotify(uint32_t bits) {
+	Atomizer_ErrorCallback_t callback;
+	Atomizer_Error_t error;
+
+	if(bits & ~ATOMIZER_DEFER_ERROR) {
+		Thread_EventFlagsSet(Atomizer_events, bits & ~ATOMIZER_DEFER_ERROR);
+	}
+
+	callback = Atomizer_errorCallbackPtr;
+	if((bits & ATOMIZER_DEFER_ERROR) && callback != NULL) {
+		error = Atomizer_deferredError;
+		if(Atomizer_errorCallbackInThread) {
+			WorkQueue_Post(Atomizer_DeferredErrorCallback, NULL, error);
+		}
+		else {
+			callback(error);
+		}
+	}
+}
+
 /**
  * Sets the atomizer error, resetting the approriate
  * atomizer state if needed. If the error is not OK,
@@ -511,10 +1107,71 @@ static void Atomizer_SetError(Atomizer_Error_t error) {
 
 	Atomizer_error = error;
 
+	if(error != OK) {
+		// Wake up waiters, they will see the error
+		Thread_DeferredPost(&Atomizer_deferred, ATOMIZER_EVENT_WARMUP | ATOMIZER_EVENT_SAMPLE);
+	}
+
 	if(Atomizer_errorCallbackPtr != NULL) {
 		// Invoke error callback
-		Atomizer_errorCallbackPtr(error);
+		Atomizer_deferredError = error;
+		Thread_DeferredPost(&Atomizer_deferred, ATOMIZER_DEFER_ERROR);
+	}
+}
+
+/**
+ * Runs one iteration of the feedback controller, updating Atomizer_ctrlOut.
+ * This is a velocity form PID: the output itself integrates the corrections,
+ * so clamping it to the converter range is all the anti-windup needed.
+ * Corrections are scaled by the inverse of the converter gain slope, which
+ * depends on battery voltage and, in boost mode, on the duty cycle squared.
+ * This way the gains are fractions of the error corrected per iteration,
+ * regardless of operating point.
+ * This is an internal function.
+ *
+ * @param error      Target minus measured voltage, in 10mV units.
+ * @param adcBattery Battery voltage (ADC).
+ */
+static void Atomizer_UpdateController(int16_t error, uint16_t adcBattery) {
+	int32_t step, out, battVolts, cmr;
+
+	// PID terms on error, error derivative and its second difference
+	step = Atomizer_ctrlKp * (int32_t) (error - Atomizer_ctrlError[0]) +
+		Atomizer_ctrlKi * (int32_t) error +
+		Atomizer_ctrlKd * (int32_t) (error - 2 * Atomizer_ctrlError[0] + Atomizer_ctrlError[1]);
+	Atomizer_ctrlError[1] = Atomizer_ctrlError[0];
+	Atomizer_ctrlError[0] = error;
+
+	if(step > ATOMIZER_CTRL_STEP_MAX) {
+		step = ATOMIZER_CTRL_STEP_MAX;
+	}
+	else if(step < -ATOMIZER_CTRL_STEP_MAX) {
+		step = -ATOMIZER_CTRL_STEP_MAX;
+	}
+
+	// Battery voltage in 10mV units (ADC value is 0.8 * mV).
+	// Not weak, so never zero.
+	battVolts = adcBattery / 8;
+
+	// Buck:  Vout = Vbatt * cmr / 960, dOut/dVout = 960 / Vbatt
+	// Boost: Vout = Vbatt * 960 / cmr, dOut/dVout = cmr^2 / (960 * Vbatt)
+	out = Atomizer_ctrlOut;
+	if(out < (ATOMIZER_CTRL_BOOST << ATOMIZER_CTRL_SHIFT)) {
+		step = step * 960 / battVolts;
+	}
+	else {
+		cmr = 2 * ATOMIZER_CTRL_BOOST - 1 - (out >> ATOMIZER_CTRL_SHIFT);
+		step = step * cmr / 960 * cmr / battVolts;
+	}
+
+	out += step;
+	if(out < 0) {
+		out = 0;
 	}
+	else if(out > (ATOMIZER_CTRL_MAX << ATOMIZER_CTRL_SHIFT)) {
+		out = ATOMIZER_CTRL_MAX << ATOMIZER_CTRL_SHIFT;
+	}
+	Atomizer_ctrlOut = out;
 }
 
 /**
@@ -523,8 +1180,10 @@ static void Atomizer_SetError(Atomizer_Error_t error) {
  * This is an internal function.
  */
 static void Atomizer_NegativeFeedback(uint32_t unused) {
-	uint16_t adcVoltage, adcCurrent, adcBattery, adcBoardTemp, curVolts;
+	uint16_t adcVoltage, adcCurrent, adcBattery, adcBoardTemp, curVolts, targetVolts, band;
+	int16_t error;
 	uint32_t resistance;
+	uint8_t isMismatch;
 	Atomizer_ConverterState_t nextState;
 
 	if(Atomizer_timerCountRefresh > 0) {
@@ -538,13 +1197,6 @@ static void Atomizer_NegativeFeedback(uint32_t unused) {
 		return;
 	}
 
-	if(Atomizer_timerCountWarmup > 0) {
-		Atomizer_timerCountWarmup--;
-	}
-	else {
-		Atomizer_timerFlag |= ATOMIZER_TMRFLAG_WARMUP;
-	}
-
 	// Update ADC cache for next iteration without blocking
 	ATOMIZER_ADC_UPDATECACHE(0);
 
@@ -575,7 +1227,16 @@ static void Atomizer_NegativeFeedback(uint32_t unused) {
 	}
 
 	// Don't check resistance unless there's some precision
+	isMismatch = 0;
 	if(adcVoltage >= 5 && adcCurrent >= 5) {
+		// While the feed-forward output is held, a resistance far from the
+		// one it was estimated with (e.g. an atomizer that hasn't been
+		// measured yet) restarts the filter from the raw reading
+		if(Atomizer_ffHold > 0 && ATOMIZER_DIFF_NOT_BOUND(resistance, Atomizer_curRes, Atomizer_curRes / 4)) {
+			Atomizer_MedianFilterReset(&ATOMIZER_MEDIANFILTER_RESISTANCE, resistance);
+			isMismatch = 1;
+		}
+
 		// Filter resistance (filter is pre-seeded)
 		resistance = Atomizer_MedianFilter(resistance, &ATOMIZER_MEDIANFILTER_RESISTANCE);
 
@@ -588,64 +1249,85 @@ static void Atomizer_NegativeFeedback(uint32_t unused) {
 			Atomizer_SetError(OPEN);
 			return;
 		}
+
+		Atomizer_curRes = resistance;
 	}
 
 	Atomizer_error = OK;
 
+	if(Atomizer_targetTemp != 0 && Atomizer_testVolts == 0) {
+		Atomizer_UpdateTempController(Atomizer_curRes);
+	}
+
+	curVolts = ATOMIZER_ADC_VOLTAGE(adcVoltage);
+	targetVolts = Atomizer_GetTargetVolts(Atomizer_curRes);
+	error = targetVolts - curVolts;
+	band = ATOMIZER_WARMUP_BAND(targetVolts);
+
+	if(error <= band && -error <= band) {
+		// Close to the target: warmup settles, and the duty
+		// cycle tells how far the output is from ideal
+		if(Atomizer_timerCountSettle < ATOMIZER_TMRCNT_WARMUP) {
+			Atomizer_timerCountSettle++;
+		}
+		Atomizer_UpdateFeedForward(curVolts, Atomizer_curRes);
+	}
+	else {
+		Atomizer_timerCountSettle = 0;
+	}
+
+	if(Atomizer_timerCountWarmup > 0) {
+		Atomizer_timerCountWarmup--;
+	}
+	if(!(Atomizer_timerFlag & ATOMIZER_TMRFLAG_WARMUP) &&
+	   (Atomizer_timerCountSettle == ATOMIZER_TMRCNT_WARMUP || Atomizer_timerCountWarmup == 0)) {
+		Atomizer_timerFlag |= ATOMIZER_TMRFLAG_WARMUP;
+		Thread_DeferredPost(&Atomizer_deferred, ATOMIZER_EVENT_WARMUP);
+	}
+
 	// Accumulate ADC data after warmup
 	if((Atomizer_timerFlag & ATOMIZER_TMRFLAG_WARMUP) && Atomizer_adcAcc.count > 0) {
 		Atomizer_adcAcc.voltage += adcVoltage;
 		Atomizer_adcAcc.current += adcCurrent;
 		Atomizer_adcAcc.resistance += resistance;
-		Atomizer_adcAcc.count--;
+		if(--Atomizer_adcAcc.count == 0) {
+			Thread_DeferredPost(&Atomizer_deferred, ATOMIZER_EVENT_SAMPLE);
+		}
 	}
 
-	curVolts = ATOMIZER_ADC_VOLTAGE(adcVoltage);
-	if(curVolts == Atomizer_targetVolts) {
-		// Target reached, nothing to do
-		return;
+	// After power on, hold the feed-forward output while it's still
+	// rising towards the target: the controller would wind up on the
+	// converter lag. Once it stops short or overshoots, take over.
+	if(Atomizer_ffHold > 0) {
+		if(isMismatch) {
+			// Estimate again with the measured resistance
+			Atomizer_ctrlOut = Atomizer_FeedForward(targetVolts, Atomizer_curRes, Atomizer_ffBattVolts * 10);
+			Atomizer_ffHold--;
+		}
+		else if(error > band && (curVolts <= band || curVolts > Atomizer_ffLastVolts + band)) {
+			Atomizer_ffHold--;
+		}
+		else {
+			Atomizer_ffHold = 0;
+		}
+		Atomizer_ffLastVolts = curVolts;
+	}
+	if(Atomizer_ffHold == 0) {
+		Atomizer_UpdateController(error, adcBattery);
 	}
 
-	nextState = Atomizer_curState;
-
-	if(curVolts < Atomizer_targetVolts) {
-		if(Atomizer_curState == POWERON_BUCK) {
-			if(Atomizer_curCmr == 959) {
-				// Reached maximum for buck, switch to boost
-				nextState = POWERON_BOOST;
-			}
-			else {
-				// In buck mode, increased duty cycle = increased voltage
-				Atomizer_curCmr++;
-			}
-		}
-		else if(Atomizer_curCmr > 160) {
-			// Boost duty cycle must be greater than 160
-			// In boost mode, decreased duty cycle = increased voltage
-			Atomizer_curCmr--;
+	if(Atomizer_ctrlOut < (ATOMIZER_CTRL_BOOST << ATOMIZER_CTRL_SHIFT)) {
+		// Buck duty cycles below 20 are forced to zero
+		nextState = POWERON_BUCK;
+		Atomizer_curCmr = Atomizer_ctrlOut >> ATOMIZER_CTRL_SHIFT;
+		if(Atomizer_curCmr < 20) {
+			Atomizer_curCmr = 0;
 		}
 	}
 	else {
-		if(Atomizer_curState == POWERON_BOOST) {
-			if(Atomizer_curCmr == 959) {
-				// Reached minimum for boost, switch to buck
-				nextState = POWERON_BUCK;
-			}
-			else {
-				// In boost mode, increased duty cycle = decreased voltage
-				Atomizer_curCmr++;
-			}
-		}
-		else {
-			if(Atomizer_curCmr <= 20) {
-				// Buck duty cycles below 20 are forced to zero
-				Atomizer_curCmr = 0;
-			}
-			else {
-				// In buck mode, decreased duty cycle = decreased voltage
-				Atomizer_curCmr--;
-			}
-		}
+		// In boost mode, decreased duty cycle = increased voltage
+		nextState = POWERON_BOOST;
+		Atomizer_curCmr = 2 * ATOMIZER_CTRL_BOOST - 1 - (Atomizer_ctrlOut >> ATOMIZER_CTRL_SHIFT);
 	}
 
 	// Set new duty cycle
@@ -662,6 +1344,9 @@ static void Atomizer_NegativeFeedback(uint32_t unused) {
 }
 
 void Atomizer_Init() {
+	int8_t timerIndex;
+	uint8_t i;
+
 	Atomizer_shuntRes = Device_GetAtomizerShunt();
 
 	// Calculate overcurrent threshold
@@ -671,6 +1356,10 @@ void Atomizer_Init() {
 	}
 
 	// Setup ADC median filtering
+	for(i = 0; i < 3; i++) {
+		Atomizer_medianFilterCtx[i].window = ATOMIZER_FILTER_WINDOW_DEFAULT;
+		Atomizer_MedianFilterReset(&Atomizer_medianFilterCtx[i], 0);
+	}
 	ADC_SetFilter(ADC_MODULE_VATM, (ADC_Filter_t) Atomizer_MedianFilter,
 		(uint32_t) &ATOMIZER_MEDIANFILTER_VOLTAGE);
 	ADC_SetFilter(ADC_MODULE_CURS, (ADC_Filter_t) Atomizer_MedianFilter,
@@ -702,13 +1391,16 @@ void Atomizer_Init() {
 	// Create our Big Atomizer Lock
 	if(Thread_MutexCreate(&Atomizer_mutex) != TD_SUCCESS) {
 		// No user code has run yet, the heap is messed up
-		asm volatile ("udf");
+		__builtin_trap();
 	}
+	Thread_EventFlagsInitStatic(&Atomizer_events, &Atomizer_eventsStorage);
+	Thread_DeferredInit(&Atomizer_deferred, Atomizer_DeferredNotify);
 
 	// Setup timer for the feedback loop.
 	// This function runs during system init, so
 	// the user hasn't had time to create timers yet.
-	Timer_CreateTimer(ATOMIZER_LOOP_FREQ, 1, Atomizer_NegativeFeedback, 0);
+	timerIndex = Timer_CreateTimer(ATOMIZER_LOOP_FREQ, 1, Atomizer_NegativeFeedback, 0);
+	Timer_SetPriority(timerIndex, ATOMIZER_IRQ_PRIORITY);
 }
 
 void Atomizer_SetOutputVoltage(uint16_t volts) {
@@ -720,6 +1412,113 @@ void Atomizer_SetOutputVoltage(uint16_t volts) {
 	}
 
 	Atomizer_targetVolts = (volts + 5) / 10;
+	Atomizer_targetPower = 0;
+	Atomizer_targetTemp = 0;
+}
+
+void Atomizer_SetOutputPower(uint32_t power) {
+	if(power < ATOMIZER_POWER_MIN) {
+		power = ATOMIZER_POWER_MIN;
+	}
+	else if(power > ATOMIZER_POWER_MAX) {
+		power = ATOMIZER_POWER_MAX;
+	}
+
+	Atomizer_targetPower = power;
+	Atomizer_targetTemp = 0;
+}
+
+void Atomizer_SetOutputTemperature(uint16_t temp, Atomizer_Material_t material, uint32_t maxPower) {
+	uint32_t primask;
+
+	if((uint32_t) material > ATOMIZER_MATERIAL_CUSTOM) {
+		// No table to look up: leave the mode unchanged
+		return;
+	}
+
+	if(temp < ATOMIZER_TEMP_MIN) {
+		temp = ATOMIZER_TEMP_MIN;
+	}
+	else if(temp > ATOMIZER_TEMP_MAX) {
+		temp = ATOMIZER_TEMP_MAX;
+	}
+
+	if(maxPower < ATOMIZER_POWER_MIN) {
+		maxPower = ATOMIZER_POWER_MIN;
+	}
+	else if(maxPower > ATOMIZER_POWER_MAX) {
+		maxPower = ATOMIZER_POWER_MAX;
+	}
+
+	// The loop must see a consistent set
+	primask = Thread_IrqDisable();
+	Atomizer_tcrTable = material == ATOMIZER_MATERIAL_CUSTOM ?
+		Atomizer_tcrCustomTable : Atomizer_tcrTables[material];
+	Atomizer_TcSetBase();
+	Atomizer_targetPower = maxPower;
+	Atomizer_targetTemp = temp;
+	Thread_IrqRestore(primask);
+}
+
+uint8_t Atomizer_SetCustomMaterial(const uint16_t table[ATOMIZER_TCR_TABLE_LEN]) {
+	uint32_t primask;
+	uint8_t i;
+
+	// Lookups need a strictly increasing table
+	for(i = 1; i < ATOMIZER_TCR_TABLE_LEN; i++) {
+		if(table[i] <= table[i - 1]) {
+			return 0;
+		}
+	}
+
+	primask = Thread_IrqDisable();
+	memcpy(Atomizer_tcrCustomTable, table, sizeof(Atomizer_tcrCustomTable));
+	if(Atomizer_tcrTable == Atomizer_tcrCustomTable) {
+		Atomizer_TcSetBase();
+	}
+	Thread_IrqRestore(primask);
+
+	return 1;
+}
+
+void Atomizer_SetFilterWindow(Atomizer_Filter_t filter, uint8_t window) {
+	Atomizer_MedianFilterCtx_t *ctx;
+	uint32_t primask;
+	uint16_t last;
+
+	if((uint32_t) filter > ATOMIZER_FILTER_RESISTANCE) {
+		// No such filter
+		return;
+	}
+
+	// Round to an odd size in range
+	if(window > ATOMIZER_FILTER_WINDOW_MAX) {
+		window = ATOMIZER_FILTER_WINDOW_MAX;
+	}
+	window |= 1;
+
+	ctx = &Atomizer_medianFilterCtx[filter];
+
+	// The filter can run from the ADC interrupt
+	primask = Thread_IrqDisable();
+	if(ctx->window != window) {
+		// Restart from the latest sample to avoid glitches
+		last = ctx->buf[ctx->idx == 0 ? ctx->window - 1 : ctx->idx - 1];
+		ctx->window = window;
+		Atomizer_MedianFilterReset(ctx, last);
+	}
+	Thread_IrqRestore(primask);
+}
+
+void Atomizer_SetFeedbackGains(uint16_t kp, uint16_t ki, uint16_t kd) {
+	uint32_t primask;
+
+	// The loop must see a consistent set
+	primask = Thread_IrqDisable();
+	Atomizer_ctrlKp = kp;
+	Atomizer_ctrlKi = ki;
+	Atomizer_ctrlKd = kd;
+	Thread_IrqRestore(primask);
 }
 
 void Atomizer_Control(uint8_t powerOn) {
@@ -773,7 +1572,6 @@ static void Atomizer_BaseUpdate(uint16_t newRes, uint8_t newTemp) {
  */
 static uint8_t Atomizer_Sample(uint16_t targetVolts, uint16_t *voltage, uint16_t *current, uint16_t *resistance) {
 	uint32_t vSum, iSum, res;
-	uint16_t savedTargetVolts;
 	uint8_t fromPowerOff, count, newTemp;
 
 	// OFF -> ON transistions are assumed to be locked.
@@ -792,18 +1590,18 @@ static uint8_t Atomizer_Sample(uint16_t targetVolts, uint16_t *voltage, uint16_t
 
 	if(fromPowerOff) {
 		// Power on atomizer for measurement
-		savedTargetVolts = Atomizer_targetVolts;
-		Atomizer_targetVolts = targetVolts;
+		Atomizer_testVolts = targetVolts;
 		Atomizer_ControlUnlocked(1);
 	}
 
 	// Wait for accumulation to complete
-	while(Atomizer_adcAcc.count > 0 && Atomizer_error == OK);
+	ATOMIZER_WAIT_EVENT(ATOMIZER_EVENT_SAMPLE,
+		Atomizer_adcAcc.count > 0 && Atomizer_error == OK);
 
 	if(fromPowerOff) {
-		// Power off and restore target voltage
+		// Power off and restore target
 		Atomizer_ControlUnlocked(0);
-		Atomizer_targetVolts = savedTargetVolts;
+		Atomizer_testVolts = 0;
 	}
 
 	if(Atomizer_error != OK) {
@@ -873,12 +1671,11 @@ static void Atomizer_Refresh() {
 		Atomizer_isMeasuring = Atomizer_forceMeasure || !Atomizer_baseRes;
 
 		// Use a 300mV test voltage for refresh
-		targetVolts = Atomizer_targetVolts;
-		Atomizer_targetVolts = 30;
+		Atomizer_testVolts = 30;
 		Atomizer_ControlUnlocked(1);
 		ATOMIZER_WAIT_WARMUP();
 		Atomizer_ControlUnlocked(0);
-		Atomizer_targetVolts = targetVolts;
+		Atomizer_testVolts = 0;
 
 		if(!Atomizer_isMeasuring) {
 			return;
@@ -969,7 +1766,22 @@ void Atomizer_Unlock() {
 }
 
 void Atomizer_SetErrorCallback(Atomizer_ErrorCallback_t callbackPtr) {
+	Atomizer_SetErrorCallbackEx(callbackPtr, 0);
+}
+
+uint8_t Atomizer_SetErrorCallbackEx(Atomizer_ErrorCallback_t callbackPtr, uint8_t inThread) {
+	uint32_t primask;
+
+	if(inThread && callbackPtr != NULL && !WorkQueue_Start()) {
+		return 0;
+	}
+
+	primask = Thread_IrqDisable();
 	Atomizer_errorCallbackPtr = callbackPtr;
+	Atomizer_errorCallbackInThread = inThread;
+	Thread_IrqRestore(primask);
+
+	return 1;
 }
 
 uint8_t Atomizer_ReadBoardTemp() {
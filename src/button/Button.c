@@ -31,6 +31,7 @@
 #include <M451Series.h>
 #include <Button.h>
 #include <Thread.h>
+#include <WorkQueue.h>
 
 /**
  * Button callback function pointers.
@@ -42,6 +43,20 @@ static volatile Button_Callback_t Button_callbackPtr[3] = {NULL, NULL, NULL};
  */
 static volatile uint8_t Button_callbackMask[3];
 
+/**
+ * Callbacks that run in thread context.
+ * Bits 0-2 are assigned to callbacks 0-2.
+ */
+static volatile uint8_t Button_callbackInThread;
+
+/**
+ * Button callback generations, bumped whenever a callback
+ * is created. Deferred callbacks carry the generation they
+ * were posted for, so that they are dropped if their slot
+ * has been reused in the meantime.
+ */
+static volatile uint8_t Button_callbackGen[3];
+
 /**
  * Global button state.
  */
@@ -71,6 +86,31 @@ static void Button_UpdateState(uint8_t mask) {
 	Button_state |= curState & mask;
 }
 
+/**
+ * Runs a button callback deferred to thread context.
+ * This is an internal function.
+ *
+ * @param context Unused.
+ * @param arg     Callback generation in bits 16-23, callback
+ *                index in bits 8-15, button state in bits 0-7.
+ */
+static void Button_DeferredCallback(void *context, uint32_t arg) {
+	Button_Callback_t callback;
+	uint32_t basepri;
+	uint8_t i;
+
+	// The callback could have been deleted, and its
+	// slot taken by another one, in the meantime
+	i = (arg >> 8) & 0xFF;
+	basepri = Thread_KernelLock();
+	callback = Button_callbackGen[i] == (uint8_t) (arg >> 16) ? Button_callbackPtr[i] : NULL;
+	Thread_KernelUnlock(basepri);
+
+	if(callback != NULL) {
+		callback(arg & 0xFF);
+	}
+}
+
 /**
  * GPD/GPE interrupt handler.
  * This is an internal function.
@@ -97,7 +137,13 @@ static void Button_IRQHandler() {
 
 		for(i = 0; i < 3; i++) {
 			if(Button_callbackPtr[i] != NULL && Button_callbackMask[i] & mask) {
-				Button_callbackPtr[i](Button_state);
+				if(Button_callbackInThread & (1 << i)) {
+					WorkQueue_Post(Button_DeferredCallback, NULL,
+						(Button_callbackGen[i] << 16) | (i << 8) | Button_state);
+				}
+				else {
+					Button_callbackPtr[i](Button_state);
+				}
 			}
 		}
 	}
@@ -138,27 +184,38 @@ uint8_t Button_GetState() {
 }
 
 int8_t Button_CreateCallback(Button_Callback_t callback, uint8_t buttonMask) {
+	return Button_CreateCallbackEx(callback, buttonMask, 0);
+}
+
+int8_t Button_CreateCallbackEx(Button_Callback_t callback, uint8_t buttonMask, uint8_t inThread) {
 	int i;
-	uint32_t primask;
+	uint32_t basepri;
 
-	if(callback == NULL) {
+	if(callback == NULL || (inThread && !WorkQueue_Start())) {
 		return -1;
 	}
 
-	primask = Thread_IrqDisable();
+	basepri = Thread_KernelLock();
 
 	// Find an unused callback
 	for(i = 0; i < 3 && Button_callbackPtr[i] != NULL; i++);
 	if(i == 3) {
-		Thread_IrqRestore(primask);
+		Thread_KernelUnlock(basepri);
 		return -1;
 	}
 
 	// Setup callback
+	Button_callbackGen[i]++;
 	Button_callbackMask[i] = buttonMask;
+	if(inThread) {
+		Button_callbackInThread |= 1 << i;
+	}
+	else {
+		Button_callbackInThread &= ~(1 << i);
+	}
 	Button_callbackPtr[i] = callback;
 
-	Thread_IrqRestore(primask);
+	Thread_KernelUnlock(basepri);
 	return i;
 }
 
@@ -0,0 +1,119 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#include <string.h>
+#include <RingBuffer.h>
+#include <AtomicOps.h>
+
+/*
+ * Ordering: each side reads the other side's index, then issues a
+ * barrier before touching data (acquire). Each side issues a barrier
+ * after touching data, then moves its own index (release). Indices
+ * are only ever written by their owner, so no read-modify-write is
+ * needed and interrupts never have to be masked.
+ */
+
+void RingBuffer_Init(RingBuffer_t *ring, uint8_t *buffer, uint32_t size) {
+	ring->buffer = buffer;
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+uint32_t RingBuffer_GetUsed(const RingBuffer_t *ring) {
+	return ring->head - ring->tail;
+}
+
+uint32_t RingBuffer_GetFree(const RingBuffer_t *ring) {
+	return ring->mask + 1 - (ring->head - ring->tail);
+}
+
+uint32_t RingBuffer_WritePeek(RingBuffer_t *ring, uint8_t **ptr) {
+	uint32_t head, freeSize, toEnd;
+
+	head = ring->head;
+	freeSize = ring->mask + 1 - (head - ring->tail);
+	AtomicOps_Barrier();
+
+	toEnd = ring->mask + 1 - (head & ring->mask);
+	*ptr = ring->buffer + (head & ring->mask);
+	return freeSize < toEnd ? freeSize : toEnd;
+}
+
+void RingBuffer_WriteCommit(RingBuffer_t *ring, uint32_t size) {
+	AtomicOps_Barrier();
+	ring->head += size;
+}
+
+uint32_t RingBuffer_ReadPeek(RingBuffer_t *ring, const uint8_t **ptr) {
+	uint32_t tail, usedSize, toEnd;
+
+	tail = ring->tail;
+	usedSize = ring->head - tail;
+	AtomicOps_Barrier();
+
+	toEnd = ring->mask + 1 - (tail & ring->mask);
+	*ptr = ring->buffer + (tail & ring->mask);
+	return usedSize < toEnd ? usedSize : toEnd;
+}
+
+void RingBuffer_ReadCommit(RingBuffer_t *ring, uint32_t size) {
+	AtomicOps_Barrier();
+	ring->tail += size;
+}
+
+uint32_t RingBuffer_Write(RingBuffer_t *ring, const uint8_t *src, uint32_t size) {
+	uint32_t done, chunk;
+	uint8_t *ptr;
+
+	// At most two chunks: up to the buffer end, then from the start
+	for(done = 0; done < size; done += chunk) {
+		chunk = RingBuffer_WritePeek(ring, &ptr);
+		if(chunk == 0) {
+			break;
+		}
+		if(chunk > size - done) {
+			chunk = size - done;
+		}
+		memcpy(ptr, src + done, chunk);
+		RingBuffer_WriteCommit(ring, chunk);
+	}
+
+	return done;
+}
+
+uint32_t RingBuffer_Read(RingBuffer_t *ring, uint8_t *dst, uint32_t size) {
+	uint32_t done, chunk;
+	const uint8_t *ptr;
+
+	// At most two chunks: up to the buffer end, then from the start
+	for(done = 0; done < size; done += chunk) {
+		chunk = RingBuffer_ReadPeek(ring, &ptr);
+		if(chunk == 0) {
+			break;
+		}
+		if(chunk > size - done) {
+			chunk = size - done;
+		}
+		memcpy(dst + done, ptr, chunk);
+		RingBuffer_ReadCommit(ring, chunk);
+	}
+
+	return done;
+}
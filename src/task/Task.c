@@ -0,0 +1,338 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#include <stddef.h>
+#include <Task.h>
+#include <Thread.h>
+#include <AtomicOps.h>
+
+/* Task is not in the schedule list. */
+#define TASK_STATE_IDLE    0
+/* Task is in the schedule list, with a wakeup time. */
+#define TASK_STATE_TIMED   1
+/* Task is in the schedule list, waiting on a semaphore forever. */
+#define TASK_STATE_FOREVER 2
+
+/* True if system time a is before system time b. */
+#define TASK_TIME_BEFORE(a, b) ((int32_t) ((a) - (b)) < 0)
+
+/**
+ * True once the runner thread is running.
+ */
+static volatile uint8_t Task_isRunning;
+
+/**
+ * Semaphore the runner sleeps on.
+ */
+static Thread_Semaphore_t Task_wakeSema;
+
+/**
+ * True if the runner has been woken up and hasn't checked
+ * its tasks yet. Avoids piling up wakeups.
+ */
+static volatile uint32_t Task_wakePending;
+
+/**
+ * Scheduled tasks. Timed tasks come first, sorted by
+ * wakeup time, followed by tasks waiting forever.
+ * Synchronization: global critical section.
+ */
+static Task_t *Task_list;
+
+/**
+ * Posted tasks, as a Task_t pointer.
+ * This is a lock-free LIFO list: anyone pushes to
+ * it and the runner takes the whole list.
+ * Synchronization: atomic operations.
+ */
+static volatile uint32_t Task_postList;
+
+/**
+ * Wakes up the runner thread, if it's running.
+ * This is an internal function.
+ */
+static void Task_Wake() {
+	if(Task_isRunning && AtomicOps_SwapRelease(&Task_wakePending, 1) == 0) {
+		Thread_SemaphoreUp(Task_wakeSema);
+	}
+}
+
+/**
+ * Removes a task from the schedule list, if it's in it.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param task Task.
+ */
+static void Task_Unlink(Task_t *task) {
+	Task_t **link;
+
+	if(task->state == TASK_STATE_IDLE) {
+		return;
+	}
+
+	for(link = &Task_list; *link != task; link = &(*link)->next);
+	*link = task->next;
+	task->state = TASK_STATE_IDLE;
+}
+
+/**
+ * Inserts a task in the schedule list, removing it first if needed.
+ * This is an internal function.
+ *
+ * @param task  Task.
+ * @param time  Wakeup time, in system ticks.
+ * @param sema  Semaphore to wait on, or 0.
+ * @param state TASK_STATE_TIMED or TASK_STATE_FOREVER.
+ */
+static void Task_Insert(Task_t *task, uint32_t time, Thread_Semaphore_t sema, uint8_t state) {
+	Task_t **link;
+	uint8_t isHead;
+
+	Thread_CriticalEnter();
+
+	Task_Unlink(task);
+	task->time = time;
+	task->sema = sema;
+
+	// Timed tasks go before the first later or forever task,
+	// forever tasks go last.
+	for(link = &Task_list; *link != NULL; link = &(*link)->next) {
+		if(state == TASK_STATE_TIMED && ((*link)->state == TASK_STATE_FOREVER ||
+		   TASK_TIME_BEFORE(task->time, (*link)->time))) {
+			break;
+		}
+	}
+
+	task->next = *link;
+	task->state = state;
+	*link = task;
+	isHead = (link == &Task_list);
+
+	Thread_CriticalExit();
+
+	// The runner has to recompute its sleep time if the
+	// earliest deadline changed. Semaphores are only checked
+	// when waking up, so also wake it for semaphore waits.
+	if(isHead || sema != 0) {
+		Task_Wake();
+	}
+}
+
+/**
+ * Runs all posted tasks.
+ * This is an internal function.
+ */
+static void Task_RunPosted() {
+	Task_t *task, *next;
+
+	task = (Task_t *) (uintptr_t) AtomicOps_SwapAcquire(&Task_postList, 0);
+	while(task != NULL) {
+		// Read next before clearing posted: once posted
+		// is zero, the task can be pushed again.
+		next = task->postNext;
+
+		Thread_CriticalEnter();
+		Task_Unlink(task);
+		task->sema = 0;
+		task->time = Thread_GetSysTicks();
+		Thread_CriticalExit();
+
+		AtomicOps_SwapAcquire(&task->posted, 0);
+		task->func(task, task->context, TASK_EVENT_POST);
+		task = next;
+	}
+}
+
+/**
+ * Runs the first due task, or the first task waiting on a
+ * semaphore that can be downed.
+ * This is an internal function.
+ *
+ * @param sleep Pointer to receive the time until the next deadline
+ *              in ticks, or UINT32_MAX if there are no timed tasks.
+ *              Only valid if no task was run.
+ *
+ * @return True if a task was run, false otherwise.
+ */
+static uint8_t Task_RunReady(uint32_t *sleep) {
+	Task_t *task;
+	uint32_t now;
+	uint8_t event;
+
+	now = Thread_GetSysTicks();
+	*sleep = UINT32_MAX;
+
+	Thread_CriticalEnter();
+
+	for(task = Task_list; task != NULL; task = task->next) {
+		if(task->state == TASK_STATE_TIMED && !TASK_TIME_BEFORE(now, task->time)) {
+			event = TASK_EVENT_TIMEOUT;
+			break;
+		}
+		if(task->sema != 0 && Thread_SemaphoreTryDown(task->sema) == TD_SUCCESS) {
+			event = TASK_EVENT_SEMA;
+			break;
+		}
+		if(task->state == TASK_STATE_TIMED && *sleep == UINT32_MAX) {
+			// First timed task that isn't due: earliest deadline
+			*sleep = task->time - now;
+		}
+	}
+
+	if(task == NULL) {
+		Thread_CriticalExit();
+		return 0;
+	}
+
+	Task_Unlink(task);
+	task->sema = 0;
+	if(event == TASK_EVENT_SEMA) {
+		// Deadlines for Task_DelayUntil() start from here
+		task->time = now;
+	}
+
+	Thread_CriticalExit();
+
+	task->func(task, task->context, event);
+	return 1;
+}
+
+/**
+ * Runner thread procedure.
+ * This is an internal function.
+ *
+ * @param args Unused.
+ *
+ * @return Never returns.
+ */
+static void *Task_RunnerProc(void *args) {
+	uint32_t sleep;
+
+	while(1) {
+		// Wakeups from now on need a new pass
+		AtomicOps_SwapAcquire(&Task_wakePending, 0);
+
+		do {
+			Task_RunPosted();
+		} while(Task_RunReady(&sleep));
+
+		if(sleep == UINT32_MAX) {
+			Thread_SemaphoreDown(Task_wakeSema);
+		}
+		else {
+			// Round up to whole milliseconds
+			Thread_SemaphoreDownTimeout(Task_wakeSema,
+				(sleep + THREAD_SYSTICK_MS - 1) / THREAD_SYSTICK_MS);
+		}
+	}
+
+	return NULL;
+}
+
+uint8_t Task_Start() {
+	Thread_t runner;
+	uint8_t ret = 1;
+
+	// Serialize concurrent starts
+	Thread_CriticalEnter();
+
+	if(!Task_isRunning) {
+		if(Thread_SemaphoreCreate(&Task_wakeSema, 0) != TD_SUCCESS) {
+			ret = 0;
+		}
+		else if(Thread_CreateEx(&runner, Task_RunnerProc, NULL,
+		        TASK_STACKSIZE, TASK_PRIORITY) != TD_SUCCESS) {
+			Thread_SemaphoreDestroy(Task_wakeSema);
+			ret = 0;
+		}
+		else {
+			Task_isRunning = 1;
+		}
+	}
+
+	Thread_CriticalExit();
+
+	return ret;
+}
+
+void Task_Init(Task_t *task, Task_Func_t func, void *context) {
+	task->func = func;
+	task->context = context;
+	task->time = Thread_GetSysTicks();
+	task->sema = 0;
+	task->next = NULL;
+	task->postNext = NULL;
+	task->posted = 0;
+	task->state = TASK_STATE_IDLE;
+}
+
+void Task_DelayMs(Task_t *task, uint32_t delay) {
+	Task_Insert(task, Thread_GetSysTicks() + delay * THREAD_SYSTICK_MS, 0, TASK_STATE_TIMED);
+}
+
+uint8_t Task_DelayUntil(Task_t *task, uint32_t period) {
+	uint32_t deadline;
+
+	// The runner updates the previous deadline
+	Thread_CriticalEnter();
+	deadline = task->time + period * THREAD_SYSTICK_MS;
+	Task_Insert(task, deadline, 0, TASK_STATE_TIMED);
+	Thread_CriticalExit();
+
+	return !TASK_TIME_BEFORE(Thread_GetSysTicks(), deadline);
+}
+
+void Task_WaitSemaphore(Task_t *task, Thread_Semaphore_t sema, uint32_t timeout) {
+	Task_Insert(task, Thread_GetSysTicks() + timeout * THREAD_SYSTICK_MS, sema,
+		timeout == 0 ? TASK_STATE_FOREVER : TASK_STATE_TIMED);
+}
+
+void Task_Post(Task_t *task) {
+	uint32_t head;
+
+	if(AtomicOps_SwapRelease(&task->posted, 1) != 0) {
+		// Already in the post list
+		return;
+	}
+
+	do {
+		head = Task_postList;
+		task->postNext = (Task_t *) (uintptr_t) head;
+	} while(AtomicOps_CmpSwapRelease(&Task_postList, head,
+		(uint32_t) (uintptr_t) task) != head);
+
+	Task_Wake();
+}
+
+void Task_Cancel(Task_t *task) {
+	Thread_CriticalEnter();
+	Task_Unlink(task);
+	task->sema = 0;
+	Thread_CriticalExit();
+}
+
+Thread_Error_t Task_SemaphoreUp(Thread_Semaphore_t sema) {
+	Thread_Error_t ret;
+
+	ret = Thread_SemaphoreUp(sema);
+	Task_Wake();
+
+	return ret;
+}
@@ -37,9 +37,14 @@ void Queue_PushFront(Queue_t *queue, void *item) {
 		// Empty queue, set as tail
 		queue->tail = item;
 	}
+	else {
+		// Link old head back to item
+		QUEUE_HDR(queue->head)->prev = item;
+	}
 
 	// Link to head and set as head
 	QUEUE_HDR(item)->next = queue->head;
+	QUEUE_HDR(item)->prev = NULL;
 	queue->head = item;
 }
 
@@ -47,10 +52,12 @@ void Queue_PushBack(Queue_t *queue, void *item) {
 	if(queue->head == NULL) {
 		// Empty queue, set as head
 		queue->head = item;
+		QUEUE_HDR(item)->prev = NULL;
 	}
 	else {
 		// Link to old tail
 		QUEUE_HDR(queue->tail)->next = item;
+		QUEUE_HDR(item)->prev = queue->tail;
 	}
 
 	// Make item terminal and set as tail
@@ -58,6 +65,24 @@ void Queue_PushBack(Queue_t *queue, void *item) {
 	queue->tail = item;
 }
 
+void Queue_InsertAfter(Queue_t *queue, void *prev, void *item) {
+	if(prev == NULL) {
+		// Insert as first
+		Queue_PushFront(queue, item);
+	}
+	else if(QUEUE_HDR(prev)->next == NULL) {
+		// Insert as last
+		Queue_PushBack(queue, item);
+	}
+	else {
+		// Middle insertion
+		QUEUE_HDR(item)->next = QUEUE_HDR(prev)->next;
+		QUEUE_HDR(item)->prev = prev;
+		QUEUE_HDR(QUEUE_HDR(prev)->next)->prev = item;
+		QUEUE_HDR(prev)->next = item;
+	}
+}
+
 void *Queue_PopFront(Queue_t *queue) {
 	void *front;
 
@@ -69,24 +94,33 @@ void *Queue_PopFront(Queue_t *queue) {
 
 	// Pop front off head
 	queue->head = QUEUE_HDR(front)->next;
+	if(queue->head != NULL) {
+		QUEUE_HDR(queue->head)->prev = NULL;
+	}
 
 	return front;
 }
 
-void Queue_Remove(Queue_t *queue, void *prev, void *item) {
+void Queue_Remove(Queue_t *queue, void *item) {
+	void *prev, *next;
+
+	prev = QUEUE_HDR(item)->prev;
+	next = QUEUE_HDR(item)->next;
+
 	if(prev == NULL) {
 		// Remove from front, emptying list
 		// if this is the only item in queue
-		queue->head = QUEUE_HDR(item)->next;
+		queue->head = next;
 	}
-	else if(QUEUE_HDR(item)->next == NULL) {
-		// Remove from back (this isn't the
-		// only item in queue)
-		QUEUE_HDR(prev)->next = NULL;
+	else {
+		QUEUE_HDR(prev)->next = next;
+	}
+
+	if(next == NULL) {
+		// Remove from back
 		queue->tail = prev;
 	}
 	else {
-		// Middle removal
-		QUEUE_HDR(prev)->next = QUEUE_HDR(item)->next;
+		QUEUE_HDR(next)->prev = prev;
 	}
 }
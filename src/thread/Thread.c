@@ -23,23 +23,72 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include <M451Series.h>
 #include <Thread.h>
 #include <AtomicOps.h>
 #include <Queue.h>
 
+#ifdef _NEWLIB_VERSION
+#include <reent.h>
+#endif
+
 /* Load value for Systick. */
 #define THREAD_SYSTICK_LOAD (SystemCoreClock / 1000 / THREAD_SYSTICK_MS)
 
+/* Maximum SysTick period, in system ticks. */
+#define THREAD_SYSTICK_MAXPERIOD ((SysTick_LOAD_RELOAD_Msk + 1) / THREAD_SYSTICK_LOAD)
+
+/* Minimum SysTick period, in cycles. Shorter periods are extended by one tick. */
+#define THREAD_SYSTICK_MINCYCLES 256
+
 /* Thread quantum, in system ticks. */
 #define THREAD_QUANTUM 20
 
 /* Number of remaining ticks before preemption after a delay to justify busy looping it. */
 #define THREAD_DELAY_MARGIN (THREAD_QUANTUM / 5)
 
+/* Maximum delay for a single chrono heap insertion, in milliseconds.
+ * Keeps all wakeup times within 2^31 ticks of each other, so that
+ * they can be compared across system time wraparound. */
+#define THREAD_DELAY_MAX (INT32_MAX / THREAD_SYSTICK_MS)
+
+/* True if system time a comes before b. Correct across wraparound,
+ * as long as the two times are less than 2^31 ticks apart. */
+#define THREAD_TIME_BEFORE(a, b) ((int32_t) ((a) - (b)) < 0)
+
+/* Stack size for the idle thread. The idle hook runs on this stack. */
+#define THREAD_IDLE_STACKSIZE 512
+
+/* Minimum length of an idle statistics window, in system ticks. */
+#define THREAD_IDLE_WINDOW (1000 * THREAD_SYSTICK_MS)
+
 /* Set when thread is ready for execution, not set when suspended. */
-#define THREAD_STATE_MSK_READY (1 << 0)
+#define THREAD_STATE_MSK_READY   (1 << 0)
+/* Set when thread is in the chrono heap. */
+#define THREAD_STATE_MSK_TIMED   (1 << 1)
+/* Set when a timed wait has timed out. */
+#define THREAD_STATE_MSK_TIMEOUT (1 << 2)
+/* Set when the object the thread was waiting on has been destroyed. */
+#define THREAD_STATE_MSK_DESTROYED (1 << 3)
+/* Set when the thread yielded, until the scheduler runs. */
+#define THREAD_STATE_MSK_YIELD   (1 << 4)
+/* Set when the thread lives in caller-provided storage. */
+#define THREAD_STATE_MSK_STATIC  (1 << 5)
+
+/* Pattern painted on thread stacks to track their high-water mark. */
+#define THREAD_STACK_PAINT 0xA5A5A5A5
+
+/* Wait types, i.e. what the thread is waiting on. */
+#define THREAD_WAIT_NONE  0
+#define THREAD_WAIT_SEMA  1
+#define THREAD_WAIT_MUTEX 2
+#define THREAD_WAIT_JOIN  3
+#define THREAD_WAIT_EVENT 4
+
+/* Timeout value for untimed waits. */
+#define THREAD_TIMEOUT_NONE UINT32_MAX
 
 /* Invalid magic, must be different from all magics. */
 #define THREAD_MAGIC_INVALID 0x00000000
@@ -47,26 +96,56 @@
 #define THREAD_MAGIC_TCB     0x44524854
 /* Semaphore magic: 'SEMA'. */
 #define THREAD_MAGIC_SEMA    0x414D4553
+/* Mutex magic: 'MUTX'. */
+#define THREAD_MAGIC_MUTEX   0x5854554D
+/* Event flags magic: 'EVNT'. */
+#define THREAD_MAGIC_EVENT   0x544E5645
+/* Message queue magic: 'MSGQ'. */
+#define THREAD_MAGIC_MSGQ    0x5147534D
+
+/* RAM bounds. Ports can override these from the device header. */
+#ifndef THREAD_RAM_START
+#define THREAD_RAM_START 0x20000000
+#endif
+#ifndef THREAD_RAM_END
+#define THREAD_RAM_END   0x20008000
+#endif
 
 /* True if the size bytes that ptr points to fully reside in RAM. */
-#define THREAD_CHECK_RAM(ptr, size) (((uint32_t) (ptr)) >= 0x20000000 && \
-	((uint32_t) (ptr)) + (size) <= 0x20008000)
+#define THREAD_CHECK_RAM(ptr, size) (((uint32_t) (ptr)) >= THREAD_RAM_START && \
+	((uint32_t) (ptr)) + (size) <= THREAD_RAM_END)
 /* True if tcb points to a valid TCB. Needs critical section to protect from exit. */
 #define THREAD_CHECK_TCB(tcb) (THREAD_CHECK_RAM((tcb), sizeof(Thread_TCB_t)) && \
 	((Thread_TCB_t *) (tcb))->magic == THREAD_MAGIC_TCB)
 /* True if sema points to a valid semaphore. Needs critical section to protect from destruction. */
 #define THREAD_CHECK_SEMA(sema) (THREAD_CHECK_RAM((sema), sizeof(Thread_SemaphoreInternal_t)) && \
 	((Thread_SemaphoreInternal_t *) (sema))->magic == THREAD_MAGIC_SEMA)
+/* True if mutex points to a valid mutex. Needs critical section to protect from destruction. */
+#define THREAD_CHECK_MUTEX(mutex) (THREAD_CHECK_RAM((mutex), sizeof(Thread_MutexInternal_t)) && \
+	((Thread_MutexInternal_t *) (mutex))->magic == THREAD_MAGIC_MUTEX)
+/* True if flags points to valid event flags. Needs critical section to protect from destruction. */
+#define THREAD_CHECK_EVENT(flags) (THREAD_CHECK_RAM((flags), sizeof(Thread_EventFlagsInternal_t)) && \
+	((Thread_EventFlagsInternal_t *) (flags))->magic == THREAD_MAGIC_EVENT)
+
+/* True if queue points to a valid message queue. Needs critical section to protect from destruction. */
+#define THREAD_CHECK_MSGQ(queue) (THREAD_CHECK_RAM((queue), sizeof(Thread_MsgQueueInternal_t)) && \
+	((Thread_MsgQueueInternal_t *) (queue))->magic == THREAD_MAGIC_MSGQ)
+
+/* True if the event flags value satisfies a wait for mask with the given mode. */
+#define THREAD_EVENT_MATCH(value, mask, mode) (((mode) & THREAD_EVENTFLAGS_ALL) ? \
+	((value) & (mask)) == (mask) : ((value) & (mask)) != 0)
 
 /* Number of the current exception, or 0 in thread mode. */
 #define THREAD_GET_IRQN() (__get_IPSR() & 0xFF)
 
 /* Marks a thread ready and pushes it to back of ready queue, taking care of IRQ masking. */
 #define THREAD_READY(tcb) do { \
-	tcb->state |= THREAD_STATE_MSK_READY; \
-	uint32_t primask = Thread_IrqDisable(); \
-	Queue_PushBack(&Thread_readyQueue, tcb); \
-	Thread_IrqRestore(primask); } while(0)
+	uint32_t basepri = Thread_KernelEnter(); \
+	Thread_ReadyQueuePush(tcb); \
+	Thread_KernelExit(basepri); } while(0)
+
+/* Highest priority with at least one ready thread. Thread_readyMask must not be zero. */
+#define THREAD_READYMASK_TOP() (31 - __CLZ(Thread_readyMask))
 
 /* Thread_StackedContext_t size, aligned to 8-byte boundary. */
 #define THREAD_HWCTX_SIZE_ALIGN ((sizeof(Thread_StackedContext_t) + 7) & ~7)
@@ -79,6 +158,12 @@
 #ifdef EVICSDK_FPU_SUPPORT
 /* NOT set in EXC_RETURN if the thread used FPU at least once. */
 #define THREAD_ER_MSK_FPCTX (1 << 4)
+
+/* Number of FPU context save areas, i.e. maximum number of
+ * live threads that have used the FPU. Must be 1 to 32. */
+#ifndef THREAD_FPU_CONTEXTS
+#define THREAD_FPU_CONTEXTS 4
+#endif
 #endif
 
 /* Creates the return value for Thread_Schedule(). */
@@ -86,7 +171,17 @@
 	((((uint64_t)(uint32_t) (oldCtx)) << 32) | ((uint32_t) (newCtx)))
 
 /* Marks the scheduler as pending by flagging PendSV. */
+#ifndef THREAD_PEND_SCHED
 #define THREAD_PEND_SCHED() do { SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk; } while(0)
+#endif
+
+/* Reads the CPU cycle counter. */
+#ifndef THREAD_GET_CYCLES
+#define THREAD_GET_CYCLES() (DWT->CYCCNT)
+#endif
+
+/* BASEPRI value for the kernel lock. */
+#define THREAD_KERNEL_BASEPRI (THREAD_KERNEL_PRIORITY << (8 - __NVIC_PRIO_BITS))
 
 /* Busy waits for the current thread to become ready again. */
 #define THREAD_WAIT_READY() do {} while( \
@@ -131,10 +226,6 @@ typedef struct {
 	uint32_t r[8];
 	/**< EXC_RETURN to be used when resuming. */
 	uint32_t er;
-#ifdef EVICSDK_FPU_SUPPORT
-	/**< Software-saved FPU registers: S0-S31. */
-	uint32_t s[32];
-#endif
 } Thread_SoftwareContext_t;
 
 #ifdef EVICSDK_FPU_SUPPORT
@@ -144,13 +235,13 @@ typedef struct {
  */
 typedef struct {
 	/**
-	 * Pointer to software-saved FPU state (Thread_SoftwareContex_t.s)
+	 * Pointer to software-saved FPU state (Thread_TCB_t.fpuCtx)
 	 * of the thread that held FPU last. Will be saved when another
 	 * thread uses the FPU. NULL if no thread holds the FPU state.
 	 */
 	uint32_t *holderCtx;
 	/**
-	 * Pointer to software-saved FPU state (Thread_SoftwareContext_t.s)
+	 * Pointer to software-saved FPU state (Thread_TCB_t.fpuCtx)
 	 * for the current thread. Will be restored when the current thread
 	 * uses the FPU. NULL if the current thread has no FPU state.
 	 * Shared with the UsageFault handler.
@@ -159,6 +250,8 @@ typedef struct {
 } Thread_FpuState_t;
 #endif
 
+struct Thread_MutexInternal;
+
 /**
  * Thread control block.
  * Field order is arranged first to minimize
@@ -168,27 +261,69 @@ typedef struct {
 typedef struct Thread_TCB {
 	/**< Next TCB in queue. */
 	struct Thread_TCB *next;
+	/**< Previous TCB in queue. */
+	struct Thread_TCB *prev;
 	/**< TCB magic. */
 	uint32_t magic;
 	/**< Pointer to the allocated memory block. */
 	void *blockPtr;
 	/**< Software-saved thread context. */
 	Thread_SoftwareContext_t ctx;
-	/**< State-specific info field. */
-	union {
-		/**< Executing: system time for preemption. */
-		uint32_t preemptTime;
-		/**< In chrono list: system time for wakeup. */
-		uint32_t chronoTime;
-	} info;
+	/**< Executing: system time for preemption. */
+	uint32_t preemptTime;
+	struct {
+		/**< System time for wakeup. Not shared with preemptTime:
+		 *   a thread woken from a timed wait is still in the
+		 *   heap until it cancels its timeout. */
+		uint32_t time;
+		/**< First child, or NULL. */
+		struct Thread_TCB *child;
+		/**< Next sibling, or NULL. */
+		struct Thread_TCB *sibling;
+		/**< Previous sibling, or parent for the first child. */
+		struct Thread_TCB *prev;
+	} chrono;
 	struct {
 		/**< TCB of thread that joined this one, or NULL. */
 		struct Thread_TCB *tcb;
 		/**< Pointer to store return value (if tcb != NULL). */
 		void **retPtr;
 	} join;
+	/**< Object the thread is waiting on (see waitType). */
+	void *waitObj;
+	/**< List of mutexes held by the thread. */
+	struct Thread_MutexInternal *heldMutex;
+	/**< C library reentrancy state, or NULL to use the global one. */
+	struct _reent *reent;
+#ifdef EVICSDK_FPU_SUPPORT
+	/**< Software-saved FPU registers (S0-S31), taken from the FPU
+	 *   context pool on first FPU use. NULL if FPU never used. */
+	uint32_t *fpuCtx;
+#endif
+	struct {
+		/**< Next TCB in the list of all threads. */
+		struct Thread_TCB *next;
+		/**< Previous TCB in the list of all threads. */
+		struct Thread_TCB *prev;
+	} all;
+	struct {
+		/**< CPU time used, in cycles. */
+		uint64_t cpuCycles;
+		/**< Number of times the thread was switched in. */
+		uint32_t switches;
+		/**< Number of times the thread gave up the CPU. */
+		uint32_t voluntary;
+		/**< Number of times the thread was preempted. */
+		uint32_t involuntary;
+	} stats;
 	/**< Thread state. */
 	uint8_t state;
+	/**< Effective thread priority, including inheritance. */
+	uint8_t priority;
+	/**< Base thread priority, as set by the user. */
+	uint8_t basePriority;
+	/**< Wait type (THREAD_WAIT_*). Synchronization: interrupt masking. */
+	uint8_t waitType;
 } Thread_TCB_t;
 
 /**
@@ -202,32 +337,148 @@ typedef struct {
 	volatile int32_t count;
 	/**< Queue of threads waiting on an up. Synchronization: interrupt masking. */
 	Queue_t waitQueue;
+	/**< True if the semaphore lives in caller-provided storage. */
+	uint8_t isStatic;
 } Thread_SemaphoreInternal_t;
 
 /**
  * Mutex.
+ * Synchronization: global critical section.
  */
-typedef struct {
-	/**< Binary semaphore for the mutex. */
-	Thread_SemaphoreInternal_t sema;
+typedef struct Thread_MutexInternal {
+	/**< Mutex magic. */
+	uint32_t magic;
 	/**< Thread that locked the mutex. NULL when unlocked. */
 	Thread_TCB_t *owner;
+	/**< Next mutex in the owner's held list. */
+	struct Thread_MutexInternal *nextHeld;
+	/**< Queue of waiting threads, ordered by priority. */
+	Queue_t waitQueue;
+	/**< Maximum time a thread has been blocked on the mutex, in ticks. */
+	uint32_t maxBlockTime;
+	/**< Number of times the owner locked the mutex. */
+	uint16_t lockCount;
+	/**< Priority ceiling. THREAD_PRIORITY_MIN for none. */
+	uint8_t ceiling;
+	/**< True if the mutex lives in caller-provided storage. */
+	uint8_t isStatic;
 } Thread_MutexInternal_t;
 
 /**
- * Ready threads queue.
+ * Event flags group.
+ * Synchronization: global critical section.
+ */
+typedef struct {
+	/**< Event flags magic. */
+	uint32_t magic;
+	/**< Current flags. Synchronization: interrupt masking. */
+	volatile uint32_t value;
+	/**< Queue of waiters (Thread_EventWaiter_t). Synchronization: interrupt masking. */
+	Queue_t waitQueue;
+	/**< True if the group lives in caller-provided storage. */
+	uint8_t isStatic;
+} Thread_EventFlagsInternal_t;
+
+/**
+ * Event flags waiter.
+ * Lives on the stack of the waiting thread, which
+ * points to it through waitObj while waiting.
+ */
+typedef struct Thread_EventWaiter {
+	/**< Next waiter in queue. */
+	struct Thread_EventWaiter *next;
+	/**< Previous waiter in queue. */
+	struct Thread_EventWaiter *prev;
+	/**< Waiting thread. */
+	Thread_TCB_t *tcb;
+	/**< Event flags group being waited on. */
+	Thread_EventFlagsInternal_t *events;
+	/**< Flags being waited for. */
+	uint32_t mask;
+	/**< Flags that satisfied the wait, set on wakeup. */
+	uint32_t result;
+	/**< Wait mode (THREAD_EVENTFLAGS_*). */
+	uint8_t mode;
+} Thread_EventWaiter_t;
+
+/**
+ * Message queue.
+ * Slots go through reserved -> published -> being read -> free.
+ * Reserved slots are published in bulk when the last outstanding
+ * reservation is committed, and slots being read are freed in bulk
+ * when the last outstanding read completes. This keeps the ring in
+ * order even when ISRs preempt a copy in progress.
+ * Synchronization: global critical section, interrupt
+ * masking for indices and counters.
+ */
+typedef struct {
+	/**< Message queue magic. */
+	uint32_t magic;
+	/**< Message buffer. */
+	uint8_t *buffer;
+	/**< Size of a message, in bytes. */
+	uint16_t msgSize;
+	/**< Number of message slots. */
+	uint16_t msgCount;
+	/**< Index of the next slot to read. */
+	uint16_t readIndex;
+	/**< Index of the next slot to reserve. */
+	uint16_t writeIndex;
+	/**< Number of free slots. */
+	uint16_t freeCount;
+	/**< Number of reserved slots not yet committed. */
+	uint16_t reserveCount;
+	/**< Number of committed slots not yet published. */
+	uint16_t commitCount;
+	/**< Number of reads in progress. */
+	uint16_t readCount;
+	/**< Number of read slots not yet freed. */
+	uint16_t doneCount;
+	/**< True if the queue lives in caller-provided storage. */
+	uint8_t isStatic;
+	/**< Counts published messages. */
+	Thread_SemaphoreInternal_t msgSema;
+} Thread_MsgQueueInternal_t;
+
+/* Public static storage sizes must match the internal structures. */
+_Static_assert(sizeof(Thread_TCB_t) <= THREAD_STATIC_TCB_SIZE,
+	"THREAD_STATIC_TCB_SIZE is too small");
+_Static_assert(THREAD_STACKGUARD_SIZE + THREAD_HWCTX_SIZE_ALIGN == THREAD_STATIC_STACK_OVERHEAD,
+	"THREAD_STATIC_STACK_OVERHEAD mismatch");
+_Static_assert(THREAD_STACKGUARD_SIZE == THREAD_STATIC_ALIGN,
+	"THREAD_STATIC_ALIGN mismatch");
+_Static_assert(sizeof(Thread_SemaphoreInternal_t) <= sizeof(Thread_SemaphoreStatic_t),
+	"Thread_SemaphoreStatic_t is too small");
+_Static_assert(sizeof(Thread_MutexInternal_t) <= sizeof(Thread_MutexStatic_t),
+	"Thread_MutexStatic_t is too small");
+_Static_assert(sizeof(Thread_EventFlagsInternal_t) <= sizeof(Thread_EventFlagsStatic_t),
+	"Thread_EventFlagsStatic_t is too small");
+_Static_assert(sizeof(Thread_MsgQueueInternal_t) <= sizeof(Thread_MsgQueueStatic_t),
+	"Thread_MsgQueueStatic_t is too small");
+
+/**
+ * Ready threads queues, one per priority level.
+ * The current thread is never in a ready queue.
  * Accessed by threads, scheduler and other ISRs.
  * Synchronization: interrupt masking.
  */
-static Queue_t Thread_readyQueue;
+static Queue_t Thread_readyQueue[THREAD_PRIORITY_COUNT];
+
+/**
+ * Ready queues bitmap. Bit N is set if and only if
+ * Thread_readyQueue[N] is not empty.
+ * Synchronization: interrupt masking.
+ */
+static uint32_t Thread_readyMask;
 
 /**
- * Chronologically ordered queue of suspended threads
- * waiting for a timed event.
+ * Root of the chrono heap, or NULL if empty.
+ * The chrono heap is a pairing heap of suspended threads
+ * waiting for a timed event, ordered by chrono.time.
  * Accessed by threads and scheduler.
  * Synchronization: global critical section.
  */
-static Queue_t Thread_chronoQueue;
+static Thread_TCB_t *Thread_chronoHeap;
 
 /**
  * Current thread TCB.
@@ -236,16 +487,90 @@ static Queue_t Thread_chronoQueue;
  */
 static Thread_TCB_t *Thread_curTcb = NULL;
 
+/**
+ * Head of the list of all threads, including the idle thread.
+ * Accessed by threads.
+ * Synchronization: global critical section.
+ */
+static Thread_TCB_t *Thread_allList;
+
+/**
+ * System time of the last context switch, and cycles
+ * left to the next tick boundary at that time.
+ * Used for CPU time accounting.
+ * Synchronization: accessed only by the scheduler.
+ */
+static uint32_t Thread_switchTime, Thread_switchToNext;
+
+/**
+ * Idle thread TCB. The idle thread is never in a ready queue: it
+ * is scheduled only when no other thread is ready.
+ * Set up by Thread_Init, read-only afterwards.
+ */
+static Thread_TCB_t *Thread_idleTcb;
+
+/**
+ * Static storage for the idle thread.
+ */
+static THREAD_STATIC_STORAGE(Thread_idleStorage, THREAD_IDLE_STACKSIZE);
+
+/**
+ * User idle hook, or NULL.
+ */
+static volatile Thread_IdleHook_t Thread_idleHook;
+
+/**
+ * Idle statistics state.
+ * Accessed by the idle thread and by Thread_GetIdleStats.
+ * Synchronization: interrupt masking.
+ */
+static struct {
+	/**< Start of the current window, in system ticks. */
+	uint32_t windowStart;
+	/**< Idle time in the current window, in cycles. */
+	uint32_t windowIdleCycles;
+	/**< Total idle time, in system ticks. */
+	uint32_t totalIdle;
+	/**< Leftover idle cycles not yet accounted in totalIdle. */
+	uint32_t totalIdleCycles;
+	/**< CPU load over the last window, in tenths of percent. */
+	uint16_t load;
+} Thread_idleStats;
+
 /**
  * Critical section counter. Zero when not in a critical section.
  */
 static volatile uint32_t Thread_criticalCount;
 
 /**
- * System time.
+ * System time at which the current SysTick period ends.
+ * SysTick is reprogrammed so that periods always end on a
+ * tick boundary, so the current time can be computed from
+ * this and the SysTick counter (see Thread_SysTickNow()).
  * Wraps around at 49 days, 17:02:47.296.
+ * Synchronization: interrupt masking.
+ */
+static uint32_t Thread_sysTickEnd;
+
+/**
+ * Kernel lock statistics.
+ * Synchronization: kernel lock.
+ */
+static Thread_LockStats_t Thread_lockStats;
+
+/**
+ * Cycle counter value when the outermost kernel lock was taken.
+ * Synchronization: kernel lock.
+ */
+static uint32_t Thread_lockStart;
+
+/**
+ * Pending deferred calls, as a Thread_Deferred_t pointer.
+ * This is a lock-free LIFO list: ISRs at any priority push to it
+ * and the PendSV handler takes the whole list.
+ * Synchronization: atomic operations.
  */
-volatile uint32_t Thread_sysTick;
+static volatile uint32_t Thread_deferredList;
 
 #ifdef EVICSDK_FPU_SUPPORT
 /**
@@ -255,284 +580,1119 @@ volatile uint32_t Thread_sysTick;
  * faults generated by higher priority FPU-using ISRs.
  */
 Thread_FpuState_t Thread_fpuState;
+
+/**
+ * FPU context pool. Slots are taken by threads on their first
+ * FPU use, so that integer-only threads don't pay for them.
+ */
+static uint32_t Thread_fpuPool[THREAD_FPU_CONTEXTS][32];
+
+/**
+ * FPU context pool usage mask. Bit N is set if slot N is taken.
+ * Synchronization: IRQ masking (see Thread_fpuState).
+ */
+static uint32_t Thread_fpuPoolUsed;
 #endif
 
 /**
- * Inserts a thread into a queue ordered by info.chronoTime.
+ * Takes the kernel lock, masking interrupts at the kernel
+ * priority and below, and starts timing it if outermost.
  * This is an internal function.
  *
- * @param queue Queue.
- * @param tcb   TCB to insert.
+ * @return Previous BASEPRI, for Thread_KernelExit().
  */
-static void Thread_ChronoQueueInsert(Queue_t *queue, Thread_TCB_t *tcb) {
-	Thread_TCB_t *prev, *next;
+__attribute__((always_inline)) static inline uint32_t Thread_KernelEnter() {
+	uint32_t basepri;
 
-	// Look up insertion place
-	// If a TCB has the same chronoTime as this one we
-	// insert before it to save iterations, since TCBs
-	// with the same chronoTime are handled together.
-	prev = NULL;
-	next = queue->head;
-	while(next != NULL && next->info.chronoTime < tcb->info.chronoTime) {
-		prev = next;
-		next = next->next;
+	basepri = __get_BASEPRI();
+	__set_BASEPRI_MAX(THREAD_KERNEL_BASEPRI);
+	__ISB();
+	if(basepri == 0) {
+		Thread_lockStart = THREAD_GET_CYCLES();
 	}
 
-	if(prev == NULL) {
-		// Insert as first
-		Queue_PushFront(queue, tcb);
-	}
-	else if(next == NULL) {
-		// Insert as last
-		Queue_PushBack(queue, tcb);
-	}
-	else {
-		// Middle insertion
-		tcb->next = next;
-		prev->next = tcb;
-	}
+	return basepri;
 }
 
 /**
- * Updates the ready queue, moving suspended threads
- * in the chronological list to it when they become ready.
- * Assumes a critical section has been acquired. Disables
- * and re-enables interrupts for ready queue push only when
- * a new ready thread is found.
+ * Releases the kernel lock, accounting its duration if outermost.
  * This is an internal function.
  *
- * @return True if at least one thread was added to the ready
- *         queue, false otherwise.
+ * @param basepri Previous BASEPRI, from Thread_KernelEnter().
  */
-static uint8_t Thread_UpdateReadyQueueFromChrono() {
-	Thread_TCB_t *tcb;
-	uint8_t found = 0;
+__attribute__((always_inline)) static inline void Thread_KernelExit(uint32_t basepri) {
+	uint32_t cycles;
 
-	while((tcb = Thread_chronoQueue.head) != NULL && tcb->info.chronoTime <= Thread_sysTick) {
-		// Wake up this thread (always removing from front)
-		Queue_Remove(&Thread_chronoQueue, NULL, tcb);
-		THREAD_READY(tcb);
-		found = 1;
+	if(basepri == 0) {
+		cycles = THREAD_GET_CYCLES() - Thread_lockStart;
+		if(cycles > Thread_lockStats.maxCycles) {
+			Thread_lockStats.maxCycles = cycles;
+		}
+		Thread_lockStats.count++;
 	}
-
-	return found;
+	__set_BASEPRI(basepri);
 }
 
 /**
- * Sets up memory protection for the stack guard.
- * Must be called from ISR context with IRQs disabled.
+ * Runs all pending deferred calls. Called from PendSV.
  * This is an internal function.
- *
- * @param guardPtr Pointer to beginning of stack guard.
- *                 Must be aligned to stack guard size.
  */
-static void Thread_SetupStackGuard(void *guardPtr) {
-	uint32_t attrAndSize;
-
-	// No need for pre-update memory barrier because the
-	// stack guard is strongly-ordered.
-
-	attrAndSize =
-		(1 << MPU_RASR_XN_Pos    ) | // Instruction fetch disabled
-		(0 << MPU_RASR_AP_Pos    ) | // No access permissions
-		(0 << MPU_RASR_TEX_Pos   ) | // Non-cacheable
-		(0 << MPU_RASR_S_Pos     ) | // Shareable (ignored)
-		(0 << MPU_RASR_C_Pos     ) | // Non-normal
-		(0 << MPU_RASR_B_Pos     ) | // Strongly-ordered
-		(0 << MPU_RASR_SRD_Pos   ) | // No subregions
-		(1 << MPU_RASR_ENABLE_Pos) | // Enabled
-		((THREAD_STACKGUARD_SIZE_EXP - 1) << MPU_RASR_SIZE_Pos); // Size = 2^(SIZE+1)
-
-	// Since our attributes and size are constant, we don't
-	// need to disable the region before updating the base
-	// address: it'll be invalid only at first setup, and the
-	// region isn't yet enabled at that point.
-
-	// Switch to stack guard region
-	MPU->RNR = THREAD_STACKGUARD_REGNUM << MPU_RNR_REGION_Pos;
-	// Configure base address
-	MPU->RBAR = (uint32_t) guardPtr;
-	// Configure attributes and size
-	MPU->RASR = attrAndSize;
-
-	// No need for post-update memory barrier and pipeline flush
-	// because we're always returning from an exception when the
-	// thread gets control back (this must be called from ISR).
+static void Thread_DeferredRun() {
+	Thread_Deferred_t *deferred, *next;
+	uint32_t bits;
+
+	deferred = (Thread_Deferred_t *) (uintptr_t) AtomicOps_SwapAcquire(&Thread_deferredList, 0);
+	while(deferred != NULL) {
+		// Read next before taking the bits: once pending
+		// is zero, the call can be pushed again.
+		next = deferred->next;
+		bits = AtomicOps_SwapAcquire(&deferred->pending, 0);
+		deferred->func(bits);
+		deferred = next;
+	}
 }
 
-#ifdef EVICSDK_FPU_SUPPORT
 /**
- * Enables/disables the FPU.
+ * Gets the current system time from the SysTick counter.
+ * Must be called with IRQs masked.
+ * This is an internal function.
  *
- * @param enable True to enable, false to disable.
+ * @param expired True if the current SysTick period is known
+ *                to have ended (i.e. from SysTick_Handler).
+ * @param toNext  Pointer to receive the number of cycles left
+ *                until the next tick boundary.
+ *
+ * @return Current system time, in ticks.
  */
-static void Thread_FpuControl(uint8_t enable) {
-	if(enable) {
-		// Enable CP10/CP11, i.e. CPACR[23:20] = 1111
-		SCB->CPACR |= (0xFUL << 20);
+static uint32_t Thread_SysTickNow(uint8_t expired, uint32_t *toNext) {
+	uint32_t val, cycles, ticks;
+
+	val = SysTick->VAL;
+	if(!expired && (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)) {
+		// Period ended, but the handler hasn't run yet. The
+		// counter might have reloaded after we read it, re-read.
+		expired = 1;
+		val = SysTick->VAL;
+	}
+
+	if(expired) {
+		// Counter reloaded at the end of the period, which
+		// is on a tick boundary: count forward from it.
+		cycles = (val == 0 ? 0 : SysTick->LOAD - val);
+		ticks = Thread_sysTickEnd + cycles / THREAD_SYSTICK_LOAD;
+		*toNext = THREAD_SYSTICK_LOAD - cycles % THREAD_SYSTICK_LOAD;
 	}
 	else {
-		// Disable CP10/CP11, i.e. CPACR[23:20] = 0000
-		SCB->CPACR &= ~(0xFUL << 20);
+		// Count backwards from the end of the period
+		ticks = Thread_sysTickEnd - (val + THREAD_SYSTICK_LOAD - 1) / THREAD_SYSTICK_LOAD;
+		*toNext = val % THREAD_SYSTICK_LOAD;
+		if(*toNext == 0) {
+			*toNext = THREAD_SYSTICK_LOAD;
+		}
 	}
 
-	// Ensure write completed, flush pipeline
-	__DMB();
-	__ISB();
+	return ticks;
 }
-#endif
 
 /**
- * Schedules the next thread. Called from PendSV.
+ * Programs SysTick to end the current period at the specified time.
+ * The deadline is clamped between the next tick and the maximum
+ * SysTick period. Writing the counter loses the few cycles between
+ * reading and restarting it, so this should only be called when the
+ * deadline actually changes.
+ * Must be called with IRQs masked.
  * This is an internal function.
  *
- * @param er EXC_RETURN from the PendSV handler.
- *           Ignored if FPU support is disabled.
- *
- * @return The lower 32 bits are the address of the software-saved
- *         context for the new thread. If NULL, no context switch
- *         is performed. The higher 32 bits are the address of the
- *         software-saved context for the old thread. If NULL, the
- *         old context isn't saved.
+ * @param deadline System time for the next SysTick interrupt.
+ * @param expired  True if the current SysTick period is known
+ *                 to have ended (i.e. from SysTick_Handler).
  */
-uint64_t Thread_Schedule(uint32_t er) {
-	Thread_TCB_t *nextTcb;
-	Thread_SoftwareContext_t *newCtx = NULL, *oldCtx = NULL;
-	uint8_t isCurReady;
-	uint32_t primask;
+static void Thread_SysTickProgram(uint32_t deadline, uint8_t expired) {
+	uint32_t now, delta, cycles, toNext;
 
-	if(Thread_criticalCount > 0) {
-		// Current thread is in a critical section, resume it
-		// Scheduler will be invoked again on section exit
-		return THREAD_MAKE_SCHEDRET(NULL, NULL);
+	now = Thread_SysTickNow(expired, &toNext);
+	delta = deadline - now;
+	if((int32_t) delta < 1) {
+		delta = 1;
 	}
-
-	// Since no thread is in a critical section we have free
-	// access to all internal data structures that are
-	// synchronized by a global critical section. When working
-	// with the ready queue we need to disable interrupts.
-
-	// Update ready queue before checking if there's something
-	// to do to amortize time complexity.
-	Thread_UpdateReadyQueueFromChrono();
-
-	if(Thread_curTcb != NULL && Thread_curTcb->info.preemptTime > Thread_sysTick) {
-		// Nothing to do
-		return THREAD_MAKE_SCHEDRET(NULL, NULL);
+	else if(delta > THREAD_SYSTICK_MAXPERIOD) {
+		delta = THREAD_SYSTICK_MAXPERIOD;
 	}
 
-	primask = Thread_IrqDisable();
-	isCurReady = (Thread_curTcb != NULL && Thread_curTcb->state & THREAD_STATE_MSK_READY);
-	// Short-circuit order is *very* important here
-	while((nextTcb = Queue_PopFront(&Thread_readyQueue)) == NULL && !isCurReady) {
-		// No ready threads to schedule.
-		// Instead of having an idle thread, we make use of
-		// the fact that we're running in a low priority
-		// PendSV interrupt, so we can busy wait for a thread
-		// to become ready. We're here because either:
-		//  - all threads are delayed, or suspended threads are
-		//    waiting on delayed threads or on semaphores that
-		//    will be released by delayed threads: we keep
-		//    updating the ready queue from the chrono list;
-		//  - all threads are waiting on each other or on semas
-		//    that will be released by other waiting threads,
-		//    resulting in a deadlock: scheduler death;
-		//  - all threads have terminated: scheduler death.
-		// If the scheduler dies, only ISRs will run from now on.
-		// To touch the ready queue we need to disable IRQs,
-		// but we can't keep them disabled, otherwise SysTick
-		// won't run. We re-enable interrupts and keep calling
-		// UpdateReadyQueueFromChrono() to find new ready threads
-		// from the chronological list. Since it disables IRQs
-		// only when it actually finds a new ready thread, we're
-		// good. We then disable IRQs for the Queue_PopFront() call.
-		Thread_IrqRestore(primask);
-		while(!Thread_UpdateReadyQueueFromChrono());
-		primask = Thread_IrqDisable();
+	// Align period end to tick boundary
+	cycles = (delta - 1) * THREAD_SYSTICK_LOAD + toNext;
+	if(cycles < THREAD_SYSTICK_MINCYCLES) {
+		// Too close to reliably make it, skip to next tick
+		cycles += THREAD_SYSTICK_LOAD;
+		delta++;
 	}
-	Thread_IrqRestore(primask);
-
-	// nextTcb can be NULL only if the current thread is ready and
-	// no other thread is. In that case, we'll just resume it.
-	if(nextTcb != NULL) {
-		// Thread_curTcb will be NULL only if this is the first
-		// run (from startup code) or if the current thread has
-		// been deleted. In both cases we don't want to save state.
-		if(Thread_curTcb != NULL) {
-			// Save old context
-			oldCtx = &Thread_curTcb->ctx;
-
-			if(isCurReady) {
-				// Current thread hasn't been suspended
-				// Push it to back of ready queue (round-robin)
-				THREAD_READY(Thread_curTcb);
-			}
-		}
 
-#ifdef EVICSDK_FPU_SUPPORT
-		uint32_t *prevFpuCtx = (Thread_curTcb != NULL ? Thread_curTcb->ctx.s : NULL);
-#endif
-
-		// Switch to next thread
-		Thread_curTcb = nextTcb;
-		newCtx = &Thread_curTcb->ctx;
-
-		primask = Thread_IrqDisable();
-
-#ifdef EVICSDK_FPU_SUPPORT
-		if(Thread_fpuState.curCtx == NULL && !(er & THREAD_ER_MSK_FPCTX)) {
-			// The previous thread used FPU for the first time
-			// The previous holder already had its context saved
-			Thread_fpuState.holderCtx = prevFpuCtx;
-		}
-		// Switch current FPU context. If a thread has never used FPU
-		// NULL its context to avoid useless saves. If it ends up using
-		// it, the holder will be updated (see above).
-		Thread_fpuState.curCtx = (Thread_curTcb->ctx.er & THREAD_ER_MSK_FPCTX ?
-			NULL : Thread_curTcb->ctx.s);
-		// If we're resuming the holder thread, enable FPU since
-		// registers are good. Otherwise, disable FPU and let lazy
-		// stacking do its job. Also disable FPU when curCtx is NULL,
-		// since we don't have FP context for that thread yet.
-		Thread_FpuControl(Thread_fpuState.curCtx != NULL &&
-			Thread_fpuState.curCtx == Thread_fpuState.holderCtx);
-#endif
+	// Writing VAL clears the counter, which will then
+	// reload from LOAD on the next clock cycle
+	SysTick->LOAD = cycles - 1;
+	SysTick->VAL = 0;
+	// The elapsed period (if any) has been accounted for
+	SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+	Thread_sysTickEnd = now + delta;
+}
 
-		// Configure stack guard: stack is at the beginning
-		// of the allocated block.
-		Thread_SetupStackGuard(Thread_curTcb->blockPtr);
+/**
+ * Programs SysTick for the next scheduling event, i.e. the first
+ * delayed thread wakeup or the current thread quantum expiry if
+ * other threads with the same priority are ready. If there is no
+ * event, the current period is left untouched.
+ * Must be called with IRQs masked.
+ * This is an internal function.
+ */
+static void Thread_SysTickUpdate() {
+	uint32_t deadline;
+	uint8_t found = 0;
 
-		Thread_IrqRestore(primask);
+	if(Thread_chronoHeap != NULL) {
+		deadline = Thread_chronoHeap->chrono.time;
+		found = 1;
+	}
+	if(Thread_curTcb != NULL && (Thread_readyMask & (1 << Thread_curTcb->priority)) &&
+	   (!found || THREAD_TIME_BEFORE(Thread_curTcb->preemptTime, deadline))) {
+		deadline = Thread_curTcb->preemptTime;
+		found = 1;
 	}
 
-	// Reset quantum
-	Thread_curTcb->info.preemptTime = Thread_sysTick + THREAD_QUANTUM;
-
-	return THREAD_MAKE_SCHEDRET(newCtx, oldCtx);
+	if(found && deadline != Thread_sysTickEnd) {
+		Thread_SysTickProgram(deadline, 0);
+	}
 }
 
 /**
- * System tick handler.
+ * Pushes a thread to the back of the ready queue for its priority.
+ * The thread state is not changed.
+ * Must be called with IRQs masked.
  * This is an internal function.
+ *
+ * @param tcb TCB to push.
  */
-void SysTick_Handler() {
-	Thread_sysTick++;
-
-	// TODO: make this smarter
-	THREAD_PEND_SCHED();
+static void Thread_ReadyQueueInsert(Thread_TCB_t *tcb) {
+	Queue_PushBack(&Thread_readyQueue[tcb->priority], tcb);
+	Thread_readyMask |= 1 << tcb->priority;
 }
 
 /**
- * Function to which a dying thread returns.
+ * Marks a thread as ready and pushes it to the ready queue.
+ * If the thread is the current one it is only marked as ready,
+ * since the scheduler takes care of requeuing it. If the thread
+ * has a higher priority than the current one, the scheduler is
+ * pended to preempt the current thread.
+ * Must be called with IRQs masked.
  * This is an internal function.
  *
- * @param ret Return value of the main thread procedure.
- *            This is taken as an argument because, on ARM,
- *            the R0 register is used both for first argument
- *            and return value.
+ * @param tcb TCB to push.
  */
-static void Thread_ExitProc(void *ret) {
-	Thread_CriticalEnter();
+static void Thread_ReadyQueuePush(Thread_TCB_t *tcb) {
+	tcb->state |= THREAD_STATE_MSK_READY;
+
+	if(tcb == Thread_curTcb) {
+		// Woken up before being switched out
+		return;
+	}
+
+	if(Thread_curTcb == Thread_idleTcb) {
+		// Idle thread is running: always preempt it
+		THREAD_PEND_SCHED();
+	}
+	else if(Thread_curTcb != NULL && (tcb->priority > Thread_curTcb->priority ||
+	   (tcb->priority == Thread_curTcb->priority &&
+	    !(Thread_readyMask & (1 << tcb->priority))))) {
+		// Higher priority: preempt the current thread. Same priority:
+		// the current quantum now matters, let the scheduler program it.
+		THREAD_PEND_SCHED();
+	}
+	Thread_ReadyQueueInsert(tcb);
+}
+
+/**
+ * Pops the highest priority thread off the ready queues.
+ * Must be called with IRQs masked.
+ * This is an internal function.
+ *
+ * @return Popped TCB, or NULL if no thread is ready.
+ */
+static Thread_TCB_t *Thread_ReadyQueuePop() {
+	Thread_TCB_t *tcb;
+	uint8_t priority;
+
+	if(Thread_readyMask == 0) {
+		return NULL;
+	}
+
+	priority = THREAD_READYMASK_TOP();
+	tcb = Queue_PopFront(&Thread_readyQueue[priority]);
+	if(Thread_readyQueue[priority].head == NULL) {
+		Thread_readyMask &= ~(1 << priority);
+	}
+
+	return tcb;
+}
+
+/**
+ * Removes a thread from the ready queue for its priority.
+ * The thread must be in the ready queue.
+ * Must be called with IRQs masked.
+ * This is an internal function.
+ *
+ * @param tcb TCB to remove.
+ */
+static void Thread_ReadyQueueRemove(Thread_TCB_t *tcb) {
+	Queue_t *queue;
+
+	queue = &Thread_readyQueue[tcb->priority];
+	Queue_Remove(queue, tcb);
+	if(queue->head == NULL) {
+		Thread_readyMask &= ~(1 << tcb->priority);
+	}
+}
+
+/**
+ * Merges two chrono heaps.
+ * The root of b must have no siblings. The root of a keeps its
+ * siblings only if it becomes the merged root.
+ * This is an internal function.
+ *
+ * @param a First heap root, or NULL.
+ * @param b Second heap root, or NULL.
+ *
+ * @return Merged heap root.
+ */
+static Thread_TCB_t *Thread_ChronoHeapMerge(Thread_TCB_t *a, Thread_TCB_t *b) {
+	Thread_TCB_t *tmp;
+
+	if(a == NULL) {
+		return b;
+	}
+	if(b == NULL) {
+		return a;
+	}
+
+	if(THREAD_TIME_BEFORE(b->chrono.time, a->chrono.time)) {
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	// Make b the first child of a
+	b->chrono.sibling = a->chrono.child;
+	if(b->chrono.sibling != NULL) {
+		b->chrono.sibling->chrono.prev = b;
+	}
+	b->chrono.prev = a;
+	a->chrono.child = b;
+
+	return a;
+}
+
+/**
+ * Merges a list of sibling heaps into a single heap, using the
+ * standard two-pass pairing. This is what gives the pairing heap
+ * its O(log n) amortized minimum removal.
+ * This is an internal function.
+ *
+ * @param first First heap in the sibling list, or NULL.
+ *
+ * @return Merged heap root, or NULL if the list was empty.
+ */
+static Thread_TCB_t *Thread_ChronoHeapMergePairs(Thread_TCB_t *first) {
+	Thread_TCB_t *a, *b, *next, *pairs, *root;
+
+	// First pass: merge pairs left to right,
+	// building a reversed list of the results
+	pairs = NULL;
+	while(first != NULL) {
+		a = first;
+		b = a->chrono.sibling;
+		next = (b != NULL ? b->chrono.sibling : NULL);
+		a->chrono.sibling = NULL;
+		if(b != NULL) {
+			b->chrono.sibling = NULL;
+		}
+		a = Thread_ChronoHeapMerge(a, b);
+		a->chrono.sibling = pairs;
+		pairs = a;
+		first = next;
+	}
+
+	// Second pass: merge results right to left
+	root = NULL;
+	while(pairs != NULL) {
+		next = pairs->chrono.sibling;
+		pairs->chrono.sibling = NULL;
+		root = Thread_ChronoHeapMerge(root, pairs);
+		pairs = next;
+	}
+
+	return root;
+}
+
+/**
+ * Inserts a thread into the chrono heap, ordered by chrono.time.
+ * Runs in O(1) time.
+ * This is an internal function.
+ *
+ * @param tcb TCB to insert.
+ */
+static void Thread_ChronoHeapInsert(Thread_TCB_t *tcb) {
+	tcb->chrono.child = NULL;
+	tcb->chrono.sibling = NULL;
+	Thread_chronoHeap = Thread_ChronoHeapMerge(Thread_chronoHeap, tcb);
+}
+
+/**
+ * Removes the earliest thread from the chrono heap.
+ * The heap must not be empty. Runs in O(log n) amortized time.
+ * This is an internal function.
+ *
+ * @return Removed TCB.
+ */
+static Thread_TCB_t *Thread_ChronoHeapPop() {
+	Thread_TCB_t *tcb;
+
+	tcb = Thread_chronoHeap;
+	Thread_chronoHeap = Thread_ChronoHeapMergePairs(tcb->chrono.child);
+
+	return tcb;
+}
+
+/**
+ * Removes a thread from the chrono heap.
+ * The thread must be in the heap. Runs in O(log n) amortized time.
+ * This is an internal function.
+ *
+ * @param tcb TCB to remove.
+ */
+static void Thread_ChronoHeapRemove(Thread_TCB_t *tcb) {
+	Thread_TCB_t *prev;
+
+	if(tcb == Thread_chronoHeap) {
+		Thread_ChronoHeapPop();
+		return;
+	}
+
+	// Detach subtree from its parent or left sibling
+	prev = tcb->chrono.prev;
+	if(prev->chrono.child == tcb) {
+		prev->chrono.child = tcb->chrono.sibling;
+	}
+	else {
+		prev->chrono.sibling = tcb->chrono.sibling;
+	}
+	if(tcb->chrono.sibling != NULL) {
+		tcb->chrono.sibling->chrono.prev = prev;
+	}
+
+	// Merge children back into the heap
+	Thread_chronoHeap = Thread_ChronoHeapMerge(Thread_chronoHeap,
+		Thread_ChronoHeapMergePairs(tcb->chrono.child));
+}
+
+/**
+ * Changes the effective priority of a thread, moving it
+ * to the right ready queue if needed.
+ * This is an internal function.
+ *
+ * @param tcb      TCB.
+ * @param priority New effective priority.
+ */
+static void Thread_ChangePriority(Thread_TCB_t *tcb, uint8_t priority) {
+	uint32_t basepri;
+
+	basepri = Thread_KernelEnter();
+	if(tcb != Thread_curTcb && tcb->state & THREAD_STATE_MSK_READY) {
+		// Thread is in a ready queue, move it to the new one
+		Thread_ReadyQueueRemove(tcb);
+		tcb->priority = priority;
+		Thread_ReadyQueuePush(tcb);
+	}
+	else {
+		// Thread is running or suspended, it will be
+		// pushed to the right queue when needed
+		tcb->priority = priority;
+	}
+	Thread_KernelExit(basepri);
+}
+
+/**
+ * Inserts a thread into a mutex wait queue. The queue is
+ * kept ordered by priority, FIFO among equal priorities.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param mtx Mutex.
+ * @param tcb TCB to insert.
+ */
+static void Thread_MutexWaitInsert(Thread_MutexInternal_t *mtx, Thread_TCB_t *tcb) {
+	Thread_TCB_t *prev, *next;
+
+	prev = NULL;
+	next = mtx->waitQueue.head;
+	while(next != NULL && next->priority >= tcb->priority) {
+		prev = next;
+		next = next->next;
+	}
+
+	Queue_InsertAfter(&mtx->waitQueue, prev, tcb);
+}
+
+/**
+ * Removes a thread from a mutex wait queue.
+ * The thread must be in the queue.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param mtx Mutex.
+ * @param tcb TCB to remove.
+ */
+static void Thread_MutexWaitRemove(Thread_MutexInternal_t *mtx, Thread_TCB_t *tcb) {
+	Queue_Remove(&mtx->waitQueue, tcb);
+}
+
+/**
+ * Recomputes the effective priority of a thread. This is the
+ * highest among its base priority, the ceilings of the mutexes
+ * it holds and the priorities of the threads waiting on them.
+ * If the thread is itself waiting on a mutex, the change is
+ * propagated along the chain of mutex owners.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param tcb TCB.
+ */
+static void Thread_MutexUpdatePriority(Thread_TCB_t *tcb) {
+	Thread_MutexInternal_t *mtx;
+	Thread_TCB_t *waiter;
+	uint8_t priority;
+
+	while(tcb != NULL) {
+		priority = tcb->basePriority;
+		for(mtx = tcb->heldMutex; mtx != NULL; mtx = mtx->nextHeld) {
+			if(mtx->ceiling > priority) {
+				priority = mtx->ceiling;
+			}
+			// Wait queue is ordered, first waiter has highest priority
+			waiter = mtx->waitQueue.head;
+			if(waiter != NULL && waiter->priority > priority) {
+				priority = waiter->priority;
+			}
+		}
+
+		if(priority == tcb->priority) {
+			// Nothing changed, no need to propagate
+			break;
+		}
+		Thread_ChangePriority(tcb, priority);
+
+		// If we're waiting on a mutex, re-sort its
+		// wait queue and propagate to its owner
+		if(tcb->waitType != THREAD_WAIT_MUTEX) {
+			break;
+		}
+		mtx = tcb->waitObj;
+		Thread_MutexWaitRemove(mtx, tcb);
+		Thread_MutexWaitInsert(mtx, tcb);
+		tcb = mtx->owner;
+	}
+}
+
+/**
+ * Makes a thread the owner of an unlocked mutex.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param mtx Mutex.
+ * @param tcb New owner TCB.
+ */
+static void Thread_MutexTake(Thread_MutexInternal_t *mtx, Thread_TCB_t *tcb) {
+	mtx->owner = tcb;
+	mtx->lockCount = 1;
+	mtx->nextHeld = tcb->heldMutex;
+	tcb->heldMutex = mtx;
+	Thread_MutexUpdatePriority(tcb);
+}
+
+/**
+ * Fully releases a locked mutex, regardless of the lock count.
+ * Ownership is handed off to the highest priority waiting
+ * thread (if any), which is woken up. The old owner priority
+ * is recomputed.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param mtx Mutex.
+ */
+static void Thread_MutexRelease(Thread_MutexInternal_t *mtx) {
+	Thread_MutexInternal_t **link;
+	Thread_TCB_t *owner, *tcb;
+
+	// Remove from owner held list
+	owner = mtx->owner;
+	for(link = &owner->heldMutex; *link != mtx; link = &(*link)->nextHeld);
+	*link = mtx->nextHeld;
+
+	// Hand off to first waiter
+	mtx->owner = NULL;
+	mtx->lockCount = 0;
+	if((tcb = Queue_PopFront(&mtx->waitQueue)) != NULL) {
+		tcb->waitType = THREAD_WAIT_NONE;
+		Thread_MutexTake(mtx, tcb);
+		THREAD_READY(tcb);
+	}
+
+	// Drop any priority we inherited through this mutex
+	Thread_MutexUpdatePriority(owner);
+}
+
+/**
+ * Arms the timeout for a wait. The current thread is
+ * inserted into the chrono heap. It must be suspended
+ * before the critical section is released.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param timeout Timeout, in milliseconds. Must not
+ *                exceed THREAD_DELAY_MAX.
+ */
+static void Thread_WaitArm(uint32_t timeout) {
+	Thread_curTcb->chrono.time = Thread_GetSysTicks() + timeout * THREAD_SYSTICK_MS;
+	Thread_curTcb->state |= THREAD_STATE_MSK_TIMED;
+	Thread_ChronoHeapInsert(Thread_curTcb);
+}
+
+/**
+ * Finishes a wait after the current thread has been woken
+ * up. If the wakeup came before the timeout, the timeout is
+ * cancelled by removing the thread from the chrono heap.
+ * This is an internal function.
+ *
+ * @param destroyed Error to return if the object waited on
+ *                  has been destroyed (see Thread_WaitAbort()).
+ *
+ * @return TD_SUCCESS, TD_TIMEOUT if the wait timed out, or
+ *         destroyed if the object has been destroyed.
+ */
+static Thread_Error_t Thread_WaitFinish(Thread_Error_t destroyed) {
+	Thread_Error_t ret = TD_SUCCESS;
+
+	Thread_CriticalEnter();
+
+	if(Thread_curTcb->state & THREAD_STATE_MSK_TIMEOUT) {
+		ret = TD_TIMEOUT;
+	}
+	else {
+		if(Thread_curTcb->state & THREAD_STATE_MSK_TIMED) {
+			// Woken up before timeout, cancel it
+			Thread_ChronoHeapRemove(Thread_curTcb);
+		}
+		if(Thread_curTcb->state & THREAD_STATE_MSK_DESTROYED) {
+			ret = destroyed;
+		}
+	}
+	Thread_curTcb->state &= ~(THREAD_STATE_MSK_TIMED | THREAD_STATE_MSK_TIMEOUT |
+		THREAD_STATE_MSK_DESTROYED);
+
+	Thread_CriticalExit();
+
+	return ret;
+}
+
+/**
+ * Wakes up a thread waiting on an object that is being destroyed.
+ * The thread must already be removed from the object wait queue.
+ * Its wait returns the invalid handle error of the object, and a
+ * pending timeout is cancelled by Thread_WaitFinish(), so the
+ * destroyed object is never touched again.
+ * Must be called with IRQs masked.
+ * This is an internal function.
+ *
+ * @param tcb Waiting TCB.
+ */
+static void Thread_WaitAbort(Thread_TCB_t *tcb) {
+	tcb->waitType = THREAD_WAIT_NONE;
+	tcb->state |= THREAD_STATE_MSK_DESTROYED;
+	Thread_ReadyQueuePush(tcb);
+}
+
+/**
+ * Handles expiry of a thread popped off the chrono heap.
+ * If the thread is in a timed wait and hasn't been woken up
+ * yet, it's removed from the object it's waiting on and
+ * woken up with the timeout flag set. Delayed threads are
+ * simply woken up.
+ * Must be called from a critical section.
+ * This is an internal function.
+ *
+ * @param tcb Expired TCB.
+ */
+static void Thread_ChronoExpire(Thread_TCB_t *tcb) {
+	Thread_SemaphoreInternal_t *sm;
+	Thread_MutexInternal_t *mtx;
+	Thread_EventWaiter_t *waiter;
+	uint32_t basepri;
+
+	// Semaphores can be upped by ISRs, mask
+	// IRQs to settle who wakes up the thread
+	basepri = Thread_KernelEnter();
+	tcb->state &= ~THREAD_STATE_MSK_TIMED;
+	if(tcb->state & THREAD_STATE_MSK_READY) {
+		// Already woken up: the timeout lost, but the
+		// thread hasn't cancelled it yet. Nothing to do.
+		Thread_KernelExit(basepri);
+		return;
+	}
+
+	switch(tcb->waitType) {
+		case THREAD_WAIT_SEMA:
+			// Leave the wait queue and give back our down
+			sm = tcb->waitObj;
+			Queue_Remove(&sm->waitQueue, tcb);
+			AtomicOps_AddRelaxed((volatile uint32_t *) &sm->count, 1);
+			tcb->state |= THREAD_STATE_MSK_TIMEOUT;
+			break;
+		case THREAD_WAIT_MUTEX:
+			// Leave the wait queue and stop lending our priority
+			mtx = tcb->waitObj;
+			Queue_Remove(&mtx->waitQueue, tcb);
+			tcb->waitType = THREAD_WAIT_NONE;
+			Thread_MutexUpdatePriority(mtx->owner);
+			tcb->state |= THREAD_STATE_MSK_TIMEOUT;
+			break;
+		case THREAD_WAIT_JOIN:
+			// Stop waiting for the thread to exit
+			((Thread_TCB_t *) tcb->waitObj)->join.tcb = NULL;
+			tcb->state |= THREAD_STATE_MSK_TIMEOUT;
+			break;
+		case THREAD_WAIT_EVENT:
+			// Leave the wait queue
+			waiter = tcb->waitObj;
+			Queue_Remove(&waiter->events->waitQueue, waiter);
+			tcb->state |= THREAD_STATE_MSK_TIMEOUT;
+			break;
+		default:
+			// Delay is over
+			break;
+	}
+
+	tcb->waitType = THREAD_WAIT_NONE;
+	Thread_ReadyQueuePush(tcb);
+	Thread_KernelExit(basepri);
+}
+
+/**
+ * Updates the ready queue, moving suspended threads
+ * in the chrono heap to it when they become ready.
+ * Assumes a critical section has been acquired. Disables
+ * and re-enables interrupts for ready queue push only when
+ * a new ready thread is found.
+ * This is an internal function.
+ *
+ * @return True if at least one thread was added to the ready
+ *         queue, false otherwise.
+ */
+static uint8_t Thread_UpdateReadyQueueFromChrono() {
+	Thread_TCB_t *tcb;
+	uint32_t now;
+	uint8_t found = 0;
+
+	now = Thread_GetSysTicks();
+	while(Thread_chronoHeap != NULL && !THREAD_TIME_BEFORE(now, Thread_chronoHeap->chrono.time)) {
+		// Wake up the earliest thread
+		tcb = Thread_ChronoHeapPop();
+		Thread_ChronoExpire(tcb);
+		found = 1;
+	}
+
+	return found;
+}
+
+/**
+ * Sets up memory protection for the stack guard.
+ * Must be called from ISR context with IRQs disabled.
+ * This is an internal function.
+ *
+ * @param guardPtr Pointer to beginning of stack guard.
+ *                 Must be aligned to stack guard size.
+ */
+static void Thread_SetupStackGuard(void *guardPtr) {
+	uint32_t attrAndSize;
+
+	// No need for pre-update memory barrier because the
+	// stack guard is strongly-ordered.
+
+	attrAndSize =
+		(1 << MPU_RASR_XN_Pos    ) | // Instruction fetch disabled
+		(0 << MPU_RASR_AP_Pos    ) | // No access permissions
+		(0 << MPU_RASR_TEX_Pos   ) | // Non-cacheable
+		(0 << MPU_RASR_S_Pos     ) | // Shareable (ignored)
+		(0 << MPU_RASR_C_Pos     ) | // Non-normal
+		(0 << MPU_RASR_B_Pos     ) | // Strongly-ordered
+		(0 << MPU_RASR_SRD_Pos   ) | // No subregions
+		(1 << MPU_RASR_ENABLE_Pos) | // Enabled
+		((THREAD_STACKGUARD_SIZE_EXP - 1) << MPU_RASR_SIZE_Pos); // Size = 2^(SIZE+1)
+
+	// Since our attributes and size are constant, we don't
+	// need to disable the region before updating the base
+	// address: it'll be invalid only at first setup, and the
+	// region isn't yet enabled at that point.
+
+	// Switch to stack guard region
+	MPU->RNR = THREAD_STACKGUARD_REGNUM << MPU_RNR_REGION_Pos;
+	// Configure base address
+	MPU->RBAR = (uint32_t) guardPtr;
+	// Configure attributes and size
+	MPU->RASR = attrAndSize;
+
+	// No need for post-update memory barrier and pipeline flush
+	// because we're always returning from an exception when the
+	// thread gets control back (this must be called from ISR).
+}
+
+#ifdef EVICSDK_FPU_SUPPORT
+/**
+ * Enables/disables the FPU.
+ *
+ * @param enable True to enable, false to disable.
+ */
+static void Thread_FpuControl(uint8_t enable) {
+	if(enable) {
+		// Enable CP10/CP11, i.e. CPACR[23:20] = 1111
+		SCB->CPACR |= (0xFUL << 20);
+	}
+	else {
+		// Disable CP10/CP11, i.e. CPACR[23:20] = 0000
+		SCB->CPACR &= ~(0xFUL << 20);
+	}
+
+	// Ensure write completed, flush pipeline
+	__DMB();
+	__ISB();
+}
+
+/**
+ * Takes a slot from the FPU context pool.
+ * Must be called with IRQs masked.
+ * This is an internal function.
+ *
+ * @return Pointer to the FPU save area, or NULL if the pool is exhausted.
+ */
+static uint32_t *Thread_FpuCtxAlloc() {
+	uint32_t bit;
+
+	// Isolate the lowest clear bit
+	bit = ~Thread_fpuPoolUsed & (Thread_fpuPoolUsed + 1);
+	if(bit == 0 || 31 - __CLZ(bit) >= THREAD_FPU_CONTEXTS) {
+		return NULL;
+	}
+
+	Thread_fpuPoolUsed |= bit;
+	return Thread_fpuPool[31 - __CLZ(bit)];
+}
+
+/**
+ * Returns a slot to the FPU context pool.
+ * Must be called with IRQs masked.
+ * This is an internal function.
+ *
+ * @param fpuCtx FPU save area, as returned by Thread_FpuCtxAlloc().
+ */
+static void Thread_FpuCtxFree(uint32_t *fpuCtx) {
+	Thread_fpuPoolUsed &= ~(1UL << ((uint32_t (*)[32]) fpuCtx - Thread_fpuPool));
+}
+#endif
+
+/**
+ * Schedules the next thread. Called from PendSV.
+ * This is an internal function.
+ *
+ * @param er EXC_RETURN from the PendSV handler.
+ *           Ignored if FPU support is disabled.
+ *
+ * @return The lower 32 bits are the address of the software-saved
+ *         context for the new thread. If NULL, no context switch
+ *         is performed. The higher 32 bits are the address of the
+ *         software-saved context for the old thread. If NULL, the
+ *         old context isn't saved.
+ */
+uint64_t Thread_Schedule(uint32_t er) {
+	Thread_TCB_t *curTcb, *nextTcb;
+	Thread_SoftwareContext_t *newCtx = NULL, *oldCtx = NULL;
+	uint32_t basepri, now, toNext;
+#ifdef EVICSDK_FPU_SUPPORT
+	uint32_t primask;
+#endif
+
+	// Deferred calls run in interrupt context,
+	// they don't care about critical sections.
+	if(Thread_deferredList != 0) {
+		Thread_DeferredRun();
+	}
+
+	if(Thread_criticalCount > 0) {
+		// Current thread is in a critical section, resume it
+		// Scheduler will be invoked again on section exit
+		return THREAD_MAKE_SCHEDRET(NULL, NULL);
+	}
+
+	// Since no thread is in a critical section we have free
+	// access to all internal data structures that are
+	// synchronized by a global critical section. When working
+	// with the ready queue we need to disable interrupts.
+
+	// Update ready queue before checking if there's something
+	// to do to amortize time complexity.
+	Thread_UpdateReadyQueueFromChrono();
+
+	// Ready queues and Thread_curTcb are also accessed by ISRs
+	// waking up threads, so we keep IRQs masked from the decision
+	// to the actual switch (except when idling, see below).
+	basepri = Thread_KernelEnter();
+	now = Thread_SysTickNow(0, &toNext);
+
+	// Thread_curTcb will be NULL only if this is the first
+	// run (from startup code) or if the current thread has
+	// been deleted. In both cases we don't want to save state.
+	// The idle thread is never pushed to a ready queue.
+	curTcb = Thread_curTcb;
+	if(curTcb != NULL && curTcb != Thread_idleTcb && curTcb->state & THREAD_STATE_MSK_READY) {
+		// The current thread keeps running unless a higher priority
+		// thread is ready, or its quantum expired and a thread with
+		// the same priority is ready (round-robin).
+		if(Thread_readyMask == 0 || THREAD_READYMASK_TOP() < curTcb->priority ||
+		   (THREAD_READYMASK_TOP() == curTcb->priority &&
+		    THREAD_TIME_BEFORE(now, curTcb->preemptTime))) {
+			curTcb->state &= ~THREAD_STATE_MSK_YIELD;
+			if(!THREAD_TIME_BEFORE(now, curTcb->preemptTime)) {
+				// Reset quantum
+				curTcb->preemptTime = now + THREAD_QUANTUM;
+			}
+			Thread_SysTickUpdate();
+			Thread_KernelExit(basepri);
+			return THREAD_MAKE_SCHEDRET(NULL, NULL);
+		}
+
+		// Current thread has been preempted
+		// Push it to back of its ready queue (round-robin)
+		Thread_ReadyQueueInsert(curTcb);
+		if(curTcb->state & THREAD_STATE_MSK_YIELD) {
+			curTcb->state &= ~THREAD_STATE_MSK_YIELD;
+			curTcb->stats.voluntary++;
+		}
+		else {
+			curTcb->stats.involuntary++;
+		}
+	}
+	else if(curTcb != NULL && curTcb != Thread_idleTcb) {
+		// Current thread suspended itself
+		curTcb->stats.voluntary++;
+	}
+
+	// The current thread is being switched out. Clearing Thread_curTcb
+	// makes wakeups from ISRs push it to the ready queue like any other
+	// thread, so it can be picked up again below.
+	Thread_curTcb = NULL;
+
+	if((nextTcb = Thread_ReadyQueuePop()) == NULL) {
+		// No ready threads to schedule: run the idle thread.
+		// We're here because either:
+		//  - all threads are delayed, or suspended threads are
+		//    waiting on delayed threads or on semaphores that
+		//    will be released by delayed threads or ISRs: SysTick
+		//    or the ISR will wake up the idle thread and pend us;
+		//  - all threads are waiting on each other or on semas
+		//    that will be released by other waiting threads,
+		//    resulting in a deadlock: scheduler death;
+		//  - all threads have terminated: scheduler death.
+		// If the scheduler dies, only ISRs and the idle thread
+		// will run from now on.
+		nextTcb = Thread_idleTcb;
+	}
+
+	// nextTcb can be equal to curTcb if the current thread was the
+	// only ready one, or if we're idling. In that case, we'll just
+	// resume it.
+	if(nextTcb != curTcb) {
+		if(curTcb != NULL) {
+			// Save old context
+			oldCtx = &curTcb->ctx;
+			// Account CPU time since the last switch
+			curTcb->stats.cpuCycles += (uint64_t) (now - Thread_switchTime) *
+				THREAD_SYSTICK_LOAD + Thread_switchToNext - toNext;
+		}
+		newCtx = &nextTcb->ctx;
+		nextTcb->stats.switches++;
+		Thread_switchTime = now;
+		Thread_switchToNext = toNext;
+
+#ifdef EVICSDK_FPU_SUPPORT
+		// FPU state is shared with UsageFault, which can be
+		// raised by ISRs above the kernel lock: mask them too.
+		primask = Thread_IrqDisable();
+		if(Thread_fpuState.curCtx == NULL && !(er & THREAD_ER_MSK_FPCTX)) {
+			// The previous thread used FPU for the first time
+			// The previous holder already had its context saved
+			// Give it a save area now: its registers are still live.
+			if(curTcb != NULL && (curTcb->fpuCtx = Thread_FpuCtxAlloc()) == NULL) {
+				// Pool exhausted: its FPU state can't be preserved.
+				// Fault instead of silently corrupting it later.
+				__builtin_trap();
+			}
+			Thread_fpuState.holderCtx = (curTcb != NULL ? curTcb->fpuCtx : NULL);
+		}
+		// Switch current FPU context. If a thread has never used FPU
+		// NULL its context to avoid useless saves. If it ends up using
+		// it, the holder will be updated (see above).
+		Thread_fpuState.curCtx = (nextTcb->ctx.er & THREAD_ER_MSK_FPCTX ?
+			NULL : nextTcb->fpuCtx);
+		// If we're resuming the holder thread, enable FPU since
+		// registers are good. Otherwise, disable FPU and let lazy
+		// stacking do its job. Also disable FPU when curCtx is NULL,
+		// since we don't have FP context for that thread yet.
+		Thread_FpuControl(Thread_fpuState.curCtx != NULL &&
+			Thread_fpuState.curCtx == Thread_fpuState.holderCtx);
+		Thread_IrqRestore(primask);
+#endif
+
+		// Configure stack guard: stack is at the beginning
+		// of the allocated block.
+		Thread_SetupStackGuard(nextTcb->blockPtr);
+
+#ifdef _NEWLIB_VERSION
+		// Switch C library state
+		_impure_ptr = (nextTcb->reent != NULL ? nextTcb->reent : _global_impure_ptr);
+#endif
+	}
+
+	// Switch to next thread and reset quantum
+	Thread_curTcb = nextTcb;
+	Thread_curTcb->preemptTime = now + THREAD_QUANTUM;
+	Thread_SysTickUpdate();
+
+	Thread_KernelExit(basepri);
+
+	return THREAD_MAKE_SCHEDRET(newCtx, oldCtx);
+}
+
+/**
+ * System tick handler.
+ * This is an internal function.
+ */
+void SysTick_Handler() {
+	uint32_t basepri;
+
+	// SysTick only fires for scheduling events, which are
+	// handled by the scheduler. Until it programs the next
+	// event, run the longest possible period.
+	basepri = Thread_KernelEnter();
+	Thread_SysTickProgram(Thread_sysTickEnd + THREAD_SYSTICK_MAXPERIOD, 1);
+	Thread_KernelExit(basepri);
+
+	THREAD_PEND_SCHED();
+}
+
+/**
+ * Accounts idle time to the idle statistics, latching the CPU
+ * load when the statistics window is over.
+ * Must be called with the kernel lock held.
+ * This is an internal function.
+ *
+ * @param idleCycles Idle time to account, in cycles.
+ */
+static void Thread_IdleAccount(uint32_t idleCycles) {
+	uint32_t now, elapsed, idle, toNext;
+
+	Thread_idleStats.windowIdleCycles += idleCycles;
+	Thread_idleStats.totalIdleCycles += idleCycles;
+	Thread_idleStats.totalIdle += Thread_idleStats.totalIdleCycles / THREAD_SYSTICK_LOAD;
+	Thread_idleStats.totalIdleCycles %= THREAD_SYSTICK_LOAD;
+
+	now = Thread_SysTickNow(0, &toNext);
+	elapsed = now - Thread_idleStats.windowStart;
+	if(elapsed >= THREAD_IDLE_WINDOW) {
+		idle = Thread_idleStats.windowIdleCycles / THREAD_SYSTICK_LOAD;
+		if(idle > elapsed) {
+			idle = elapsed;
+		}
+		Thread_idleStats.load = 1000 - (uint16_t) ((uint64_t) idle * 1000 / elapsed);
+		Thread_idleStats.windowStart = now;
+		Thread_idleStats.windowIdleCycles = 0;
+	}
+}
+
+/**
+ * Idle thread procedure.
+ * Runs the idle hook, then sleeps until an interrupt arrives.
+ * IRQs are masked while sleeping, so that the sleep time can be
+ * measured before the waking interrupt is handled. WFI still
+ * wakes up on pending masked interrupts. The sleep time is then
+ * accounted under the kernel lock, so that higher priority
+ * interrupts are only held off for the wakeup sample.
+ * This is an internal function.
+ *
+ * @param args Unused.
+ *
+ * @return Never returns.
+ */
+static void *Thread_IdleProc(void *args) {
+	Thread_IdleHook_t hook;
+	uint32_t primask, basepri, start, end, startNext, endNext;
+
+	while(1) {
+		hook = Thread_idleHook;
+		if(hook != NULL) {
+			hook();
+		}
+
+		primask = Thread_IrqDisable();
+		if(Thread_readyMask != 0) {
+			Thread_IrqRestore(primask);
+			continue;
+		}
+		start = Thread_SysTickNow(0, &startNext);
+		__DSB();
+		__WFI();
+		end = Thread_SysTickNow(0, &endNext);
+		// Pending interrupts are handled here
+		Thread_IrqRestore(primask);
+
+		basepri = Thread_KernelEnter();
+		Thread_IdleAccount((end - start) * THREAD_SYSTICK_LOAD + startNext - endNext);
+		Thread_KernelExit(basepri);
+	}
+
+	return NULL;
+}
+
+/**
+ * Function to which a dying thread returns.
+ * This is an internal function.
+ *
+ * @param ret Return value of the main thread procedure.
+ *            This is taken as an argument because, on ARM,
+ *            the R0 register is used both for first argument
+ *            and return value.
+ */
+static void Thread_ExitProc(void *ret) {
+#ifdef _NEWLIB_VERSION
+	struct _reent *reent;
+
+	// Release our C library state. It must not be current
+	// while reclaimed, and it won't be switched back in
+	// once the TCB doesn't point to it anymore.
+	reent = Thread_curTcb->reent;
+	if(reent != NULL) {
+		Thread_curTcb->reent = NULL;
+		_impure_ptr = _global_impure_ptr;
+		_reclaim_reent(reent);
+		free(reent);
+	}
+#endif
+
+	Thread_CriticalEnter();
 
 #ifdef EVICSDK_FPU_SUPPORT
 	// We don't hold FPU anymore
@@ -540,520 +1700,1842 @@ static void Thread_ExitProc(void *ret) {
 	if(Thread_fpuState.holderCtx == Thread_fpuState.curCtx) {
 		Thread_fpuState.holderCtx = NULL;
 	}
-	Thread_fpuState.curCtx = NULL;
-	Thread_IrqRestore(primask);
-#endif
+	Thread_fpuState.curCtx = NULL;
+	// Give our save area back to the pool
+	if(Thread_curTcb->fpuCtx != NULL) {
+		Thread_FpuCtxFree(Thread_curTcb->fpuCtx);
+		Thread_curTcb->fpuCtx = NULL;
+	}
+	Thread_IrqRestore(primask);
+#endif
+
+	// Release any mutex we're holding
+	while(Thread_curTcb->heldMutex != NULL) {
+		Thread_MutexRelease(Thread_curTcb->heldMutex);
+	}
+
+	// If a thread has joined us, wake him up
+	if(Thread_curTcb->join.tcb != NULL) {
+		*Thread_curTcb->join.retPtr = ret;
+		Thread_curTcb->join.tcb->waitType = THREAD_WAIT_NONE;
+		THREAD_READY(Thread_curTcb->join.tcb);
+	}
+
+	// Unlink from list of all threads
+	if(Thread_curTcb->all.prev != NULL) {
+		Thread_curTcb->all.prev->all.next = Thread_curTcb->all.next;
+	}
+	else {
+		Thread_allList = Thread_curTcb->all.next;
+	}
+	if(Thread_curTcb->all.next != NULL) {
+		Thread_curTcb->all.next->all.prev = Thread_curTcb->all.prev;
+	}
+
+	// Delete ourselves
+	// We won't be using stack or TCB after free
+	Thread_curTcb->magic = THREAD_MAGIC_INVALID;
+	if(!(Thread_curTcb->state & THREAD_STATE_MSK_STATIC)) {
+		free(Thread_curTcb->blockPtr);
+	}
+	Thread_curTcb = NULL;
+
+	// Release all critical sections
+	Thread_criticalCount = 0;
+
+	// Pend scheduler and wait for death.
+	// Since Thread_curTcb is NULL, the context
+	// switcher won't use the stack we just freed.
+	// If scheduler runs between critical release
+	// and the THREAD_PEND_SCHED() call we won't
+	// get back here.
+	THREAD_PEND_SCHED();
+	while(1);
+}
+
+/**
+ * Gets the total stack size for a thread, including the
+ * stack guard and the initial hardware-pushed context.
+ * This is an internal function.
+ *
+ * @param stackSize Thread stack size, in bytes.
+ *
+ * @return Total stack size, in bytes.
+ */
+static uint32_t Thread_GetTotalStackSize(uint16_t stackSize) {
+	// Align stack size to 8-byte boundary, reserving extra
+	// space for hardware-pushed context and stack guard
+	return ((stackSize + 7) & ~7) + THREAD_HWCTX_SIZE_ALIGN + THREAD_STACKGUARD_SIZE;
+}
+
+/**
+ * Sets up a new thread in a memory block, without making it ready.
+ * The TCB is placed below the thread stack (i.e. at higher addresses).
+ * This is an internal function.
+ *
+ * @param block     Memory block, aligned to THREAD_STACKGUARD_SIZE.
+ * @param entry     Thread entry point.
+ * @param args      Thread arguments.
+ * @param stackSize Thread stack size, in bytes.
+ * @param priority  Thread priority.
+ * @param state     Initial thread state.
+ *
+ * @return New thread TCB.
+ */
+static Thread_TCB_t *Thread_SetupTcb(uint8_t *block, Thread_EntryPtr_t entry, void *args,
+		uint16_t stackSize, uint8_t priority, uint8_t state) {
+	uint32_t *paint, totalSize;
+	Thread_TCB_t *tcb;
+	Thread_StackedContext_t *ctx;
+
+	totalSize = Thread_GetTotalStackSize(stackSize);
+
+	// Setup TCB
+	tcb = (Thread_TCB_t *) (block + totalSize);
+	tcb->magic = THREAD_MAGIC_TCB;
+	tcb->blockPtr = block;
+	tcb->join.tcb = NULL;
+	tcb->waitObj = NULL;
+	tcb->heldMutex = NULL;
+	tcb->reent = NULL;
+#ifdef EVICSDK_FPU_SUPPORT
+	tcb->fpuCtx = NULL;
+#endif
+	tcb->state = state;
+	tcb->priority = priority;
+	tcb->basePriority = priority;
+	tcb->waitType = THREAD_WAIT_NONE;
+	tcb->stats.cpuCycles = 0;
+	tcb->stats.switches = 0;
+	tcb->stats.voluntary = 0;
+	tcb->stats.involuntary = 0;
+
+	// Setup initial thread context and stack
+	ctx = (Thread_StackedContext_t *) (block + totalSize - THREAD_HWCTX_SIZE_ALIGN);
+
+	// Paint the stack to track its high-water mark
+	for(paint = (uint32_t *) (block + THREAD_STACKGUARD_SIZE); paint < (uint32_t *) ctx; paint++) {
+		*paint = THREAD_STACK_PAINT;
+	}
+
+	ctx->r0 = (uint32_t) args;
+	ctx->lr = (uint32_t) Thread_ExitProc;
+	ctx->pc = (uint32_t) entry;
+	ctx->psr = THREAD_DEFAULT_PSR;
+	tcb->ctx.er = THREAD_DEFAULT_ER;
+	tcb->ctx.sp = (uint32_t) ctx;
+
+	// Link to list of all threads
+	Thread_CriticalEnter();
+	tcb->all.prev = NULL;
+	tcb->all.next = Thread_allList;
+	if(Thread_allList != NULL) {
+		Thread_allList->all.prev = tcb;
+	}
+	Thread_allList = tcb;
+	Thread_CriticalExit();
+
+	return tcb;
+}
+
+/**
+ * Allocates and sets up a new thread, without making it ready.
+ * This is an internal function.
+ *
+ * @param entry     Thread entry point.
+ * @param args      Thread arguments.
+ * @param stackSize Thread stack size, in bytes.
+ * @param priority  Thread priority.
+ *
+ * @return New thread TCB, or NULL if out of memory.
+ */
+static Thread_TCB_t *Thread_AllocTcb(Thread_EntryPtr_t entry, void *args, uint16_t stackSize, uint8_t priority) {
+	uint8_t *block;
+
+	// Allocate space for TCB and stack. Stack must be 8-byte
+	// aligned and stack guard must be size-aligned, so align
+	// allocation to stack guard size (which is 8-byte aligned).
+	block = memalign(THREAD_STACKGUARD_SIZE,
+		Thread_GetTotalStackSize(stackSize) + sizeof(Thread_TCB_t));
+	if(block == NULL) {
+		return NULL;
+	}
+
+	return Thread_SetupTcb(block, entry, args, stackSize, priority, 0);
+}
+
+/**
+ * Makes a newly created thread ready, starting
+ * the scheduler if this is the first thread.
+ * This is an internal function.
+ *
+ * @param tcb Thread TCB.
+ */
+static void Thread_StartTcb(Thread_TCB_t *tcb) {
+	// Push new thread to back of ready queue
+	// This will preempt us if it has higher priority
+	THREAD_READY(tcb);
+
+	if(!(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)) {
+		// SysTick is not enabled, i.e. this is the first
+		// run. Enable SysTick and pend scheduler.
+		// Once the scheduler runs we will never go back
+		// to the startup code. The first period ends
+		// on the first tick.
+		Thread_sysTickEnd = 1;
+		SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+		THREAD_PEND_SCHED();
+	}
+}
+
+void Thread_Init() {
+	uint32_t i;
+
+	for(i = 0; i < THREAD_PRIORITY_COUNT; i++) {
+		Queue_Init(&Thread_readyQueue[i]);
+	}
+	Thread_readyMask = 0;
+	Thread_chronoHeap = NULL;
+	Thread_allList = NULL;
+
+	// Configure MPU for stack guard
+	MPU->CTRL =
+		(1 << MPU_CTRL_PRIVDEFENA_Pos) | // Use default map as background
+		(0 << MPU_CTRL_HFNMIENA_Pos  ) | // Disable MPU for fault handlers
+		(1 << MPU_CTRL_ENABLE_Pos    ) ; // Enable MPU
+
+	// Set lowest priority for PendSV
+	// While NVIC_SetPriority works with system interrupts,
+	// it considers priority to always be 4 bits like NVIC
+	// interrupts, while system interrupts only have 2 high bits,
+	// so we shift to make up for it.
+	NVIC_SetPriority(PendSV_IRQn, 3 << 2);
+
+	// Configure systick (kernel priority) but leave it disabled
+	SysTick->LOAD = THREAD_SYSTICK_LOAD - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
+	NVIC_SetPriority(SysTick_IRQn, THREAD_KERNEL_PRIORITY);
+
+	// Interrupts left at priority 0 would not be masked by the
+	// kernel lock: move them to the kernel priority. Drivers that
+	// never call into the thread library set a higher priority.
+	for(i = 0; i < sizeof(NVIC->IP); i++) {
+		if(NVIC->IP[i] == 0) {
+			NVIC->IP[i] = THREAD_KERNEL_BASEPRI;
+		}
+	}
+
+	// Enable cycle counter for kernel lock statistics
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	Thread_lockStats.maxCycles = 0;
+	Thread_lockStats.count = 0;
+
+#ifdef EVICSDK_FPU_SUPPORT
+	// Enable UsageFault for lazy stacking
+	SCB->SHCSR |= SCB_SHCSR_USGFAULTENA_Msk;
+#endif
+
+	// Create idle thread in static storage, so that boot
+	// doesn't depend on the heap. It's always ready, but
+	// never queued.
+	Thread_idleTcb = Thread_SetupTcb(Thread_idleStorage, Thread_IdleProc, NULL,
+		THREAD_IDLE_STACKSIZE, THREAD_PRIORITY_MIN,
+		THREAD_STATE_MSK_READY | THREAD_STATE_MSK_STATIC);
+	Thread_idleHook = NULL;
+}
+
+Thread_Error_t Thread_Create(Thread_t *thread, Thread_EntryPtr_t entry, void *args, uint16_t stackSize) {
+	return Thread_CreateEx(thread, entry, args, stackSize, THREAD_PRIORITY_DEFAULT);
+}
+
+Thread_Error_t Thread_CreateEx(Thread_t *thread, Thread_EntryPtr_t entry, void *args, uint16_t stackSize, uint8_t priority) {
+	Thread_TCB_t *tcb;
+
+	if(priority > THREAD_PRIORITY_MAX) {
+		return TD_INVALID_VALUE;
+	}
+
+	tcb = Thread_AllocTcb(entry, args, stackSize, priority);
+	if(tcb == NULL) {
+		return TD_NO_MEMORY;
+	}
+	*thread = (Thread_t) tcb;
+
+	Thread_StartTcb(tcb);
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_CreateStatic(Thread_t *thread, Thread_EntryPtr_t entry, void *args, void *storage, uint16_t stackSize, uint8_t priority) {
+	Thread_TCB_t *tcb;
+
+	if(priority > THREAD_PRIORITY_MAX ||
+	   ((uint32_t) storage & (THREAD_STATIC_ALIGN - 1)) ||
+	   !THREAD_CHECK_RAM(storage, THREAD_STATIC_SIZE(stackSize))) {
+		return TD_INVALID_VALUE;
+	}
+
+	tcb = Thread_SetupTcb(storage, entry, args, stackSize, priority, THREAD_STATE_MSK_STATIC);
+	*thread = (Thread_t) tcb;
+
+	Thread_StartTcb(tcb);
+
+	return TD_SUCCESS;
+}
+
+Thread_t Thread_GetCurrent() {
+	return (Thread_t) Thread_curTcb;
+}
+
+Thread_Error_t Thread_SetPriority(Thread_t thread, uint8_t priority) {
+	if(priority > THREAD_PRIORITY_MAX) {
+		return TD_INVALID_VALUE;
+	}
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_TCB(thread)) {
+		Thread_CriticalExit();
+		return TD_INVALID_THREAD;
+	}
+
+	// Update base priority and recompute the effective one,
+	// which might be kept higher by priority inheritance
+	((Thread_TCB_t *) thread)->basePriority = priority;
+	Thread_MutexUpdatePriority((Thread_TCB_t *) thread);
+
+	// CriticalExit pends the scheduler: if we lowered our
+	// own priority, a higher priority thread will preempt us
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_GetPriority(Thread_t thread, uint8_t *priority) {
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_TCB(thread)) {
+		Thread_CriticalExit();
+		return TD_INVALID_THREAD;
+	}
+
+	*priority = ((Thread_TCB_t *) thread)->basePriority;
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_GetStats(Thread_t thread, Thread_Stats_t *stats) {
+	Thread_TCB_t *tcb;
+	uint32_t *paint, basepri, now, toNext;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_TCB(thread)) {
+		Thread_CriticalExit();
+		return TD_INVALID_THREAD;
+	}
+
+	tcb = (Thread_TCB_t *) thread;
+	basepri = Thread_KernelEnter();
+	stats->cpuCycles = tcb->stats.cpuCycles;
+	if(tcb == Thread_curTcb) {
+		// Add CPU time since we were switched in
+		now = Thread_SysTickNow(0, &toNext);
+		stats->cpuCycles += (uint64_t) (now - Thread_switchTime) *
+			THREAD_SYSTICK_LOAD + Thread_switchToNext - toNext;
+	}
+	stats->switches = tcb->stats.switches;
+	stats->voluntarySwitches = tcb->stats.voluntary;
+	stats->involuntarySwitches = tcb->stats.involuntary;
+	Thread_KernelExit(basepri);
+	stats->priority = tcb->priority;
+	stats->basePriority = tcb->basePriority;
+
+	// Stack spans from the stack guard to the TCB. Look for
+	// the first word that has been overwritten since painting.
+	paint = (uint32_t *) ((uint8_t *) tcb->blockPtr + THREAD_STACKGUARD_SIZE);
+	stats->stackSize = (uint8_t *) tcb - (uint8_t *) paint;
+	while(paint < (uint32_t *) tcb && *paint == THREAD_STACK_PAINT) {
+		paint++;
+	}
+	stats->stackUsed = (uint8_t *) tcb - (uint8_t *) paint;
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+uint32_t Thread_Enumerate(Thread_t *threads, uint32_t size) {
+	Thread_TCB_t *tcb;
+	uint32_t count = 0;
+
+	Thread_CriticalEnter();
+
+	for(tcb = Thread_allList; tcb != NULL; tcb = tcb->all.next) {
+		if(count < size) {
+			threads[count] = (Thread_t) tcb;
+		}
+		count++;
+	}
+
+	Thread_CriticalExit();
+
+	return count;
+}
+
+void Thread_SetIdleHook(Thread_IdleHook_t hook) {
+	Thread_idleHook = hook;
+}
+
+void Thread_GetIdleStats(Thread_IdleStats_t *stats) {
+	uint32_t basepri;
+
+	basepri = Thread_KernelEnter();
+	// Latch load if the window is over, even if
+	// the idle thread hasn't been running
+	Thread_IdleAccount(0);
+	stats->totalIdle = Thread_idleStats.totalIdle;
+	stats->load = Thread_idleStats.load;
+	Thread_KernelExit(basepri);
+}
+
+void Thread_GetLockStats(Thread_LockStats_t *stats) {
+	uint32_t basepri;
+
+	basepri = Thread_KernelEnter();
+	*stats = Thread_lockStats;
+	Thread_KernelExit(basepri);
+}
+
+void Thread_ResetLockStats() {
+	uint32_t basepri;
+
+	basepri = Thread_KernelEnter();
+	Thread_lockStats.maxCycles = 0;
+	Thread_lockStats.count = 0;
+	Thread_KernelExit(basepri);
+}
+
+uint32_t Thread_KernelLock() {
+	return Thread_KernelEnter();
+}
+
+void Thread_KernelUnlock(uint32_t basepri) {
+	Thread_KernelExit(basepri);
+}
+
+void Thread_DeferredInit(Thread_Deferred_t *deferred, Thread_DeferredFunc_t func) {
+	deferred->func = func;
+	deferred->pending = 0;
+	deferred->next = NULL;
+}
+
+void Thread_DeferredPost(Thread_Deferred_t *deferred, uint32_t bits) {
+	uint32_t head;
+
+	if(AtomicOps_FetchOrRelease(&deferred->pending, bits) != 0) {
+		// Already in the pending list
+		return;
+	}
+
+	// First bits since the last run: push to the pending list
+	do {
+		head = Thread_deferredList;
+		deferred->next = (Thread_Deferred_t *) (uintptr_t) head;
+	} while(AtomicOps_CmpSwapRelease(&Thread_deferredList, head,
+		(uint32_t) (uintptr_t) deferred) != head);
+
+	THREAD_PEND_SCHED();
+}
+
+uint32_t Thread_GetSysTicks() {
+	uint32_t primask, ticks, toNext;
+
+	primask = Thread_IrqDisable();
+	ticks = Thread_SysTickNow(0, &toNext);
+	Thread_IrqRestore(primask);
+
+	return ticks;
+}
+
+void Thread_Yield() {
+	// Expire our quantum
+	Thread_curTcb->state |= THREAD_STATE_MSK_YIELD;
+	Thread_curTcb->preemptTime = Thread_GetSysTicks();
+
+	// Schedule (even if we might have already
+	// been preempted) and wait for suspend/wakeup.
+	THREAD_PEND_SCHED();
+	THREAD_WAIT_READY();
+}
+
+/**
+ * Waits for a thread to terminate.
+ * This is an internal function.
+ *
+ * @param thread  Thread handle.
+ * @param ret     Pointer to receive thread return value.
+ * @param timeout Timeout, in milliseconds, or THREAD_TIMEOUT_NONE.
+ *
+ * @return TD_SUCCESS, TD_INVALID_THREAD, TD_ALREADY_JOINED or TD_TIMEOUT.
+ */
+static Thread_Error_t Thread_JoinInternal(Thread_t thread, void **ret, uint32_t timeout) {
+	Thread_TCB_t *tcb;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_TCB(thread)) {
+		Thread_CriticalExit();
+		return TD_INVALID_THREAD;
+	}
+
+	tcb = (Thread_TCB_t *) thread;
+	if(tcb->join.tcb != NULL) {
+		Thread_CriticalExit();
+		return TD_ALREADY_JOINED;
+	}
+	if(timeout == 0) {
+		// The thread is still alive
+		Thread_CriticalExit();
+		return TD_TIMEOUT;
+	}
+
+	// Setup ourselves as the joined thread
+	tcb->join.tcb = Thread_curTcb;
+	tcb->join.retPtr = ret;
+
+	// Mark current thread as suspended
+	Thread_curTcb->state &= ~THREAD_STATE_MSK_READY;
+	Thread_curTcb->waitType = THREAD_WAIT_JOIN;
+	Thread_curTcb->waitObj = tcb;
+	if(timeout != THREAD_TIMEOUT_NONE) {
+		Thread_WaitArm(timeout);
+	}
+
+	Thread_CriticalExit();
+
+	// CriticalExit pended the scheduler, wait for suspend/wakeup
+	THREAD_WAIT_READY();
+
+	return Thread_WaitFinish(TD_INVALID_THREAD);
+}
+
+Thread_Error_t Thread_Join(Thread_t thread, void **ret) {
+	return Thread_JoinInternal(thread, ret, THREAD_TIMEOUT_NONE);
+}
+
+Thread_Error_t Thread_JoinTimeout(Thread_t thread, void **ret, uint32_t timeout) {
+	if(timeout > THREAD_DELAY_MAX) {
+		timeout = THREAD_DELAY_MAX;
+	}
+	return Thread_JoinInternal(thread, ret, timeout);
+}
+
+/**
+ * Delays the current thread until the specified system time.
+ * Must be called from a critical section, which will be exited.
+ * This is an internal function.
+ *
+ * @param delayEnd Wakeup time, in system ticks.
+ * @param flags    Delay options (THREAD_DELAY_*).
+ */
+static void Thread_DelayUntilTime(uint32_t delayEnd, uint8_t flags) {
+	if(!(flags & THREAD_DELAY_NOBUSYWAIT) &&
+	   THREAD_TIME_BEFORE(delayEnd, Thread_curTcb->preemptTime - THREAD_DELAY_MARGIN)) {
+		// The delay will end before preemption: busy wait.
+		Thread_CriticalExit();
+		while(THREAD_TIME_BEFORE(Thread_GetSysTicks(), delayEnd));
+	}
+	else {
+		// Suspend thread to the chrono heap
+		Thread_curTcb->chrono.time = delayEnd;
+		Thread_curTcb->state &= ~THREAD_STATE_MSK_READY;
+		Thread_curTcb->state |= THREAD_STATE_MSK_TIMED;
+		Thread_ChronoHeapInsert(Thread_curTcb);
+		Thread_CriticalExit();
+		// CriticalExit pended the scheduler, wait for suspend/wakeup
+		THREAD_WAIT_READY();
+	}
+}
+
+void Thread_DelayMs(uint32_t delay) {
+	// Split delays too long for the chrono heap
+	while(delay > THREAD_DELAY_MAX) {
+		Thread_DelayMs(THREAD_DELAY_MAX);
+		delay -= THREAD_DELAY_MAX;
+	}
+
+	Thread_CriticalEnter();
+	Thread_DelayUntilTime(Thread_GetSysTicks() + delay * THREAD_SYSTICK_MS, 0);
+}
+
+uint8_t Thread_DelayUntil(uint32_t *lastWake, uint32_t period) {
+	return Thread_DelayUntilEx(lastWake, period, 0);
+}
+
+uint8_t Thread_DelayUntilEx(uint32_t *lastWake, uint32_t period, uint8_t flags) {
+	uint32_t delayEnd;
+
+	delayEnd = *lastWake + period * THREAD_SYSTICK_MS;
+	*lastWake = delayEnd;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_TIME_BEFORE(Thread_GetSysTicks(), delayEnd)) {
+		// Deadline already passed
+		Thread_CriticalExit();
+		return 1;
+	}
+
+	Thread_DelayUntilTime(delayEnd, flags);
+	return 0;
+}
+
+void Thread_PeriodicInit(Thread_Periodic_t *periodic, uint32_t period, uint8_t flags) {
+	periodic->lastWake = Thread_GetSysTicks();
+	periodic->period = period;
+	periodic->flags = flags;
+	periodic->missed = 0;
+}
+
+uint32_t Thread_PeriodicWait(Thread_Periodic_t *periodic) {
+	uint32_t periodTicks, missed;
+
+	if(!Thread_DelayUntilEx(&periodic->lastWake, periodic->period, periodic->flags)) {
+		return 0;
+	}
+
+	// Skip all the periods that have been overrun. lastWake
+	// is left at the start of the period we are now in.
+	periodTicks = periodic->period * THREAD_SYSTICK_MS;
+	missed = (Thread_GetSysTicks() - periodic->lastWake) / periodTicks + 1;
+	periodic->lastWake += (missed - 1) * periodTicks;
+	periodic->missed += missed;
+
+	return missed;
+}
+
+Thread_Error_t Thread_EnableReent() {
+#ifdef _NEWLIB_VERSION
+	struct _reent *reent;
+
+	if(Thread_curTcb->reent != NULL) {
+		return TD_SUCCESS;
+	}
+
+	reent = malloc(sizeof(struct _reent));
+	if(reent == NULL) {
+		return TD_NO_MEMORY;
+	}
+	_REENT_INIT_PTR(reent);
+
+	// The scheduler switches _impure_ptr from the TCB:
+	// update both without being preempted in between.
+	Thread_CriticalEnter();
+	Thread_curTcb->reent = reent;
+	_impure_ptr = reent;
+	Thread_CriticalExit();
+#endif
+
+	return TD_SUCCESS;
+}
+
+#ifdef _NEWLIB_VERSION
+/**
+ * Locks the newlib heap. Heap operations only block scheduling,
+ * so they are thread-safe but not ISR-safe. Critical sections
+ * nest, so the recursive locking newlib needs is supported.
+ * This is an internal function.
+ *
+ * @param reent Unused.
+ */
+void __malloc_lock(struct _reent *reent) {
+	Thread_CriticalEnter();
+}
+
+/**
+ * Unlocks the newlib heap.
+ * This is an internal function.
+ *
+ * @param reent Unused.
+ */
+void __malloc_unlock(struct _reent *reent) {
+	Thread_CriticalExit();
+}
+#endif
+
+void Thread_CriticalEnter() {
+	// No-op from ISRs or startup code
+	if(THREAD_GET_IRQN() != 0 || Thread_curTcb == NULL) {
+		return;
+	}
+
+	// No atomic operations needed here.
+	// criticalCount = 0: even if preemption occurs
+	// during read-update-store, the atomic store to
+	// 1 will still be correct since criticalCount
+	// must be zero for this code to be resumed.
+	// criticalCount > 0: already in critical section,
+	// so read-update-store won't be disturbed.
+	Thread_criticalCount++;
+}
+
+void Thread_CriticalExit() {
+	// No-op from ISRs or startup code
+	if(THREAD_GET_IRQN() != 0 || Thread_curTcb == NULL) {
+		return;
+	}
+
+	// No atomic operations needed here.
+	// criticalCount = 0: even if preemption occurs
+	// during read-check, the atomic read of 0 will
+	// still be correct since criticalCount must be
+	// zero for this code to be resumed.
+	// criticalCount > 0: already in critical section,
+	// so read-update-store won't be disturbed.
+	if(Thread_criticalCount == 0) {
+		return;
+	}
+	Thread_criticalCount--;
+
+	// This check is correct even in case of preemption
+	// for the same reasons shown above.
+	if(Thread_criticalCount == 0) {
+		// Just exited the last critical section, time
+		// to reschedule. Even if we've been preempted
+		// after exiting, an extra scheduler call won't
+		// cause issues.
+		THREAD_PEND_SCHED();
+	}
+}
+
+/**
+ * Initializes a semaphore.
+ * This is an internal function.
+ *
+ * @param sema     Semaphore.
+ * @param count    Initial semaphore count.
+ * @param isStatic True if sema is caller-provided storage.
+ */
+static void Thread_SemaphoreInit(Thread_SemaphoreInternal_t *sema, int32_t count, uint8_t isStatic) {
+	sema->magic = THREAD_MAGIC_SEMA;
+	sema->count = count;
+	Queue_Init(&sema->waitQueue);
+	sema->isStatic = isStatic;
+}
+
+/**
+ * Deletes and deallocates a semaphore, waking up its waiters
+ * with TD_INVALID_SEMA. Static semaphores are not deallocated.
+ * This is an internal function.
+ *
+ * @param sema Semaphore.
+ *
+ * @return TD_SUCCESS or TD_INVALID_SEMA.
+ */
+static Thread_Error_t Thread_SemaphoreDelete(Thread_SemaphoreInternal_t *sema) {
+	Thread_TCB_t *tcb;
+	uint32_t basepri;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_SEMA(sema)) {
+		Thread_CriticalExit();
+		return TD_INVALID_SEMA;
+	}
+
+	// Wake up waiters and invalidate. Semaphores can
+	// be upped by ISRs, so do it with IRQs masked.
+	basepri = Thread_KernelEnter();
+	while((tcb = Queue_PopFront(&sema->waitQueue)) != NULL) {
+		Thread_WaitAbort(tcb);
+	}
+	sema->magic = THREAD_MAGIC_INVALID;
+	Thread_KernelExit(basepri);
+
+	// Delete semaphore
+	if(!sema->isStatic) {
+		free(sema);
+	}
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_SemaphoreCreate(Thread_Semaphore_t *sema, int32_t count) {
+	Thread_SemaphoreInternal_t *sm;
+
+	if(count < 0) {
+		return TD_INVALID_VALUE;
+	}
+
+	// Allocate semaphore
+	sm = malloc(sizeof(Thread_SemaphoreInternal_t));
+	if(sm == NULL) {
+		return TD_NO_MEMORY;
+	}
+
+	// Initialize semaphore
+	Thread_SemaphoreInit(sm, count, 0);
+	*sema = (Thread_Semaphore_t) sm;
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_SemaphoreInitStatic(Thread_Semaphore_t *sema, Thread_SemaphoreStatic_t *storage, int32_t count) {
+	if(count < 0 || !THREAD_CHECK_RAM(storage, sizeof(Thread_SemaphoreStatic_t))) {
+		return TD_INVALID_VALUE;
+	}
+
+	Thread_SemaphoreInit((Thread_SemaphoreInternal_t *) storage, count, 1);
+	*sema = (Thread_Semaphore_t) storage;
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_SemaphoreDestroy(Thread_Semaphore_t sema) {
+	return Thread_SemaphoreDelete((Thread_SemaphoreInternal_t *) sema);
+}
+
+/**
+ * Decrements a semaphore count, waiting if needed.
+ * This is an internal function.
+ *
+ * @param sema    Semaphore handle.
+ * @param timeout Timeout, in milliseconds, or THREAD_TIMEOUT_NONE.
+ *
+ * @return TD_SUCCESS, TD_INVALID_SEMA or TD_TIMEOUT.
+ */
+static Thread_Error_t Thread_SemaphoreDownInternal(Thread_Semaphore_t sema, uint32_t timeout) {
+	Thread_SemaphoreInternal_t *sm;
+	Thread_Error_t ret = TD_SUCCESS;
+	int32_t newSema;
+	uint32_t basepri;
+	uint8_t waitWakeup = 0;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_SEMA(sema)) {
+		Thread_CriticalExit();
+		return TD_INVALID_SEMA;
+	}
+
+	// Decrement semaphore. Acquire: accesses to what the
+	// semaphore guards must not move before the down.
+	sm = (Thread_SemaphoreInternal_t *) sema;
+	newSema = AtomicOps_SubAcquire((volatile uint32_t *) &sm->count, 1);
+
+	if(newSema < 0) {
+		// This semaphore can't be downed without waiting.
+		// We might have been preempted after determining that
+		// newSema < 0, but before disabling interrupts, by a thread
+		// or ISR that upped the semaphore.
+		// If we don't re-check, we could wrongly suspend ourselves
+		// and we wouldn't be woken up until another up occurs.
+		// This double check avoids disabling interrupts when
+		// the semaphore can be simply downed without suspending and
+		// the race described above doesn't happen.
+		basepri = Thread_KernelEnter();
+		if(sm->count < 0) {
+			if(timeout == 0) {
+				// Can't wait: give back our down
+				AtomicOps_AddRelaxed((volatile uint32_t *) &sm->count, 1);
+				ret = TD_TIMEOUT;
+			}
+			else {
+				// Mark current thread as suspended
+				Thread_curTcb->state &= ~THREAD_STATE_MSK_READY;
+				Thread_curTcb->waitType = THREAD_WAIT_SEMA;
+				Thread_curTcb->waitObj = sm;
+				// Push ourselves to back of wait queue
+				Queue_PushBack(&sm->waitQueue, Thread_curTcb);
+				waitWakeup = 1;
+			}
+		}
+		Thread_KernelExit(basepri);
+
+		// The scheduler can't run the timeout before
+		// we're out of the critical section
+		if(waitWakeup && timeout != THREAD_TIMEOUT_NONE) {
+			Thread_WaitArm(timeout);
+		}
+	}
+
+	Thread_CriticalExit();
+
+	if(waitWakeup) {
+		// Thread_CriticalExit pended scheduler, wait for suspend/wakeup
+		THREAD_WAIT_READY();
+		ret = Thread_WaitFinish(TD_INVALID_SEMA);
+	}
+
+	return ret;
+}
+
+Thread_Error_t Thread_SemaphoreDown(Thread_Semaphore_t sema) {
+	return Thread_SemaphoreDownInternal(sema, THREAD_TIMEOUT_NONE);
+}
+
+Thread_Error_t Thread_SemaphoreDownTimeout(Thread_Semaphore_t sema, uint32_t timeout) {
+	if(timeout > THREAD_DELAY_MAX) {
+		timeout = THREAD_DELAY_MAX;
+	}
+	return Thread_SemaphoreDownInternal(sema, timeout);
+}
+
+Thread_Error_t Thread_SemaphoreTryDown(Thread_Semaphore_t sema) {
+	Thread_SemaphoreInternal_t *sm;
+	int32_t oldVal;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_SEMA(sema)) {
+		Thread_CriticalExit();
+		return TD_INVALID_SEMA;
+	}
+
+	// Try to down by compare-and-swap
+	sm = (Thread_SemaphoreInternal_t *) sema;
+	do {
+		oldVal = sm->count;
+		if(oldVal <= 0) {
+			// Can't be downed without waiting
+			Thread_CriticalExit();
+			return TD_TRY_FAIL;
+		}
+	} while(AtomicOps_CmpSwapAcquire((volatile uint32_t *) &sm->count, oldVal, oldVal - 1) != oldVal);
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_SemaphoreUp(Thread_Semaphore_t sema) {
+	Thread_SemaphoreInternal_t *sm;
+	Thread_TCB_t *tcb;
+	int32_t newSema;
+	uint32_t basepri;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_SEMA(sema)) {
+		Thread_CriticalExit();
+		return TD_INVALID_SEMA;
+	}
+
+	// Increment semaphore. Release: accesses to what the
+	// semaphore guards must not move after the up.
+	sm = (Thread_SemaphoreInternal_t *) sema;
+	newSema = AtomicOps_AddRelease((volatile uint32_t *) &sm->count, 1);
+	if(newSema <= 0) {
+		// The old value was negative: there's at least a thread
+		// waiting on this sema. Each up handles a single wakeup
+		// only, so another thread or ISR (try)downing between
+		// the newSema check and disabling IRQs won't hurt us.
+		// Wake up the first thread in queue.
+		basepri = Thread_KernelEnter();
+		if((tcb = Queue_PopFront(&sm->waitQueue)) != NULL) {
+			tcb->waitType = THREAD_WAIT_NONE;
+			Thread_ReadyQueuePush(tcb);
+		}
+		Thread_KernelExit(basepri);
+	}
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_SemaphoreGetCount(Thread_Semaphore_t sema, int32_t *count) {
+	Thread_SemaphoreInternal_t *sm;
+	int32_t val;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_SEMA(sema)) {
+		Thread_CriticalExit();
+		return TD_INVALID_SEMA;
+	}
+
+	// We internally use negative values to count
+	// waiting threads, mask them as zero
+	sm = (Thread_SemaphoreInternal_t *) sema;
+	val = sm->count;
+	*count = val < 0 ? 0 : val;
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+/**
+ * Initializes a mutex (unlocked).
+ * This is an internal function.
+ *
+ * @param mtx      Mutex.
+ * @param isStatic True if mtx is caller-provided storage.
+ */
+static void Thread_MutexInit(Thread_MutexInternal_t *mtx, uint8_t isStatic) {
+	mtx->magic = THREAD_MAGIC_MUTEX;
+	mtx->owner = NULL;
+	mtx->nextHeld = NULL;
+	Queue_Init(&mtx->waitQueue);
+	mtx->maxBlockTime = 0;
+	mtx->lockCount = 0;
+	mtx->ceiling = THREAD_PRIORITY_MIN;
+	mtx->isStatic = isStatic;
+}
+
+Thread_Error_t Thread_MutexCreate(Thread_Mutex_t *mutex) {
+	Thread_MutexInternal_t *mtx;
+
+	// Allocate mutex
+	mtx = malloc(sizeof(Thread_MutexInternal_t));
+	if(mtx == NULL) {
+		return TD_NO_MEMORY;
+	}
+
+	// Initialize mutex
+	Thread_MutexInit(mtx, 0);
+	*mutex = (Thread_Mutex_t) mtx;
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_MutexInitStatic(Thread_Mutex_t *mutex, Thread_MutexStatic_t *storage) {
+	if(!THREAD_CHECK_RAM(storage, sizeof(Thread_MutexStatic_t))) {
+		return TD_INVALID_VALUE;
+	}
+
+	Thread_MutexInit((Thread_MutexInternal_t *) storage, 1);
+	*mutex = (Thread_Mutex_t) storage;
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_MutexDestroy(Thread_Mutex_t mutex) {
+	Thread_MutexInternal_t *mtx;
+	Thread_MutexInternal_t **link;
+	Thread_TCB_t *owner, *tcb;
+	uint32_t basepri;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_MUTEX(mutex)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MUTEX;
+	}
+
+	mtx = (Thread_MutexInternal_t *) mutex;
+	owner = mtx->owner;
+	if(owner != NULL) {
+		// Wake up waiters with TD_INVALID_MUTEX
+		basepri = Thread_KernelEnter();
+		while((tcb = Queue_PopFront(&mtx->waitQueue)) != NULL) {
+			Thread_WaitAbort(tcb);
+		}
+		Thread_KernelExit(basepri);
+
+		// Remove from owner held list and drop inherited priority
+		for(link = &owner->heldMutex; *link != mtx; link = &(*link)->nextHeld);
+		*link = mtx->nextHeld;
+		Thread_MutexUpdatePriority(owner);
+	}
+
+	// Destroy mutex
+	mtx->magic = THREAD_MAGIC_INVALID;
+	if(!mtx->isStatic) {
+		free(mtx);
+	}
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_MutexSetCeiling(Thread_Mutex_t mutex, uint8_t ceiling) {
+	Thread_MutexInternal_t *mtx;
+
+	if(ceiling > THREAD_PRIORITY_MAX) {
+		return TD_INVALID_VALUE;
+	}
 
-	// If a thread has joined us, wake him up
-	if(Thread_curTcb->join.tcb != NULL) {
-		*Thread_curTcb->join.retPtr = ret;
-		THREAD_READY(Thread_curTcb->join.tcb);
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_MUTEX(mutex)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MUTEX;
 	}
 
-	// Delete ourselves
-	// We won't be using stack or TCB after free
-	Thread_curTcb->magic = THREAD_MAGIC_INVALID;
-	free(Thread_curTcb->blockPtr);
-	Thread_curTcb = NULL;
+	mtx = (Thread_MutexInternal_t *) mutex;
+	mtx->ceiling = ceiling;
+	if(mtx->owner != NULL) {
+		Thread_MutexUpdatePriority(mtx->owner);
+	}
 
-	// Release all critical sections
-	Thread_criticalCount = 0;
+	Thread_CriticalExit();
 
-	// Pend scheduler and wait for death.
-	// Since Thread_curTcb is NULL, the context
-	// switcher won't use the stack we just freed.
-	// If scheduler runs between critical release
-	// and the THREAD_PEND_SCHED() call we won't
-	// get back here.
-	THREAD_PEND_SCHED();
-	while(1);
+	return TD_SUCCESS;
 }
 
-void Thread_Init() {
-	Queue_Init(&Thread_readyQueue);
-	Queue_Init(&Thread_chronoQueue);
+/**
+ * Locks a mutex, waiting if needed.
+ * This is an internal function.
+ *
+ * @param mutex   Mutex handle.
+ * @param timeout Timeout, in milliseconds, or THREAD_TIMEOUT_NONE.
+ *
+ * @return TD_SUCCESS, TD_INVALID_MUTEX or TD_TIMEOUT.
+ */
+static Thread_Error_t Thread_MutexLockInternal(Thread_Mutex_t mutex, uint32_t timeout) {
+	Thread_MutexInternal_t *mtx;
+	Thread_Error_t ret;
+	uint32_t waitStart, waitTime;
 
-	// Configure MPU for stack guard
-	MPU->CTRL =
-		(1 << MPU_CTRL_PRIVDEFENA_Pos) | // Use default map as background
-		(0 << MPU_CTRL_HFNMIENA_Pos  ) | // Disable MPU for fault handlers
-		(1 << MPU_CTRL_ENABLE_Pos    ) ; // Enable MPU
+	Thread_CriticalEnter();
 
-	// Set lowest priority for PendSV
-	// While NVIC_SetPriority works with system interrupts,
-	// it considers priority to always be 4 bits like NVIC
-	// interrupts, while system interrupts only have 2 high bits,
-	// so we shift to make up for it.
-	NVIC_SetPriority(PendSV_IRQn, 3 << 2);
+	if(!THREAD_CHECK_MUTEX(mutex)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MUTEX;
+	}
 
-	// Configure systick (highest priority) but leave it disabled
-	SysTick->LOAD = THREAD_SYSTICK_LOAD - 1;
-	SysTick->VAL = 0;
-	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk;
-	NVIC_SetPriority(SysTick_IRQn, 0 << 2);
+	mtx = (Thread_MutexInternal_t *) mutex;
+	if(mtx->owner == NULL) {
+		// Unlocked, take ownership
+		Thread_MutexTake(mtx, Thread_curTcb);
+		Thread_CriticalExit();
+		return TD_SUCCESS;
+	}
+	if(mtx->owner == Thread_curTcb) {
+		// Recursive lock
+		mtx->lockCount++;
+		Thread_CriticalExit();
+		return TD_SUCCESS;
+	}
+	if(timeout == 0) {
+		// Can't wait
+		Thread_CriticalExit();
+		return TD_TIMEOUT;
+	}
 
-#ifdef EVICSDK_FPU_SUPPORT
-	// Enable UsageFault for lazy stacking
-	SCB->SHCSR |= SCB_SHCSR_USGFAULTENA_Msk;
-#endif
+	// Locked by another thread: suspend ourselves
+	// in the wait queue and lend our priority to
+	// the owner (and to whatever it's waiting on)
+	waitStart = Thread_GetSysTicks();
+	Thread_curTcb->state &= ~THREAD_STATE_MSK_READY;
+	Thread_curTcb->waitType = THREAD_WAIT_MUTEX;
+	Thread_curTcb->waitObj = mtx;
+	Thread_MutexWaitInsert(mtx, Thread_curTcb);
+	Thread_MutexUpdatePriority(mtx->owner);
+	if(timeout != THREAD_TIMEOUT_NONE) {
+		Thread_WaitArm(timeout);
+	}
+
+	Thread_CriticalExit();
+
+	// CriticalExit pended the scheduler, wait for suspend/wakeup
+	// Ownership is handed off to us by the unlocking thread
+	THREAD_WAIT_READY();
+	ret = Thread_WaitFinish(TD_INVALID_MUTEX);
+	if(ret != TD_SUCCESS) {
+		// Timed out or destroyed while we were waiting:
+		// the mutex may be gone, don't touch it
+		return ret;
+	}
+
+	// Track maximum blocking time
+	waitTime = Thread_GetSysTicks() - waitStart;
+	Thread_CriticalEnter();
+	if(waitTime > mtx->maxBlockTime) {
+		mtx->maxBlockTime = waitTime;
+	}
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_Create(Thread_t *thread, Thread_EntryPtr_t entry, void *args, uint16_t stackSize) {
-	uint8_t *block;
-	Thread_TCB_t *tcb;
-	Thread_StackedContext_t *ctx;
+Thread_Error_t Thread_MutexLock(Thread_Mutex_t mutex) {
+	return Thread_MutexLockInternal(mutex, THREAD_TIMEOUT_NONE);
+}
 
-	// Align stack size to 8-byte boundary, reserving extra
-	// space for hardware-pushed context and stack guard
-	stackSize = (stackSize + 7) & ~7;
-	stackSize += THREAD_HWCTX_SIZE_ALIGN;
-	stackSize += THREAD_STACKGUARD_SIZE;
+Thread_Error_t Thread_MutexLockTimeout(Thread_Mutex_t mutex, uint32_t timeout) {
+	if(timeout > THREAD_DELAY_MAX) {
+		timeout = THREAD_DELAY_MAX;
+	}
+	return Thread_MutexLockInternal(mutex, timeout);
+}
 
-	// Allocate space for TCB and stack. TCB is below thread
-	// stack (i.e. at higher addresses). Stack must be 8-byte
-	// aligned and stack guard must be size-aligned, so align
-	// allocation to stack guard size (which is 8-byte aligned).
-	block = memalign(THREAD_STACKGUARD_SIZE, stackSize + sizeof(Thread_TCB_t));
-	if(block == NULL) {
-		return TD_NO_MEMORY;
+Thread_Error_t Thread_MutexTryLock(Thread_Mutex_t mutex) {
+	Thread_MutexInternal_t *mtx;
+	Thread_Error_t ret = TD_SUCCESS;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_MUTEX(mutex)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MUTEX;
 	}
 
-	// Setup TCB
-	tcb = (Thread_TCB_t *) (block + stackSize);
-	tcb->magic = THREAD_MAGIC_TCB;
-	tcb->blockPtr = block;
-	tcb->join.tcb = NULL;
-	tcb->state = 0;
-	*thread = (Thread_t) tcb;
+	mtx = (Thread_MutexInternal_t *) mutex;
+	if(mtx->owner == NULL) {
+		// Unlocked, take ownership
+		Thread_MutexTake(mtx, Thread_curTcb);
+	}
+	else if(mtx->owner == Thread_curTcb) {
+		// Recursive lock
+		mtx->lockCount++;
+	}
+	else {
+		ret = TD_TRY_FAIL;
+	}
 
-	// Setup initial thread context and stack
-	ctx = (Thread_StackedContext_t *) (block + stackSize - THREAD_HWCTX_SIZE_ALIGN);
-	ctx->r0 = (uint32_t) args;
-	ctx->lr = (uint32_t) Thread_ExitProc;
-	ctx->pc = (uint32_t) entry;
-	ctx->psr = THREAD_DEFAULT_PSR;
-	tcb->ctx.er = THREAD_DEFAULT_ER;
-	tcb->ctx.sp = (uint32_t) ctx;
+	Thread_CriticalExit();
 
-	// Push new thread to back of ready queue
-	THREAD_READY(tcb);
+	return ret;
+}
 
-	if(!(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)) {
-		// SysTick is not enabled, i.e. this is the first
-		// run. Enable SysTick and pend scheduler.
-		// Once the scheduler runs we will never go back
-		// to the startup code.
-		SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
-		THREAD_PEND_SCHED();
+Thread_Error_t Thread_MutexUnlock(Thread_Mutex_t mutex) {
+	Thread_MutexInternal_t *mtx;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_MUTEX(mutex)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MUTEX;
 	}
 
+	// Assumption: Thread_curTcb != NULL
+	mtx = (Thread_MutexInternal_t *) mutex;
+	if(mtx->owner != Thread_curTcb) {
+		// We didn't lock this mutex
+		Thread_CriticalExit();
+		return TD_MUTEX_BAD_UNLOCK;
+	}
+
+	// Release the mutex once all recursive locks are undone
+	if(--mtx->lockCount == 0) {
+		Thread_MutexRelease(mtx);
+	}
+
+	// CriticalExit pends the scheduler: if we dropped an
+	// inherited priority, the new owner will preempt us
+	Thread_CriticalExit();
+
 	return TD_SUCCESS;
 }
 
-void Thread_Yield() {
-	// Will waste 1 tick if sysTick == 0 when
-	// the scheduler runs, but that's *very*
-	// unlikely (and would only happen once).
-	Thread_curTcb->info.preemptTime = 0;
+Thread_Error_t Thread_MutexGetState(Thread_Mutex_t mutex, uint8_t *isLocked) {
+	Thread_CriticalEnter();
 
-	// Schedule (even if we might have already
-	// been preempted) and wait for suspend/wakeup.
-	THREAD_PEND_SCHED();
-	THREAD_WAIT_READY();
+	if(!THREAD_CHECK_MUTEX(mutex)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MUTEX;
+	}
+
+	*isLocked = (((Thread_MutexInternal_t *) mutex)->owner != NULL);
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_Join(Thread_t thread, void **ret) {
-	Thread_TCB_t *tcb;
+Thread_Error_t Thread_MutexGetMaxBlockTime(Thread_Mutex_t mutex, uint32_t *maxTime) {
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_MUTEX(mutex)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MUTEX;
+	}
+
+	*maxTime = ((Thread_MutexInternal_t *) mutex)->maxBlockTime;
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+/**
+ * Initializes event flags, with all flags cleared.
+ * This is an internal function.
+ *
+ * @param ev       Event flags.
+ * @param isStatic True if ev is caller-provided storage.
+ */
+static void Thread_EventFlagsInit(Thread_EventFlagsInternal_t *ev, uint8_t isStatic) {
+	ev->magic = THREAD_MAGIC_EVENT;
+	ev->value = 0;
+	Queue_Init(&ev->waitQueue);
+	ev->isStatic = isStatic;
+}
+
+Thread_Error_t Thread_EventFlagsCreate(Thread_EventFlags_t *flags) {
+	Thread_EventFlagsInternal_t *ev;
+
+	// Allocate event flags
+	ev = malloc(sizeof(Thread_EventFlagsInternal_t));
+	if(ev == NULL) {
+		return TD_NO_MEMORY;
+	}
+
+	// Initialize event flags
+	Thread_EventFlagsInit(ev, 0);
+	*flags = (Thread_EventFlags_t) ev;
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_EventFlagsInitStatic(Thread_EventFlags_t *flags, Thread_EventFlagsStatic_t *storage) {
+	if(!THREAD_CHECK_RAM(storage, sizeof(Thread_EventFlagsStatic_t))) {
+		return TD_INVALID_VALUE;
+	}
+
+	Thread_EventFlagsInit((Thread_EventFlagsInternal_t *) storage, 1);
+	*flags = (Thread_EventFlags_t) storage;
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_EventFlagsDestroy(Thread_EventFlags_t flags) {
+	Thread_EventFlagsInternal_t *ev;
+	Thread_EventWaiter_t *waiter;
+	uint32_t basepri;
 
 	Thread_CriticalEnter();
 
-	if(!THREAD_CHECK_TCB(thread)) {
+	if(!THREAD_CHECK_EVENT(flags)) {
 		Thread_CriticalExit();
-		return TD_INVALID_THREAD;
+		return TD_INVALID_EVENTFLAGS;
 	}
 
-	tcb = (Thread_TCB_t *) thread;
-	if(tcb->join.tcb != NULL) {
-		return TD_ALREADY_JOINED;
+	// Wake up waiters with TD_INVALID_EVENTFLAGS
+	ev = (Thread_EventFlagsInternal_t *) flags;
+	basepri = Thread_KernelEnter();
+	while((waiter = Queue_PopFront(&ev->waitQueue)) != NULL) {
+		Thread_WaitAbort(waiter->tcb);
 	}
+	ev->magic = THREAD_MAGIC_INVALID;
+	Thread_KernelExit(basepri);
 
-	// Setup ourselves as the joined thread
-	tcb->join.tcb = Thread_curTcb;
-	tcb->join.retPtr = ret;
+	// Destroy event flags
+	if(!ev->isStatic) {
+		free(ev);
+	}
 
-	// Mark current thread as suspended
-	Thread_curTcb->state &= ~THREAD_STATE_MSK_READY;
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_EventFlagsSet(Thread_EventFlags_t flags, uint32_t mask) {
+	Thread_EventFlagsInternal_t *ev;
+	Thread_EventWaiter_t *waiter, *next;
+	uint32_t basepri, value, clearMask = 0;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_EVENT(flags)) {
+		Thread_CriticalExit();
+		return TD_INVALID_EVENTFLAGS;
+	}
+
+	// Wake up all satisfied waiters. All of them see the
+	// same value: flags they want cleared are only cleared
+	// once every waiter has been checked.
+	ev = (Thread_EventFlagsInternal_t *) flags;
+	basepri = Thread_KernelEnter();
+	value = ev->value | mask;
+	for(waiter = ev->waitQueue.head; waiter != NULL; waiter = next) {
+		next = waiter->next;
+		if(THREAD_EVENT_MATCH(value, waiter->mask, waiter->mode)) {
+			waiter->result = value;
+			if(waiter->mode & THREAD_EVENTFLAGS_CLEAR) {
+				clearMask |= waiter->mask;
+			}
+			Queue_Remove(&ev->waitQueue, waiter);
+			waiter->tcb->waitType = THREAD_WAIT_NONE;
+			Thread_ReadyQueuePush(waiter->tcb);
+		}
+	}
+	ev->value = value & ~clearMask;
+	Thread_KernelExit(basepri);
 
 	Thread_CriticalExit();
 
-	// CriticalExit pended the scheduler, wait for suspend/wakeup
-	THREAD_WAIT_READY();
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_EventFlagsClear(Thread_EventFlags_t flags, uint32_t mask) {
+	Thread_EventFlagsInternal_t *ev;
+	uint32_t basepri;
+
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_EVENT(flags)) {
+		Thread_CriticalExit();
+		return TD_INVALID_EVENTFLAGS;
+	}
+
+	ev = (Thread_EventFlagsInternal_t *) flags;
+	basepri = Thread_KernelEnter();
+	ev->value &= ~mask;
+	Thread_KernelExit(basepri);
+
+	Thread_CriticalExit();
+
+	return TD_SUCCESS;
+}
+
+Thread_Error_t Thread_EventFlagsGet(Thread_EventFlags_t flags, uint32_t *value) {
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_EVENT(flags)) {
+		Thread_CriticalExit();
+		return TD_INVALID_EVENTFLAGS;
+	}
+
+	*value = ((Thread_EventFlagsInternal_t *) flags)->value;
+
+	Thread_CriticalExit();
 
 	return TD_SUCCESS;
 }
 
-void Thread_DelayMs(uint32_t delay) {
-	uint32_t delayEnd;
+/**
+ * Waits for flags in an event flags group.
+ * This is an internal function.
+ *
+ * @param flags   Event flags handle.
+ * @param mask    Flags to wait for.
+ * @param mode    Wait mode (THREAD_EVENTFLAGS_*).
+ * @param value   Pointer to receive the flags, or NULL.
+ * @param timeout Timeout, in milliseconds, or THREAD_TIMEOUT_NONE.
+ *
+ * @return TD_SUCCESS, TD_INVALID_VALUE, TD_INVALID_EVENTFLAGS or TD_TIMEOUT.
+ */
+static Thread_Error_t Thread_EventFlagsWaitInternal(Thread_EventFlags_t flags, uint32_t mask, uint8_t mode, uint32_t *value, uint32_t timeout) {
+	Thread_EventFlagsInternal_t *ev;
+	Thread_EventWaiter_t waiter;
+	Thread_Error_t ret = TD_SUCCESS;
+	uint32_t basepri;
+	uint8_t waitWakeup = 0;
+
+	if(mask == 0) {
+		return TD_INVALID_VALUE;
+	}
 
 	Thread_CriticalEnter();
 
-	delayEnd = Thread_sysTick + delay * THREAD_SYSTICK_MS;
-	if(delayEnd < Thread_curTcb->info.preemptTime - THREAD_DELAY_MARGIN) {
-		// The delay will end before preemption: busy wait.
+	if(!THREAD_CHECK_EVENT(flags)) {
 		Thread_CriticalExit();
-		while(Thread_sysTick < delayEnd);
+		return TD_INVALID_EVENTFLAGS;
+	}
+
+	// Flags can be set by ISRs, so check
+	// and suspend with IRQs masked
+	ev = (Thread_EventFlagsInternal_t *) flags;
+	basepri = Thread_KernelEnter();
+	if(THREAD_EVENT_MATCH(ev->value, mask, mode)) {
+		// Already satisfied
+		waiter.result = ev->value;
+		if(mode & THREAD_EVENTFLAGS_CLEAR) {
+			ev->value &= ~mask;
+		}
+	}
+	else if(timeout == 0) {
+		ret = TD_TIMEOUT;
 	}
 	else {
-		// Suspend thread to the chronological queue
-		Thread_curTcb->info.chronoTime = delayEnd;
+		// Mark current thread as suspended
+		waiter.tcb = Thread_curTcb;
+		waiter.events = ev;
+		waiter.mask = mask;
+		waiter.mode = mode;
 		Thread_curTcb->state &= ~THREAD_STATE_MSK_READY;
-		Thread_ChronoQueueInsert(&Thread_chronoQueue, Thread_curTcb);
-		Thread_CriticalExit();
-		// CriticalExit pended the scheduler, wait for suspend/wakeup
-		THREAD_WAIT_READY();
+		Thread_curTcb->waitType = THREAD_WAIT_EVENT;
+		Thread_curTcb->waitObj = &waiter;
+		Queue_PushBack(&ev->waitQueue, &waiter);
+		waitWakeup = 1;
 	}
-}
+	Thread_KernelExit(basepri);
 
-void Thread_CriticalEnter() {
-	// No-op from ISRs or startup code
-	if(THREAD_GET_IRQN() != 0 || Thread_curTcb == NULL) {
-		return;
+	// The scheduler can't run the timeout before
+	// we're out of the critical section
+	if(waitWakeup && timeout != THREAD_TIMEOUT_NONE) {
+		Thread_WaitArm(timeout);
 	}
 
-	// No atomic operations needed here.
-	// criticalCount = 0: even if preemption occurs
-	// during read-update-store, the atomic store to
-	// 1 will still be correct since criticalCount
-	// must be zero for this code to be resumed.
-	// criticalCount > 0: already in critical section,
-	// so read-update-store won't be disturbed.
-	Thread_criticalCount++;
-}
+	Thread_CriticalExit();
 
-void Thread_CriticalExit() {
-	// No-op from ISRs or startup code
-	if(THREAD_GET_IRQN() != 0 || Thread_curTcb == NULL) {
-		return;
+	if(waitWakeup) {
+		// Thread_CriticalExit pended scheduler, wait for suspend/wakeup
+		THREAD_WAIT_READY();
+		ret = Thread_WaitFinish(TD_INVALID_EVENTFLAGS);
 	}
 
-	// No atomic operations needed here.
-	// criticalCount = 0: even if preemption occurs
-	// during read-check, the atomic read of 0 will
-	// still be correct since criticalCount must be
-	// zero for this code to be resumed.
-	// criticalCount > 0: already in critical section,
-	// so read-update-store won't be disturbed.
-	if(Thread_criticalCount == 0) {
-		return;
+	// The result is only filled in if the flags matched
+	if(ret == TD_SUCCESS && value != NULL) {
+		*value = waiter.result;
 	}
-	Thread_criticalCount--;
 
-	// This check is correct even in case of preemption
-	// for the same reasons shown above.
-	if(Thread_criticalCount == 0) {
-		// Just exited the last critical section, time
-		// to reschedule. Even if we've been preempted
-		// after exiting, an extra scheduler call won't
-		// cause issues.
-		THREAD_PEND_SCHED();
+	return ret;
+}
+
+Thread_Error_t Thread_EventFlagsWait(Thread_EventFlags_t flags, uint32_t mask, uint8_t mode, uint32_t *value) {
+	return Thread_EventFlagsWaitInternal(flags, mask, mode, value, THREAD_TIMEOUT_NONE);
+}
+
+Thread_Error_t Thread_EventFlagsWaitTimeout(Thread_EventFlags_t flags, uint32_t mask, uint8_t mode, uint32_t *value, uint32_t timeout) {
+	if(timeout > THREAD_DELAY_MAX) {
+		timeout = THREAD_DELAY_MAX;
 	}
+	return Thread_EventFlagsWaitInternal(flags, mask, mode, value, timeout);
 }
 
 /**
- * Initializes a semaphore.
+ * Initializes a message queue.
  * This is an internal function.
  *
- * @param sema  Semaphore.
- * @param count Initial semaphore count.
+ * @param mq       Message queue.
+ * @param buffer   Message buffer.
+ * @param msgSize  Size of a message, in bytes.
+ * @param msgCount Number of message slots.
+ * @param isStatic True if mq is caller-provided storage.
  */
-static void Thread_SemaphoreInit(Thread_SemaphoreInternal_t *sema, int32_t count) {
-	sema->magic = THREAD_MAGIC_SEMA;
-	sema->count = count;
-	Queue_Init(&sema->waitQueue);
+static void Thread_MsgQueueInit(Thread_MsgQueueInternal_t *mq, void *buffer,
+		uint16_t msgSize, uint16_t msgCount, uint8_t isStatic) {
+	mq->magic = THREAD_MAGIC_MSGQ;
+	mq->buffer = buffer;
+	mq->msgSize = msgSize;
+	mq->msgCount = msgCount;
+	mq->readIndex = 0;
+	mq->writeIndex = 0;
+	mq->freeCount = msgCount;
+	mq->reserveCount = 0;
+	mq->commitCount = 0;
+	mq->readCount = 0;
+	mq->doneCount = 0;
+	mq->isStatic = isStatic;
+	Thread_SemaphoreInit(&mq->msgSema, 0, 1);
 }
 
 /**
- * Deletes and deallocates a semaphore.
+ * Reserves a free slot in a message queue.
  * This is an internal function.
  *
- * @param sema   Semaphore.
- * @param doFree True to free the memory pointed by sema.
+ * @param mq Message queue.
  *
- * @return TD_SUCCESS or TD_INVALID_SEMA.
+ * @return Slot address, or NULL if the queue is full.
  */
-static Thread_Error_t Thread_SemaphoreDelete(Thread_SemaphoreInternal_t *sema, uint8_t doFree) {
-	Thread_CriticalEnter();
+static uint8_t *Thread_MsgQueueReserveSlot(Thread_MsgQueueInternal_t *mq) {
+	uint8_t *slot = NULL;
+	uint32_t basepri;
+
+	basepri = Thread_KernelEnter();
+	if(mq->freeCount != 0) {
+		slot = mq->buffer + mq->writeIndex * mq->msgSize;
+		if(++mq->writeIndex == mq->msgCount) {
+			mq->writeIndex = 0;
+		}
+		mq->freeCount--;
+		mq->reserveCount++;
+	}
+	Thread_KernelExit(basepri);
 
-	if(!THREAD_CHECK_SEMA(sema)) {
-		Thread_CriticalExit();
-		return TD_INVALID_SEMA;
+	return slot;
+}
+
+/**
+ * Commits a reserved slot in a message queue, publishing all
+ * committed slots if no other reservation is outstanding.
+ * This is an internal function.
+ *
+ * @param mq Message queue.
+ *
+ * @return True on success, false if there was no reservation.
+ */
+static uint8_t Thread_MsgQueueCommitSlot(Thread_MsgQueueInternal_t *mq) {
+	uint32_t basepri;
+	uint16_t publish = 0;
+
+	basepri = Thread_KernelEnter();
+	if(mq->reserveCount == 0) {
+		Thread_KernelExit(basepri);
+		return 0;
 	}
+	mq->reserveCount--;
+	mq->commitCount++;
+	if(mq->reserveCount == 0) {
+		publish = mq->commitCount;
+		mq->commitCount = 0;
+	}
+	Thread_KernelExit(basepri);
 
-	// Delete semaphore
-	sema->magic = THREAD_MAGIC_INVALID;
-	if(doFree) {
-		free(sema);
+	// Wake up receivers, one per message
+	while(publish-- > 0) {
+		Thread_SemaphoreUp((Thread_Semaphore_t) &mq->msgSema);
 	}
 
-	Thread_CriticalExit();
+	return 1;
+}
 
-	return TD_SUCCESS;
+/**
+ * Reads the first published slot of a message queue and frees it.
+ * The caller must have downed the message semaphore.
+ * This is an internal function.
+ *
+ * @param mq  Message queue.
+ * @param msg Buffer to receive the message.
+ */
+static void Thread_MsgQueueReadSlot(Thread_MsgQueueInternal_t *mq, void *msg) {
+	uint8_t *slot;
+	uint32_t basepri;
+
+	basepri = Thread_KernelEnter();
+	slot = mq->buffer + mq->readIndex * mq->msgSize;
+	if(++mq->readIndex == mq->msgCount) {
+		mq->readIndex = 0;
+	}
+	mq->readCount++;
+	Thread_KernelExit(basepri);
+
+	// Copy with IRQs enabled
+	memcpy(msg, slot, mq->msgSize);
+
+	basepri = Thread_KernelEnter();
+	mq->readCount--;
+	mq->doneCount++;
+	if(mq->readCount == 0) {
+		mq->freeCount += mq->doneCount;
+		mq->doneCount = 0;
+	}
+	Thread_KernelExit(basepri);
 }
 
-Thread_Error_t Thread_SemaphoreCreate(Thread_Semaphore_t *sema, int32_t count) {
-	Thread_SemaphoreInternal_t *sm;
+Thread_Error_t Thread_MsgQueueCreate(Thread_MsgQueue_t *queue, void *buffer, uint16_t msgSize, uint16_t msgCount) {
+	Thread_MsgQueueInternal_t *mq;
 
-	if(count < 0) {
+	if(msgSize == 0 || msgCount == 0 || !THREAD_CHECK_RAM(buffer, (uint32_t) msgSize * msgCount)) {
 		return TD_INVALID_VALUE;
 	}
 
-	// Allocate semaphore
-	sm = malloc(sizeof(Thread_SemaphoreInternal_t));
-	if(sm == NULL) {
+	// Allocate message queue
+	mq = malloc(sizeof(Thread_MsgQueueInternal_t));
+	if(mq == NULL) {
 		return TD_NO_MEMORY;
 	}
 
-	// Initialize semaphore
-	Thread_SemaphoreInit(sm, count);
-	*sema = (Thread_Semaphore_t) sm;
+	// Initialize message queue
+	Thread_MsgQueueInit(mq, buffer, msgSize, msgCount, 0);
+	*queue = (Thread_MsgQueue_t) mq;
 
 	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_SemaphoreDestroy(Thread_Semaphore_t sema) {
-	return Thread_SemaphoreDelete((Thread_SemaphoreInternal_t *) sema, 1);
+Thread_Error_t Thread_MsgQueueInitStatic(Thread_MsgQueue_t *queue, Thread_MsgQueueStatic_t *storage,
+		void *buffer, uint16_t msgSize, uint16_t msgCount) {
+	if(msgSize == 0 || msgCount == 0 || !THREAD_CHECK_RAM(buffer, (uint32_t) msgSize * msgCount) ||
+	   !THREAD_CHECK_RAM(storage, sizeof(Thread_MsgQueueStatic_t))) {
+		return TD_INVALID_VALUE;
+	}
+
+	Thread_MsgQueueInit((Thread_MsgQueueInternal_t *) storage, buffer, msgSize, msgCount, 1);
+	*queue = (Thread_MsgQueue_t) storage;
+
+	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_SemaphoreDown(Thread_Semaphore_t sema) {
-	Thread_SemaphoreInternal_t *sm;
-	int32_t newSema;
-	uint32_t primask;
-	uint8_t waitWakeup = 0;
+Thread_Error_t Thread_MsgQueueDestroy(Thread_MsgQueue_t queue) {
+	Thread_MsgQueueInternal_t *mq;
+	Thread_TCB_t *tcb;
+	uint32_t basepri;
 
 	Thread_CriticalEnter();
 
-	if(!THREAD_CHECK_SEMA(sema)) {
+	if(!THREAD_CHECK_MSGQ(queue)) {
 		Thread_CriticalExit();
-		return TD_INVALID_SEMA;
+		return TD_INVALID_MSGQUEUE;
 	}
 
-	// Decrement semaphore
-	sm = (Thread_SemaphoreInternal_t *) sema;
-	newSema = AtomicOps_Add((volatile uint32_t *) &sm->count, -1);
+	// Wake up receivers, their semaphore down returns
+	// TD_INVALID_SEMA (see Thread_MsgQueueReceiveInternal)
+	mq = (Thread_MsgQueueInternal_t *) queue;
+	basepri = Thread_KernelEnter();
+	while((tcb = Queue_PopFront(&mq->msgSema.waitQueue)) != NULL) {
+		Thread_WaitAbort(tcb);
+	}
+	mq->msgSema.magic = THREAD_MAGIC_INVALID;
+	mq->magic = THREAD_MAGIC_INVALID;
+	Thread_KernelExit(basepri);
 
-	if(newSema < 0) {
-		// This semaphore can't be downed without waiting.
-		// We might have been preempted after determining that
-		// newSema < 0, but before disabling interrupts, by a thread
-		// or ISR that upped the semaphore.
-		// If we don't re-check, we could wrongly suspend ourselves
-		// and we wouldn't be woken up until another up occurs.
-		// This double check avoids disabling interrupts when
-		// the semaphore can be simply downed without suspending and
-		// the race described above doesn't happen.
-		primask = Thread_IrqDisable();
-		if(sm->count < 0) {
-			// Mark current thread as suspended
-			Thread_curTcb->state &= ~THREAD_STATE_MSK_READY;
-			// Push ourselves to back of wait queue
-			Queue_PushBack(&sm->waitQueue, Thread_curTcb);
-			waitWakeup = 1;
-		}
-		Thread_IrqRestore(primask);
+	// Destroy message queue
+	if(!mq->isStatic) {
+		free(mq);
 	}
 
 	Thread_CriticalExit();
 
-	if(waitWakeup) {
-		// Thread_CriticalExit pended scheduler, wait for suspend/wakeup
-		THREAD_WAIT_READY();
-	}
-
 	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_SemaphoreTryDown(Thread_Semaphore_t sema) {
-	Thread_SemaphoreInternal_t *sm;
-	int32_t oldVal;
+Thread_Error_t Thread_MsgQueuePost(Thread_MsgQueue_t queue, const void *msg) {
+	Thread_MsgQueueInternal_t *mq;
+	uint8_t *slot;
 
 	Thread_CriticalEnter();
 
-	if(!THREAD_CHECK_SEMA(sema)) {
+	if(!THREAD_CHECK_MSGQ(queue)) {
 		Thread_CriticalExit();
-		return TD_INVALID_SEMA;
+		return TD_INVALID_MSGQUEUE;
 	}
 
-	// Try to down by compare-and-swap
-	sm = (Thread_SemaphoreInternal_t *) sema;
-	do {
-		oldVal = sm->count;
-		if(oldVal <= 0) {
-			// Can't be downed without waiting
-			Thread_CriticalExit();
-			return TD_TRY_FAIL;
-		}
-	} while(AtomicOps_CmpSwap((volatile uint32_t *) &sm->count, oldVal, oldVal - 1) != oldVal);
+	mq = (Thread_MsgQueueInternal_t *) queue;
+	slot = Thread_MsgQueueReserveSlot(mq);
+	if(slot == NULL) {
+		Thread_CriticalExit();
+		return TD_TRY_FAIL;
+	}
+	memcpy(slot, msg, mq->msgSize);
+	Thread_MsgQueueCommitSlot(mq);
 
 	Thread_CriticalExit();
 
 	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_SemaphoreUp(Thread_Semaphore_t sema) {
-	Thread_SemaphoreInternal_t *sm;
-	Thread_TCB_t *tcb;
-	int32_t newSema;
-	uint32_t primask;
+Thread_Error_t Thread_MsgQueueReserve(Thread_MsgQueue_t queue, void **msg) {
+	uint8_t *slot;
 
 	Thread_CriticalEnter();
 
-	if(!THREAD_CHECK_SEMA(sema)) {
+	if(!THREAD_CHECK_MSGQ(queue)) {
 		Thread_CriticalExit();
-		return TD_INVALID_SEMA;
+		return TD_INVALID_MSGQUEUE;
 	}
 
-	// Increment semaphore
-	sm = (Thread_SemaphoreInternal_t *) sema;
-	newSema = AtomicOps_Add((volatile uint32_t *) &sm->count, 1);
-	if(newSema <= 0) {
-		// The old value was negative: there's at least a thread
-		// waiting on this sema. Each up handles a single wakeup
-		// only, so another thread or ISR (try)downing between
-		// the newSema check and disabling IRQs won't hurt us.
-		// Wake up the first thread in queue.
-		primask = Thread_IrqDisable();
-		if((tcb = Queue_PopFront(&sm->waitQueue)) != NULL) {
-			tcb->state |= THREAD_STATE_MSK_READY;
-			Queue_PushBack(&Thread_readyQueue, tcb);
-		}
-		Thread_IrqRestore(primask);
-	}
+	slot = Thread_MsgQueueReserveSlot((Thread_MsgQueueInternal_t *) queue);
 
 	Thread_CriticalExit();
 
+	if(slot == NULL) {
+		return TD_TRY_FAIL;
+	}
+	*msg = slot;
+
 	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_SemaphoreGetCount(Thread_Semaphore_t sema, int32_t *count) {
-	Thread_SemaphoreInternal_t *sm;
-	int32_t val;
+Thread_Error_t Thread_MsgQueueCommit(Thread_MsgQueue_t queue) {
+	Thread_Error_t ret = TD_SUCCESS;
 
 	Thread_CriticalEnter();
 
-	if(!THREAD_CHECK_SEMA(sema)) {
+	if(!THREAD_CHECK_MSGQ(queue)) {
 		Thread_CriticalExit();
-		return TD_INVALID_SEMA;
+		return TD_INVALID_MSGQUEUE;
 	}
 
-	// We internally use negative values to count
-	// waiting threads, mask them as zero
-	sm = (Thread_SemaphoreInternal_t *) sema;
-	val = sm->count;
-	*count = val < 0 ? 0 : val;
+	if(!Thread_MsgQueueCommitSlot((Thread_MsgQueueInternal_t *) queue)) {
+		ret = TD_INVALID_VALUE;
+	}
 
 	Thread_CriticalExit();
 
-	return TD_SUCCESS;
+	return ret;
 }
 
-Thread_Error_t Thread_MutexCreate(Thread_Mutex_t *mutex) {
-	Thread_MutexInternal_t *mtx;
+/**
+ * Receives a message from a queue, waiting if needed.
+ * This is an internal function.
+ *
+ * @param queue   Message queue handle.
+ * @param msg     Buffer to receive the message.
+ * @param timeout Timeout, in milliseconds, or THREAD_TIMEOUT_NONE.
+ *
+ * @return TD_SUCCESS, TD_INVALID_MSGQUEUE or TD_TIMEOUT.
+ */
+static Thread_Error_t Thread_MsgQueueReceiveInternal(Thread_MsgQueue_t queue, void *msg, uint32_t timeout) {
+	Thread_MsgQueueInternal_t *mq;
+	Thread_Error_t ret;
 
-	// Allocate mutex and binary semaphore
-	mtx = malloc(sizeof(Thread_MutexInternal_t));
-	if(mtx == NULL) {
-		return TD_NO_MEMORY;
+	// Can't wait inside a critical section. The semaphore
+	// is invalidated along with the queue, so downing it
+	// will catch a concurrent destruction, and destroying
+	// the queue wakes us up with TD_INVALID_SEMA.
+	Thread_CriticalEnter();
+	ret = THREAD_CHECK_MSGQ(queue) ? TD_SUCCESS : TD_INVALID_MSGQUEUE;
+	Thread_CriticalExit();
+	if(ret != TD_SUCCESS) {
+		return ret;
 	}
 
-	// Initialize mutex/semaphore to 1 (unlocked)
-	Thread_SemaphoreInit(&mtx->sema, 1);
-	mtx->owner = NULL;
-	*mutex = (Thread_Mutex_t) mtx;
-
-	return TD_SUCCESS;
-}
-
-Thread_Error_t Thread_MutexDestroy(Thread_Mutex_t mutex) {
-	Thread_MutexInternal_t *mtx;
-
-	// Destroy semaphore, without freeing memory
-	mtx = (Thread_MutexInternal_t *) mutex;
-	if(Thread_SemaphoreDelete(&mtx->sema, 0) == TD_INVALID_SEMA) {
-		return TD_INVALID_MUTEX;
+	mq = (Thread_MsgQueueInternal_t *) queue;
+	ret = Thread_SemaphoreDownInternal((Thread_Semaphore_t) &mq->msgSema, timeout);
+	if(ret == TD_INVALID_SEMA) {
+		return TD_INVALID_MSGQUEUE;
+	}
+	if(ret != TD_SUCCESS) {
+		return ret;
 	}
 
-	// Destroy mutex
-	free(mtx);
+	// A message is reserved for us. The queue must not
+	// be destroyed while we copy it (see Thread.h).
+	Thread_MsgQueueReadSlot(mq, msg);
 
 	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_MutexLock(Thread_Mutex_t mutex) {
-	Thread_MutexInternal_t *mtx;
-
-	// Down semaphore (blocking) and take ownership
-	mtx = (Thread_MutexInternal_t *) mutex;
-	if(Thread_SemaphoreDown((Thread_Semaphore_t) &mtx->sema) == TD_INVALID_SEMA) {
-		return TD_INVALID_MUTEX;
-	}
-	mtx->owner = Thread_curTcb;
-
-	return TD_SUCCESS;
+Thread_Error_t Thread_MsgQueueReceive(Thread_MsgQueue_t queue, void *msg) {
+	return Thread_MsgQueueReceiveInternal(queue, msg, THREAD_TIMEOUT_NONE);
 }
 
-Thread_Error_t Thread_MutexTryLock(Thread_Mutex_t mutex) {
-	Thread_MutexInternal_t *mtx;
-	Thread_Error_t ret;
-
-	// Try downing the semaphore
-	mtx = (Thread_MutexInternal_t *) mutex;
-	ret = Thread_SemaphoreTryDown((Thread_Semaphore_t) &mtx->sema);
-	switch(ret) {
-		case TD_SUCCESS:
-			// Lock succeeded, take ownership
-			mtx->owner = Thread_curTcb;
-			break;
-		case TD_INVALID_SEMA:
-			ret = TD_INVALID_MUTEX;
-			break;
-		default:
-			ret = TD_TRY_FAIL;
-			break;
+Thread_Error_t Thread_MsgQueueReceiveTimeout(Thread_MsgQueue_t queue, void *msg, uint32_t timeout) {
+	if(timeout > THREAD_DELAY_MAX) {
+		timeout = THREAD_DELAY_MAX;
 	}
-
-	return ret;
+	return Thread_MsgQueueReceiveInternal(queue, msg, timeout);
 }
 
-Thread_Error_t Thread_MutexUnlock(Thread_Mutex_t mutex) {
-	Thread_MutexInternal_t *mtx;
+Thread_Error_t Thread_MsgQueueTryReceive(Thread_MsgQueue_t queue, void *msg) {
+	Thread_MsgQueueInternal_t *mq;
 
-	mtx = (Thread_MutexInternal_t *) mutex;
+	Thread_CriticalEnter();
 
-	// Assumption: Thread_curTcb != NULL
-	if(mtx->owner != Thread_curTcb) {
-		// We didn't lock this mutex, it's
-		// already unlocked or we preempted
-		// a Thread_Mutex(Try)Lock, which can
-		// only happen if we don't own the mutex
-		return TD_MUTEX_BAD_UNLOCK;
+	if(!THREAD_CHECK_MSGQ(queue)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MSGQUEUE;
 	}
 
-	// Release ownership and up semaphore
-	mtx->owner = NULL;
-	Thread_SemaphoreUp((Thread_Semaphore_t) &mtx->sema);
+	mq = (Thread_MsgQueueInternal_t *) queue;
+	if(Thread_SemaphoreTryDown((Thread_Semaphore_t) &mq->msgSema) != TD_SUCCESS) {
+		Thread_CriticalExit();
+		return TD_TRY_FAIL;
+	}
+	Thread_MsgQueueReadSlot(mq, msg);
+
+	Thread_CriticalExit();
 
 	return TD_SUCCESS;
 }
 
-Thread_Error_t Thread_MutexGetState(Thread_Mutex_t mutex, uint8_t *isLocked) {
-	Thread_MutexInternal_t *mtx;
-	int32_t count;
+Thread_Error_t Thread_MsgQueueGetCount(Thread_MsgQueue_t queue, uint16_t *count) {
+	int32_t val;
 
-	mtx = (Thread_MutexInternal_t *) mutex;
-	if(Thread_SemaphoreGetCount((Thread_Semaphore_t) &mtx->sema, &count) == TD_INVALID_SEMA) {
-		return TD_INVALID_MUTEX;
+	Thread_CriticalEnter();
+
+	if(!THREAD_CHECK_MSGQ(queue)) {
+		Thread_CriticalExit();
+		return TD_INVALID_MSGQUEUE;
 	}
-	*isLocked = (count == 0);
+
+	val = ((Thread_MsgQueueInternal_t *) queue)->msgSema.count;
+	*count = val < 0 ? 0 : val;
+
+	Thread_CriticalExit();
 
 	return TD_SUCCESS;
 }
@@ -20,6 +20,7 @@
 #include <M451Series.h>
 #include <TimerUtils.h>
 #include <Thread.h>
+#include <WorkQueue.h>
 
 /**
  * Structure for holding timeout status.
@@ -42,6 +43,14 @@ static volatile Timer_Callback_t Timer_callbackPtr[4];
  */
 static volatile uint32_t Timer_callbackData[4];
 
+/**
+ * Timer slot generations, bumped whenever a slot is assigned.
+ * Deferred callbacks carry the generation they were posted for,
+ * so that they are dropped if their slot has been reused in the
+ * meantime.
+ */
+static volatile uint8_t Timer_callbackGen[4];
+
 /**
  * Timeout status.
  */
@@ -51,7 +60,8 @@ static volatile Timer_TimeoutData_t Timer_timeoutData[4];
  * Timer information flags.
  * Bits 0-3 are assigned to timers 0-3.
  * If a bit is 1, the corresponding timer is a timeout.
- * Bits 4-7 are unused.
+ * Bits 4-7 are assigned to timers 0-3.
+ * If a bit is 1, the corresponding callback runs in thread context.
  */
 static volatile uint8_t Timer_info;
 
@@ -65,6 +75,49 @@ static TIMER_T * const Timer_TimerPtr[] = {TIMER0, TIMER1, TIMER2, TIMER3};
  */
 static const IRQn_Type Timer_IrqNum[] = {TMR0_IRQn, TMR1_IRQn, TMR2_IRQn, TMR3_IRQn};
 
+/* Timer_info bit for thread context callbacks. */
+#define TIMER_INFO_INTHREAD(n) (1 << ((n) + 4))
+
+/* Software timer service counter frequency, in Hz. */
+#define TIMER_SOFT_FREQ 1000000
+/* Mask for the 24-bit hardware counter. */
+#define TIMER_SOFT_CNT_MASK 0xFFFFFF
+/* Minimum distance to arm the compare match, in microseconds.
+ * Covers the time between reading the counter and writing CMP. */
+#define TIMER_SOFT_ARM_MIN 10
+/* Maximum distance to arm the compare match, in microseconds.
+ * Must be less than the counter range, so that the time
+ * extension never misses a counter wrap while timers run. */
+#define TIMER_SOFT_ARM_MAX (1 << 23)
+
+/* True if software timer time a is before time b. */
+#define TIMER_SOFT_BEFORE(a, b) ((int32_t) ((a) - (b)) < 0)
+
+/**
+ * Hardware timer index used by the software timer service,
+ * or -1 if the service hasn't been started yet.
+ */
+static volatile int8_t Timer_softIndex = -1;
+
+/**
+ * Active software timers, sorted by expiration time.
+ * Synchronization: kernel lock.
+ */
+static Timer_Soft_t *Timer_softList;
+
+/**
+ * Software timer service time, in microseconds. The hardware
+ * counter is only 24 bits wide: this extends it to 32 bits.
+ * Synchronization: kernel lock.
+ */
+static uint32_t Timer_softNow;
+
+/**
+ * Hardware counter value at the last Timer_softNow update.
+ * Synchronization: kernel lock.
+ */
+static uint32_t Timer_softLastCnt;
+
 /**
  * Convenience macro to define timer IRQ handlers.
  */
@@ -75,11 +128,53 @@ static const IRQn_Type Timer_IrqNum[] = {TMR0_IRQn, TMR1_IRQn, TMR2_IRQn, TMR3_I
 			Timer_HandleTimeoutTick(n); \
 		} \
 		else { \
-			Timer_callbackPtr[n](Timer_callbackData[n]); \
+			Timer_RunCallback(n); \
 		} \
 	} \
 }
 
+/**
+ * Runs a timer callback deferred to thread context.
+ * This is an internal function.
+ *
+ * @param context Unused.
+ * @param arg     Slot generation in bits 8-15,
+ *                timer index in bits 0-7.
+ */
+static void Timer_DeferredCallback(void *context, uint32_t arg) {
+	Timer_Callback_t callback;
+	uint32_t primask, callbackData;
+	uint8_t i;
+
+	// The timer could have been deleted, and its slot
+	// taken by another one, in the meantime
+	i = arg & 0xFF;
+	primask = Thread_IrqDisable();
+	callback = Timer_callbackGen[i] == (uint8_t) (arg >> 8) ? Timer_callbackPtr[i] : NULL;
+	callbackData = Timer_callbackData[i];
+	Thread_IrqRestore(primask);
+
+	if(callback != NULL) {
+		callback(callbackData);
+	}
+}
+
+/**
+ * Invokes a timer callback, or defers it to
+ * thread context if requested.
+ * This is an internal function.
+ *
+ * @param timerIndex Timer index.
+ */
+static void Timer_RunCallback(uint8_t timerIndex) {
+	if(Timer_info & TIMER_INFO_INTHREAD(timerIndex)) {
+		WorkQueue_Post(Timer_DeferredCallback, NULL, (Timer_callbackGen[timerIndex] << 8) | timerIndex);
+	}
+	else {
+		Timer_callbackPtr[timerIndex](Timer_callbackData[timerIndex]);
+	}
+}
+
 /**
  * Handles a timeout tick.
  * This is an internal function.
@@ -91,7 +186,7 @@ static void Timer_HandleTimeoutTick(uint8_t timerIndex) {
 
 	if(Timer_timeoutData[timerIndex].tickCounter >= Timer_timeoutData[timerIndex].tickTarget) {
 		Timer_timeoutData[timerIndex].tickCounter = 0;
-		Timer_callbackPtr[timerIndex](Timer_callbackData[timerIndex]);
+		Timer_RunCallback(timerIndex);
 	}
 }
 
@@ -130,11 +225,13 @@ static int8_t Timer_AssignSlot(uint32_t freq, uint8_t isPeriodic, Timer_Callback
 	// Set up timer
 	TIMER_Open(Timer_TimerPtr[i], isPeriodic ? TIMER_PERIODIC_MODE : TIMER_ONESHOT_MODE, freq);
 	TIMER_EnableInt(Timer_TimerPtr[i]);
+	NVIC_SetPriority(Timer_IrqNum[i], THREAD_KERNEL_PRIORITY);
 	NVIC_EnableIRQ(Timer_IrqNum[i]);
 
 	// The callback pointer is set here to avoid using a "poison" non-NULL
 	// pointer to synchronize concurrent AssignSlot calls (before the caller
 	// would have a chance to set it to a non-NULL value).
+	Timer_callbackGen[i]++;
 	Timer_callbackPtr[i] = callback;
 
 	Thread_IrqRestore(primask);
@@ -146,10 +243,165 @@ static int8_t Timer_AssignSlot(uint32_t freq, uint8_t isPeriodic, Timer_Callback
 	return i;
 }
 
+/**
+ * Updates and gets the software timer service time.
+ * Must be called with the kernel lock held.
+ * This is an internal function.
+ *
+ * @param cnt Pointer to receive the hardware counter value.
+ *
+ * @return Current time, in microseconds.
+ */
+static uint32_t Timer_SoftGetTime(uint32_t *cnt) {
+	*cnt = TIMER_GetCounter(Timer_TimerPtr[Timer_softIndex]);
+	Timer_softNow += (*cnt - Timer_softLastCnt) & TIMER_SOFT_CNT_MASK;
+	Timer_softLastCnt = *cnt;
+
+	return Timer_softNow;
+}
+
+/**
+ * Inserts a software timer in the active list.
+ * Must be called with the kernel lock held.
+ * This is an internal function.
+ *
+ * @param timer Software timer. Must not be in the list.
+ */
+static void Timer_SoftInsert(Timer_Soft_t *timer) {
+	Timer_Soft_t **link;
+
+	// Insert after timers with the same expiration time,
+	// so that they expire in start order.
+	for(link = &Timer_softList; *link != NULL &&
+	    !TIMER_SOFT_BEFORE(timer->expiry, (*link)->expiry); link = &(*link)->next);
+	timer->next = *link;
+	*link = timer;
+}
+
+/**
+ * Removes a software timer from the active list, if it's in it.
+ * Must be called with the kernel lock held.
+ * This is an internal function.
+ *
+ * @param timer Software timer.
+ */
+static void Timer_SoftRemove(Timer_Soft_t *timer) {
+	Timer_Soft_t **link;
+
+	for(link = &Timer_softList; *link != NULL && *link != timer; link = &(*link)->next);
+	if(*link != NULL) {
+		*link = timer->next;
+	}
+}
+
+/**
+ * Arms the hardware timer for the earliest software timer
+ * expiration, or disables its interrupt if no timer is active.
+ * Must be called with the kernel lock held.
+ * This is an internal function.
+ */
+static void Timer_SoftArm() {
+	TIMER_T *hwTimer = Timer_TimerPtr[Timer_softIndex];
+	uint32_t now, cnt, delta;
+
+	if(Timer_softList == NULL) {
+		// Nothing to do until the next start. Losing track of
+		// counter wraps in the meantime is harmless, since no
+		// expiration time refers to the current time base.
+		TIMER_DisableInt(hwTimer);
+		return;
+	}
+
+	do {
+		now = Timer_SoftGetTime(&cnt);
+		delta = Timer_softList->expiry - now;
+		if(TIMER_SOFT_BEFORE(Timer_softList->expiry, now + TIMER_SOFT_ARM_MIN)) {
+			delta = TIMER_SOFT_ARM_MIN;
+		}
+		else if(delta > TIMER_SOFT_ARM_MAX) {
+			delta = TIMER_SOFT_ARM_MAX;
+		}
+
+		// The counter keeps running in continuous mode: set the
+		// compare match to the absolute counter value. CMP must
+		// be at least 2.
+		cnt = (cnt + delta) & TIMER_SOFT_CNT_MASK;
+		TIMER_SET_CMP_VALUE(hwTimer, cnt < 2 ? 2 : cnt);
+		TIMER_EnableInt(hwTimer);
+
+		// If a higher priority interrupt delayed us past the
+		// compare value, the match would only happen after a
+		// full counter wrap: arm again.
+	} while(((TIMER_GetCounter(hwTimer) - Timer_softLastCnt) & TIMER_SOFT_CNT_MASK) >= delta);
+}
+
+/**
+ * Runs a software timer callback deferred to thread context.
+ * This is an internal function.
+ *
+ * @param context Software timer.
+ * @param arg     Unused.
+ */
+static void Timer_SoftDeferredCallback(void *context, uint32_t arg) {
+	Timer_Soft_t *timer = context;
+
+	timer->callback(timer->callbackData);
+}
+
+/**
+ * Handles the software timer service interrupt: runs
+ * expired timers and re-arms the hardware timer.
+ * This is an internal function.
+ *
+ * @param unused Unused.
+ */
+static void Timer_SoftTick(uint32_t unused) {
+	Timer_Soft_t *timer;
+	uint32_t basepri, now, cnt;
+
+	basepri = Thread_KernelLock();
+
+	now = Timer_SoftGetTime(&cnt);
+	while((timer = Timer_softList) != NULL && !TIMER_SOFT_BEFORE(now, timer->expiry)) {
+		Timer_softList = timer->next;
+		if(timer->flags & TIMER_SOFT_PERIODIC) {
+			timer->expiry += timer->period;
+			if(TIMER_SOFT_BEFORE(timer->expiry, now)) {
+				// Overrun: skip the missed expirations
+				timer->expiry = now + timer->period;
+			}
+			Timer_SoftInsert(timer);
+		}
+		else {
+			timer->isActive = 0;
+		}
+
+		// Callbacks can start and stop timers
+		Thread_KernelUnlock(basepri);
+		if(timer->flags & TIMER_SOFT_INTHREAD) {
+			WorkQueue_Post(Timer_SoftDeferredCallback, timer, 0);
+		}
+		else {
+			timer->callback(timer->callbackData);
+		}
+		basepri = Thread_KernelLock();
+
+		now = Timer_SoftGetTime(&cnt);
+	}
+
+	Timer_SoftArm();
+
+	Thread_KernelUnlock(basepri);
+}
+
 int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData) {
+	return Timer_CreateTimerEx(freq, isPeriodic, callback, callbackData, 0);
+}
+
+int8_t Timer_CreateTimerEx(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData, uint8_t inThread) {
 	uint8_t timerIndex;
 
-	if(callback == NULL) {
+	if(callback == NULL || (inThread && !WorkQueue_Start())) {
 		return -1;
 	}
 
@@ -159,8 +411,11 @@ int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t cal
 		return timerIndex;
 	}
 
-	// Mark info as 0 (not a timeout)
-	Timer_info &= ~(1 << timerIndex);
+	// Mark info as 0 (not a timeout) and set callback context
+	Timer_info &= ~((1 << timerIndex) | TIMER_INFO_INTHREAD(timerIndex));
+	if(inThread) {
+		Timer_info |= TIMER_INFO_INTHREAD(timerIndex);
+	}
 
 	TIMER_Start(Timer_TimerPtr[timerIndex]);
 
@@ -168,11 +423,15 @@ int8_t Timer_CreateTimer(uint32_t freq, uint8_t isPeriodic, Timer_Callback_t cal
 }
 
 int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData) {
+	return Timer_CreateTimeoutEx(timeout, isPeriodic, callback, callbackData, 0);
+}
+
+int8_t Timer_CreateTimeoutEx(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_t callback, uint32_t callbackData, uint8_t inThread) {
 	int8_t i, timerIndex;
 	uint16_t tickCount;
 	uint32_t timerFreq;
 
-	if(callback == NULL) {
+	if(callback == NULL || (inThread && !WorkQueue_Start())) {
 		return -1;
 	}
 
@@ -209,8 +468,10 @@ int8_t Timer_CreateTimeout(uint16_t timeout, uint8_t isPeriodic, Timer_Callback_
 		return timerIndex;
 	}
 
-	// Mark info as 1 (timeout) and setup timeout status
-	Timer_info |= 1 << timerIndex;
+	// Mark info as 1 (timeout), set callback context
+	// and setup timeout status
+	Timer_info &= ~TIMER_INFO_INTHREAD(timerIndex);
+	Timer_info |= (1 << timerIndex) | (inThread ? TIMER_INFO_INTHREAD(timerIndex) : 0);
 	Timer_timeoutData[timerIndex].tickCounter = 0;
 	Timer_timeoutData[timerIndex].tickTarget = tickCount;
 
@@ -232,6 +493,111 @@ void Timer_DeleteTimer(int8_t index) {
 	Timer_callbackPtr[index] = NULL;
 }
 
+void Timer_SetPriority(int8_t index, uint8_t priority) {
+	if(index < 0 || index > 3) {
+		// Invalid index
+		return;
+	}
+
+	NVIC_SetPriority(Timer_IrqNum[index], priority);
+}
+
+uint8_t Timer_SoftInit(Timer_Soft_t *timer, Timer_Callback_t callback, uint32_t callbackData, uint8_t flags) {
+	TIMER_T *hwTimer;
+	int8_t timerIndex;
+	uint8_t ret = 1;
+
+	if(callback == NULL || ((flags & TIMER_SOFT_INTHREAD) && !WorkQueue_Start())) {
+		return 0;
+	}
+
+	// Serialize concurrent service starts
+	Thread_CriticalEnter();
+
+	if(Timer_softIndex < 0) {
+		timerIndex = Timer_AssignSlot(TIMER_SOFT_FREQ, 1, Timer_SoftTick, 0);
+		if(timerIndex < 0) {
+			ret = 0;
+		}
+		else {
+			hwTimer = Timer_TimerPtr[timerIndex];
+			Timer_info &= ~((1 << timerIndex) | TIMER_INFO_INTHREAD(timerIndex));
+
+			// Free-running microsecond counter: the compare match
+			// is moved to the next expiration without resetting it.
+			// The interrupt is enabled once a timer is armed.
+			TIMER_DisableInt(hwTimer);
+			hwTimer->CTL = (hwTimer->CTL & ~TIMER_CTL_OPMODE_Msk) | TIMER_CONTINUOUS_MODE;
+			TIMER_SET_PRESCALE_VALUE(hwTimer, TIMER_GetModuleClock(hwTimer) / TIMER_SOFT_FREQ - 1);
+			TIMER_Start(hwTimer);
+
+			Timer_softLastCnt = TIMER_GetCounter(hwTimer);
+			Timer_softIndex = timerIndex;
+		}
+	}
+
+	Thread_CriticalExit();
+
+	timer->callback = callback;
+	timer->callbackData = callbackData;
+	timer->next = NULL;
+	timer->flags = flags;
+	timer->isActive = 0;
+
+	return ret;
+}
+
+void Timer_SoftStart(Timer_Soft_t *timer, uint32_t timeout) {
+	uint32_t basepri, cnt;
+
+	if(Timer_softIndex < 0) {
+		// Service not started (Timer_SoftInit failed)
+		return;
+	}
+
+	if(timeout < TIMER_SOFT_MIN_TIMEOUT) {
+		timeout = TIMER_SOFT_MIN_TIMEOUT;
+	}
+
+	basepri = Thread_KernelLock();
+
+	if(timer->isActive) {
+		Timer_SoftRemove(timer);
+	}
+
+	timer->period = timeout;
+	timer->expiry = Timer_SoftGetTime(&cnt) + timeout;
+	timer->isActive = 1;
+	Timer_SoftInsert(timer);
+
+	// Re-arm if this is now the earliest expiration
+	if(Timer_softList == timer) {
+		Timer_SoftArm();
+	}
+
+	Thread_KernelUnlock(basepri);
+}
+
+void Timer_SoftStop(Timer_Soft_t *timer) {
+	uint32_t basepri;
+
+	basepri = Thread_KernelLock();
+
+	if(timer->isActive) {
+		Timer_SoftRemove(timer);
+		timer->isActive = 0;
+		if(Timer_softList == NULL) {
+			Timer_SoftArm();
+		}
+	}
+
+	Thread_KernelUnlock(basepri);
+}
+
+uint8_t Timer_SoftIsActive(Timer_Soft_t *timer) {
+	return timer->isActive;
+}
+
 void Timer_DelayMs(uint32_t delay) {
 	uint8_t delayRem;
 
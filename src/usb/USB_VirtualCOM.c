@@ -28,6 +28,7 @@
 #include <USB_VirtualCOM.h>
 #include <USB.h>
 #include <Thread.h>
+#include <RingBuffer.h>
 
 /* Endpoints */
 #define USB_VCOM_CTRL_IN_EP  EP0
@@ -83,12 +84,22 @@
 /* Virtual COM index */
 #define USB_VCOM_INDEX 0
 
-/* RX buffer size */
+/* RX buffer size (power of two) */
 #define USB_VCOM_RX_BUF_SIZE 128
 
 /* Mask for DTR bit in line state */
 #define USB_VCOM_LINESTATE_MASK_DTR (1 << 0)
 
+/* Event flag set when the host is ready for a bulk in */
+#define USB_VCOM_EVENT_BULKIN (1 << 0)
+
+/* Waits for the bulk in to be free, blocking the calling thread */
+#define USB_VCOM_WAIT_BULKIN() do { \
+	while(!USB_VirtualCOM_bulkInWaiting) { \
+		Thread_EventFlagsWait(USB_VirtualCOM_events, USB_VCOM_EVENT_BULKIN, \
+			THREAD_EVENTFLAGS_ANY | THREAD_EVENTFLAGS_CLEAR, NULL); \
+	} } while(0)
+
 /**
  * USB device descriptor.
  */
@@ -298,20 +309,6 @@ typedef struct {
 	USB_VirtualCOM_TxTransfer_t *tail;
 } USB_VirtualCOM_TxQueue_t;
 
-/**
- * Structure for RX ring buffer.
- */
-typedef struct {
-	/**< Current reading position. */
-	uint16_t readIndex;
-	/**< Current writing position. */
-	uint16_t writeIndex;
-	/**< Number of used bytes in the buffer. */
-	uint16_t dataSize;
-	/**< Ring buffer. */
-	uint8_t buffer[USB_VCOM_RX_BUF_SIZE];
-} USB_VirtualCOM_RxBuffer_t;
-
 /**
  * Line coding data.
  * This is ignored, but stored for GET_LINE_CODE.
@@ -336,9 +333,11 @@ static volatile USB_VirtualCOM_TxQueue_t USB_VirtualCOM_txQueue;
 static volatile uint8_t USB_VirtualCOM_bulkInWaiting;
 
 /**
- * RX ring buffer.
+ * RX ring buffer and its storage. The USB interrupt
+ * is the producer, readers are the consumer.
  */
-static volatile USB_VirtualCOM_RxBuffer_t USB_VirtualCOM_rxBuffer;
+static RingBuffer_t USB_VirtualCOM_rxBuffer;
+static uint8_t USB_VirtualCOM_rxData[USB_VCOM_RX_BUF_SIZE];
 
 /**
  * RX callback function pointer.
@@ -357,79 +356,38 @@ static uint8_t USB_VirtualCOM_isAsync;
 static Thread_Mutex_t USB_VirtualCOM_mutex;
 
 /**
- * Write data to the RX ring buffer.
+ * Virtual COM event flags (USB_VCOM_EVENT_*), and their storage.
+ */
+static Thread_EventFlags_t USB_VirtualCOM_events;
+static Thread_EventFlagsStatic_t USB_VirtualCOM_eventsStorage;
+
+/**
+ * Copies a packet to the RX ring buffer.
  * If the data size exceeds current buffer capacity, excess
  * data will be discarded.
  * This is an internal function.
  *
- * @param src  Source buffer.
+ * @param src  Source buffer (USB packet memory).
  * @param size Data size.
  *
  * @return Number of bytes actually written.
  */
 static uint16_t USB_VirtualCOM_RxBuffer_Write(uint8_t *src, uint16_t size) {
-	uint16_t copySize1, copySize2;
-
-	// Discard overflowing data
-	size = Minimum(USB_VCOM_RX_BUF_SIZE - USB_VirtualCOM_rxBuffer.dataSize, size);
-
-	// Copy data to write index up to buffer end
-	copySize1 = Minimum(USB_VCOM_RX_BUF_SIZE - USB_VirtualCOM_rxBuffer.writeIndex, size);
-	if(copySize1 == 0) {
-		return 0;
-	}
-	USBD_MemCopy((uint8_t *) (USB_VirtualCOM_rxBuffer.buffer + USB_VirtualCOM_rxBuffer.writeIndex),
-		src, copySize1);
-
-	// Copy data (if any) to buffer start
-	if(copySize1 != size) {
-		copySize2 = size - copySize1;
-		USBD_MemCopy((uint8_t *) USB_VirtualCOM_rxBuffer.buffer, src + copySize1, copySize2);
-	}
-
-	// Update index and used size
-	USB_VirtualCOM_rxBuffer.writeIndex = (USB_VirtualCOM_rxBuffer.writeIndex + size) % USB_VCOM_RX_BUF_SIZE;
-	USB_VirtualCOM_rxBuffer.dataSize += size;
-
-	return size;
-}
-
-/**
- * Reads data from the RX ring buffer.
- * If the data size exceeds currently available bytes, it will
- * be reduced.
- * This is an internal function.
- *
- * @param dst  Destination buffer.
- * @param size Data size.
- *
- * @return Number of bytes actually read.
- */
-static uint16_t USB_VirtualCOM_RxBuffer_Read(uint8_t *dst, uint16_t size) {
-	uint16_t copySize1, copySize2;
-
-	// Do not read more than is available
-	size = Minimum(USB_VirtualCOM_rxBuffer.dataSize, size);
-
-	// Copy data from read index up to buffer end
-	copySize1 = Minimum(USB_VCOM_RX_BUF_SIZE - USB_VirtualCOM_rxBuffer.readIndex, size);
-	if(copySize1 == 0) {
-		return 0;
-	}
-	USBD_MemCopy(dst,
-		(uint8_t *) (USB_VirtualCOM_rxBuffer.buffer + USB_VirtualCOM_rxBuffer.readIndex), copySize1);
-
-	// Copy data (if any) from buffer start
-	if(copySize1 != size) {
-		copySize2 = size - copySize1;
-		USBD_MemCopy(dst + copySize1, (uint8_t *) USB_VirtualCOM_rxBuffer.buffer, copySize2);
+	uint16_t done, chunk;
+	uint8_t *ptr;
+
+	// Copy in place, up to the buffer end and then from the start
+	for(done = 0; done < size; done += chunk) {
+		chunk = RingBuffer_WritePeek(&USB_VirtualCOM_rxBuffer, &ptr);
+		if(chunk == 0) {
+			break;
+		}
+		chunk = Minimum(chunk, size - done);
+		USBD_MemCopy(ptr, src + done, chunk);
+		RingBuffer_WriteCommit(&USB_VirtualCOM_rxBuffer, chunk);
 	}
 
-	// Update index and used size
-	USB_VirtualCOM_rxBuffer.readIndex = (USB_VirtualCOM_rxBuffer.readIndex + size) % USB_VCOM_RX_BUF_SIZE;
-	USB_VirtualCOM_rxBuffer.dataSize -= size;
-
-	return size;
+	return done;
 }
 
 /**
@@ -459,6 +417,7 @@ static void USB_VirtualCOM_HandleBulkIn() {
 	// We are inside an interrupt, no need to worry about race conditions
 	// This will be 0 only when a packet is actually transferred
 	USB_VirtualCOM_bulkInWaiting = 1;
+	Thread_EventFlagsSet(USB_VirtualCOM_events, USB_VCOM_EVENT_BULKIN);
 
 	transfer = USB_VirtualCOM_txQueue.head;
 	if(transfer == NULL) {
@@ -657,7 +616,7 @@ static void USB_VirtualCOM_SendSync(const uint8_t *buf, uint32_t size) {
 
 	while(size > 0) {
 		// Wait for bulk in to be free
-		while(!USB_VirtualCOM_bulkInWaiting);
+		USB_VCOM_WAIT_BULKIN();
 
 		// Send one packet at a time
 		partialSize = Minimum(size, USB_VCOM_BULK_IN_MAX_PKT_SIZE);
@@ -669,11 +628,11 @@ static void USB_VirtualCOM_SendSync(const uint8_t *buf, uint32_t size) {
 	if(partialSize == USB_VCOM_BULK_IN_MAX_PKT_SIZE) {
 		// Size is a multiple of USB_VCOM_BULK_IN_MAX_PKT_SIZE
 		// Send zero packet for termination
-		while(!USB_VirtualCOM_bulkInWaiting);
+		USB_VCOM_WAIT_BULKIN();
 		USB_VirtualCOM_SendBulkInPayload(NULL, 0);
 	}
 
-	while(!USB_VirtualCOM_bulkInWaiting);
+	USB_VCOM_WAIT_BULKIN();
 }
 
 /**
@@ -685,7 +644,7 @@ static void USB_VirtualCOM_SendSync(const uint8_t *buf, uint32_t size) {
  */
 static void USB_VirtualCOM_SendAsync(const uint8_t *buf, uint32_t size) {
 	USB_VirtualCOM_TxTransfer_t *transfer;
-	uint32_t primask, partialSize;
+	uint32_t basepri, partialSize;
 
 	if(size == 0) {
 		return;
@@ -724,7 +683,7 @@ static void USB_VirtualCOM_SendAsync(const uint8_t *buf, uint32_t size) {
 	}
 
 	// Append transfer to queue
-	primask = Thread_IrqDisable();
+	basepri = Thread_KernelLock();
 	if(USB_VirtualCOM_txQueue.head == NULL) {
 		USB_VirtualCOM_txQueue.head = USB_VirtualCOM_txQueue.tail = transfer;
 	}
@@ -732,7 +691,7 @@ static void USB_VirtualCOM_SendAsync(const uint8_t *buf, uint32_t size) {
 		USB_VirtualCOM_txQueue.tail->next = transfer;
 		USB_VirtualCOM_txQueue.tail = transfer;
 	}
-	Thread_IrqRestore(primask);
+	Thread_KernelUnlock(basepri);
 }
 
 void USB_VirtualCOM_Init() {
@@ -742,6 +701,8 @@ void USB_VirtualCOM_Init() {
 		// No user code has run yet, the heap is messed up
 		asm volatile ("udf");
 	}
+	Thread_EventFlagsInitStatic(&USB_VirtualCOM_events, &USB_VirtualCOM_eventsStorage);
+	RingBuffer_Init(&USB_VirtualCOM_rxBuffer, USB_VirtualCOM_rxData, USB_VCOM_RX_BUF_SIZE);
 
 	// Open USB
 	USBD_Open(&USB_VirtualCOM_UsbdInfo, USB_VirtualCOM_HandleClassRequest, NULL);
@@ -796,16 +757,17 @@ void USB_VirtualCOM_SendString(const char *str) {
 }
 
 uint16_t USB_VirtualCOM_GetAvailableSize() {
-	return USB_VirtualCOM_rxBuffer.dataSize;
+	return RingBuffer_GetUsed(&USB_VirtualCOM_rxBuffer);
 }
 
 uint16_t USB_VirtualCOM_Read(uint8_t *buf, uint16_t size) {
 	uint16_t readSize;
-	uint32_t primask;
 
-	primask = Thread_IrqDisable();
-	readSize = USB_VirtualCOM_RxBuffer_Read(buf, size);
-	Thread_IrqRestore(primask);
+	// The ring buffer allows a single consumer: keep other
+	// threads out, the USB interrupt can still run.
+	Thread_CriticalEnter();
+	readSize = RingBuffer_Read(&USB_VirtualCOM_rxBuffer, buf, size);
+	Thread_CriticalExit();
 
 	return readSize;
 }
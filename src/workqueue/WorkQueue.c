@@ -0,0 +1,121 @@
+/*
+ * This file is part of eVic SDK.
+ *
+ * eVic SDK is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * eVic SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eVic SDK.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2016 ReservedField
+ */
+
+#include <stdlib.h>
+#include <WorkQueue.h>
+#include <Thread.h>
+#include <AtomicOps.h>
+
+/**
+ * Work item.
+ */
+typedef struct {
+	/**< Function to run. */
+	WorkQueue_Func_t func;
+	/**< User-defined pointer. */
+	void *context;
+	/**< User-defined argument. */
+	uint32_t arg;
+} WorkQueue_Item_t;
+
+/**
+ * True once the worker thread is running.
+ */
+static volatile uint8_t WorkQueue_isRunning;
+
+/**
+ * Pending work items.
+ */
+static Thread_MsgQueue_t WorkQueue_queue;
+
+/**
+ * Number of dropped work items.
+ */
+static volatile uint32_t WorkQueue_dropCount;
+
+/**
+ * Worker thread procedure.
+ * This is an internal function.
+ *
+ * @param args Unused.
+ *
+ * @return Never returns.
+ */
+static void *WorkQueue_WorkerProc(void *args) {
+	WorkQueue_Item_t item;
+
+	while(1) {
+		if(Thread_MsgQueueReceive(WorkQueue_queue, &item) == TD_SUCCESS) {
+			item.func(item.context, item.arg);
+		}
+	}
+
+	return NULL;
+}
+
+uint8_t WorkQueue_Start() {
+	WorkQueue_Item_t *buffer;
+	Thread_t worker;
+	uint8_t ret = 1;
+
+	// Serialize concurrent starts
+	Thread_CriticalEnter();
+
+	if(!WorkQueue_isRunning) {
+		buffer = malloc(sizeof(WorkQueue_Item_t) * WORKQUEUE_SIZE);
+		if(buffer == NULL || Thread_MsgQueueCreate(&WorkQueue_queue, buffer,
+		   sizeof(WorkQueue_Item_t), WORKQUEUE_SIZE) != TD_SUCCESS) {
+			free(buffer);
+			ret = 0;
+		}
+		else if(Thread_CreateEx(&worker, WorkQueue_WorkerProc, NULL,
+		        WORKQUEUE_STACKSIZE, WORKQUEUE_PRIORITY) != TD_SUCCESS) {
+			Thread_MsgQueueDestroy(WorkQueue_queue);
+			free(buffer);
+			ret = 0;
+		}
+		else {
+			WorkQueue_isRunning = 1;
+		}
+	}
+
+	Thread_CriticalExit();
+
+	return ret;
+}
+
+uint8_t WorkQueue_Post(WorkQueue_Func_t func, void *context, uint32_t arg) {
+	WorkQueue_Item_t item;
+
+	if(WorkQueue_isRunning) {
+		item.func = func;
+		item.context = context;
+		item.arg = arg;
+		if(Thread_MsgQueuePost(WorkQueue_queue, &item) == TD_SUCCESS) {
+			return 1;
+		}
+	}
+
+	AtomicOps_AddRelaxed(&WorkQueue_dropCount, 1);
+	return 0;
+}
+
+uint32_t WorkQueue_GetDropCount() {
+	return WorkQueue_dropCount;
+}